@@ -0,0 +1,343 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "apply.h"
+
+/* The machines are listed once and counted per group, leaving out
+   those already on their way out.  A group short of machines gets a
+   slice of a launch plan for the difference, so that all groups launch
+   together.  A group with too many loses the machines furthest from
+   being of use first: those still starting, then idle ones, newest
+   first, and running ones only when forced.  The kills go out as one
+   request, on the pool's thread while the plan is launched. */
+
+typedef struct {
+  int         rank;           /* 0 starting, 1 idle, 2 running */
+  int         group;          /* -1 for machines of no group */
+  const char *create_time;
+  char       *machine_id;
+} Candidate;
+
+typedef struct {
+  pthread_mutex_t lock;
+  pthread_cond_t  cond;
+  int             done;
+} Waiter;
+
+void
+apply_init(ICapply *a)
+{
+  memset(a, 0, sizeof(*a));
+  a->interval     = 10;
+  a->timeout      = 600;
+  a->retries      = 2;
+  a->idleshutdown = 60;
+}
+
+static int
+groupof(const ICapply   *a,
+        const ICmachine *m)
+{
+  int g;
+
+  for (g = 0; g < a->num_groups; g++) {
+    if (strcmp(a->groups[g].region, m->region) == 0             &&
+        strcmp(a->groups[g].machine_type, m->machine_type) == 0 &&
+        strcmp(a->groups[g].license_type, m->license_type) == 0   )
+      return g;
+  }
+  return -1;
+}
+
+/* 0 starting, 1 idle, 2 running, -1 for killed or failed machines */
+static int
+rankof(const ICmachine *m)
+{
+  if (strcmp(m->state, STATE_LAUNCHING) == 0 ||
+      strcmp(m->state, STATE_PENDING) == 0   ||
+      strcmp(m->state, STATE_OBTAINING_LICENSE) == 0)
+    return 0;
+  if (strcmp(m->state, STATE_IDLE) == 0)
+    return 1;
+  if (strcmp(m->state, STATE_RUNNING) == 0)
+    return 2;
+  return -1;
+}
+
+static int
+comparekill(const void *a,
+            const void *b)
+{
+  const Candidate *x = (const Candidate *) a;
+  const Candidate *y = (const Candidate *) b;
+
+  if (x->rank != y->rank)
+    return x->rank - y->rank;
+  return strcmp(y->create_time, x->create_time);
+}
+
+static void
+killdone(ICasync *op,
+         void    *arg)
+{
+  Waiter *w = (Waiter *) arg;
+
+  pthread_mutex_lock(&w->lock);
+  w->done = 1;
+  pthread_cond_signal(&w->cond);
+  pthread_mutex_unlock(&w->lock);
+}
+
+/* List the machines until every group has its count of idle or running
+   machines and no more than it was left with */
+static int
+waitready(ICapply *a)
+{
+  ICmachineinfo *info = NULL;
+  IClaunchslice *g;
+  int   *live = NULL;
+  int   *ready = NULL;
+  int   *running = NULL;
+  time_t started = time(NULL);
+  int  other;
+  int  pending;
+  int  rank;
+  int  i;
+  int  j;
+  int  error = 0;
+
+  MALLOC(live, a->num_groups);
+  MALLOC(ready, a->num_groups);
+  MALLOC(running, a->num_groups);
+
+  for (;;) {
+    error = ICgetmachinefields(IC_FIELD_STATE        | IC_FIELD_REGION |
+                               IC_FIELD_MACHINE_TYPE | IC_FIELD_LICENSE_TYPE,
+                               &info);
+    if (error) goto QUIT;
+
+    memset(live, 0, sizeof(int)*a->num_groups);
+    memset(ready, 0, sizeof(int)*a->num_groups);
+    memset(running, 0, sizeof(int)*a->num_groups);
+    other = 0;
+    for (i = 0; i < info->num_machines; i++) {
+      rank = rankof(&info->machines[i]);
+      if (rank < 0)
+        continue;
+      j = groupof(a, &info->machines[i]);
+      if (j < 0) {
+        if (a->prune && (rank < 2 || a->force))
+          other++;
+        continue;
+      }
+      live[j]++;
+      if (rank > 0)
+        ready[j]++;
+      if (rank == 2 && !a->force)
+        running[j]++;
+    }
+
+    pending = other > 0;
+    for (j = 0; j < a->num_groups; j++) {
+      g = &a->groups[j];
+      if (ready[j] >= g->count && live[j] - g->count <= running[j])
+        continue;
+      printf("%s,%s,%s: %d of %d ready\n", g->region, g->machine_type,
+             g->license_type, ready[j], g->count);
+      pending++;
+    }
+    if (other > 0)
+      printf("other groups: %d machines left\n", other);
+
+    if (pending == 0) {
+      printf("Ready after %d seconds\n", (int) (time(NULL) - started));
+      break;
+    }
+    if (time(NULL) - started + a->interval > a->timeout) {
+      printf("Not ready after %d seconds\n", (int) (time(NULL) - started));
+      error = ERROR_TIMEOUT;
+      break;
+    }
+    fflush(stdout);
+
+    /* Cut short by the caller's deadline or cancellation */
+    error = ICsleep(1000*a->interval);
+    if (error) goto QUIT;
+  }
+
+QUIT:
+  ICfreemachineinfo(&info);
+  FREE(live);
+  FREE(ready);
+  FREE(running);
+
+  return error;
+}
+
+int
+apply_run(ICapply *a)
+{
+  ICmachineinfo *info = NULL;
+  ICmachineinfo *launched = NULL;
+  ICmachineinfo *killed = NULL;
+  ICasync       *op = NULL;
+  IClaunchslice *launches = NULL;
+  IClaunchslice *g;
+  Candidate     *candidates = NULL;
+  char         **ids = NULL;
+  int           *live = NULL;
+  int           *surplus = NULL;
+  Waiter waiter = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0 };
+  int  num_launches = 0;
+  int  num_candidates = 0;
+  int  num_kills = 0;
+  int  other = 0;
+  int  rank;
+  int  n;
+  int  i;
+  int  j;
+  int  failed = 0;
+  int  error = 0;
+
+  error = ICgetmachinefields(IC_FIELD_MACHINE_ID   | IC_FIELD_STATE  |
+                             IC_FIELD_CREATE_TIME  | IC_FIELD_REGION |
+                             IC_FIELD_MACHINE_TYPE | IC_FIELD_LICENSE_TYPE,
+                             &info);
+  if (error) goto QUIT;
+
+  CALLOC(live, a->num_groups);
+  CALLOC(surplus, a->num_groups);
+  MALLOC(launches, a->num_groups);
+  MALLOC(candidates, info->num_machines);
+  MALLOC(ids, info->num_machines);
+
+  for (i = 0; i < info->num_machines; i++) {
+    if (rankof(&info->machines[i]) < 0)
+      continue;
+    j = groupof(a, &info->machines[i]);
+    if (j < 0)
+      other++;
+    else
+      live[j]++;
+  }
+
+  for (j = 0; j < a->num_groups; j++) {
+    g = &a->groups[j];
+    n = g->count - live[j];
+    printf("%s,%s,%s: %d of %d, ", g->region, g->machine_type,
+           g->license_type, live[j], g->count);
+    if (n > 0) {
+      printf("launch %d\n", n);
+      launches[num_launches] = *g;
+      launches[num_launches].count = n;
+      num_launches++;
+    } else if (n < 0) {
+      printf("kill %d\n", -n);
+      surplus[j] = -n;
+    } else {
+      printf("no change\n");
+    }
+  }
+  if (a->prune && other > 0)
+    printf("other groups: %d, kill them\n", other);
+
+  for (i = 0; i < info->num_machines; i++) {
+    rank = rankof(&info->machines[i]);
+    if (rank < 0 || (rank == 2 && !a->force))
+      continue;
+    j = groupof(a, &info->machines[i]);
+    if (j < 0 ? !a->prune : surplus[j] == 0)
+      continue;
+    candidates[num_candidates].rank        = rank;
+    candidates[num_candidates].group       = j;
+    candidates[num_candidates].create_time = info->machines[i].create_time;
+    candidates[num_candidates].machine_id  = info->machines[i].machine_id;
+    num_candidates++;
+  }
+  qsort(candidates, num_candidates, sizeof(Candidate), comparekill);
+
+  for (i = 0; i < num_candidates; i++) {
+    j = candidates[i].group;
+    if (j >= 0) {
+      if (surplus[j] == 0)
+        continue;
+      surplus[j]--;
+    } else {
+      other--;
+    }
+    ids[num_kills++] = candidates[i].machine_id;
+  }
+
+  for (j = 0; j < a->num_groups; j++) {
+    if (surplus[j] > 0)
+      printf("%s,%s,%s: %d running machines kept, kill them with --force\n",
+             a->groups[j].region, a->groups[j].machine_type,
+             a->groups[j].license_type, surplus[j]);
+  }
+  if (a->prune && other > 0)
+    printf("other groups: %d running machines kept, kill them with --force\n",
+           other);
+
+  if (a->dry_run)
+    goto QUIT;
+
+  if (num_kills > 0) {
+    error = ICstartkill(num_kills, ids, killdone, &waiter, &op);
+    if (error) {
+      printf("Kill of %d machines failed: error %d\n", num_kills, error);
+      failed = error;
+    }
+  }
+
+  if (num_launches > 0) {
+    error = IClaunchplan(num_launches, launches, a->password,
+                         &a->idleshutdown, a->gurobi_version, a->retries,
+                         &launched);
+    for (i = 0; i < num_launches; i++) {
+      if (launches[i].status) {
+        printf("%s,%s,%s: launch of %d failed: error %d\n",
+               launches[i].region, launches[i].machine_type,
+               launches[i].license_type, launches[i].count,
+               launches[i].status);
+      }
+    }
+    if (error)
+      failed = error;
+    for (i = 0; launched && i < launched->num_machines; i++)
+      printf("launched %s\n", launched->machines[i].machine_id);
+  }
+
+  if (op) {
+    pthread_mutex_lock(&waiter.lock);
+    while (!waiter.done)
+      pthread_cond_wait(&waiter.cond, &waiter.lock);
+    pthread_mutex_unlock(&waiter.lock);
+
+    error = ICfinishmachines(&op, &killed);
+    if (error) {
+      printf("Kill of %d machines failed: error %d\n", num_kills, error);
+      failed = error;
+    } else {
+      for (i = 0; i < num_kills; i++)
+        printf("killed %s\n", ids[i]);
+    }
+  }
+
+  error = failed;
+  if (!error && a->wait)
+    error = waitready(a);
+
+QUIT:
+  ICfreeasync(&op);
+  ICfreemachineinfo(&killed);
+  ICfreemachineinfo(&launched);
+  ICfreemachineinfo(&info);
+  FREE(candidates);
+  FREE(launches);
+  FREE(surplus);
+  FREE(live);
+  FREE(ids);
+
+  return error;
+}
@@ -0,0 +1,30 @@
+/* Reconcile the fleet with a desired count of machines per group */
+#ifndef _APPLY_H
+#define _APPLY_H
+
+#include "cloud.h"
+
+/* A group is the machines of one region, machine type and license
+   type; the count of its slice is the number wanted, and its license
+   id the license new machines are launched with. */
+typedef struct _apply
+{
+  int            num_groups;
+  IClaunchslice *groups;
+  int    prune;                   /* kill the machines of other groups */
+  int    force;                   /* kill running machines too */
+  int    dry_run;                 /* print the changes, make none */
+  int    wait;                    /* until every group is ready */
+  int    interval;                /* seconds between two checks */
+  int    timeout;                 /* seconds to wait at most */
+  int    retries;                 /* of failed launches */
+
+  char  *password;                /* launch options, NULL for defaults */
+  int    idleshutdown;
+  char  *gurobi_version;
+} ICapply;
+
+void apply_init(ICapply *a);
+int  apply_run(ICapply *a);
+
+#endif
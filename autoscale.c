@@ -0,0 +1,345 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <limits.h>
+#include <ctype.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "autoscale.h"
+
+/* Each pool holds the machines of one license type.  Idle machines and
+   machines on their way to idle count towards the demand, which is the
+   spare count plus what the queued jobs will take.  A shortfall is
+   launched at once.  Idle machines beyond the demand, starting ones
+   left out, are killed only once the surplus has lasted for the
+   cool-down, so a queue that drains and refills does not cycle
+   machines. */
+
+static const char *poolnames[NUM_POOLS] = { "servers", "workers" };
+static char *poollicenses[NUM_POOLS] =
+  { LICENSE_FULL_COMPUTE_SERVER, LICENSE_DISTRIBUTED_WORKER };
+
+static volatile sig_atomic_t stopping = 0;
+
+typedef struct {
+  const char *create_time;
+  char       *machine_id;
+} Candidate;
+
+void
+autoscale_init(ICautoscale *a)
+{
+  memset(a, 0, sizeof(*a));
+  a->spare[POOL_SERVERS]   = 1;
+  a->per_job[POOL_SERVERS] = 1;
+  a->max_machines          = 10;
+  a->cooldown              = 300;
+  a->interval              = 30;
+  a->idleshutdown          = 60;
+}
+
+static void
+logstep(const char *format, ...)
+{
+  va_list ap;
+  char    stamp[32];
+  time_t  now = time(NULL);
+
+  strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+  printf("%s ", stamp);
+  va_start(ap, format);
+  vprintf(format, ap);
+  va_end(ap);
+  printf("\n");
+  fflush(stdout);
+}
+
+/* The depth is a decimal number, read from a regular file or from a
+   Unix stream socket that answers each connection with it */
+int
+autoscale_read_queue(const char *path,
+                     int        *depthP)
+{
+  struct sockaddr_un addr;
+  struct timeval     timeout = { 2, 0 };
+  struct stat        st;
+  char    buf[32];
+  char   *end;
+  size_t  len = 0;
+  ssize_t n;
+  long    depth;
+  int     fd;
+
+  if (path == NULL || stat(path, &st))
+    return 1;
+
+  if (S_ISSOCK(st.st_mode)) {
+    if (strlen(path) >= sizeof(addr.sun_path))
+      return 1;
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+      return 1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr))) {
+      close(fd);
+      return 1;
+    }
+  } else {
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+      return 1;
+  }
+
+  while (len < sizeof(buf) - 1 &&
+         (n = read(fd, &buf[len], sizeof(buf) - 1 - len)) > 0) {
+    len += n;
+    if (memchr(buf, '\n', len))
+      break;
+  }
+  close(fd);
+  buf[len] = '\0';
+
+  depth = strtol(buf, &end, 10);
+  if (end == buf || depth < 0 || depth > INT_MAX ||
+      (*end != '\0' && !isspace((unsigned char) *end)))
+    return 1;
+
+  *depthP = (int) depth;
+  return 0;
+}
+
+static int
+poolof(int license_type)
+{
+  int p;
+
+  for (p = 0; p < NUM_POOLS; p++) {
+    if (license_type == ICcode(IC_COLUMN_LICENSE_TYPE, poollicenses[p]))
+      return p;
+  }
+  return -1;
+}
+
+static int
+compareage(const void *a,
+           const void *b)
+{
+  return strcmp(((const Candidate *) a)->create_time,
+                ((const Candidate *) b)->create_time);
+}
+
+/* Kill the idle machines of pool p beyond want, those created first.
+   The machines are listed again, so that one a job took since the step
+   began is not killed. */
+static int
+killsurplus(int p,
+            int want)
+{
+  ICmachineinfo *info = NULL;
+  ICmachineinfo *killed = NULL;
+  ICfleet       *fleet = NULL;
+  Candidate     *candidates = NULL;
+  char         **ids = NULL;
+  int  idle = ICcode(IC_COLUMN_STATE, STATE_IDLE);
+  int  num_candidates = 0;
+  int  n;
+  int  i;
+  int  error = 0;
+
+  error = ICgetmachinefields(IC_FIELD_MACHINE_ID  | IC_FIELD_STATE        |
+                             IC_FIELD_CREATE_TIME | IC_FIELD_LICENSE_TYPE,
+                             &info);
+  if (error) goto QUIT;
+
+  error = ICbuildfleet(info, &fleet);
+  if (error) goto QUIT;
+
+  MALLOC(candidates, fleet->num_machines + 1);
+
+  for (i = 0; i < fleet->num_machines; i++) {
+    if (fleet->state[i] != idle || poolof(fleet->license_type[i]) != p)
+      continue;
+    candidates[num_candidates].create_time = fleet->create_time[i];
+    candidates[num_candidates].machine_id  = (char *) fleet->machine_id[i];
+    num_candidates++;
+  }
+  qsort(candidates, num_candidates, sizeof(Candidate), compareage);
+
+  n = num_candidates - want;
+  if (n <= 0) {
+    logstep("%s: no surplus left", poolnames[p]);
+    goto QUIT;
+  }
+
+  MALLOC(ids, n);
+  for (i = 0; i < n; i++)
+    ids[i] = candidates[i].machine_id;
+
+  error = ICkillmachines(n, ids, &killed);
+  if (error) goto QUIT;
+
+  for (i = 0; i < n; i++)
+    logstep("%s: killed %s", poolnames[p], ids[i]);
+
+QUIT:
+  ICfreemachineinfo(&killed);
+  ICfreefleet(&fleet);
+  ICfreemachineinfo(&info);
+  FREE(candidates);
+  FREE(ids);
+
+  return error;
+}
+
+int
+autoscale_step(ICautoscale *a,
+               time_t       now)
+{
+  ICmachineinfo *info = NULL;
+  ICmachineinfo *launched = NULL;
+  ICfleet       *fleet = NULL;
+  int  idle[NUM_POOLS]     = { 0 };
+  int  starting[NUM_POOLS] = { 0 };
+  int  busy[NUM_POOLS]     = { 0 };
+  int  total = 0;
+  int  depth;
+  int  want;
+  int  n;
+  int  p;
+  int  i;
+  int  state;
+  int  error = 0;
+  int  failed = 0;
+
+  /* Without a depth there is no telling demand, leave the pool alone */
+  if (autoscale_read_queue(a->queue, &depth)) {
+    logstep("cannot read the queue depth from %s", a->queue);
+    return 0;
+  }
+
+  error = ICgetmachinefields(IC_FIELD_MACHINE_ID  | IC_FIELD_STATE        |
+                             IC_FIELD_CREATE_TIME | IC_FIELD_LICENSE_TYPE,
+                             &info);
+  if (error) goto QUIT;
+
+  error = ICbuildfleet(info, &fleet);
+  if (error) goto QUIT;
+
+  for (i = 0; i < fleet->num_machines; i++) {
+    p = poolof(fleet->license_type[i]);
+    if (p < 0) continue;
+    state = fleet->state[i];
+    if (state == ICcode(IC_COLUMN_STATE, STATE_IDLE)) {
+      idle[p]++;
+    } else if (state == ICcode(IC_COLUMN_STATE, STATE_RUNNING)) {
+      busy[p]++;
+    } else if (state == ICcode(IC_COLUMN_STATE, STATE_LAUNCHING) ||
+               state == ICcode(IC_COLUMN_STATE, STATE_PENDING)   ||
+               state == ICcode(IC_COLUMN_STATE, STATE_OBTAINING_LICENSE)) {
+      starting[p]++;
+    } else {
+      continue;
+    }
+    total++;
+  }
+
+  for (p = 0; p < NUM_POOLS; p++) {
+    want = a->spare[p] + a->per_job[p]*depth;
+    n    = want - idle[p] - starting[p];
+
+    logstep("queue %d, %s: %d idle, %d starting, %d busy, want %d idle",
+            depth, poolnames[p], idle[p], starting[p], busy[p], want);
+
+    if (n > 0) {
+      a->surplus_since[p] = 0;
+      if (n > a->max_machines - total)
+        n = a->max_machines - total;
+      if (n <= 0) {
+        logstep("%s: at the limit of %d machines", poolnames[p],
+                a->max_machines);
+        continue;
+      }
+
+      error = IClaunchmachines(n, poollicenses[p], a->license_idP,
+                               a->password, a->region, a->machine_type,
+                               &a->idleshutdown, a->gurobi_version,
+                               &launched);
+      if (error) {
+        logstep("%s: launch of %d failed: error %d", poolnames[p], n, error);
+        failed = error;
+        continue;
+      }
+      logstep("%s: launched %d", poolnames[p], launched->num_machines);
+      total += launched->num_machines;
+      ICfreemachineinfo(&launched);
+    } else if (idle[p] > want) {
+      if (a->surplus_since[p] == 0)
+        a->surplus_since[p] = now;
+      if (now - a->surplus_since[p] < a->cooldown)
+        continue;
+
+      error = killsurplus(p, want);
+      if (error) {
+        logstep("%s: kill failed: error %d", poolnames[p], error);
+        failed = error;
+        continue;
+      }
+      a->surplus_since[p] = 0;
+    } else {
+      a->surplus_since[p] = 0;
+    }
+  }
+  error = failed;
+
+QUIT:
+  ICfreefleet(&fleet);
+  ICfreemachineinfo(&info);
+
+  return error;
+}
+
+static void
+stop(int sig)
+{
+  stopping = 1;
+}
+
+/* Step until interrupted.  A failed step is logged and retried at the
+   next interval rather than ending the loop. */
+int
+autoscale_run(ICautoscale *a)
+{
+  struct timespec ts;
+  int error;
+
+  signal(SIGINT, stop);
+  signal(SIGTERM, stop);
+
+  for (;;) {
+    if (a->deadline > 0)
+      ICsetdeadline(ICnowms() + 1000LL*a->deadline);
+    error = autoscale_step(a, time(NULL));
+    if (a->once)
+      return error;
+    if (error)
+      logstep("step failed: error %d", error);
+    if (stopping)
+      break;
+
+    ts.tv_sec  = a->interval;
+    ts.tv_nsec = 0;
+    nanosleep(&ts, NULL);
+    if (stopping)
+      break;
+  }
+
+  return 0;
+}
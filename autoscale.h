@@ -0,0 +1,38 @@
+/* Warm pool of compute servers and workers driven by a queue depth */
+#ifndef _AUTOSCALE_H
+#define _AUTOSCALE_H
+
+#include <time.h>
+#include "cloud.h"
+
+#define POOL_SERVERS 0    /* full compute servers */
+#define POOL_WORKERS 1    /* distributed workers */
+#define NUM_POOLS    2
+
+typedef struct _autoscale
+{
+  const char *queue;              /* file or Unix socket with the depth */
+  int    spare[NUM_POOLS];        /* idle machines beyond the demand */
+  int    per_job[NUM_POOLS];      /* machines a queued job will take */
+  int    max_machines;            /* cap on machines of both pools */
+  int    cooldown;                /* seconds a surplus lasts before kills */
+  int    interval;                /* seconds between two steps */
+  int    once;                    /* a single step, then return */
+  int    deadline;                /* seconds a step may take, 0 for none */
+
+  char  *region;                  /* launch options, NULL for defaults */
+  char  *machine_type;
+  char  *password;
+  int   *license_idP;
+  int    idleshutdown;            /* minutes, the service's safety net */
+  char  *gurobi_version;
+
+  time_t surplus_since[NUM_POOLS];
+} ICautoscale;
+
+void autoscale_init(ICautoscale *a);
+int  autoscale_read_queue(const char *path, int *depthP);
+int  autoscale_step(ICautoscale *a, time_t now);
+int  autoscale_run(ICautoscale *a);
+
+#endif
@@ -0,0 +1,171 @@
+/* Compare the JSON scanners on a large synthetic machine listing */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "cloud.h"
+
+static char *
+makefleet(int num_machines)
+{
+  static const char *states[]  = { "idle", "running", "launching" };
+  static const char *regions[] = { "us-east-1", "eu-west-1", "ap-southeast-2" };
+  static const char *types[]   = { "c4.large", "c4.2xlarge", "r3.8xlarge" };
+  static const char *licenses[] = { LICENSE_FULL_COMPUTE_SERVER,
+                                    LICENSE_LIGHT_COMPUTE_SERVER,
+                                    LICENSE_DISTRIBUTED_WORKER };
+  char  *buf;
+  size_t len = 0;
+  int    i;
+
+  buf = malloc(400*(size_t) num_machines + 3);
+  if (buf == NULL)
+    return NULL;
+
+  buf[len++] = '[';
+  for (i = 0; i < num_machines; i++) {
+    len += sprintf(&buf[len],
+                   "%s{\"_id\": \"m%016d\", \"state\": \"%s\", "
+                   "\"DNSName\": \"ec2-%d.compute.amazonaws.com\", "
+                   "\"machineType\": \"%s\", "
+                   "\"createTime\": \"2015-10-14T20:27:01.224Z\", "
+                   "\"region\": \"%s\", \"licenseType\": \"%s\", "
+                   "\"idleShutdown\": %d, \"licenseId\": \"%d\", "
+                   "\"userPassword\": \"p\\\\w\\\"%06d\"}",
+                   i ? ", " : "", i, states[i%3], i, types[i%3],
+                   regions[i%3], licenses[i%3], 60 + i%60, 95900 + i%4, i);
+  }
+  buf[len++] = ']';
+  buf[len] = '\0';
+
+  return buf;
+}
+
+static double
+seconds(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + 1e-9*ts.tv_nsec;
+}
+
+/* Time the whole client, signing and dispatch included, on recorded
+   answers to the listing requests */
+static int
+replay(const char *path,
+       int         repeat)
+{
+  ICmachineinfo  *machine_info = NULL;
+  ICcloudlicense *licenses = NULL;
+  ICtransport    *transport = NULL;
+  double start;
+  double elapsed;
+  int    num_licenses;
+  int    i;
+  int    error = 0;
+
+  error = ICreplaytransport(path, &transport);
+  if (error) {
+    printf("Could not read the recording %s\n", path);
+    return error;
+  }
+  ICsettransport(transport);
+  ICsetsingleflight(0);
+
+  error = ICcloudcreds("abcdefghijklmnopq",
+                       "abcdefghijklmnopqrstuvwxyzabcdefghijklmnopq");
+  if (error) goto QUIT;
+
+  start = seconds();
+  for (i = 0; i < repeat; i++) {
+    error = ICgetmachines(&machine_info);
+    if (error) goto QUIT;
+  }
+  elapsed = (seconds() - start)/repeat;
+  printf("machines %8.3f ms per call  %d machines\n", 1e3*elapsed,
+         machine_info->num_machines);
+
+  start = seconds();
+  for (i = 0; i < repeat; i++) {
+    error = ICgetlicenselist(&num_licenses, &licenses);
+    if (error) goto QUIT;
+    ICfreelicenses(&licenses);
+  }
+  elapsed = (seconds() - start)/repeat;
+  printf("licenses %8.3f ms per call  %d licenses\n", 1e3*elapsed,
+         num_licenses);
+
+QUIT:
+  if (error)
+    printf("Error %d\n", error);
+  ICsettransport(NULL);
+  ICfreetransport(&transport);
+  ICfreemachineinfo(&machine_info);
+  ICfreelicenses(&licenses);
+
+  return error;
+}
+
+int
+main(int   argc,
+     char *argv[])
+{
+  static const char *names[] = { "auto", "scalar", "sse2", "avx2" };
+  ICmachineinfo *machine_info = NULL;
+  char  *fleet;
+  double start;
+  double elapsed;
+  size_t len;
+  int    num_machines = argc > 1 ? atoi(argv[1]) : 100000;
+  int    repeat       = argc > 2 ? atoi(argv[2]) : 5;
+  int    num_threads  = argc > 3 ? atoi(argv[3]) : 1;
+  unsigned int fields;
+  int    kind;
+  int    i;
+  int    error = 0;
+
+  if (argc > 2 && strcmp(argv[1], "--replay") == 0)
+    return replay(argv[2], argc > 3 ? atoi(argv[3]) : 1000) != 0;
+
+  fleet = makefleet(num_machines);
+  if (fleet == NULL) {
+    printf("Out of memory\n");
+    return 1;
+  }
+  len = strlen(fleet);
+  printf("%d machines, %.1f MB, %d threads\n", num_machines, len/1e6,
+         num_threads);
+
+  if (ICsetparsethreads(num_threads)) {
+    printf("Bad number of threads %d\n", num_threads);
+    return 1;
+  }
+
+  for (kind = IC_SCAN_SCALAR; kind <= IC_SCAN_AVX2; kind++) {
+    if (ICsetscanner(kind)) {
+      printf("%-8s not available\n", names[kind]);
+      continue;
+    }
+    /* With no fields the time is dominated by the scan itself */
+    for (fields = 0; fields <= IC_FIELD_ALL; fields += IC_FIELD_ALL) {
+      start = seconds();
+      for (i = 0; i < repeat; i++) {
+        error = ICdecodemachines(fleet, fields, &machine_info);
+        if (error) goto QUIT;
+      }
+      elapsed = (seconds() - start)/repeat;
+      printf("%-8s %-10s %8.2f ms %8.1f MB/s  %d machines\n", names[kind],
+             fields ? "all fields" : "no fields", 1e3*elapsed,
+             len/elapsed/1e6, machine_info->num_machines);
+    }
+  }
+
+QUIT:
+  if (error)
+    printf("Error %d\n", error);
+  ICfreemachineinfo(&machine_info);
+  free(fleet);
+
+  return error != 0;
+}
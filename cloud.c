@@ -1,13 +1,29 @@
 #include "cloud.h"
+#include "trace.h"
 #include <time.h>
 #include <string.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <stddef.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
 #include <curl/curl.h>
+#include <openssl/ssl.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define HAVE_SSE2_SCAN
+#if defined(__GNUC__)
+#include <immintrin.h>
+#define HAVE_AVX2_SCAN
+#endif
+#endif
 
 #define DEFAULT_PORT   80
 #define MAX_STRLEN 5000
+#define MAX_HOSTLEN 255
 
 char baseurl[] = "https://cloud.gurobi.com/api";
 char accessid[ACCESS_ID_LEN+1];
@@ -54,11 +70,29 @@ license_type_encode[NUM_CLOUD_LICENSE_TYPE][24+1] = \
     "distributed%20worker" };
 
 
+struct Command {
+  char  command[MAX_STRLEN+1];
+  char *response;
+  char  timestr[MAX_STRLEN+1];
+  char  signature[SIG_LEN+1];
+  char *postfields;   /* heap-owned POST body, NULL for a GET */
+  int   error;
+  int   retryable;
+};
+
 static int sendcommand(const char *command, char *postfields, char *timestr,
-                       char *signature, char *response);
+                       char *signature, char **responseP);
+static int sendcommands(int n, struct Command *commands);
+static int sendget(const char *endpoint, struct Command *cmd);
+static int buildget(const char *endpoint, struct Command *cmd);
+static int scanner = IC_SCAN_AUTO;
 
 /* JSMN JSON parser from http://zserge.bitbucket.org/jsmn.html */
 
+/* Parent links keep closing a container O(depth) instead of a scan back
+   over every token parsed so far */
+#define JSMN_PARENT_LINKS
+
 /**
  * JSON type identifier. Basic types are:
  * o Object
@@ -120,6 +154,15 @@ static void jsmn_init(jsmn_parser *parser);
 static jsmnerr_t jsmn_parse(jsmn_parser *parser, const char *js, size_t len,
                      jsmntok_t *tokens, unsigned int num_tokens);
 
+static int bestscanner(void);
+static ICtransport *getrecorder(void);
+#ifdef HAVE_SSE2_SCAN
+static int scanjson(const char *js, size_t len, int kind,
+                    jsmntok_t **tokensP, int *num_tokensP);
+#endif
+static int splitobjects(const char *js, size_t len, int **startsP,
+                        int **endsP, int *num_objectsP);
+
 
 /* hmac sha1 from http://oauth.googlecode.com/svn/code/c/liboauth/src/sha1.c */
 
@@ -369,6 +412,150 @@ getISO8601(char *time_str)
 
 }
 
+static double
+nowms(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec*1000.0 + ts.tv_nsec/1000000.0;
+}
+
+/* The CLOCK_REALTIME time ms from now, for pthread_cond_timedwait */
+static void
+abstime(double           ms,
+        struct timespec *ts)
+{
+  double wake;
+
+  clock_gettime(CLOCK_REALTIME, ts);
+  wake = ts->tv_nsec/1000000.0 + (ms > 0 ? ms : 0) + 1;
+  ts->tv_sec  += (time_t) (wake/1000);
+  ts->tv_nsec  = (long) ((wake - 1000*(long) (wake/1000))*1000000);
+}
+
+/* Deadlines and cancellation.  Each thread has a deadline and a token
+   of its own, which every transfer, retry and delay captures when it
+   starts.  The pool thread stops transfers whose deadline has passed or
+   whose token is cancelled; ICcancel wakes it, and every other wait
+   that has to notice. */
+
+struct _canceltoken {
+  int cancelled;
+};
+
+static __thread double         call_deadline_ms = 0;
+static __thread ICcanceltoken *call_token = NULL;
+
+static pthread_mutex_t cancel_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  cancel_cond = PTHREAD_COND_INITIALIZER;
+
+/* ERROR_CANCELLED or ERROR_TIMEOUT when work under this deadline and
+   token must stop, 0 otherwise */
+static int
+callstopped(double         deadline_ms,
+            ICcanceltoken *token)
+{
+  if (token && __atomic_load_n(&token->cancelled, __ATOMIC_ACQUIRE))
+    return ERROR_CANCELLED;
+  if (deadline_ms > 0 && nowms() >= deadline_ms)
+    return ERROR_TIMEOUT;
+  return 0;
+}
+
+/* Milliseconds of the monotonic clock, the clock of deadlines */
+long long
+ICnowms(void)
+{
+  return (long long) nowms();
+}
+
+/* Applies to the calling thread, 0 for no deadline */
+int
+ICsetdeadline(long long deadline_ms)
+{
+  if (deadline_ms < 0)
+    return ERROR_INVALID_ARGUMENT;
+
+  call_deadline_ms = (double) deadline_ms;
+  return 0;
+}
+
+long long
+ICgetdeadline(void)
+{
+  return (long long) call_deadline_ms;
+}
+
+/* Applies to the calling thread, NULL for none */
+int
+ICsetcanceltoken(ICcanceltoken *token)
+{
+  call_token = token;
+  return 0;
+}
+
+ICcanceltoken *
+ICgetcanceltoken(void)
+{
+  return call_token;
+}
+
+int
+ICcreatecanceltoken(ICcanceltoken **tokenP)
+{
+  ICcanceltoken *token = NULL;
+  int error = 0;
+
+  if (!tokenP)
+    return ERROR_NULL_ARGUMENT;
+
+  CALLOC(token, 1);
+
+QUIT:
+  *tokenP = token;
+  return error;
+}
+
+int
+ICiscancelled(const ICcanceltoken *token)
+{
+  return token && __atomic_load_n(&token->cancelled, __ATOMIC_ACQUIRE);
+}
+
+int
+ICfreecanceltoken(ICcanceltoken **tokenP)
+{
+  if (!tokenP)
+    return ERROR_NULL_ARGUMENT;
+
+  FREE(*tokenP);
+  return 0;
+}
+
+/* Sleep for ms, or until the calling thread's deadline or cancellation,
+   which is returned */
+int
+ICsleep(int ms)
+{
+  struct timespec ts;
+  ICcanceltoken *token = call_token;
+  double deadline_ms = call_deadline_ms;
+  double due_ms = nowms() + (ms > 0 ? ms : 0);
+  double wake_ms;
+  int error;
+
+  pthread_mutex_lock(&cancel_lock);
+  while (!(error = callstopped(deadline_ms, token)) && nowms() < due_ms) {
+    wake_ms = deadline_ms > 0 && deadline_ms < due_ms ? deadline_ms : due_ms;
+    abstime(wake_ms - nowms(), &ts);
+    pthread_cond_timedwait(&cancel_cond, &cancel_lock, &ts);
+  }
+  pthread_mutex_unlock(&cancel_lock);
+
+  return error;
+}
+
 static const char b64_table[] = \
   "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/=";
 
@@ -412,81 +599,228 @@ b64_encode(const char *input,
 }
 
 
-int
-ICgetlicenses(int              *num_licenseP,
-              ICcloudlicense   *licenses)
+/* Canonical requests.  A request is signed as METHOD&field&...&date
+   and its POST body is the same fields without the method and the date.
+   The builder appends each field once to a growing body and feeds the
+   same bytes to the HMAC, so a request of any size is built and signed
+   in one pass. */
+typedef struct {
+  sha1nfo hmac;
+  char   *body;
+  size_t  len;
+  size_t  cap;
+  int     error;
+} RequestBuilder;
+
+static void
+startrequest(RequestBuilder *b,
+             const char     *method)
 {
-  char request[MAX_STRLEN+1];
-  char response[MAX_STRLEN+1];
-  char timestr[MAX_STRLEN+1];
-  char digest[MAX_STRLEN+1];
-  char signature[SIG_LEN+1];
-  char *endpoint = "licenses";
-  char command[MAX_STRLEN+1];
-  sha1nfo s;
-  jsmn_parser parser;
-  jsmntok_t tokens[256];
-  int         jsmn_ret;
-  jsmntok_t *t;
-  int  num_license  = -1;
-  int  found_credit = 0;
-  int  found_lic_id = 0;
-  int  found_exp    = 0;
-  int  found_rate   = 0;
-  int  i;
-  int error = 0;
+  b->body  = NULL;
+  b->len   = 0;
+  b->cap   = 0;
+  b->error = 0;
 
+  sha1_initHmac(&b->hmac, (unsigned char *) secretkey, SECRET_KEY_LEN);
+  sha1_write(&b->hmac, method, strlen(method));
+}
 
-  if (!(strlen(accessid) == ACCESS_ID_LEN   &&
-        strlen(secretkey) == SECRET_KEY_LEN   )) {
-    error = ERROR_INVALID_ARGUMENT;
-    goto QUIT;
+/* Append formatted text to the body, starting a new field if asked */
+static void
+appendrequest(RequestBuilder *b,
+              int             field,
+              const char     *format,
+              ...)
+{
+  va_list ap;
+  size_t  sep = field && b->len > 0;
+  size_t  avail;
+  size_t  cap;
+  char   *body;
+  int     n;
+
+  if (b->error) return;
+
+  for (;;) {
+    avail = b->cap - b->len;
+    n = 0;
+    if (avail > sep) {
+      va_start(ap, format);
+      n = vsnprintf(&b->body[b->len + sep], avail - sep, format, ap);
+      va_end(ap);
+      if (n < 0) {
+        b->error = ERROR_INVALID_ARGUMENT;
+        return;
+      }
+      if ((size_t) n < avail - sep) break;
+    }
+
+    cap = b->cap ? 2*b->cap : 256;
+    while (cap < b->len + sep + n + 1)
+      cap *= 2;
+    body = realloc(b->body, cap);
+    if (body == NULL) {
+      b->error = ERROR_OUT_OF_MEMORY;
+      return;
+    }
+    b->body = body;
+    b->cap  = cap;
   }
 
-  sprintf(command, "%s/%s?id=%s", baseurl, endpoint, accessid);
-#ifdef VERBOSE
-  printf("command %s\n", command);
-#endif
+  if (sep)
+    b->body[b->len] = '&';
+  if (field)
+    sha1_writebyte(&b->hmac, '&');
+  sha1_write(&b->hmac, &b->body[b->len + sep], n);
+  b->len += sep + n;
+}
 
-  getISO8601(timestr);
-  sprintf(request, "GET&id=%s&%s", accessid, timestr);
+/* Date and sign the request.  On success the body belongs to the
+   caller, on failure it is freed. */
+static int
+signrequest(RequestBuilder *b,
+            char           *timestr,
+            char           *signature,
+            char          **bodyP)
+{
+  char digest[HASH_LENGTH];
+
+  if (b->error) {
+    FREE(b->body);
+    return b->error;
+  }
 
-  sha1_init(&s);
-  sha1_initHmac(&s, (unsigned char *) secretkey, 43);
-  sha1_write(&s, request, strlen(request));
-  memcpy(digest, sha1_resultHmac(&s), 20);
-  digest[20] = 0;
+  getISO8601(timestr);
+  sha1_writebyte(&b->hmac, '&');
+  sha1_write(&b->hmac, timestr, strlen(timestr));
+  memcpy(digest, sha1_resultHmac(&b->hmac), HASH_LENGTH);
 #ifdef VERBOSE
   printf("digest ");
   printHash((uint8_t *)digest);
 #endif
 
-  b64_encode(digest, 20, signature, SIG_LEN);
+  b64_encode(digest, HASH_LENGTH, signature, SIG_LEN);
   signature[SIG_LEN] = '\0';
 
 #ifdef VERBOSE
-  printf("request %s\n", request);
+  printf("request %s\n", b->body);
   printf("timestr %s\n", timestr);
   printf("signature %s\n", signature);
 #endif
 
-  error = sendcommand(command, NULL, timestr, signature, response);
-  if (error) goto QUIT;
+  *bodyP = b->body;
+  b->body = NULL;
+
+  return 0;
+}
+
+static int
+buildget(const char     *endpoint,
+         struct Command *cmd)
+{
+  RequestBuilder b;
+  char *body = NULL;
+  int   error;
+  ICspan span = IC_SPAN_INIT;
 
+  TRACE_BEGIN(span);
+
+  sprintf(cmd->command, "%s/%s?id=%s", baseurl, endpoint, accessid);
 #ifdef VERBOSE
-  printf("response %s\n", response);
+  printf("command %s\n", cmd->command);
+#endif
+
+  startrequest(&b, "GET");
+  appendrequest(&b, 1, "id=%s", accessid);
+  error = signrequest(&b, cmd->timestr, cmd->signature, &body);
+
+  /* Only the signature goes out with a GET */
+  FREE(body);
+  cmd->postfields = NULL;
+  TRACE_END(span, "sign", endpoint);
+
+  return error;
+}
+
+/* Tokenize a whole response, growing the token array until it fits */
+static int
+parsejson(const char *js,
+          size_t      len,
+          jsmntok_t **tokensP,
+          int        *num_tokensP)
+{
+  jsmn_parser parser;
+  jsmntok_t  *tokens = NULL;
+  jsmntok_t  *more;
+  int         num_tokens = len/8 + 16;
+  int         kind = scanner;
+  int         jsmn_ret;
+  int         error = 0;
+
+  if (kind == IC_SCAN_AUTO)
+    kind = bestscanner();
+#ifdef HAVE_SSE2_SCAN
+  if (kind != IC_SCAN_SCALAR)
+    return scanjson(js, len, kind, tokensP, num_tokensP);
 #endif
 
+  MALLOC(tokens, num_tokens);
   jsmn_init(&parser);
 
-  jsmn_ret = jsmn_parse(&parser, response, strlen(response), tokens, 256);
+  for (;;) {
+    jsmn_ret = jsmn_parse(&parser, js, len, tokens, num_tokens);
+    if (jsmn_ret != JSMN_ERROR_NOMEM)
+      break;
+    num_tokens *= 2;
+    more = (jsmntok_t *) realloc(tokens, num_tokens*sizeof(jsmntok_t));
+    if (more == NULL) {
+      error = ERROR_OUT_OF_MEMORY;
+      goto QUIT;
+    }
+    tokens = more;
+  }
   if (jsmn_ret < 0) {
+#ifdef VERBOSE
     printf("jsmn_error %d\n", jsmn_ret);
+#endif
     error = ERROR_NETWORK;
     goto QUIT;
   }
 
-  for (i = 0; i < jsmn_ret; i++) {
+  *tokensP     = tokens;
+  *num_tokensP = parser.toknext;
+  tokens = NULL;
+
+QUIT:
+  FREE(tokens);
+
+  return error;
+}
+
+/* Count the licenses of a response and, with licenses, decode them */
+static int
+decodelicenses(const char     *response,
+               int            *num_licenseP,
+               ICcloudlicense *licenses)
+{
+  jsmntok_t *tokens = NULL;
+  int         num_tokens;
+  jsmntok_t *t;
+  int  num_license  = -1;
+  int  found_credit = 0;
+  int  found_lic_id = 0;
+  int  found_exp    = 0;
+  int  found_rate   = 0;
+  int  i;
+  int error = 0;
+  ICspan span = IC_SPAN_INIT;
+
+  TRACE_BEGIN(span);
+
+  error = parsejson(response, strlen(response), &tokens, &num_tokens);
+  if (error) goto QUIT;
+
+  for (i = 0; i < num_tokens; i++) {
     char buff[128];
     int  size;
     t = &tokens[i];
@@ -496,8 +830,10 @@ ICgetlicenses(int              *num_licenseP,
       num_license++;
       continue;
     }
-    if (t->type == JSMN_STRING && licenses) {
+    if (t->type == JSMN_STRING && licenses && num_license >= 0) {
       size = (t->end - t->start);
+      if (size >= (int) sizeof(buff))
+        size = sizeof(buff) - 1;
       memcpy(buff, &response[t->start], sizeof(char)*size);
       buff[size] = 0;
 #ifdef VERBOSE
@@ -510,10 +846,16 @@ ICgetlicenses(int              *num_licenseP,
         sscanf(buff, "%d", &(licenses[num_license].license_id));
         found_lic_id = 0;
       } else if (found_exp) {
-        memcpy(licenses[num_license].expiration, buff, sizeof(char)*(size+1));
+        if (size > MAX_ISO8601_LEN)
+          size = MAX_ISO8601_LEN;
+        memcpy(licenses[num_license].expiration, buff, sizeof(char)*size);
+        licenses[num_license].expiration[size] = 0;
         found_exp = 0;
       } else if (found_rate) {
-        memcpy(licenses[num_license].rate_plan, buff, sizeof(char)*(size+1));
+        if (size > MAX_RATE_LEN)
+          size = MAX_RATE_LEN;
+        memcpy(licenses[num_license].rate_plan, buff, sizeof(char)*size);
+        licenses[num_license].rate_plan[size] = 0;
         found_rate = 0;
       } else if (strcmp(buff, "credit") == 0) {
         found_credit = 1;
@@ -531,682 +873,4065 @@ ICgetlicenses(int              *num_licenseP,
     *num_licenseP = num_license + 1;
   }
 
-
 QUIT:
+  FREE(tokens);
+  TRACE_END(span, "parse", "licenses");
 
   return error;
 }
 
 static int
-getmachineinfo(char           *response,
-               ICmachineinfo **machine_infoP)
+getlicenses(char **responseP)
 {
-  jsmn_parser parser;
-  jsmntok_t tokens[256];
-  int         jsmn_ret;
-  jsmntok_t *t;
-  ICmachineinfo *machine_info = NULL;
-  ICmachine     *machines     = NULL;
-  int  num_machines = 0;
-  int  id_found = 0;
-  int  state_found = 0;
-  int  dns_name_found = 0;
-  int  machine_found = 0;
-  int  time_found = 0;
-  int  region_found = 0;
-  int  lic_type_found = 0;
-  int  idle_found = 0;
-  int  lic_found = 0;
-  int  password_found = 0;
-  char buff[128];
-  int  size;
-  int  flag;
-  int  i;
-  int  j;
-  int  error = 0;
+  struct Command cmd;
+  char *endpoint = "licenses";
+  int error = 0;
 
-  jsmn_init(&parser);
+  cmd.response = NULL;
 
-  jsmn_ret = jsmn_parse(&parser, response, strlen(response), tokens, 256);
-  if (jsmn_ret < 0) {
-    error = ERROR_NETWORK;
-    printf("getmachine info error in jsmn_parse\n");
+  if (!(strlen(accessid) == ACCESS_ID_LEN   &&
+        strlen(secretkey) == SECRET_KEY_LEN   )) {
+    error = ERROR_INVALID_ARGUMENT;
     goto QUIT;
   }
 
+  error = buildget(endpoint, &cmd);
+  if (error) goto QUIT;
 
-  /* Count the number of machines we have */
-
-  for (i = 0; i < jsmn_ret; i++) {
-    t = &tokens[i];
-    if (t->type == JSMN_OBJECT) {
-      num_machines++;
-    }
-  }
-
-  /* Alloc machine info */
-  MALLOC(machine_info, 1);
-  MALLOC(machine_info->machines, num_machines);
-  MALLOC(machine_info->machine_ids, num_machines);
-  for (i = 0; i < num_machines; i++) {
-    MALLOC(machine_info->machine_ids[i], sizeof(char)*(MAX_ID_LEN+1));
-  }
-
-  machines = machine_info->machines;
-  *machine_infoP = machine_info;
+  error = sendget(endpoint, &cmd);
+  if (error) goto QUIT;
 
-  num_machines = -1;
-  for (i = 0; i < jsmn_ret; i++) {
-    t = &tokens[i];
-    if (t->type == JSMN_ARRAY) /* Ignore enclosing array */
-      continue;
-    if (t->type == JSMN_OBJECT) {
-      num_machines++;
-      continue;
-    }
-    if (t->type == JSMN_STRING) {
-      size = (t->end - t->start);
-      memcpy(buff, &response[t->start], sizeof(char)*size);
-      buff[size] = 0;
 #ifdef VERBOSE
-      printf("str: %s %d %d %d\n", buff, lic_found, id_found, idle_found);
+  printf("response %s\n", cmd.response);
 #endif
-      if (id_found) {
-        memcpy(machines[num_machines].machine_id, buff, sizeof(char)*(size+1));
-        id_found = 0;
-      } else if (state_found) {
-        flag = 0;
-        for (j = 0; j < NUM_MACHINE_STATE; j++) {
-          if (strcmp(machine_state_data[j], buff) == 0) {
-            memcpy(machines[num_machines].state, buff, sizeof(char)*(size+1));
-            flag = 1;
-            break;
-          }
-        }
-        if (!flag) {
-          error = ERROR_NETWORK;
-          goto QUIT;
-        }
-        state_found = 0;
-      } else if (dns_name_found) {
-        memcpy(machines[num_machines].dns_name, buff, sizeof(char)*(size+1));
-        dns_name_found = 0;
-      } else if (machine_found) {
-        flag = 0;
-        for (j = 0; j < NUM_MACHINE_TYPE; j++) {
-          if (strcmp(machine_data[j], buff) == 0) {
-            memcpy(machines[num_machines].machine_type, buff,
-                   sizeof(char)*(size+1));
-            flag = 1;
-            break;
-          }
-        }
-        if (!flag) {
-          error = ERROR_NETWORK;
-          goto QUIT;
-        }
-        machine_found = 0;
-      } else if (time_found) {
-        memcpy(machines[num_machines].create_time, buff, sizeof(char)*(size+1));
-        time_found = 0;
-      } else if (region_found) {
-        flag = 0;
-        for (j = 0; j < NUM_REGIONS; j++) {
-          if (strcmp(region_data[j], buff) == 0) {
-            memcpy(machines[num_machines].region, buff, sizeof(char)*(size+1));
-            flag = 1;
-            break;
-          }
-        }
-        if (!flag) {
-          error = ERROR_NETWORK;
-          goto QUIT;
-        }
-        region_found = 0;
-      } else if (lic_type_found) {
-        flag = 0;
-        for (j = 0; j < NUM_CLOUD_LICENSE_TYPE; j++) {
-          if (strcmp(license_type_data[j], buff) == 0) {
-            memcpy(machines[num_machines].license_type, buff,
-                   sizeof(char)*(size+1));
-            flag = 1;
-            break;
-          }
-        }
-        if (!flag) {
-          error = ERROR_NETWORK;
-          goto QUIT;
-        }
-        lic_type_found = 0;
-      } else if (lic_found) {
-        machines[num_machines].license_id = atoi(buff);
-        lic_found = 0;
-      } else if (idle_found) {
-        size = (t->end - t->start);
-        memcpy(buff, &response[t->start], sizeof(char)*size);
-        machines[num_machines].idle_shutdown = atoi(buff);
-        idle_found = 0;
-      } else if (password_found) {
-        memcpy(machines[num_machines].user_password, buff,
-               sizeof(char)*(size+1));
-        password_found = 0;
-      } else if (strcmp(buff, "_id") == 0) {
-        id_found = 1;
-      } else if (strcmp(buff, "state") == 0) {
-        state_found = 1;
-      } else if (strcmp(buff, "DNSName") == 0) {
-        dns_name_found = 1;
-      } else if (strcmp(buff, "machineType") == 0) {
-        machine_found = 1;
-      } else if (strcmp(buff, "createTime") == 0) {
-        time_found = 1;
-      } else if (strcmp(buff, "region") == 0) {
-        region_found = 1;
-      } else if (strcmp(buff, "licenseType") == 0) {
-        lic_type_found = 1;
-      } else if (strcmp(buff, "idleShutdown") == 0) {
-        idle_found = 1;
-      } else if (strcmp(buff, "licenseId") == 0) {
-        lic_found = 1;
-      } else if (strcmp(buff, "userPassword") == 0) {
-        password_found = 1;
-      }
-    }
 
-    if (t->type == JSMN_PRIMITIVE && idle_found) {
-      size = (t->end - t->start);
-      memcpy(buff, &response[t->start], sizeof(char)*size);
-      machines[num_machines].idle_shutdown = atoi(buff);
-      idle_found = 0;
-    }
-  }
-
-  machine_info->num_machines = num_machines + 1;
-  for (i = 0; i < machine_info->num_machines; i++) {
-    memcpy(machine_info->machine_ids[i],
-           machine_info->machines[i].machine_id,
-           sizeof(MAX_ID_LEN+1));
-  }
+  *responseP = cmd.response;
+  cmd.response = NULL;
 
 QUIT:
+  FREE(cmd.response);
 
   return error;
 }
 
-
 int
-ICgetmachines(ICmachineinfo **machine_infoP)
+ICgetlicenses(int              *num_licenseP,
+              ICcloudlicense   *licenses)
 {
-  char request[MAX_STRLEN+1];
-  char response[MAX_STRLEN+1];
-  char timestr[MAX_STRLEN+1];
-  char digest[MAX_STRLEN+1];
-  char signature[SIG_LEN+1];
-  char *endpoint = "machines";
-  char command[MAX_STRLEN+1];
-  sha1nfo s;
-  int  error = 0;
+  char *response = NULL;
+  int error = 0;
+  ICspan span = IC_SPAN_INIT;
 
-  if (!(strlen(accessid) == ACCESS_ID_LEN   &&
-        strlen(secretkey) == SECRET_KEY_LEN   )) {
-    error = ERROR_INVALID_ARGUMENT;
-    goto QUIT;
-  }
+  TRACE_BEGIN(span);
 
-  /* free old machine info */
-  error = ICfreemachineinfo(machine_infoP);
+  error = getlicenses(&response);
   if (error) goto QUIT;
 
-  sprintf(command, "%s/%s?id=%s", baseurl, endpoint, accessid);
-#ifdef VERBOSE
-  printf("command %s\n", command);
-#endif
+  error = decodelicenses(response, num_licenseP, licenses);
 
-  getISO8601(timestr);
-  sprintf(request, "GET&id=%s&%s", accessid, timestr);
+QUIT:
+  FREE(response);
+  TRACE_END(span, "ICgetlicenses", NULL);
 
-  sha1_init(&s);
-  sha1_initHmac(&s, (unsigned char *) secretkey, 43);
-  sha1_write(&s, request, strlen(request));
-  memcpy(digest, sha1_resultHmac(&s), 20);
-  digest[20] = 0;
+  return error;
+}
 
-#ifdef VERBOSE
-  printf("digest ");
-  printHash((uint8_t *)digest);
-#endif
+/* Licenses of one request, in an array the caller releases with
+   ICfreelicenses */
+int
+ICgetlicenselist(int             *num_licensesP,
+                 ICcloudlicense **licensesP)
+{
+  ICcloudlicense *licenses = NULL;
+  char *response = NULL;
+  int   num_licenses = 0;
+  int   error = 0;
+  ICspan span = IC_SPAN_INIT;
 
+  if (!num_licensesP || !licensesP)
+    return ERROR_NULL_ARGUMENT;
 
-  b64_encode(digest, 20, signature, SIG_LEN);
-  signature[SIG_LEN] = '\0';
+  TRACE_BEGIN(span);
 
-#ifdef VERBOSE
-  printf("request %s\n", request);
-  printf("timestr %s\n", timestr);
-  printf("signature %s\n", signature);
+  error = getlicenses(&response);
+  if (error) goto QUIT;
+
+  error = decodelicenses(response, &num_licenses, NULL);
+  if (error) goto QUIT;
+
+  CALLOC(licenses, num_licenses);
+  error = decodelicenses(response, NULL, licenses);
+  if (error) goto QUIT;
+
+  *num_licensesP = num_licenses;
+  *licensesP     = licenses;
+  licenses       = NULL;
+
+QUIT:
+  FREE(licenses);
+  FREE(response);
+  TRACE_END(span, "ICgetlicenselist", NULL);
+
+  return error;
+}
+
+int
+ICfreelicenses(ICcloudlicense **licensesP)
+{
+  if (!licensesP)
+    return ERROR_NULL_ARGUMENT;
+
+  FREE(*licensesP);
+  return 0;
+}
+
+/* Keys of a machine record, in the order of the IC_FIELD_ bits */
+#define MACHINEKEY(key, field, column) \
+  { key, offsetof(ICmachine, field), sizeof(((ICmachine *) 0)->field), \
+    offsetof(ICmachineview, field), column }
+#define COLUMN_STRING -1
+#define COLUMN_INT    -2
+
+static const struct {
+  const char *key;
+  size_t      offset;
+  size_t      size;
+  size_t      view_offset;
+  int         column;
+} machinekeys[] = {
+  MACHINEKEY("_id",          machine_id,    COLUMN_STRING),
+  MACHINEKEY("state",        state,         IC_COLUMN_STATE),
+  MACHINEKEY("DNSName",      dns_name,      COLUMN_STRING),
+  MACHINEKEY("createTime",   create_time,   COLUMN_STRING),
+  MACHINEKEY("machineType",  machine_type,  IC_COLUMN_MACHINE_TYPE),
+  MACHINEKEY("region",       region,        IC_COLUMN_REGION),
+  MACHINEKEY("licenseType",  license_type,  IC_COLUMN_LICENSE_TYPE),
+  MACHINEKEY("idleShutdown", idle_shutdown, COLUMN_INT),
+  MACHINEKEY("licenseId",    license_id,    COLUMN_INT),
+  MACHINEKEY("userPassword", user_password, COLUMN_STRING) };
+
+#define NUM_MACHINE_KEYS (int) (sizeof(machinekeys)/sizeof(machinekeys[0]))
+
+static int
+findkey(const char      *js,
+        const jsmntok_t *key)
+{
+  int len = key->end - key->start;
+  int f;
+
+  for (f = 0; f < NUM_MACHINE_KEYS; f++) {
+    if (machinekeys[f].key[0] == js[key->start]   &&
+        (int) strlen(machinekeys[f].key) == len &&
+        memcmp(machinekeys[f].key, &js[key->start], len) == 0)
+      return f;
+  }
+  return -1;
+}
+
+/* Index of the first token after token i and everything nested in it */
+static int
+skiptoken(const jsmntok_t *tokens,
+          int              num_tokens,
+          int              i)
+{
+  int end = tokens[i].end;
+
+  for (i++; i < num_tokens && tokens[i].start < end; i++)
+    ;
+  return i;
+}
+
+/* Decode the objects among the tokens from index first on into
+   consecutive machines.  Only the keys selected by fields are decoded,
+   the values of other keys are skipped unseen. */
+static int
+decoderecords(const char      *js,
+              const jsmntok_t *tokens,
+              int              num_tokens,
+              int              first,
+              unsigned int     fields,
+              ICmachine       *machines,
+              int              max_machines,
+              int             *num_machinesP)
+{
+  const jsmntok_t *t;
+  ICmachine *machine;
+  char *dst;
+  char  buff[32];
+  int  num_machines = 0;
+  int  size;
+  int  f;
+  int  i;
+  int  j;
+  int  k;
+  int  error = 0;
+
+  for (i = first; i < num_tokens; i = skiptoken(tokens, num_tokens, i)) {
+    if (tokens[i].type != JSMN_OBJECT)
+      continue;
+    if (num_machines == max_machines) {
+      error = ERROR_NETWORK;
+      goto QUIT;
+    }
+    machine = &machines[num_machines++];
+
+    /* Members alternate key, value; values may nest */
+    j = i + 1;
+    for (k = 0; k < tokens[i].size && j + 1 < num_tokens; k++) {
+      f = findkey(js, &tokens[j++]);
+      t = &tokens[j];
+      j = skiptoken(tokens, num_tokens, j);
+      if (f < 0 || !(fields & (1u << f)))
+        continue;
+
+      size = t->end - t->start;
+      dst  = (char *) machine + machinekeys[f].offset;
+      if (machinekeys[f].column == COLUMN_INT) {
+        if (size >= (int) sizeof(buff))
+          size = sizeof(buff) - 1;
+        memcpy(buff, &js[t->start], sizeof(char)*size);
+        buff[size] = 0;
+        *(int *) dst = atoi(buff);
+        continue;
+      }
+
+      if (t->type != JSMN_STRING) {
+        error = ERROR_NETWORK;
+        goto QUIT;
+      }
+      if (size >= (int) machinekeys[f].size)
+        size = machinekeys[f].size - 1;
+      memcpy(dst, &js[t->start], sizeof(char)*size);
+      dst[size] = 0;
+#ifdef VERBOSE
+      printf("str: %s %s\n", machinekeys[f].key, dst);
+#endif
+      if (machinekeys[f].column >= 0 &&
+          ICcode(machinekeys[f].column, dst) == IC_UNKNOWN_CODE) {
+        error = ERROR_NETWORK;
+        goto QUIT;
+      }
+    }
+  }
+
+QUIT:
+  *num_machinesP = num_machines;
+
+  return error;
+}
+
+/* Parallel decoding.  The objects of a large listing are split into
+   contiguous runs, each tokenized and decoded by its own thread into
+   its own slots of the machine array. */
+
+#define PARSE_MIN_OBJECTS 1024   /* fewest objects worth a thread */
+
+static int parsethreads = 1;
+
+struct ParseJob {
+  const char   *js;
+  size_t        len;
+  unsigned int  fields;
+  ICmachine    *machines;
+  int           num_machines;
+  int           error;
+  int           started;
+  pthread_t     thread;
+};
+
+int
+ICsetparsethreads(int num_threads)
+{
+  if (num_threads < 1)
+    return ERROR_INVALID_ARGUMENT;
+  parsethreads = num_threads;
+  return 0;
+}
+
+static void *
+parsejob(void *arg)
+{
+  struct ParseJob *job = (struct ParseJob *) arg;
+  jsmntok_t *tokens = NULL;
+  int  num_tokens;
+  int  num_machines;
+  int  error = 0;
+
+  error = parsejson(job->js, job->len, &tokens, &num_tokens);
+  if (error) goto QUIT;
+
+  error = decoderecords(job->js, tokens, num_tokens, 0, job->fields,
+                        job->machines, job->num_machines, &num_machines);
+  if (error) goto QUIT;
+
+  if (num_machines != job->num_machines)
+    error = ERROR_NETWORK;
+
+QUIT:
+  FREE(tokens);
+  job->error = error;
+
+  return NULL;
+}
+
+static int
+parsemachines(const char  *response,
+              int          num_objects,
+              const int   *starts,
+              const int   *ends,
+              int          num_jobs,
+              unsigned int fields,
+              ICmachine   *machines)
+{
+  struct ParseJob *jobs = NULL;
+  int  a;
+  int  b;
+  int  i;
+  int  error = 0;
+
+  CALLOC(jobs, num_jobs);
+
+  for (i = 0; i < num_jobs; i++) {
+    a = (long) i*num_objects/num_jobs;
+    b = (long) (i + 1)*num_objects/num_jobs;
+    jobs[i].js           = &response[starts[a]];
+    jobs[i].len          = ends[b-1] - starts[a];
+    jobs[i].fields       = fields;
+    jobs[i].machines     = &machines[a];
+    jobs[i].num_machines = b - a;
+  }
+
+  /* The calling thread takes the first run */
+  for (i = 1; i < num_jobs; i++)
+    jobs[i].started = !pthread_create(&jobs[i].thread, NULL, parsejob,
+                                      &jobs[i]);
+  parsejob(&jobs[0]);
+
+  for (i = 1; i < num_jobs; i++) {
+    if (jobs[i].started)
+      pthread_join(jobs[i].thread, NULL);
+    else
+      parsejob(&jobs[i]);
+  }
+  for (i = 0; i < num_jobs && !error; i++)
+    error = jobs[i].error;
+
+QUIT:
+  FREE(jobs);
+
+  return error;
+}
+
+/* Machine index.  Two open-addressing tables of machine positions plus
+   one, keyed by machine_id and by DNS name, with linear probing.  Each
+   table has at least twice as many slots as machines, so probes stay
+   short, and machines without a DNS name yet are left out of the
+   second one.  Lookups scan the machines when there is no index. */
+
+static int indexing = 0;
+
+int
+ICsetindexing(int enable)
+{
+  indexing = enable;
+  return 0;
+}
+
+static unsigned int
+hashkey(const char *key)
+{
+  unsigned int h = 2166136261u;
+
+  while (*key) {
+    h ^= (unsigned char) *key++;
+    h *= 16777619u;
+  }
+  return h;
+}
+
+static void
+indexkey(int        *table,
+         int         mask,
+         const char *key,
+         int         position)
+{
+  unsigned int slot = hashkey(key) & mask;
+
+  while (table[slot])
+    slot = (slot + 1) & mask;
+  table[slot] = position + 1;
+}
+
+/* A single-flight result is shared, and its holders may index it at
+   the same time.  Each builds a whole index of its own; the first one
+   published is kept and the others are freed.  The mask is the same
+   for all, so it is stored before the index is published. */
+int
+ICindexmachines(ICmachineinfo *machine_info)
+{
+  ICmachine *m;
+  int *index = NULL;
+  int *published = NULL;
+  int  size = 16;
+  int  i;
+  int  error = 0;
+
+  if (!machine_info) {
+    error = ERROR_NULL_ARGUMENT;
+    goto QUIT;
+  }
+  if (__atomic_load_n(&machine_info->index, __ATOMIC_ACQUIRE))
+    goto QUIT;
+
+  while (size < 2*machine_info->num_machines)
+    size *= 2;
+  CALLOC(index, 2*size);
+
+  for (i = 0; i < machine_info->num_machines; i++) {
+    m = &machine_info->machines[i];
+    if (m->machine_id[0])
+      indexkey(index, size - 1, m->machine_id, i);
+    if (m->dns_name[0] && strcmp(m->dns_name, "-") != 0)
+      indexkey(&index[size], size - 1, m->dns_name, i);
+  }
+
+  __atomic_store_n(&machine_info->index_mask, size - 1, __ATOMIC_RELAXED);
+  if (__atomic_compare_exchange_n(&machine_info->index, &published, index,
+                                  0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+    index = NULL;
+
+QUIT:
+  FREE(index);
+
+  return error;
+}
+
+static int
+lookupkey(const ICmachineinfo *machine_info,
+          int                  by_dns,
+          const char          *key)
+{
+  const ICmachine *m;
+  const int *table;
+  const int *index;
+  unsigned int slot;
+  int  mask;
+  int  i;
+
+  if (!machine_info || !key || !key[0] ||
+      (by_dns && strcmp(key, "-") == 0))
+    return -1;
+
+  index = __atomic_load_n(&machine_info->index, __ATOMIC_ACQUIRE);
+  if (!index) {
+    for (i = 0; i < machine_info->num_machines; i++) {
+      m = &machine_info->machines[i];
+      if (strcmp(by_dns ? m->dns_name : m->machine_id, key) == 0)
+        return i;
+    }
+    return -1;
+  }
+
+  mask  = __atomic_load_n(&machine_info->index_mask, __ATOMIC_RELAXED);
+  table = &index[by_dns ? mask + 1 : 0];
+  for (slot = hashkey(key) & mask; table[slot]; slot = (slot + 1) & mask) {
+    m = &machine_info->machines[table[slot] - 1];
+    if (strcmp(by_dns ? m->dns_name : m->machine_id, key) == 0)
+      return table[slot] - 1;
+  }
+  return -1;
+}
+
+int
+ICfindmachine(const ICmachineinfo *machine_info,
+              const char          *machine_id)
+{
+  return lookupkey(machine_info, 0, machine_id);
+}
+
+int
+ICfinddns(const ICmachineinfo *machine_info,
+          const char          *dns_name)
+{
+  return lookupkey(machine_info, 1, dns_name);
+}
+
+static int
+getmachineinfo(const char     *response,
+               unsigned int    fields,
+               ICmachineinfo **machine_infoP)
+{
+  jsmntok_t *tokens = NULL;
+  int         num_tokens;
+  ICmachineinfo *machine_info = NULL;
+  int  *starts = NULL;
+  int  *ends   = NULL;
+  int  num_machines = 0;
+  int  num_jobs = 1;
+  int  first;
+  int  count;
+  int  i;
+  int  error = 0;
+  ICspan span = IC_SPAN_INIT;
+
+  TRACE_BEGIN(span);
+
+  /* Large listings are split when parallel decoding is enabled, any
+     response that cannot be split is decoded serially below */
+  if (parsethreads > 1 &&
+      splitobjects(response, strlen(response), &starts, &ends, &count) == 0) {
+    num_jobs = count/PARSE_MIN_OBJECTS;
+    if (num_jobs > parsethreads)
+      num_jobs = parsethreads;
+  }
+
+  if (num_jobs < 2) {
+    error = parsejson(response, strlen(response), &tokens, &num_tokens);
+    if (error) {
+      printf("getmachine info error in jsmn_parse\n");
+      goto QUIT;
+    }
+
+    /* A single record may come back without the enclosing array */
+    if (num_tokens == 0 ||
+        (tokens[0].type != JSMN_ARRAY && tokens[0].type != JSMN_OBJECT)) {
+      error = ERROR_NETWORK;
+      goto QUIT;
+    }
+    first = (tokens[0].type == JSMN_ARRAY);
+    count = first ? tokens[0].size : 1;
+  }
+
+  /* Alloc machine info */
+  CALLOC(machine_info, 1);
+  machine_info->refcount = 1;
+  machine_info->fields   = fields;
+  CALLOC(machine_info->machines, count);
+  *machine_infoP = machine_info;
+
+  if (num_jobs < 2) {
+    error = decoderecords(response, tokens, num_tokens, first, fields,
+                          machine_info->machines, count, &num_machines);
+  } else {
+    error = parsemachines(response, count, starts, ends, num_jobs, fields,
+                          machine_info->machines);
+    num_machines = count;
+  }
+  if (error) goto QUIT;
+
+  machine_info->num_machines = num_machines;
+  CALLOC(machine_info->machine_ids, num_machines);
+  for (i = 0; i < num_machines; i++) {
+    MALLOC(machine_info->machine_ids[i], sizeof(char)*(MAX_ID_LEN+1));
+    memcpy(machine_info->machine_ids[i],
+           machine_info->machines[i].machine_id,
+           sizeof(char)*(MAX_ID_LEN+1));
+  }
+
+  if (indexing) {
+    error = ICindexmachines(machine_info);
+    if (error) goto QUIT;
+  }
+
+QUIT:
+  FREE(tokens);
+  FREE(starts);
+  FREE(ends);
+  TRACE_END(span, "parse", "machines");
+
+  return error;
+}
+
+
+/* Single-flight.  Concurrent ICgetmachines calls for the same account
+   attach to a request already in flight that decodes at least the
+   fields they asked for, and all receive the same result, which they
+   must treat as read-only. */
+
+struct Flight {
+  char            accessid[ACCESS_ID_LEN+1];
+  unsigned int    fields;
+  int             done;
+  int             error;
+  int             waiters;
+  ICmachineinfo  *result;
+  pthread_cond_t  cond;
+  struct Flight  *next;
+};
+
+static pthread_mutex_t flight_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct Flight  *flights = NULL;
+static int             singleflight = 0;
+
+int
+ICsetsingleflight(int enable)
+{
+  pthread_mutex_lock(&flight_lock);
+  singleflight = enable;
+  pthread_mutex_unlock(&flight_lock);
+
+  return 0;
+}
+
+static int
+fetchmachines(unsigned int    fields,
+              ICmachineinfo **machine_infoP)
+{
+  struct Command cmd;
+  char *endpoint = "machines";
+  int  error = 0;
+
+  cmd.response = NULL;
+
+  error = buildget(endpoint, &cmd);
+  if (error) goto QUIT;
+
+  error = sendget(endpoint, &cmd);
+  if (error) goto QUIT;
+
+#ifdef VERBOSE
+  printf("response %s\n", cmd.response);
 #endif
 
-  error = sendcommand(command, NULL, timestr, signature, response);
-  if (error) goto QUIT;
+  error = getmachineinfo(cmd.response, fields, machine_infoP);
+  if (error) goto QUIT;
+
+QUIT:
+  FREE(cmd.response);
+
+  return error;
+}
+
+int
+ICdecodemachines(const char     *response,
+                 unsigned int    fields,
+                 ICmachineinfo **machine_infoP)
+{
+  int error = 0;
+  ICspan span = IC_SPAN_INIT;
+
+  TRACE_BEGIN(span);
+
+  if (!response || !machine_infoP) {
+    error = ERROR_NULL_ARGUMENT;
+    goto QUIT;
+  }
+
+  error = ICfreemachineinfo(machine_infoP);
+  if (error) goto QUIT;
+
+  error = getmachineinfo(response, fields, machine_infoP);
+  if (error)
+    ICfreemachineinfo(machine_infoP);
+
+QUIT:
+  TRACE_END(span, "ICdecodemachines", NULL);
+
+  return error;
+}
+
+int
+ICgetmachines(ICmachineinfo **machine_infoP)
+{
+  return ICgetmachinefields(IC_FIELD_ALL, machine_infoP);
+}
+
+int
+ICgetmachinefields(unsigned int    fields,
+                   ICmachineinfo **machine_infoP)
+{
+  struct Flight *flight = NULL;
+  struct Flight **prev;
+  struct timespec ts;
+  int  error = 0;
+  ICspan span = IC_SPAN_INIT;
+
+  TRACE_BEGIN(span);
+
+  if (!(strlen(accessid) == ACCESS_ID_LEN   &&
+        strlen(secretkey) == SECRET_KEY_LEN   )) {
+    error = ERROR_INVALID_ARGUMENT;
+    goto QUIT;
+  }
+
+  /* free old machine info */
+  error = ICfreemachineinfo(machine_infoP);
+  if (error) goto QUIT;
+
+  pthread_mutex_lock(&flight_lock);
+  if (!singleflight) {
+    pthread_mutex_unlock(&flight_lock);
+    error = fetchmachines(fields, machine_infoP);
+    goto QUIT;
+  }
+
+JOIN:
+  for (flight = flights; flight; flight = flight->next) {
+    if (strcmp(flight->accessid, accessid) == 0 &&
+        (flight->fields & fields) == fields)
+      break;
+  }
+
+  if (flight) {
+    /* Wait for the leader, up to our own deadline; it takes a reference
+       for every waiter left when it is done */
+    flight->waiters++;
+    while (!flight->done &&
+           !(error = callstopped(call_deadline_ms, call_token))) {
+      if (call_deadline_ms > 0) {
+        abstime(call_deadline_ms - nowms(), &ts);
+        pthread_cond_timedwait(&flight->cond, &flight_lock, &ts);
+      } else {
+        pthread_cond_wait(&flight->cond, &flight_lock);
+      }
+    }
+    if (flight->done) {
+      error = flight->error;
+      if (!error)
+        *machine_infoP = flight->result;
+    }
+    if (--flight->waiters == 0 && flight->done) {
+      pthread_cond_destroy(&flight->cond);
+      free(flight);
+    }
+    /* The leader's deadline or token is not ours */
+    if ((error == ERROR_TIMEOUT || error == ERROR_CANCELLED) &&
+        !callstopped(call_deadline_ms, call_token)) {
+      error = 0;
+      goto JOIN;
+    }
+    pthread_mutex_unlock(&flight_lock);
+    goto QUIT;
+  }
+
+  flight = calloc(1, sizeof(*flight));
+  if (flight == NULL) {
+    pthread_mutex_unlock(&flight_lock);
+    error = ERROR_OUT_OF_MEMORY;
+    goto QUIT;
+  }
+  memcpy(flight->accessid, accessid, ACCESS_ID_LEN+1);
+  flight->fields = fields;
+  pthread_cond_init(&flight->cond, NULL);
+  flight->next = flights;
+  flights = flight;
+  pthread_mutex_unlock(&flight_lock);
+
+  error = fetchmachines(fields, machine_infoP);
+
+  pthread_mutex_lock(&flight_lock);
+  for (prev = &flights; *prev != flight; prev = &(*prev)->next)
+    ;
+  *prev = flight->next;
+  flight->done  = 1;
+  flight->error = error;
+  if (!error) {
+    flight->result = *machine_infoP;
+    flight->result->refcount += flight->waiters;
+  }
+  pthread_cond_broadcast(&flight->cond);
+  if (flight->waiters == 0) {
+    pthread_cond_destroy(&flight->cond);
+    free(flight);
+  }
+  pthread_mutex_unlock(&flight_lock);
+
+QUIT:
+  TRACE_END(span, "ICgetmachinefields", NULL);
+
+  return error;
+}
+
+static int
+buildlaunch(int              n,
+            char            *license_type,
+            int             *license_idP,
+            char            *user_password,
+            char            *region,
+            char            *machine_type,
+            int             *idleshutdownP,
+            char            *gurobi_version,
+            struct Command  *cmd)
+{
+  RequestBuilder b;
+  char *endpoint = "launch";
+  int  i;
+  int  flag = 0;
+  int  error = 0;
+  ICspan span = IC_SPAN_INIT;
+
+  TRACE_BEGIN(span);
+
+  sprintf(cmd->command, "%s/%s", baseurl, endpoint);
+
+#ifdef VERBOSE
+  printf("command %s\n", cmd->command);
+#endif
+
+  FREE(cmd->postfields);
+  startrequest(&b, "POST");
+  appendrequest(&b, 1, "id=%s", accessid);
+  appendrequest(&b, 1, "numMachines=%d", n);
+
+  if (license_type) {
+    flag = 0;
+    for (i = 0; i < NUM_CLOUD_LICENSE_TYPE; i++) {
+      if (strcmp(license_type_data[i], license_type) == 0) {
+        flag = 1;
+        break;
+      }
+    }
+
+    if (!flag) {
+      error = ERROR_INVALID_ARGUMENT;
+      goto QUIT;
+    }
+    appendrequest(&b, 1, "licenseType=%s", license_type_encode[i]);
+  }
+
+  if (user_password) {
+    appendrequest(&b, 1, "userPassword=%s", user_password);
+  }
+
+  if (machine_type) {
+    flag = 0;
+    for (i = 0; i < NUM_MACHINE_TYPE; i++) {
+      if (strcmp(machine_data[i], machine_type) == 0) {
+        flag = 1;
+        break;
+      }
+    }
+
+    if (!flag) {
+      error = ERROR_INVALID_ARGUMENT;
+      goto QUIT;
+    }
+    appendrequest(&b, 1, "machineType=%s", machine_type);
+  }
+
+  if (license_idP) {
+    appendrequest(&b, 1, "licenseId=%d", *license_idP);
+  }
+
+  if (region) {
+    flag = 0;
+    for (i = 0; i < NUM_REGIONS; i++) {
+      if (strcmp(region_data[i], region) == 0) {
+        flag = 1;
+        break;
+      }
+    }
+
+    if (!flag) {
+      error = ERROR_INVALID_ARGUMENT;
+      goto QUIT;
+    }
+    appendrequest(&b, 1, "region=%s", region);
+  }
+
+  if (idleshutdownP) {
+    appendrequest(&b, 1, "idleShutdown=%d", *idleshutdownP);
+  }
+
+  if (gurobi_version) {
+    appendrequest(&b, 1, "GRBVersion=%s", gurobi_version);
+  }
+
+  error = signrequest(&b, cmd->timestr, cmd->signature, &cmd->postfields);
+
+QUIT:
+  FREE(b.body);
+  TRACE_END(span, "sign", "launch");
+
+  return error;
+}
+
+int
+IClaunchmachines(int              n,
+                 char            *license_type,
+                 int             *license_idP,
+                 char            *user_password,
+                 char            *region,
+                 char            *machine_type,
+                 int             *idleshutdownP,
+                 char            *gurobi_version,
+                 ICmachineinfo  **machine_infoP)
+{
+  struct Command *cmd = NULL;
+  int  error = 0;
+  ICspan span = IC_SPAN_INIT;
+
+  TRACE_BEGIN(span);
+
+  if (!(strlen(accessid) == 17 && strlen(secretkey) == 43)) {
+    error = ERROR_INVALID_ARGUMENT;
+    goto QUIT;
+  }
+
+  if (n <= 0) goto QUIT;
+
+  /* free old machine info */
+  error = ICfreemachineinfo(machine_infoP);
+  if (error) goto QUIT;
+
+  MALLOC(cmd, 1);
+  cmd->response   = NULL;
+  cmd->postfields = NULL;
+
+  error = buildlaunch(n, license_type, license_idP, user_password, region,
+                      machine_type, idleshutdownP, gurobi_version, cmd);
+  if (error) goto QUIT;
+
+  error = sendcommand(cmd->command, cmd->postfields, cmd->timestr,
+                      cmd->signature, &cmd->response);
+  if (error) goto QUIT;
+
+#ifdef VERBOSE
+  printf("response %s\n", cmd->response);
+#endif
+
+  error = getmachineinfo(cmd->response, IC_FIELD_ALL, machine_infoP);
+  if (error) goto QUIT;
+
+
+QUIT:
+  if (cmd) {
+    FREE(cmd->response);
+    FREE(cmd->postfields);
+  }
+  FREE(cmd);
+  TRACE_END(span, "IClaunchmachines", NULL);
+
+  return error;
+}
+
+static int
+mergemachineinfo(ICmachineinfo **machine_infoP,
+                 ICmachineinfo  *more)
+{
+  ICmachineinfo *info = *machine_infoP;
+  ICmachine     *machines = NULL;
+  char         **machine_ids = NULL;
+  int            total;
+  int            indexed;
+  int            i;
+  int            error = 0;
+
+  if (info == NULL) {
+    *machine_infoP = more;
+    return 0;
+  }
+
+  total = info->num_machines + more->num_machines;
+  if (more->num_machines == 0) goto QUIT;
+
+  /* The positions move with the machines, index them again */
+  indexed = info->index != NULL;
+  FREE(info->index);
+
+  machines = realloc(info->machines, sizeof(ICmachine)*total);
+  if (machines == NULL) {
+    error = ERROR_OUT_OF_MEMORY;
+    goto QUIT;
+  }
+  info->machines = machines;
+
+  machine_ids = realloc(info->machine_ids, sizeof(char *)*total);
+  if (machine_ids == NULL) {
+    error = ERROR_OUT_OF_MEMORY;
+    goto QUIT;
+  }
+  info->machine_ids = machine_ids;
+
+  memcpy(&machines[info->num_machines], more->machines,
+         sizeof(ICmachine)*more->num_machines);
+  for (i = 0; i < more->num_machines; i++) {
+    machine_ids[info->num_machines + i] = more->machine_ids[i];
+    more->machine_ids[i] = NULL;
+  }
+  info->num_machines = total;
+
+  if (indexed)
+    error = ICindexmachines(info);
+
+QUIT:
+  ICfreemachineinfo(&more);
+
+  return error;
+}
+
+int
+IClaunchplan(int              num_slices,
+             IClaunchslice   *slices,
+             char            *user_password,
+             int             *idleshutdownP,
+             char            *gurobi_version,
+             int              max_retries,
+             ICmachineinfo  **machine_infoP)
+{
+  struct Command *commands = NULL;
+  int            *pending  = NULL;
+  ICmachineinfo  *more     = NULL;
+  int  num_pending;
+  int  num_retry;
+  int  round;
+  int  i;
+  int  j;
+  int  error = 0;
+  ICspan span = IC_SPAN_INIT;
+
+  TRACE_BEGIN(span);
+
+  if (!(strlen(accessid) == 17 && strlen(secretkey) == 43)) {
+    error = ERROR_INVALID_ARGUMENT;
+    goto QUIT;
+  }
+
+  if (!slices && num_slices > 0) {
+    error = ERROR_NULL_ARGUMENT;
+    goto QUIT;
+  }
+
+  if (num_slices <= 0) goto QUIT;
+
+  /* free old machine info */
+  error = ICfreemachineinfo(machine_infoP);
+  if (error) goto QUIT;
+
+  CALLOC(commands, num_slices);
+  MALLOC(pending, num_slices);
+
+  num_pending = 0;
+  for (i = 0; i < num_slices; i++) {
+    slices[i].status = 0;
+    if (slices[i].count <= 0) continue;
+    pending[num_pending++] = i;
+  }
+
+  for (round = 0; num_pending > 0 && round <= max_retries; round++) {
+    if (round > 0) {
+      error = ICsleep(500 << (round < 7 ? round - 1 : 6));
+      if (error) {
+        for (j = 0; j < num_pending; j++)
+          slices[pending[j]].status = error;
+        break;
+      }
+    }
+
+    /* Sign every pending slice afresh so retries carry a current date */
+    for (j = 0; j < num_pending; j++) {
+      i = pending[j];
+      slices[i].status =
+        buildlaunch(slices[i].count, slices[i].license_type,
+                    slices[i].license_id >= 0 ? &slices[i].license_id : NULL,
+                    user_password, slices[i].region, slices[i].machine_type,
+                    idleshutdownP, gurobi_version, &commands[j]);
+      if (slices[i].status) {
+        error = slices[i].status;
+        goto QUIT;
+      }
+    }
+
+    error = sendcommands(num_pending, commands);
+    if (error) goto QUIT;
+
+    num_retry = 0;
+    for (j = 0; j < num_pending; j++) {
+      i = pending[j];
+      slices[i].status = commands[j].error;
+      if (!commands[j].error) {
+#ifdef VERBOSE
+        printf("response %s\n", commands[j].response);
+#endif
+        slices[i].status = getmachineinfo(commands[j].response, IC_FIELD_ALL,
+                                          &more);
+        if (!slices[i].status)
+          slices[i].status = mergemachineinfo(machine_infoP, more);
+        else
+          ICfreemachineinfo(&more);
+        more = NULL;
+      } else if (commands[j].retryable) {
+        pending[num_retry++] = i;
+      }
+    }
+    num_pending = num_retry;
+  }
+
+  for (i = 0; i < num_slices; i++) {
+    if (slices[i].status) {
+      error = slices[i].status;
+      break;
+    }
+  }
+
+QUIT:
+  ICfreemachineinfo(&more);
+  if (commands) {
+    for (i = 0; i < num_slices; i++) {
+      FREE(commands[i].response);
+      FREE(commands[i].postfields);
+    }
+  }
+  FREE(pending);
+  FREE(commands);
+  TRACE_END(span, "IClaunchplan", NULL);
+
+  return error;
+}
+
+static int
+buildkill(int             n,
+          char          **machine_ids,
+          struct Command *cmd)
+{
+  RequestBuilder b;
+  char   *endpoint = "kill";
+  int     i;
+  int     error;
+  ICspan  span = IC_SPAN_INIT;
+
+  TRACE_BEGIN(span);
+
+  sprintf(cmd->command, "%s/%s", baseurl, endpoint);
+#ifdef VERBOSE
+  printf("command %s\n", cmd->command);
+#endif
+
+  FREE(cmd->postfields);
+  startrequest(&b, "POST");
+  appendrequest(&b, 1, "id=%s", accessid);
+
+  /* ["id","id"] as %5B%22id%22%2C%22id%22%5D */
+  appendrequest(&b, 1, "machineIds=%%5B");
+  for (i = 0; i < n; i++)
+    appendrequest(&b, 0, i > 0 ? "%%2C%%22%s%%22" : "%%22%s%%22",
+                  machine_ids[i]);
+  appendrequest(&b, 0, "%%5D");
+
+  error = signrequest(&b, cmd->timestr, cmd->signature, &cmd->postfields);
+  TRACE_END(span, "sign", "kill");
+
+  return error;
+}
+
+int
+ICkillmachines(int             n,
+               char          **machine_ids,
+               ICmachineinfo **machine_infoP)
+{
+  struct Command cmd;
+  int     error = 0;
+  ICspan  span = IC_SPAN_INIT;
+
+  TRACE_BEGIN(span);
+
+  cmd.response   = NULL;
+  cmd.postfields = NULL;
+
+  if (!(strlen(accessid) == 17 && strlen(secretkey) == 43)) {
+    error = ERROR_INVALID_ARGUMENT;
+    goto QUIT;
+  }
+
+
+  if (n <= 0) goto QUIT;
+
+  error = buildkill(n, machine_ids, &cmd);
+  if (error) goto QUIT;
+
+  error = sendcommand(cmd.command, cmd.postfields, cmd.timestr,
+                      cmd.signature, &cmd.response);
+  if (error) goto QUIT;
+
+#ifdef VERBOSE
+  printf("response %s\n", cmd.response);
+#endif
+
+  error = getmachineinfo(cmd.response, IC_FIELD_ALL, machine_infoP);
+  if (error) goto QUIT;
+
+QUIT:
+  FREE(cmd.postfields);
+  FREE(cmd.response);
+  TRACE_END(span, "ICkillmachines", NULL);
+
+  return error;
+}
+
+int
+ICcloudcreds(char *id,
+             char *key)
+{
+  if (!id || !key)
+    return ERROR_NULL_ARGUMENT;
+
+  if (strlen(id)  != ACCESS_ID_LEN ||
+      strlen(key) != SECRET_KEY_LEN  )
+    return ERROR_INVALID_ARGUMENT;
+
+  memcpy(accessid, id, sizeof(char)*(ACCESS_ID_LEN+1));
+  accessid[ACCESS_ID_LEN] = 0;
+
+  memcpy(secretkey, key, sizeof(char)*(SECRET_KEY_LEN+1));
+  secretkey[SECRET_KEY_LEN] = 0;
+
+  return 0;
+}
+
+int
+ICfreemachineinfo(ICmachineinfo **machine_infoP)
+{
+  int i;
+  ICmachineinfo *info;
+  int num_machines;
+  int shared;
+  int error = 0;
+
+  if (*machine_infoP) {
+    info = *machine_infoP;
+
+    /* A result shared by single-flight callers goes with the last one */
+    pthread_mutex_lock(&flight_lock);
+    shared = --info->refcount > 0;
+    pthread_mutex_unlock(&flight_lock);
+    if (shared) {
+      *machine_infoP = NULL;
+      return 0;
+    }
+
+    num_machines = info->num_machines;
+
+    if (info->machine_ids) {
+      for (i = 0; i < num_machines; i++) {
+        FREE(info->machine_ids[i]);
+      }
+      FREE(info->machine_ids);
+    }
+
+    if (info->machines) {
+      FREE(info->machines);
+    }
+    FREE(info->index);
+    info->num_machines = 0;
+
+    FREE(info);
+    *machine_infoP = NULL;
+  }
+
+  return error;
+}
+
+static const char *
+codetable(int  column,
+          int *num_codesP,
+          int *widthP)
+{
+  switch (column) {
+  case IC_COLUMN_STATE:
+    *num_codesP = NUM_MACHINE_STATE;
+    *widthP = MAX_STATE_LEN+1;
+    return machine_state_data[0];
+  case IC_COLUMN_REGION:
+    *num_codesP = NUM_REGIONS;
+    *widthP = MAX_REGION_LEN+1;
+    return region_data[0];
+  case IC_COLUMN_MACHINE_TYPE:
+    *num_codesP = NUM_MACHINE_TYPE;
+    *widthP = MAX_MACHINE_LEN+1;
+    return machine_data[0];
+  case IC_COLUMN_LICENSE_TYPE:
+    *num_codesP = NUM_CLOUD_LICENSE_TYPE;
+    *widthP = MAX_LICENSE_TYPE_LEN+1;
+    return license_type_data[0];
+  }
+  *num_codesP = 0;
+  *widthP = 0;
+  return NULL;
+}
+
+int
+ICcode(int         column,
+       const char *value)
+{
+  const char *table;
+  int num_codes;
+  int width;
+  int i;
+
+  table = codetable(column, &num_codes, &width);
+  if (table == NULL || value == NULL)
+    return IC_UNKNOWN_CODE;
+
+  for (i = 0; i < num_codes; i++) {
+    if (strcmp(&table[i*width], value) == 0)
+      return i;
+  }
+  return IC_UNKNOWN_CODE;
+}
+
+int
+ICnumcodes(int column)
+{
+  int num_codes;
+  int width;
+
+  codetable(column, &num_codes, &width);
+  return num_codes;
+}
+
+const char *
+ICcodename(int column,
+           int code)
+{
+  const char *table;
+  int num_codes;
+  int width;
+
+  table = codetable(column, &num_codes, &width);
+  if (table == NULL || code < 0 || code >= num_codes)
+    return "";
+  return &table[code*width];
+}
+
+int
+ICbuildfleet(const ICmachineinfo *machine_info,
+             ICfleet            **fleetP)
+{
+  ICfleet   *fleet = NULL;
+  ICmachine *m;
+  int        n;
+  int        i;
+  int        error = 0;
+  ICspan     span = IC_SPAN_INIT;
+
+  TRACE_BEGIN(span);
+
+  if (!machine_info || !fleetP) {
+    error = ERROR_NULL_ARGUMENT;
+    goto QUIT;
+  }
+
+  error = ICfreefleet(fleetP);
+  if (error) goto QUIT;
+
+  n = machine_info->num_machines;
+
+  CALLOC(fleet, 1);
+  fleet->num_machines = n;
+  *fleetP = fleet;
+
+  MALLOC(fleet->state, n);
+  MALLOC(fleet->region, n);
+  MALLOC(fleet->machine_type, n);
+  MALLOC(fleet->license_type, n);
+  MALLOC(fleet->license_id, n);
+  MALLOC(fleet->idle_shutdown, n);
+  MALLOC(fleet->dns_name, n);
+  MALLOC(fleet->machine_id, n);
+  MALLOC(fleet->create_time, n);
+  MALLOC(fleet->user_password, n);
+
+  for (i = 0; i < n; i++) {
+    m = &machine_info->machines[i];
+    fleet->state[i]         = ICcode(IC_COLUMN_STATE, m->state);
+    fleet->region[i]        = ICcode(IC_COLUMN_REGION, m->region);
+    fleet->machine_type[i]  = ICcode(IC_COLUMN_MACHINE_TYPE, m->machine_type);
+    fleet->license_type[i]  = ICcode(IC_COLUMN_LICENSE_TYPE, m->license_type);
+    fleet->license_id[i]    = m->license_id;
+    fleet->idle_shutdown[i] = m->idle_shutdown;
+    fleet->dns_name[i]      = m->dns_name;
+    fleet->machine_id[i]    = m->machine_id;
+    fleet->create_time[i]   = m->create_time;
+    fleet->user_password[i] = m->user_password;
+  }
+
+QUIT:
+  if (error && fleetP)
+    ICfreefleet(fleetP);
+  TRACE_END(span, "ICbuildfleet", NULL);
+
+  return error;
+}
+
+int
+ICfreefleet(ICfleet **fleetP)
+{
+  ICfleet *fleet;
+
+  if (fleetP && *fleetP) {
+    fleet = *fleetP;
+    FREE(fleet->state);
+    FREE(fleet->region);
+    FREE(fleet->machine_type);
+    FREE(fleet->license_type);
+    FREE(fleet->license_id);
+    FREE(fleet->idle_shutdown);
+    FREE(fleet->dns_name);
+    FREE(fleet->machine_id);
+    FREE(fleet->create_time);
+    FREE(fleet->user_password);
+    FREE(*fleetP);
+  }
+
+  return 0;
+}
+
+/* Zero-copy machine views.  The response buffer is kept and each
+   field of a machine is recorded as the span of its value, so decoding
+   is a single pass over the tokens with no per-field copies. */
+static int
+getmachineviews(char            *response,
+                ICmachineviews **viewsP)
+{
+  ICmachineviews *views  = NULL;
+  ICmachineview  *m;
+  jsmntok_t      *tokens = NULL;
+  jsmntok_t      *key;
+  ICstrview      *field;
+  int  num_tokens;
+  int  num_machines = 0;
+  int  first;
+  int  count;
+  int  i;
+  int  j;
+  int  k;
+  int  f;
+  int  error = 0;
+  ICspan span = IC_SPAN_INIT;
+
+  TRACE_BEGIN(span);
+
+  error = parsejson(response, strlen(response), &tokens, &num_tokens);
+  if (error) goto QUIT;
+
+  /* A single record may come back without the enclosing array */
+  if (num_tokens == 0 ||
+      (tokens[0].type != JSMN_ARRAY && tokens[0].type != JSMN_OBJECT)) {
+    error = ERROR_NETWORK;
+    goto QUIT;
+  }
+  first = (tokens[0].type == JSMN_ARRAY);
+  count = first ? tokens[0].size : 1;
+
+  CALLOC(views, 1);
+  CALLOC(views->machines, count);
+
+  for (i = first; i < num_tokens; i = skiptoken(tokens, num_tokens, i)) {
+    if (tokens[i].type != JSMN_OBJECT)
+      continue;
+    m = &views->machines[num_machines++];
+
+    /* Members alternate key, value; values may nest */
+    j = i + 1;
+    for (k = 0; k < tokens[i].size && j + 1 < num_tokens; k++) {
+      key   = &tokens[j++];
+      field = NULL;
+      f = findkey(response, key);
+      if (f >= 0)
+        field = (ICstrview *) ((char *) m + machinekeys[f].view_offset);
+      if (field) {
+        field->ptr = &response[tokens[j].start];
+        field->len = tokens[j].end - tokens[j].start;
+      }
+      j = skiptoken(tokens, num_tokens, j);
+    }
+  }
+
+  views->response     = response;
+  views->num_machines = num_machines;
+  *viewsP = views;
+  views = NULL;
+
+QUIT:
+  if (views)
+    FREE(views->machines);
+  FREE(views);
+  FREE(tokens);
+  TRACE_END(span, "parse", "views");
+
+  return error;
+}
+
+int
+ICgetmachineviews(ICmachineviews **viewsP)
+{
+  struct Command cmd;
+  char *endpoint = "machines";
+  int  error = 0;
+  ICspan span = IC_SPAN_INIT;
+
+  TRACE_BEGIN(span);
+
+  cmd.response = NULL;
+
+  if (!viewsP) {
+    error = ERROR_NULL_ARGUMENT;
+    goto QUIT;
+  }
+
+  if (!(strlen(accessid) == ACCESS_ID_LEN   &&
+        strlen(secretkey) == SECRET_KEY_LEN   )) {
+    error = ERROR_INVALID_ARGUMENT;
+    goto QUIT;
+  }
+
+  error = ICfreemachineviews(viewsP);
+  if (error) goto QUIT;
+
+  error = buildget(endpoint, &cmd);
+  if (error) goto QUIT;
+
+  error = sendget(endpoint, &cmd);
+  if (error) goto QUIT;
+
+  /* On success the views take over the response */
+  error = getmachineviews(cmd.response, viewsP);
+  if (error) goto QUIT;
+  cmd.response = NULL;
+
+QUIT:
+  FREE(cmd.response);
+  TRACE_END(span, "ICgetmachineviews", NULL);
+
+  return error;
+}
+
+int
+ICfreemachineviews(ICmachineviews **viewsP)
+{
+  if (viewsP && *viewsP) {
+    FREE((*viewsP)->response);
+    FREE((*viewsP)->machines);
+    FREE(*viewsP);
+  }
+
+  return 0;
+}
+
+int
+ICviewint(ICstrview view)
+{
+  int value = 0;
+  int sign  = 1;
+  int i     = 0;
+
+  if (view.len > 0 && view.ptr[0] == '-') {
+    sign = -1;
+    i++;
+  }
+  for (; i < view.len && view.ptr[i] >= '0' && view.ptr[i] <= '9'; i++)
+    value = 10*value + (view.ptr[i] - '0');
+
+  return sign*value;
+}
+
+int
+ICviewequal(ICstrview   view,
+            const char *value)
+{
+  return view.ptr != NULL &&
+         (int) strlen(value) == view.len &&
+         memcmp(view.ptr, value, view.len) == 0;
+}
+
+int
+ICviewcode(int       column,
+           ICstrview view)
+{
+  const char *table;
+  int num_codes;
+  int width;
+  int i;
+
+  table = codetable(column, &num_codes, &width);
+  if (table == NULL)
+    return IC_UNKNOWN_CODE;
+
+  for (i = 0; i < num_codes; i++) {
+    if (ICviewequal(view, &table[i*width]))
+      return i;
+  }
+  return IC_UNKNOWN_CODE;
+}
+
+struct MemoryStruct {
+  char *memory;
+  size_t size;
+  size_t capacity;
+};
+
+static size_t
+WriteMemoryCallback(void   *contents,
+                    size_t  size,
+                    size_t  nmemb,
+                    void   *userp)
+{
+  size_t realsize = size * nmemb;
+  struct MemoryStruct *mem = (struct MemoryStruct *)userp;
+  size_t capacity;
+  char  *memory;
+
+  if (mem->size + realsize + 1 > mem->capacity) {
+    capacity = mem->capacity ? mem->capacity : MAX_STRLEN+1;
+    while (mem->size + realsize + 1 > capacity)
+      capacity *= 2;
+    memory = realloc(mem->memory, capacity);
+    if (memory == NULL)
+      return 0;
+    mem->memory   = memory;
+    mem->capacity = capacity;
+  }
+
+  memcpy(&(mem->memory[mem->size]), contents, realsize);
+  mem->size += realsize;
+  mem->memory[mem->size] = 0;
+
+  return realsize;
+}
+
+
+struct Transfer {
+  CURL               *curl_handle;
+  struct curl_slist  *list;
+  struct MemoryStruct chunk;
+  char              **responseP;
+  char                dateheader[MAX_STRLEN+1];
+  char                signheader[MAX_STRLEN+1];
+  CURLcode            res;
+  long                response_code;
+  struct curl_slist  *resolve;   /* addresses from the session cache */
+  char                host[MAX_HOSTLEN+1];
+  long                port;
+  int                 done;      /* completed or cancelled, under pool.lock */
+  int                 cancel;
+  int                 admitted;  /* handed to the multi handle */
+  int                 priority;  /* lane, IC_PRIORITY_* */
+  double              submitted_ms;
+  double              admitted_ms;
+  double              deadline_ms;  /* of the thread that set it up */
+  ICcanceltoken      *token;
+  int                 stop;      /* ERROR_TIMEOUT or ERROR_CANCELLED */
+  struct Transfer    *next;      /* pool.pending or pool.running */
+  struct Transfer    *next_cancel;
+  ICasync            *async;     /* completed by the pool thread */
+  ICspan              trace;     /* span that submitted it */
+  const char         *command;   /* the request, kept by the caller */
+  const char         *postfields;
+  const char         *timestr;
+  const char         *signature;
+  ICtransport        *recorder;  /* records the answer, or NULL */
+};
+
+static void recordexchange(struct Transfer *transfer);
+
+/* An operation started without waiting.  Requests run as a transfer of
+   the pool, delays as a timer of the pool thread; either way done is
+   called once, from the pool thread and with no lock held. */
+struct _async {
+  struct Command    cmd;
+  struct Transfer   transfer;
+  unsigned int      fields;
+  double            due_ms;      /* delays only */
+  double            deadline_ms;
+  ICcanceltoken    *token;
+  ICasynccallback   done;
+  void             *arg;
+  int               error;
+  int               pooled;      /* handed to the pool, under pool.lock */
+  int               called;      /* done called, under pool.lock */
+  int               abandoned;   /* released in flight, freed by the pool */
+  ICasync          *next_timer;
+};
+
+static pthread_once_t curl_once = PTHREAD_ONCE_INIT;
+
+static void
+globalinit(void)
+{
+  curl_global_init(CURL_GLOBAL_ALL);
+}
+
+static void
+initcurl(void)
+{
+  pthread_once(&curl_once, globalinit);
+}
+
+/* Transfer statistics and content encoding */
+
+static pthread_mutex_t transfer_lock = PTHREAD_MUTEX_INITIALIZER;
+static ICtransferstats transferstats;
+static int             compression = 1;
+static int             httpversion = IC_HTTP_2;
+
+int
+ICsetcompression(int enable)
+{
+  pthread_mutex_lock(&transfer_lock);
+  compression = enable;
+  pthread_mutex_unlock(&transfer_lock);
+
+  return 0;
+}
+
+int
+ICsethttpversion(int version)
+{
+  if (version != IC_HTTP_1_1 && version != IC_HTTP_2 &&
+      version != IC_HTTP_2_PRIOR_KNOWLEDGE)
+    return ERROR_INVALID_ARGUMENT;
+
+  pthread_mutex_lock(&transfer_lock);
+  httpversion = version;
+  pthread_mutex_unlock(&transfer_lock);
+
+  return 0;
+}
+
+int
+ICgettransferstats(ICtransferstats *stats)
+{
+  if (!stats)
+    return ERROR_NULL_ARGUMENT;
+
+  pthread_mutex_lock(&transfer_lock);
+  *stats = transferstats;
+  pthread_mutex_unlock(&transfer_lock);
+
+  return 0;
+}
+
+static void
+recordtransfer(struct Transfer *transfer)
+{
+  curl_off_t wire_bytes = 0;
+  curl_off_t total_us   = 0;
+  long       header_bytes = 0;
+  long       connects     = 0;
+
+  curl_easy_getinfo(transfer->curl_handle, CURLINFO_SIZE_DOWNLOAD_T,
+                    &wire_bytes);
+  curl_easy_getinfo(transfer->curl_handle, CURLINFO_HEADER_SIZE,
+                    &header_bytes);
+  curl_easy_getinfo(transfer->curl_handle, CURLINFO_TOTAL_TIME_T, &total_us);
+  curl_easy_getinfo(transfer->curl_handle, CURLINFO_NUM_CONNECTS, &connects);
+
+  pthread_mutex_lock(&transfer_lock);
+  transferstats.requests++;
+  transferstats.connects     += connects;
+  transferstats.wire_bytes   += wire_bytes;
+  transferstats.body_bytes   += transfer->chunk.size;
+  transferstats.header_bytes += header_bytes;
+  transferstats.seconds      += total_us/1e6;
+  pthread_mutex_unlock(&transfer_lock);
+}
+
+/* Session cache.  A short-lived process pays a DNS lookup and a full
+   TLS handshake before its only request.  When a cache file is set,
+   resolved addresses and TLS sessions are saved there, shared by every
+   process of the user under flock(2), and preloaded into the next
+   transfers to the same host.  Neither libcurl nor getaddrinfo report
+   the TTL of an address, so an address is kept as long as libcurl would
+   keep it in its own DNS cache; a session is kept for the lifetime the
+   server gave its ticket.  New entries are kept in memory, where later
+   transfers of the process find them at once, and merged into the file
+   at exit, so the pool thread never waits on the file lock. */
+
+#define SESSION_DNS         0
+#define SESSION_TLS         1
+#define SESSION_MAX_ENTRIES 64
+#define SESSION_DNS_TTL     60    /* seconds, CURLOPT_DNS_CACHE_TIMEOUT */
+
+typedef struct {
+  int    kind;
+  char   host[MAX_HOSTLEN+1];
+  long   port;                    /* 0 for TLS sessions */
+  time_t expires;
+  char  *value;                   /* address, or hex of a DER session */
+} SessionEntry;
+
+typedef struct {
+  int          num_entries;
+  SessionEntry entries[SESSION_MAX_ENTRIES];
+} SessionTable;
+
+static struct {
+  pthread_mutex_t lock;
+  char           *path;
+  int             tls;            /* libcurl uses OpenSSL */
+  int           (*newsession)(SSL *, SSL_SESSION *);
+  int             atexit;         /* flushsessions is registered */
+  SessionTable    cache;
+  SessionTable    changes;        /* not yet in the file, "" removes */
+} sessions = { PTHREAD_MUTEX_INITIALIZER };
+
+static const char *sessionkinds[] = { "dns", "tls" };
+
+/* The functions below up to ICsetsessioncache expect sessions.lock */
+
+static void
+clearsessions(SessionTable *table)
+{
+  int i;
+
+  for (i = 0; i < table->num_entries; i++)
+    FREE(table->entries[i].value);
+  table->num_entries = 0;
+}
+
+static SessionEntry *
+findsession(SessionTable *table, int kind, const char *host, long port)
+{
+  SessionEntry *entry;
+  int i;
+
+  for (i = 0; i < table->num_entries; i++) {
+    entry = &table->entries[i];
+    if (entry->kind == kind && entry->port == port &&
+        strcmp(entry->host, host) == 0)
+      return entry;
+  }
+
+  return NULL;
+}
+
+/* Replace the entry for kind, host and port, evicting the entry that
+   expires first when the table is full.  A NULL value removes it. */
+static void
+putsession(SessionTable *table, int kind, const char *host, long port,
+           time_t expires, const char *value)
+{
+  SessionEntry *entry;
+  int i;
+
+  if (strlen(host) > MAX_HOSTLEN)
+    return;
+
+  entry = findsession(table, kind, host, port);
+  if (entry == NULL) {
+    if (value == NULL)
+      return;
+    if (table->num_entries < SESSION_MAX_ENTRIES) {
+      entry = &table->entries[table->num_entries++];
+    } else {
+      entry = &table->entries[0];
+      for (i = 1; i < table->num_entries; i++)
+        if (table->entries[i].expires < entry->expires)
+          entry = &table->entries[i];
+    }
+    entry->kind = kind;
+    entry->port = port;
+    strcpy(entry->host, host);
+  }
+
+  FREE(entry->value);
+  entry->expires = expires;
+  if (value)
+    entry->value = strdup(value);
+  if (entry->value == NULL)
+    *entry = table->entries[--table->num_entries];
+}
+
+/* One entry per line: kind host port expires value */
+static void
+readsessions(FILE *fp)
+{
+  char     *line = NULL;
+  size_t    cap  = 0;
+  char      kind[4];
+  char      host[MAX_HOSTLEN+1];
+  char     *value;
+  long      port;
+  long long expires;
+  int       offset;
+  time_t    now = time(NULL);
+
+  while (getline(&line, &cap, fp) > 0) {
+    if (sscanf(line, "%3s %255s %ld %lld %n", kind, host, &port, &expires,
+               &offset) != 4 || expires <= now)
+      continue;
+    value = &line[offset];
+    value[strcspn(value, " \n")] = '\0';
+    if (*value == '\0')
+      continue;
+    if (strcmp(kind, sessionkinds[SESSION_DNS]) == 0)
+      putsession(&sessions.cache, SESSION_DNS, host, port, expires, value);
+    else if (strcmp(kind, sessionkinds[SESSION_TLS]) == 0)
+      putsession(&sessions.cache, SESSION_TLS, host, port, expires, value);
+  }
+
+  free(line);
+}
+
+static void
+writesessions(FILE *fp)
+{
+  SessionEntry *entry;
+  time_t now = time(NULL);
+  int i;
+
+  for (i = 0; i < sessions.cache.num_entries; i++) {
+    entry = &sessions.cache.entries[i];
+    if (entry->expires > now)
+      fprintf(fp, "%s %s %ld %lld %s\n", sessionkinds[entry->kind],
+              entry->host, entry->port, (long long) entry->expires,
+              entry->value);
+  }
+}
+
+/* Open the cache file and take the lock, shared for reading */
+static FILE *
+opensessions(int exclusive)
+{
+  FILE *fp = NULL;
+  int   fd;
+
+  fd = open(sessions.path, exclusive ? O_RDWR | O_CREAT : O_RDONLY, 0600);
+  if (fd < 0)
+    return NULL;
+
+  if (flock(fd, exclusive ? LOCK_EX : LOCK_SH) == 0)
+    fp = fdopen(fd, exclusive ? "r+" : "r");
+  if (fp == NULL)
+    close(fd);
+
+  return fp;
+}
+
+/* Merge the changes into the file, keeping what other processes saved
+   since it was read */
+static void
+writechanges(void)
+{
+  SessionEntry *entry;
+  FILE *fp;
+  int   i;
+
+  if (sessions.path == NULL || sessions.changes.num_entries == 0)
+    return;
+
+  fp = opensessions(1);
+  if (fp == NULL)
+    return;
+
+  clearsessions(&sessions.cache);
+  readsessions(fp);
+  for (i = 0; i < sessions.changes.num_entries; i++) {
+    entry = &sessions.changes.entries[i];
+    putsession(&sessions.cache, entry->kind, entry->host, entry->port,
+               entry->expires, *entry->value ? entry->value : NULL);
+  }
+  clearsessions(&sessions.changes);
+
+  rewind(fp);
+  if (ftruncate(fileno(fp), 0) == 0)
+    writesessions(fp);
+  fclose(fp);
+}
+
+static void
+flushsessions(void)
+{
+  pthread_mutex_lock(&sessions.lock);
+  writechanges();
+  pthread_mutex_unlock(&sessions.lock);
+}
+
+/* Record one entry for this process and for the file, which is only
+   written by flushsessions */
+static void
+storesession(int kind, const char *host, long port, time_t expires,
+             const char *value)
+{
+  pthread_mutex_lock(&sessions.lock);
+  if (sessions.path) {
+    putsession(&sessions.cache, kind, host, port, expires, value);
+    putsession(&sessions.changes, kind, host, port, expires,
+               value ? value : "");
+  }
+  pthread_mutex_unlock(&sessions.lock);
+}
+
+int
+ICsetsessioncache(const char *path)
+{
+  const curl_version_info_data *info;
+  FILE *fp;
+  char *copy = NULL;
+
+  if (path) {
+    copy = strdup(path);
+    if (copy == NULL)
+      return ERROR_OUT_OF_MEMORY;
+  }
+
+  initcurl();
+  info = curl_version_info(CURLVERSION_NOW);
+
+  pthread_mutex_lock(&sessions.lock);
+  writechanges();
+  clearsessions(&sessions.changes);
+  clearsessions(&sessions.cache);
+  FREE(sessions.path);
+  sessions.path = copy;
+  if (sessions.path && !sessions.atexit)
+    sessions.atexit = atexit(flushsessions) == 0;
+  sessions.tls  = info->ssl_version != NULL &&
+                  strncmp(info->ssl_version, "OpenSSL", 7) == 0;
+  if (sessions.path) {
+    fp = opensessions(0);
+    if (fp) {
+      readsessions(fp);
+      fclose(fp);
+    }
+  }
+  pthread_mutex_unlock(&sessions.lock);
+
+  return 0;
+}
+
+/* TLS sessions are captured and restored through OpenSSL callbacks on
+   the SSL_CTX libcurl sets up for each connection, keyed by the server
+   name sent in the handshake */
+
+static int
+savetlssession(SSL *ssl, SSL_SESSION *session)
+{
+  const char    *host = SSL_get_servername(ssl, TLSEXT_NAMETYPE_host_name);
+  unsigned char *der  = NULL;
+  unsigned char *p;
+  char          *hex  = NULL;
+  int          (*newsession)(SSL *, SSL_SESSION *);
+  int            len;
+  int            i;
+
+  if (host == NULL || !SSL_SESSION_is_resumable(session))
+    goto QUIT;
+
+  len = i2d_SSL_SESSION(session, NULL);
+  if (len <= 0)
+    goto QUIT;
+  der = malloc(len);
+  hex = malloc(2*len + 1);
+  if (der == NULL || hex == NULL)
+    goto QUIT;
+
+  p = der;
+  i2d_SSL_SESSION(session, &p);
+  for (i = 0; i < len; i++)
+    sprintf(&hex[2*i], "%02x", der[i]);
+
+  storesession(SESSION_TLS, host, 0,
+               SSL_SESSION_get_time(session) +
+               SSL_SESSION_get_timeout(session), hex);
+
+QUIT:
+  FREE(der);
+  FREE(hex);
+
+  /* libcurl keeps its in-memory session cache through this callback */
+  pthread_mutex_lock(&sessions.lock);
+  newsession = sessions.newsession;
+  pthread_mutex_unlock(&sessions.lock);
+  return newsession ? newsession(ssl, session) : 0;
+}
+
+static void
+resumetlssession(const SSL *ssl, int where, int ret)
+{
+  SSL_SESSION         *session = NULL;
+  SessionEntry        *entry;
+  const char          *host;
+  unsigned char       *der = NULL;
+  const unsigned char *p;
+  unsigned int         byte;
+  size_t               len = 0;
+  size_t               i;
+
+  /* Only a first handshake that libcurl is not resuming itself */
+  if (!(where & SSL_CB_HANDSHAKE_START) || SSL_get_session(ssl) != NULL)
+    return;
+
+  host = SSL_get_servername(ssl, TLSEXT_NAMETYPE_host_name);
+  if (host == NULL)
+    return;
+
+  pthread_mutex_lock(&sessions.lock);
+  entry = findsession(&sessions.cache, SESSION_TLS, host, 0);
+  if (entry && entry->expires > time(NULL)) {
+    len = strlen(entry->value)/2;
+    der = malloc(len);
+    for (i = 0; der && i < len; i++) {
+      if (sscanf(&entry->value[2*i], "%2x", &byte) != 1) break;
+      der[i] = byte;
+    }
+    if (der && i == len) {
+      p = der;
+      session = d2i_SSL_SESSION(NULL, &p, len);
+    }
+  }
+  pthread_mutex_unlock(&sessions.lock);
+  FREE(der);
+
+  if (session) {
+    SSL_set_session((SSL *) ssl, session);
+    SSL_SESSION_free(session);
+  }
+}
+
+static CURLcode
+sslctxfunction(CURL *curl_handle, void *sslctx, void *arg)
+{
+  SSL_CTX *ctx = sslctx;
+  int    (*newsession)(SSL *, SSL_SESSION *);
+
+  newsession = SSL_CTX_sess_get_new_cb(ctx);
+  if (newsession != savetlssession) {
+    pthread_mutex_lock(&sessions.lock);
+    sessions.newsession = newsession;
+    pthread_mutex_unlock(&sessions.lock);
+  }
+
+  SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT |
+                                      SSL_SESS_CACHE_NO_INTERNAL);
+  SSL_CTX_sess_set_new_cb(ctx, savetlssession);
+  SSL_CTX_set_info_callback(ctx, resumetlssession);
+
+  return CURLE_OK;
+}
+
+/* Point a transfer at the cached address of its host and let it
+   resume a cached TLS session */
+static void
+preloadsession(struct Transfer *transfer, const char *command)
+{
+  SessionEntry *entry;
+  CURLU *url    = NULL;
+  char  *scheme = NULL;
+  char  *host   = NULL;
+  char  *port   = NULL;
+  char   resolve[2*MAX_HOSTLEN + 64];
+  int    tls;
+
+  pthread_mutex_lock(&sessions.lock);
+  tls = sessions.tls;
+  if (sessions.path == NULL)
+    goto QUIT;
+  pthread_mutex_unlock(&sessions.lock);
+
+  url = curl_url();
+  if (url == NULL ||
+      curl_url_set(url, CURLUPART_URL, command, 0)                        ||
+      curl_url_get(url, CURLUPART_SCHEME, &scheme, 0)                     ||
+      curl_url_get(url, CURLUPART_HOST, &host, 0)                         ||
+      curl_url_get(url, CURLUPART_PORT, &port, CURLU_DEFAULT_PORT)        ||
+      strlen(host) > MAX_HOSTLEN)
+    goto CLEANUP;
+
+  strcpy(transfer->host, host);
+  transfer->port = atol(port);
+
+  pthread_mutex_lock(&sessions.lock);
+  entry = findsession(&sessions.cache, SESSION_DNS, host, transfer->port);
+  if (entry && entry->expires > time(NULL) &&
+      strlen(entry->value) <= MAX_HOSTLEN) {
+    sprintf(resolve, strchr(entry->value, ':') ? "+%s:%ld:[%s]"
+                                               : "+%s:%ld:%s",
+            host, transfer->port, entry->value);
+    transfer->resolve = curl_slist_append(NULL, resolve);
+  }
+  pthread_mutex_unlock(&sessions.lock);
+
+  if (transfer->resolve)
+    curl_easy_setopt(transfer->curl_handle, CURLOPT_RESOLVE,
+                     transfer->resolve);
+  if (tls && strcmp(scheme, "https") == 0)
+    curl_easy_setopt(transfer->curl_handle, CURLOPT_SSL_CTX_FUNCTION,
+                     sslctxfunction);
+
+CLEANUP:
+  curl_free(scheme);
+  curl_free(host);
+  curl_free(port);
+  curl_url_cleanup(url);
+  return;
+
+QUIT:
+  pthread_mutex_unlock(&sessions.lock);
+}
+
+/* Remember the address a new connection went to, or forget a cached
+   address that no longer accepts connections */
+static void
+saveaddress(struct Transfer *transfer)
+{
+  char *ip       = NULL;
+  long  connects = 0;
+
+  if (transfer->resolve) {
+    if (transfer->res == CURLE_COULDNT_CONNECT)
+      storesession(SESSION_DNS, transfer->host, transfer->port, 0, NULL);
+    return;
+  }
+
+  curl_easy_getinfo(transfer->curl_handle, CURLINFO_NUM_CONNECTS, &connects);
+  curl_easy_getinfo(transfer->curl_handle, CURLINFO_PRIMARY_IP, &ip);
+  if (transfer->res == CURLE_OK && connects > 0 && ip && *ip &&
+      strcmp(ip, transfer->host) != 0)
+    storesession(SESSION_DNS, transfer->host, transfer->port,
+                 time(NULL) + SESSION_DNS_TTL, ip);
+}
+
+/* Reads are listings; of the writes, kills stop machines that are
+   costing credit and go first */
+static int
+priorityof(const char *command,
+           const char *postfields)
+{
+  size_t len = strlen(command);
+
+  if (postfields == NULL)
+    return IC_PRIORITY_LIST;
+  if (len >= 5 && strcmp(&command[len - 5], "/kill") == 0)
+    return IC_PRIORITY_KILL;
+  return IC_PRIORITY_LAUNCH;
+}
+
+static int
+setuptransfer(struct Transfer *transfer,
+              const char      *command,
+              char            *postfields,
+              char            *timestr,
+              char            *signature,
+              char           **responseP)
+{
+  CURL *curl_handle;
+
+  memset(transfer, 0, sizeof(*transfer));
+  transfer->responseP   = responseP;
+  transfer->priority    = priorityof(command, postfields);
+  transfer->deadline_ms = call_deadline_ms;
+  transfer->token       = call_token;
+  transfer->command     = command;
+  transfer->postfields  = postfields;
+  transfer->timestr     = timestr;
+  transfer->signature   = signature;
+  transfer->recorder    = getrecorder();
+  FREE(*responseP);
+
+  initcurl();
+
+  curl_handle = curl_easy_init();
+  if (curl_handle == NULL)
+    return ERROR_OUT_OF_MEMORY;
+  transfer->curl_handle = curl_handle;
+
+  curl_easy_setopt(curl_handle, CURLOPT_URL, command);
+  curl_easy_setopt(curl_handle, CURLOPT_USERAGENT, "libcurl-agent/1.0");
+  curl_easy_setopt(curl_handle, CURLOPT_FOLLOWLOCATION, 1);
+
+  /* An empty list offers every encoding this libcurl can decode; bodies
+     are inflated as they arrive, before WriteMemoryCallback sees them */
+  pthread_mutex_lock(&transfer_lock);
+  if (compression)
+    curl_easy_setopt(curl_handle, CURLOPT_ACCEPT_ENCODING, "");
+
+  /* Wait for an HTTP/2 connection that is being set up rather than
+     open another one, so concurrent requests become streams on it.
+     Plain http:// never negotiates HTTP/2 without prior knowledge, and
+     waiting there would only serialize requests on one HTTP/1.1
+     connection. */
+  switch (httpversion) {
+  case IC_HTTP_1_1:
+    curl_easy_setopt(curl_handle, CURLOPT_HTTP_VERSION,
+                     (long) CURL_HTTP_VERSION_1_1);
+    break;
+  case IC_HTTP_2_PRIOR_KNOWLEDGE:
+    curl_easy_setopt(curl_handle, CURLOPT_HTTP_VERSION,
+                     (long) CURL_HTTP_VERSION_2_PRIOR_KNOWLEDGE);
+    curl_easy_setopt(curl_handle, CURLOPT_PIPEWAIT, 1L);
+    break;
+  default:
+    curl_easy_setopt(curl_handle, CURLOPT_HTTP_VERSION,
+                     (long) CURL_HTTP_VERSION_2TLS);
+    if (strncmp(command, "https://", 8) == 0)
+      curl_easy_setopt(curl_handle, CURLOPT_PIPEWAIT, 1L);
+    break;
+  }
+  pthread_mutex_unlock(&transfer_lock);
+
+  curl_easy_setopt(curl_handle, CURLOPT_WRITEFUNCTION, WriteMemoryCallback);
+  curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, (void *) &transfer->chunk);
+  curl_easy_setopt(curl_handle, CURLOPT_PRIVATE, (void *) transfer);
+
+  preloadsession(transfer, command);
+
+#if 0
+  if (strlen(signature) != 28) {
+    printf("Bad signature %s\n", signature);
+  }
+  assert(strlen(signature) == 28);
+#endif
+
+  sprintf(transfer->dateheader, "X-Gurobi-Date: %s", timestr);
+  sprintf(transfer->signheader, "X-Gurobi-Signature: %s", signature);
+
+  transfer->list = curl_slist_append(transfer->list, transfer->signheader);
+  transfer->list = curl_slist_append(transfer->list, transfer->dateheader);
+
+  curl_easy_setopt(curl_handle, CURLOPT_HTTPHEADER, transfer->list);
+
+  if (postfields) {
+    curl_easy_setopt(curl_handle, CURLOPT_POSTFIELDS, postfields);
+  }
+
+  return 0;
+}
+
+static void
+cleanuptransfer(struct Transfer *transfer)
+{
+  curl_slist_free_all(transfer->list);
+  transfer->list = NULL;
+  curl_slist_free_all(transfer->resolve);
+  transfer->resolve = NULL;
+
+  curl_easy_cleanup(transfer->curl_handle);
+  transfer->curl_handle = NULL;
+
+  FREE(transfer->chunk.memory);
+}
+
+/* The request as a span under the one that submitted it, with the
+   phases libcurl timed from the moment the pool admitted it */
+static void
+tracetransfer(struct Transfer *transfer)
+{
+  static const struct {
+    const char *name;
+    CURLINFO    info;
+  } phases[] = {
+    { "dns",        CURLINFO_NAMELOOKUP_TIME_T },
+    { "connect",    CURLINFO_CONNECT_TIME_T },
+    { "tls",        CURLINFO_APPCONNECT_TIME_T },
+    { "first byte", CURLINFO_STARTTRANSFER_TIME_T },
+    { "receive",    CURLINFO_TOTAL_TIME_T }
+  };
+  ICspan     request;
+  curl_off_t at_us;
+  char      *url = NULL;
+  char      *endpoint;
+  char       detail[64];
+  long long  admitted_us = (long long) (transfer->admitted_ms*1000);
+  long long  from_us = 0;
+  int        i;
+
+  curl_easy_getinfo(transfer->curl_handle, CURLINFO_EFFECTIVE_URL, &url);
+  endpoint = url ? strrchr(url, '/') : NULL;
+  snprintf(detail, sizeof(detail), "%s %.*s %ld",
+           transfer->priority == IC_PRIORITY_LIST ? "GET" : "POST",
+           endpoint ? (int) strcspn(endpoint + 1, "?") : 0,
+           endpoint ? endpoint + 1 : "", transfer->response_code);
+
+  at_us = 0;
+  curl_easy_getinfo(transfer->curl_handle, CURLINFO_TOTAL_TIME_T, &at_us);
+  request.id = trace_span("request", detail, &transfer->trace, 0,
+                          (long long) (transfer->submitted_ms*1000),
+                          admitted_us + at_us);
+  if (request.id == 0)
+    return;
+  request.root = transfer->trace.id ? transfer->trace.root : request.id;
+
+  if (transfer->admitted_ms > transfer->submitted_ms)
+    trace_span("queue", NULL, &request, request.id,
+               (long long) (transfer->submitted_ms*1000), admitted_us);
+
+  /* A reused connection has no lookup, connect or handshake to show */
+  for (i = 0; i < (int) (sizeof(phases)/sizeof(phases[0])); i++) {
+    at_us = 0;
+    curl_easy_getinfo(transfer->curl_handle, phases[i].info, &at_us);
+    if (at_us > from_us) {
+      trace_span(phases[i].name, NULL, &request, request.id,
+                 admitted_us + from_us, admitted_us + at_us);
+      from_us = at_us;
+    }
+  }
+}
+
+/* Hand the response buffer over to the caller and release the rest */
+static int
+taketransfer(struct Transfer *transfer)
+{
+  curl_easy_getinfo(transfer->curl_handle, CURLINFO_RESPONSE_CODE,
+                    &transfer->response_code);
+  recordtransfer(transfer);
+  if (TRACE_ENABLED)
+    tracetransfer(transfer);
+  if (transfer->host[0])
+    saveaddress(transfer);
+
+  if (transfer->chunk.memory == NULL)
+    transfer->chunk.memory = calloc(1, 1);
+  *transfer->responseP = transfer->chunk.memory;
+  transfer->chunk.memory = NULL;
+  if (transfer->recorder && *transfer->responseP &&
+      transfer->res == CURLE_OK && !transfer->stop)
+    recordexchange(transfer);
+
+  cleanuptransfer(transfer);
+
+  if (*transfer->responseP == NULL)
+    return ERROR_OUT_OF_MEMORY;
+
+  return 0;
+}
+
+static int
+finishtransfer(struct Transfer *transfer)
+{
+  int error;
+
+  error = taketransfer(transfer);
+  if (error) return error;
+
+  if (transfer->stop)
+    return transfer->stop;
+
+#ifdef VERBOSE
+  printf("response_code %ld\n", transfer->response_code);
+#endif
+
+  if (transfer->res == CURLE_OK && transfer->response_code == 200) {
+    error = 0;
+  } else {
+    printf("Server Error: %ld\n%s\n", transfer->response_code,
+           *transfer->responseP);
+    error = ERROR_NETWORK;
+  }
+
+  return error;
+}
+
+/* A request is safe to repeat if it never reached the server, or if
+   the server turned it away unprocessed with 429 or 503; any other
+   failure may have launched machines already */
+static int
+transferretryable(struct Transfer *transfer)
+{
+  if (transfer->stop)
+    return 0;
+
+  if (transfer->res == CURLE_OK)
+    return transfer->response_code == 429 || transfer->response_code == 503;
+
+  return transfer->res == CURLE_COULDNT_RESOLVE_HOST ||
+         transfer->res == CURLE_COULDNT_CONNECT;
+}
+
+/* Connection pool.  One multi handle, driven by its own thread,
+   carries every transfer of the process.  Concurrent requests to a host
+   become streams on one HTTP/2 connection, or reuse idle HTTP/1.1
+   keep-alive connections, instead of each opening its own.  Callers
+   hand transfers to the pool and sleep on pool.cond until done. */
+
+static struct {
+  pthread_mutex_t  lock;
+  pthread_cond_t   cond;       /* broadcast when any transfer is done */
+  CURLM           *multi;
+  int              started;
+  struct Transfer *pending[IC_NUM_PRIORITIES];  /* per lane, oldest first */
+  struct Transfer *last[IC_NUM_PRIORITIES];
+  struct Transfer *running;    /* admitted, newest first */
+  ICasync         *timers;     /* delays, soonest first */
+  struct Transfer *cancelled;  /* to be removed by the pool thread */
+  ICasync         *calling;    /* whose done is running */
+  pthread_t        thread;
+} pool = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+/* Adaptive concurrency, under pool.lock.  A pending transfer starts
+   once fewer than limit are in flight and, with a rate set, the token
+   bucket holds a token.  The limit grows by one for each window of
+   healthy answers while the window is in use, and halves on 429, 5xx,
+   network errors or a time to first byte well above the recent best.
+   It is cut at most once per window: answers to requests sent before
+   the last cut do not cut it again.  A Retry-After holds every start
+   until it has passed.
+
+   Pending transfers wait in one lane per priority and the lanes are
+   served in order, so kills and launches never queue behind listings.
+   Listings may only fill the window up to reserved slots short of the
+   limit.  With preemption, a kill or launch that finds the window full
+   aborts the newest running listing, which goes back to the head of its
+   lane and is sent again once there is room. */
+
+#define LIMIT_INITIAL    8
+#define LIMIT_MAX        64
+#define LATENCY_HISTORY  32
+#define LATENCY_FACTOR   3.0
+#define LATENCY_SLACK_MS 100.0
+#define RESERVED_SLOTS   2
+
+static struct {
+  int            adaptive;
+  double         limit;
+  int            max_limit;
+  int            reserved;     /* slots listings may not take */
+  int            preempt;
+  double         rate;         /* tokens per second, 0 for no bucket */
+  double         burst;
+  double         tokens;
+  double         refilled_ms;
+  double         cut_ms;       /* time of the last decrease */
+  double         hold_ms;      /* no starts before, from Retry-After */
+  double         latencies[LATENCY_HISTORY];
+  int            num_latencies;
+  int            next_latency;
+  IClimiterstats stats;
+} limiter = { 1, LIMIT_INITIAL, LIMIT_MAX, RESERVED_SLOTS };
+
+/* Whether a transfer may start as far as the hold and the token bucket
+   go.  When not, *waitP is how long until a token or the end of the
+   hold; it stays negative to wait for a transfer to complete. */
+static int
+ready(double  now,
+      double *waitP)
+{
+  if (now < limiter.hold_ms) {
+    *waitP = limiter.hold_ms - now;
+    return 0;
+  }
+
+  if (limiter.rate > 0) {
+    limiter.tokens += (now - limiter.refilled_ms)*limiter.rate/1000;
+    if (limiter.tokens > limiter.burst)
+      limiter.tokens = limiter.burst;
+    limiter.refilled_ms = now;
+    if (limiter.tokens < 1) {
+      *waitP = (1 - limiter.tokens)*1000/limiter.rate;
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+static int
+windowfull(int priority)
+{
+  int limit = (int) limiter.limit;
+
+  if (!limiter.adaptive)
+    return 0;
+
+  if (priority == IC_PRIORITY_LIST) {
+    limit -= limiter.reserved;
+    if (limit < 1)
+      limit = 1;
+  }
+
+  return limiter.stats.in_flight >= limit;
+}
+
+static void
+feedback(struct Transfer *transfer,
+         double           now)
+{
+  curl_off_t ttfb_us     = 0;
+  curl_off_t retry_after = 0;
+  long   response_code = 0;
+  double latency;
+  double best;
+  int    congested;
+  int    i;
+
+  curl_easy_getinfo(transfer->curl_handle, CURLINFO_RESPONSE_CODE,
+                    &response_code);
+  curl_easy_getinfo(transfer->curl_handle, CURLINFO_STARTTRANSFER_TIME_T,
+                    &ttfb_us);
+  latency = ttfb_us/1000.0;
+
+  best = latency;
+  for (i = 0; i < limiter.num_latencies; i++) {
+    if (limiter.latencies[i] < best)
+      best = limiter.latencies[i];
+  }
+
+  congested = transfer->res != CURLE_OK ||
+              response_code == 429 || response_code >= 500 ||
+              (limiter.num_latencies == LATENCY_HISTORY &&
+               latency > LATENCY_FACTOR*best &&
+               latency > best + LATENCY_SLACK_MS);
+
+  if (transfer->res == CURLE_OK) {
+    limiter.latencies[limiter.next_latency] = latency;
+    limiter.next_latency = (limiter.next_latency + 1) % LATENCY_HISTORY;
+    if (limiter.num_latencies < LATENCY_HISTORY)
+      limiter.num_latencies++;
+    limiter.stats.latency_ms = limiter.stats.latency_ms > 0 ?
+      0.9*limiter.stats.latency_ms + 0.1*latency : latency;
+    limiter.stats.baseline_ms = best;
+  }
+
+  if (response_code == 429 || response_code == 503) {
+    curl_easy_getinfo(transfer->curl_handle, CURLINFO_RETRY_AFTER,
+                      &retry_after);
+    if (retry_after > 0 && now + 1000.0*retry_after > limiter.hold_ms)
+      limiter.hold_ms = now + 1000.0*retry_after;
+  }
+
+  if (congested)
+    limiter.stats.congested++;
+
+  if (!limiter.adaptive)
+    return;
+
+  if (congested) {
+    if (transfer->admitted_ms >= limiter.cut_ms) {
+      limiter.limit  = limiter.limit > 2 ? limiter.limit/2 : 1;
+      limiter.cut_ms = now;
+      limiter.stats.decreases++;
+    }
+  } else if (response_code == 200 && windowfull(transfer->priority)) {
+    limiter.limit += 1/limiter.limit;
+    if (limiter.limit > limiter.max_limit)
+      limiter.limit = limiter.max_limit;
+  }
+}
+
+/* The helpers below must be called with pool.lock held */
+static void
+unlinktransfer(struct Transfer **head,
+               struct Transfer **lastP,
+               struct Transfer  *transfer)
+{
+  struct Transfer **link = head;
+  struct Transfer  *prev = NULL;
+
+  while (*link && *link != transfer) {
+    prev = *link;
+    link = &(*link)->next;
+  }
+  if (*link == NULL)
+    return;
+
+  *link = transfer->next;
+  if (lastP && *lastP == transfer)
+    *lastP = prev;
+}
+
+static void
+enqueue(struct Transfer *transfer)
+{
+  int lane = transfer->priority;
+
+  transfer->next = NULL;
+  if (pool.last[lane])
+    pool.last[lane]->next = transfer;
+  else
+    pool.pending[lane] = transfer;
+  pool.last[lane] = transfer;
+}
+
+static void
+start(struct Transfer *transfer,
+      double           now)
+{
+  int lane = transfer->priority;
+
+  pool.pending[lane] = transfer->next;
+  if (pool.pending[lane] == NULL)
+    pool.last[lane] = NULL;
+
+  if (limiter.rate > 0)
+    limiter.tokens -= 1;
+
+  if (now - transfer->submitted_ms > 1) {
+    limiter.stats.queued++;
+    limiter.stats.queue_ms += now - transfer->submitted_ms;
+  }
+  limiter.stats.lane_admitted[lane]++;
+  limiter.stats.lane_queue_ms[lane] += now - transfer->submitted_ms;
+
+  /* libcurl times connect, TLS and transfer against what is left */
+  if (transfer->deadline_ms > 0)
+    curl_easy_setopt(transfer->curl_handle, CURLOPT_TIMEOUT_MS,
+                     transfer->deadline_ms - now > 1 ?
+                     (long) (transfer->deadline_ms - now) : 1L);
+
+  transfer->admitted    = 1;
+  transfer->admitted_ms = now;
+  transfer->next        = pool.running;
+  pool.running          = transfer;
+  curl_multi_add_handle(pool.multi, transfer->curl_handle);
+
+  limiter.stats.admitted++;
+  if (++limiter.stats.in_flight > limiter.stats.max_in_flight)
+    limiter.stats.max_in_flight = limiter.stats.in_flight;
+}
+
+/* Mark a transfer done, taking it off the cancel list first: its owner
+   may free it as soon as it sees done.  Must be called with pool.lock
+   held, once the transfer is on no other list of the pool. */
+static void
+settransferdone(struct Transfer *transfer)
+{
+  struct Transfer **link;
+
+  if (transfer->cancel) {
+    for (link = &pool.cancelled; *link; link = &(*link)->next_cancel) {
+      if (*link == transfer) {
+        *link = transfer->next_cancel;
+        break;
+      }
+    }
+  }
+  transfer->done = 1;
+}
+
+/* Abort the most recently started listing and put it back at the head
+   of its lane, its partial answer dropped */
+static int
+preemptlisting(void)
+{
+  struct Transfer *transfer;
+  int lane = IC_PRIORITY_LIST;
+
+  for (transfer = pool.running; transfer; transfer = transfer->next) {
+    if (transfer->priority == lane && !transfer->cancel)
+      break;
+  }
+  if (transfer == NULL)
+    return 0;
+
+  curl_multi_remove_handle(pool.multi, transfer->curl_handle);
+  unlinktransfer(&pool.running, NULL, transfer);
+  limiter.stats.in_flight--;
+  limiter.stats.preempted++;
+
+  FREE(transfer->chunk.memory);
+  transfer->chunk.size     = 0;
+  transfer->chunk.capacity = 0;
+  transfer->admitted       = 0;
+
+  transfer->next = pool.pending[lane];
+  pool.pending[lane] = transfer;
+  if (pool.last[lane] == NULL)
+    pool.last[lane] = transfer;
+
+  return 1;
+}
+
+/* Take a transfer out of the pool before it has completed */
+static void
+removetransfer(struct Transfer *transfer)
+{
+  if (transfer->admitted) {
+    curl_multi_remove_handle(pool.multi, transfer->curl_handle);
+    unlinktransfer(&pool.running, NULL, transfer);
+    limiter.stats.in_flight--;
+  } else {
+    unlinktransfer(&pool.pending[transfer->priority],
+                   &pool.last[transfer->priority], transfer);
+  }
+  transfer->res = CURLE_ABORTED_BY_CALLBACK;
+  settransferdone(transfer);
+}
+
+/* Stop the transfers past their deadline or cancelled, those of
+   operations onto *completedP.  Returns the time until the next
+   deadline of a pending transfer, or -1; running ones are timed out by
+   libcurl. */
+static double
+stopexpired(double            now,
+            struct Transfer **completedP)
+{
+  struct Transfer *transfer;
+  struct Transfer *next;
+  double wait = -1;
+  int    lane;
+
+  for (lane = -1; lane < IC_NUM_PRIORITIES; lane++) {
+    for (transfer = lane < 0 ? pool.running : pool.pending[lane]; transfer;
+         transfer = next) {
+      next = transfer->next;
+      if (transfer->deadline_ms <= 0 && transfer->token == NULL)
+        continue;
+      transfer->stop = callstopped(transfer->deadline_ms, transfer->token);
+      if (!transfer->stop) {
+        if (lane >= 0 && transfer->deadline_ms > 0 &&
+            (wait < 0 || transfer->deadline_ms - now < wait))
+          wait = transfer->deadline_ms - now;
+        continue;
+      }
+      removetransfer(transfer);
+      if (transfer->async) {
+        transfer->next = *completedP;
+        *completedP    = transfer;
+      }
+    }
+  }
+
+  return wait;
+}
+
+static void asynccomplete(ICasync *op);
+static void calldone(ICasync *op);
+
+static void *
+poolthread(void *arg)
+{
+  struct Transfer *transfer;
+  struct Transfer *completed;
+  ICasync *op;
+  ICasync *expired;
+  ICasync **link;
+  CURLMsg *msg;
+  double   now;
+  double   wait;
+  double   expiry;
+  int      running;
+  int      remaining;
+  int      lane;
+
+  trace_thread_name("pool");
+
+  for (;;) {
+    completed = NULL;
+    pthread_mutex_lock(&pool.lock);
+    while ((transfer = pool.cancelled) != NULL) {
+      pool.cancelled = transfer->next_cancel;
+      removetransfer(transfer);
+      if (transfer->async) {
+        transfer->next = completed;
+        completed      = transfer;
+      }
+    }
+
+    now    = nowms();
+    wait   = -1;
+    expiry = stopexpired(now, &completed);
+    for (lane = 0; lane < IC_NUM_PRIORITIES; lane++) {
+      while ((transfer = pool.pending[lane]) != NULL) {
+        if (!ready(now, &wait))
+          goto STARTED;
+        if (windowfull(lane) &&
+            !(limiter.preempt && lane < IC_PRIORITY_LIST && preemptlisting()))
+          break;
+        start(transfer, now);
+      }
+    }
+STARTED:
+    if (expiry >= 0 && (wait < 0 || expiry < wait))
+      wait = expiry;
+    pthread_cond_broadcast(&pool.cond);
+    pthread_mutex_unlock(&pool.lock);
+
+    curl_multi_perform(pool.multi, &running);
+
+    while ((msg = curl_multi_info_read(pool.multi, &remaining)) != NULL) {
+      if (msg->msg != CURLMSG_DONE) continue;
+      curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE,
+                        (char **) &transfer);
+      pthread_mutex_lock(&pool.lock);
+      transfer->res = msg->data.result;
+      /* Running out of the caller's time says nothing of the server */
+      if (transfer->res == CURLE_OPERATION_TIMEDOUT &&
+          transfer->deadline_ms > 0)
+        transfer->stop = ERROR_TIMEOUT;
+      else
+        feedback(transfer, nowms());
+      unlinktransfer(&pool.running, NULL, transfer);
+      limiter.stats.in_flight--;
+      curl_multi_remove_handle(pool.multi, transfer->curl_handle);
+      settransferdone(transfer);
+      if (transfer->async) {
+        transfer->next = completed;
+        completed      = transfer;
+      }
+      if (pool.pending[IC_PRIORITY_KILL] || pool.pending[IC_PRIORITY_LAUNCH] ||
+          pool.pending[IC_PRIORITY_LIST])
+        wait = 0;          /* a slot is free, admit without polling */
+      pthread_cond_broadcast(&pool.cond);
+      pthread_mutex_unlock(&pool.lock);
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    now     = nowms();
+    expired = NULL;
+    link    = &pool.timers;
+    while ((op = *link) != NULL) {
+      op->error = callstopped(op->deadline_ms, op->token);
+      if (op->due_ms > now && op->error != ERROR_CANCELLED) {
+        link = &op->next_timer;
+        continue;
+      }
+      *link          = op->next_timer;
+      op->next_timer = expired;
+      expired        = op;
+    }
+    if (pool.timers && (wait < 0 || pool.timers->due_ms - now < wait))
+      wait = pool.timers->due_ms - now;
+    pthread_mutex_unlock(&pool.lock);
+
+    /* Callbacks may start further operations */
+    while ((transfer = completed) != NULL) {
+      completed = transfer->next;
+      asynccomplete(transfer->async);
+    }
+    while ((op = expired) != NULL) {
+      expired = op->next_timer;
+      calldone(op);
+    }
+
+    if (wait != 0)
+      curl_multi_poll(pool.multi, NULL, 0,
+                      wait > 0 && wait < 1000 ? (int) wait + 1 : 1000, NULL);
+  }
+
+  return NULL;
+}
+
+/* Must be called with pool.lock held */
+static int
+startpool(void)
+{
+  pthread_t thread;
+
+  if (pool.started)
+    return 0;
+
+  initcurl();
+
+  pool.multi = curl_multi_init();
+  if (pool.multi == NULL)
+    return ERROR_OUT_OF_MEMORY;
+  curl_multi_setopt(pool.multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+
+  if (pthread_create(&thread, NULL, poolthread, NULL)) {
+    curl_multi_cleanup(pool.multi);
+    pool.multi = NULL;
+    return ERROR_OUT_OF_MEMORY;
+  }
+  pthread_detach(thread);
+  pool.thread  = thread;
+  pool.started = 1;
+
+  return 0;
+}
+
+static void
+wakepool(void)
+{
+  int started;
+
+  pthread_mutex_lock(&pool.lock);
+  started = pool.started;
+  pthread_mutex_unlock(&pool.lock);
+
+  if (started)
+    curl_multi_wakeup(pool.multi);
+}
+
+int
+ICsetconcurrency(int enable,
+                 int initial_limit,
+                 int max_limit)
+{
+  if (enable && (initial_limit < 1 || max_limit < initial_limit))
+    return ERROR_INVALID_ARGUMENT;
+
+  pthread_mutex_lock(&pool.lock);
+  limiter.adaptive = enable;
+  if (enable) {
+    limiter.limit     = initial_limit;
+    limiter.max_limit = max_limit;
+  }
+  pthread_mutex_unlock(&pool.lock);
+
+  wakepool();
+  return 0;
+}
+
+int
+ICsetratelimit(double per_second,
+               int    burst)
+{
+  if (per_second < 0 || (per_second > 0 && burst < 1))
+    return ERROR_INVALID_ARGUMENT;
+
+  pthread_mutex_lock(&pool.lock);
+  limiter.rate        = per_second;
+  limiter.burst       = burst;
+  limiter.tokens      = burst;
+  limiter.refilled_ms = nowms();
+  pthread_mutex_unlock(&pool.lock);
+
+  wakepool();
+  return 0;
+}
+
+int
+ICsetpriorities(int reserved,
+                int preempt)
+{
+  if (reserved < 0)
+    return ERROR_INVALID_ARGUMENT;
+
+  pthread_mutex_lock(&pool.lock);
+  limiter.reserved = reserved;
+  limiter.preempt  = preempt;
+  pthread_mutex_unlock(&pool.lock);
+
+  wakepool();
+  return 0;
+}
+
+int
+ICgetlimiterstats(IClimiterstats *stats)
+{
+  if (!stats)
+    return ERROR_NULL_ARGUMENT;
+
+  pthread_mutex_lock(&pool.lock);
+  *stats = limiter.stats;
+  stats->limit = limiter.adaptive ? (int) limiter.limit : 0;
+  pthread_mutex_unlock(&pool.lock);
+
+  return 0;
+}
+
+static int
+submittransfer(struct Transfer *transfer)
+{
+  int error = 0;
+
+  error = callstopped(transfer->deadline_ms, transfer->token);
+  if (error) return error;
+
+  pthread_mutex_lock(&pool.lock);
+  error = startpool();
+  if (!error) {
+    transfer->done         = 0;
+    transfer->cancel       = 0;
+    transfer->admitted     = 0;
+    transfer->submitted_ms = nowms();
+    trace_current(&transfer->trace);
+    enqueue(transfer);
+  }
+  pthread_mutex_unlock(&pool.lock);
+
+  if (!error)
+    curl_multi_wakeup(pool.multi);
+
+  return error;
+}
+
+static void
+waittransfer(struct Transfer *transfer)
+{
+  pthread_mutex_lock(&pool.lock);
+  while (!transfer->done)
+    pthread_cond_wait(&pool.cond, &pool.lock);
+  pthread_mutex_unlock(&pool.lock);
+}
+
+/* Stop a transfer that has not completed and wait until the pool has
+   let go of it */
+static void
+canceltransfer(struct Transfer *transfer)
+{
+  pthread_mutex_lock(&pool.lock);
+  if (!transfer->done && !transfer->cancel) {
+    transfer->cancel      = 1;
+    transfer->next_cancel = pool.cancelled;
+    pool.cancelled        = transfer;
+    curl_multi_wakeup(pool.multi);
+  }
+  while (!transfer->done)
+    pthread_cond_wait(&pool.cond, &pool.lock);
+  pthread_mutex_unlock(&pool.lock);
+}
+
+/* Calls and operations using the token fail with ERROR_CANCELLED from
+   now on, those waiting included */
+int
+ICcancel(ICcanceltoken *token)
+{
+  struct Flight *flight;
+
+  if (!token)
+    return ERROR_NULL_ARGUMENT;
+
+  __atomic_store_n(&token->cancelled, 1, __ATOMIC_RELEASE);
+
+  pthread_mutex_lock(&cancel_lock);
+  pthread_cond_broadcast(&cancel_cond);
+  pthread_mutex_unlock(&cancel_lock);
+
+  pthread_mutex_lock(&flight_lock);
+  for (flight = flights; flight; flight = flight->next)
+    pthread_cond_broadcast(&flight->cond);
+  pthread_mutex_unlock(&flight_lock);
+
+  wakepool();
+  return 0;
+}
+
+/* Transports.  transport stays NULL for the built-in pool; any other
+   transport carries the requests of sendcommand, sendcommands and
+   sendget one at a time, without hedging.  The curl transport, alone
+   or inside recorders, is the pool itself: requests keep its
+   concurrency and hedging, and taketransfer hands each answer to the
+   recorders. */
+
+static ICtransport *transport = NULL;
+static ICtransport *recorder  = NULL;
+
+static int curlsend(ICtransport *t, const ICrequest *request,
+                    ICresponse *response);
+
+static ICtransport *
+gettransport(void)
+{
+  ICtransport *t;
+
+  pthread_mutex_lock(&transfer_lock);
+  t = transport;
+  pthread_mutex_unlock(&transfer_lock);
+
+  return t;
+}
+
+static ICtransport *
+getrecorder(void)
+{
+  ICtransport *t;
+
+  pthread_mutex_lock(&transfer_lock);
+  t = recorder;
+  pthread_mutex_unlock(&transfer_lock);
+
+  return t;
+}
+
+int
+ICsettransport(ICtransport *t)
+{
+  ICtransport *inner = t;
+
+  while (inner && inner->record && inner->inner)
+    inner = inner->inner;
+
+  pthread_mutex_lock(&transfer_lock);
+  if (inner && inner->send == curlsend) {
+    transport = NULL;
+    recorder  = inner != t ? t : NULL;
+  } else {
+    transport = t;
+    recorder  = NULL;
+  }
+  pthread_mutex_unlock(&transfer_lock);
+
+  return 0;
+}
+
+/* The endpoint is the last path component, before any query */
+static void
+endpointof(const char *command,
+           char       *endpoint)
+{
+  const char *start;
+  size_t len;
+
+  len   = strcspn(command, "?");
+  start = command + len;
+  while (start > command && start[-1] != '/')
+    start--;
+  len = command + len - start;
+  if (len > MAX_STRLEN)
+    len = MAX_STRLEN;
+  memcpy(endpoint, start, len);
+  endpoint[len] = '\0';
+}
+
+static void
+recordexchange(struct Transfer *transfer)
+{
+  ICrequest    request;
+  ICresponse   response;
+  ICtransport *t;
+  char endpoint[MAX_STRLEN+1];
+
+  endpointof(transfer->command, endpoint);
+  request.method    = transfer->postfields ? "POST" : "GET";
+  request.url       = transfer->command;
+  request.endpoint  = endpoint;
+  request.body      = transfer->postfields;
+  request.date      = transfer->timestr;
+  request.signature = transfer->signature;
+  response.status   = transfer->response_code;
+  response.body     = *transfer->responseP;
+
+  for (t = transfer->recorder; t && t->record; t = t->inner)
+    t->record(t, &request, &response);
+}
+
+static int
+transportsend(ICtransport *t,
+              const char  *command,
+              const char  *postfields,
+              const char  *timestr,
+              const char  *signature,
+              char       **responseP,
+              int         *retryableP)
+{
+  ICrequest  request;
+  ICresponse response = { 0, NULL };
+  char  endpoint[MAX_STRLEN+1];
+  int   error;
+
+  endpointof(command, endpoint);
+  request.method    = postfields ? "POST" : "GET";
+  request.url       = command;
+  request.endpoint  = endpoint;
+  request.body      = postfields;
+  request.date      = timestr;
+  request.signature = signature;
+
+  FREE(*responseP);
+  error = callstopped(call_deadline_ms, call_token);
+  if (!error)
+    error = t->send(t, &request, &response);
+  if (response.body == NULL && error != ERROR_OUT_OF_MEMORY)
+    response.body = calloc(1, 1);
+  *responseP = response.body;
+  if (*responseP == NULL)
+    return ERROR_OUT_OF_MEMORY;
+
+  if (error == ERROR_TIMEOUT || error == ERROR_CANCELLED) {
+    if (retryableP)
+      *retryableP = 0;
+    return error;
+  }
+
+  /* Without an answer there is no telling whether the server got it */
+  if (retryableP)
+    *retryableP = response.status == 429 || response.status == 503;
+
+  if (error == ERROR_NETWORK || (error == 0 && response.status != 200)) {
+    printf("Server Error: %ld\n%s\n", response.status, *responseP);
+    error = ERROR_NETWORK;
+  }
+
+  return error;
+}
+
+/* One request through the pool.  Transfer failures other than the
+   status are ERROR_NETWORK, or ERROR_TIMEOUT and ERROR_CANCELLED for
+   the calling thread's deadline and token; the status is left to the
+   caller. */
+static int
+curlsend(ICtransport     *t,
+         const ICrequest *request,
+         ICresponse      *response)
+{
+  struct Transfer transfer;
+  int error;
+
+  error = setuptransfer(&transfer, request->url, (char *) request->body,
+                        (char *) request->date, (char *) request->signature,
+                        &response->body);
+  if (error) return error;
+
+  error = submittransfer(&transfer);
+  if (error) {
+    cleanuptransfer(&transfer);
+    return error;
+  }
+  waittransfer(&transfer);
+
+  error = taketransfer(&transfer);
+  if (error) return error;
+
+  response->status = transfer.response_code;
+  if (transfer.stop)
+    return transfer.stop;
+  return transfer.res == CURLE_OK ? 0 : ERROR_NETWORK;
+}
+
+static void
+curlfree(ICtransport *t)
+{
+}
+
+int
+ICcurltransport(ICtransport **transportP)
+{
+  ICtransport *t = NULL;
+  int error = 0;
+
+  if (!transportP)
+    return ERROR_NULL_ARGUMENT;
+
+  CALLOC(t, 1);
+  t->send = curlsend;
+  t->free = curlfree;
+
+QUIT:
+  *transportP = t;
+  return error;
+}
+
+int
+ICfreetransport(ICtransport **transportP)
+{
+  if (!transportP)
+    return ERROR_NULL_ARGUMENT;
+
+  if (*transportP) {
+    (*transportP)->free(*transportP);
+    FREE(*transportP);
+  }
+
+  return 0;
+}
+
+static int
+sendcommand(const char *command,
+            char       *postfields,
+            char       *timestr,
+            char       *signature,
+            char      **responseP)
+{
+  struct Transfer transfer;
+  ICtransport    *t = gettransport();
+  ICspan          span = IC_SPAN_INIT;
+  int error;
+
+  TRACE_BEGIN(span);
 
-#ifdef VERBOSE
-  printf("response %s\n", response);
-#endif
+  if (t) {
+    error = transportsend(t, command, postfields, timestr, signature,
+                          responseP, NULL);
+    goto QUIT;
+  }
 
-  error = getmachineinfo(response, machine_infoP);
+  error = setuptransfer(&transfer, command, postfields, timestr,
+                        signature, responseP);
   if (error) goto QUIT;
 
+  error = submittransfer(&transfer);
+  if (error) {
+    cleanuptransfer(&transfer);
+    goto QUIT;
+  }
+  waittransfer(&transfer);
+
+  error = finishtransfer(&transfer);
+
 QUIT:
+  TRACE_END(span, "send", NULL);
 
   return error;
 }
 
-int
-IClaunchmachines(int              n,
-                 char            *license_type,
-                 int             *license_idP,
-                 char            *user_password,
-                 char            *region,
-                 char            *machine_type,
-                 int             *idleshutdownP,
-                 char            *gurobi_version,
-                 ICmachineinfo  **machine_infoP)
+/* Issue all commands at once and wait for every one of them to
+   complete.  Each command records its own outcome. */
+static int
+sendcommands(int            n,
+             struct Command *commands)
 {
-  char request[MAX_STRLEN+1];
-  char response[MAX_STRLEN+1];
-  char timestr[MAX_STRLEN+1];
-  char digest[MAX_STRLEN+1];
-  char signature[SIG_LEN+1];
-  char *endpoint = "launch";
-  char command[MAX_STRLEN+1];
-  char *post_end;
-  sha1nfo  s;
-  int  i;
-  int  flag = 0;
-  ICmachineinfo *machine_info = NULL;
-  int  error = 0;
-
-
-  if (!(strlen(accessid) == 17 && strlen(secretkey) == 43)) {
-    error = ERROR_INVALID_ARGUMENT;
+  struct Transfer *transfers = NULL;
+  ICtransport     *t = gettransport();
+  ICspan           span = IC_SPAN_INIT;
+  int      i;
+  int      error = 0;
+
+  TRACE_BEGIN(span);
+
+  if (t) {
+    for (i = 0; i < n; i++)
+      commands[i].error = transportsend(t, commands[i].command,
+                                        commands[i].postfields,
+                                        commands[i].timestr,
+                                        commands[i].signature,
+                                        &commands[i].response,
+                                        &commands[i].retryable);
     goto QUIT;
   }
 
-  if (n <= 0) goto QUIT;
+  CALLOC(transfers, n);
 
-  /* free old machine info */
-  error = ICfreemachineinfo(machine_infoP);
-  if (error) goto QUIT;
+  for (i = 0; i < n; i++) {
+    commands[i].error = setuptransfer(&transfers[i], commands[i].command,
+                                      commands[i].postfields,
+                                      commands[i].timestr,
+                                      commands[i].signature,
+                                      &commands[i].response);
+    if (commands[i].error) continue;
+    commands[i].error = submittransfer(&transfers[i]);
+    if (commands[i].error)
+      cleanuptransfer(&transfers[i]);
+  }
 
-  /* alloc info for new machines */
-  MALLOC(machine_info, n);
-  MALLOC(machine_info->machine_ids, n);
   for (i = 0; i < n; i++) {
-    MALLOC(machine_info->machine_ids[i], sizeof(char)*(MAX_ID_LEN+1));
+    if (transfers[i].curl_handle == NULL) continue;
+    waittransfer(&transfers[i]);
+    commands[i].error = finishtransfer(&transfers[i]);
+    commands[i].retryable = transferretryable(&transfers[i]);
   }
-  machine_info->machines = NULL;
-  machine_info->num_machines = n;
 
-  *machine_infoP = machine_info;
+QUIT:
+  FREE(transfers);
+  TRACE_END(span, "send", NULL);
 
-  sprintf(command, "%s/%s", baseurl, endpoint);
+  return error;
+}
 
-#ifdef VERBOSE
-  printf("command %s\n", command);
-#endif
+/* Hedged reads.  An idempotent GET that has not been answered within
+   the configured percentile of recent latencies is sent a second time
+   on a fresh connection, and whichever answer arrives first is used.
+   The number of second requests is capped at max_extra times the
+   number of hedgeable requests. */
 
-  getISO8601(timestr);
-  sprintf(request, "POST&id=%s&numMachines=%d", accessid, n);
+#define HEDGE_HISTORY     128
+#define HEDGE_MIN_SAMPLES 8
 
-  if (license_type) {
-    flag = 0;
-    for (i = 0; i < NUM_CLOUD_LICENSE_TYPE; i++) {
-      if (strcmp(license_type_data[i], license_type) == 0) {
-        flag = 1;
-        break;
-      }
-    }
+static pthread_mutex_t hedge_lock = PTHREAD_MUTEX_INITIALIZER;
 
-    if (!flag) {
-      error = ERROR_INVALID_ARGUMENT;
-      goto QUIT;
-    }
-    sprintf(&request[strlen(request)],
-            "&licenseType=%s", license_type_encode[i]);
-  }
+static struct {
+  int          enabled;
+  double       percentile;
+  int          min_delay_ms;
+  double       max_extra;
+  double       history[HEDGE_HISTORY];
+  int          num_history;
+  int          next_history;
+  IChedgestats stats;
+} hedging = { 0, 0.95, 50, 0.05 };
 
-  if (user_password) {
-    sprintf(&request[strlen(request)],
-            "&userPassword=%s", user_password);
+static int
+comparedouble(const void *a,
+              const void *b)
+{
+  double da = *(const double *) a;
+  double db = *(const double *) b;
+
+  return (da > db) - (da < db);
+}
+
+/* Must be called with hedge_lock held */
+static double
+hedgedelay(void)
+{
+  double sorted[HEDGE_HISTORY];
+  double delay = hedging.min_delay_ms;
+  int    n = hedging.num_history;
+  int    k;
+
+  if (n >= HEDGE_MIN_SAMPLES) {
+    memcpy(sorted, hedging.history, sizeof(double)*n);
+    qsort(sorted, n, sizeof(double), comparedouble);
+    k = (int) (hedging.percentile*(n - 1) + 0.5);
+    if (sorted[k] > delay)
+      delay = sorted[k];
   }
+  return delay;
+}
 
-  if (machine_type) {
-    flag = 0;
-    for (i = 0; i < NUM_MACHINE_TYPE; i++) {
-      if (strcmp(machine_data[i], machine_type) == 0) {
-        flag = 1;
-        break;
-      }
-    }
+int
+ICsethedging(int    enable,
+             double percentile,
+             int    min_delay_ms,
+             double max_extra)
+{
+  if (percentile <= 0.0 || percentile > 1.0 ||
+      min_delay_ms < 0 || max_extra < 0.0     )
+    return ERROR_INVALID_ARGUMENT;
 
-    if (!flag) {
-      error = ERROR_INVALID_ARGUMENT;
-      goto QUIT;
-    }
-    sprintf(&request[strlen(request)], "&machineType=%s",
-            machine_type);
+  pthread_mutex_lock(&hedge_lock);
+  hedging.enabled      = enable;
+  hedging.percentile   = percentile;
+  hedging.min_delay_ms = min_delay_ms;
+  hedging.max_extra    = max_extra;
+  pthread_mutex_unlock(&hedge_lock);
+
+  return 0;
+}
+
+int
+ICgethedgestats(IChedgestats *stats)
+{
+  if (!stats)
+    return ERROR_NULL_ARGUMENT;
+
+  pthread_mutex_lock(&hedge_lock);
+  *stats = hedging.stats;
+  pthread_mutex_unlock(&hedge_lock);
+
+  return 0;
+}
+
+static int
+transferok(struct Transfer *transfer)
+{
+  long response_code = 0;
+
+  curl_easy_getinfo(transfer->curl_handle, CURLINFO_RESPONSE_CODE,
+                    &response_code);
+  return transfer->res == CURLE_OK && response_code == 200;
+}
+
+static int
+sendget(const char     *endpoint,
+        struct Command *cmd)
+{
+  struct Command  *hedge = NULL;
+  struct Transfer  transfers[2];
+  struct timespec  ts;
+  ICspan   span = IC_SPAN_INIT;
+  double   start;
+  double   delay = 0.0;
+  double   elapsed;
+  int      enabled;
+  int      allowed;
+  int      hedge_tried = 0;
+  int      num_started = 0;
+  int      winner  = -1;
+  int      k;
+  int      error = 0;
+
+  pthread_mutex_lock(&hedge_lock);
+  enabled = hedging.enabled && gettransport() == NULL;
+  if (enabled) {
+    hedging.stats.requests++;
+    delay = hedgedelay();
   }
+  pthread_mutex_unlock(&hedge_lock);
 
-  if (license_idP) {
-    sprintf(&request[strlen(request)], "&licenseId=%d", *license_idP);
+  if (!enabled)
+    return sendcommand(cmd->command, cmd->postfields, cmd->timestr,
+                       cmd->signature, &cmd->response);
+
+  TRACE_BEGIN(span);
+
+  MALLOC(hedge, 1);
+  hedge->response = NULL;
+
+  error = setuptransfer(&transfers[0], cmd->command, cmd->postfields,
+                        cmd->timestr, cmd->signature, &cmd->response);
+  if (error) goto QUIT;
+  error = submittransfer(&transfers[0]);
+  if (error) {
+    cleanuptransfer(&transfers[0]);
+    goto QUIT;
   }
+  num_started = 1;
 
-  if (region) {
-    flag = 0;
-    for (i = 0; i < NUM_REGIONS; i++) {
-      if (strcmp(region_data[i], region) == 0) {
-        flag = 1;
-        break;
+  start = nowms();
+
+  pthread_mutex_lock(&pool.lock);
+  for (;;) {
+    for (k = 0; k < num_started && winner < 0; k++) {
+      if (transfers[k].done && transferok(&transfers[k]))
+        winner = k;
+    }
+    if (winner >= 0)
+      break;
+
+    /* Everything sent so far has failed */
+    if (transfers[0].done && (num_started == 1 || transfers[1].done))
+      break;
+
+    elapsed = nowms() - start;
+    if (!hedge_tried && elapsed >= delay) {
+      hedge_tried = 1;
+      pthread_mutex_unlock(&pool.lock);
+
+      pthread_mutex_lock(&hedge_lock);
+      allowed = hedging.stats.hedges + 1 <=
+                hedging.max_extra*hedging.stats.requests;
+      if (allowed)
+        hedging.stats.hedges++;
+      else
+        hedging.stats.throttled++;
+      pthread_mutex_unlock(&hedge_lock);
+
+      if (allowed &&
+          buildget(endpoint, hedge) == 0 &&
+          setuptransfer(&transfers[1], hedge->command, NULL, hedge->timestr,
+                        hedge->signature, &hedge->response) == 0) {
+        /* Keep clear of whatever is holding up the first connection */
+        curl_easy_setopt(transfers[1].curl_handle, CURLOPT_FRESH_CONNECT, 1L);
+        curl_easy_setopt(transfers[1].curl_handle, CURLOPT_PIPEWAIT, 0L);
+        if (submittransfer(&transfers[1]) == 0)
+          num_started = 2;
+        else
+          cleanuptransfer(&transfers[1]);
       }
+
+      pthread_mutex_lock(&pool.lock);
+      continue;
     }
 
-    if (!flag) {
-      error = ERROR_INVALID_ARGUMENT;
-      goto QUIT;
+    if (hedge_tried) {
+      pthread_cond_wait(&pool.cond, &pool.lock);
+    } else {
+      abstime(delay - elapsed, &ts);
+      pthread_cond_timedwait(&pool.cond, &pool.lock, &ts);
     }
-    sprintf(&request[strlen(request)], "&region=%s", region);
   }
-
-  if (idleshutdownP) {
-     sprintf(&request[strlen(request)], "&idleShutdown=%d", *idleshutdownP);
+  pthread_mutex_unlock(&pool.lock);
+
+  if (winner >= 0) {
+    pthread_mutex_lock(&hedge_lock);
+    hedging.history[hedging.next_history] = nowms() - start;
+    hedging.next_history = (hedging.next_history + 1) % HEDGE_HISTORY;
+    if (hedging.num_history < HEDGE_HISTORY)
+      hedging.num_history++;
+    if (winner == 1)
+      hedging.stats.hedge_wins++;
+    pthread_mutex_unlock(&hedge_lock);
   }
 
-  if (gurobi_version) {
-    sprintf(&request[strlen(request)], "&GRBVersion=%s", gurobi_version);
+QUIT:
+  for (k = 0; k < num_started; k++) {
+    canceltransfer(&transfers[k]);
+    if (!error && k == (winner >= 0 ? winner : 0)) {
+      /* Whichever request won, its answer becomes the command's */
+      transfers[k].responseP = &cmd->response;
+      error = finishtransfer(&transfers[k]);
+    } else {
+      cleanuptransfer(&transfers[k]);
+    }
   }
 
-  post_end = &request[strlen(request)];
+  if (hedge)
+    FREE(hedge->response);
+  FREE(hedge);
+  TRACE_END(span, "send", hedge_tried ? "hedged" : NULL);
 
-  sprintf(&request[strlen(request)], "&%s", timestr);
+  return error;
+}
 
-  sha1_init(&s);
-  sha1_initHmac(&s, (unsigned char *) secretkey, 43);
-  sha1_write(&s, request, strlen(request));
-  memcpy(digest, sha1_resultHmac(&s), 20);
-  digest[20] = 0;
-#ifdef VERBOSE
-  printf("digest ");
-  printHash((uint8_t *)digest);
-#endif
+/* Operations that do not wait.  ICstart* signs the request and hands it
+   to the pool; the pool thread calls done once the answer is in, and
+   ICfinish* decodes it on whichever thread the caller likes.  With a
+   transport installed the request is sent before ICstart* returns and
+   done is called from it.  *opP is set before done can run. */
 
+static void
+freeasync(ICasync *op)
+{
+  FREE(op->cmd.response);
+  FREE(op->cmd.postfields);
+  FREE(op);
+}
 
-  b64_encode(digest, 20, signature, SIG_LEN);
-  signature[SIG_LEN] = '\0';
+/* Call done on the pool thread, or free the operation if it was
+   released while in flight */
+static void
+calldone(ICasync *op)
+{
+  ICasynccallback done;
+  void *arg;
+
+  pthread_mutex_lock(&pool.lock);
+  if (op->abandoned) {
+    pthread_mutex_unlock(&pool.lock);
+    freeasync(op);
+    return;
+  }
+  op->called   = 1;
+  pool.calling = op;
+  done = op->done;
+  arg  = op->arg;
+  pthread_mutex_unlock(&pool.lock);
+
+  done(op, arg);
+
+  pthread_mutex_lock(&pool.lock);
+  pool.calling = NULL;
+  pthread_cond_broadcast(&pool.cond);
+  pthread_mutex_unlock(&pool.lock);
+}
 
-#ifdef VERBOSE
-  printf("request %s\n", request);
-  printf("timestr %s\n", timestr);
-  printf("signature %s\n", signature);
-#endif
+static void
+asynccomplete(ICasync *op)
+{
+  op->error = finishtransfer(&op->transfer);
+  calldone(op);
+}
 
-  *post_end = '\0';
+static int
+startasync(ICasync        *op,
+           ICasync       **opP)
+{
+  ICtransport *t = gettransport();
+  int error;
 
-  error = sendcommand(command, &request[5], timestr, signature, response);
-  if (error) goto QUIT;
+  *opP = op;
 
-#ifdef VERBOSE
-  printf("response %s\n", response);
-#endif
+  if (t) {
+    op->error = transportsend(t, op->cmd.command, op->cmd.postfields,
+                              op->cmd.timestr, op->cmd.signature,
+                              &op->cmd.response, NULL);
+    op->done(op, op->arg);
+    return 0;
+  }
 
-  error = getmachineinfo(response, machine_infoP);
+  error = setuptransfer(&op->transfer, op->cmd.command, op->cmd.postfields,
+                        op->cmd.timestr, op->cmd.signature,
+                        &op->cmd.response);
   if (error) goto QUIT;
 
+  op->transfer.async = op;
+  op->pooled = 1;
+  error = submittransfer(&op->transfer);
+  if (error) {
+    op->pooled = 0;
+    cleanuptransfer(&op->transfer);
+  }
 
 QUIT:
-
+  if (error)
+    *opP = NULL;
   return error;
 }
 
-int
-ICkillmachines(int             n,
-               char          **machine_ids,
-               ICmachineinfo **machine_infoP)
+static int
+newasync(ICasynccallback   done,
+         void             *arg,
+         ICasync         **opP)
 {
-  char    request[MAX_STRLEN+1];
-  char    response[MAX_STRLEN+1];
-  char    timestr[MAX_STRLEN+1];
-  char    digest[MAX_STRLEN+1];
-  char    signature[SIG_LEN+1];
-  char   *endpoint = "kill";
-  char    command[MAX_STRLEN+1];
-  char    machineIdJSON[MAX_STRLEN+1];
-  char   *post_end;
-  sha1nfo s;
-  int     i;
-  int     error = 0;
-
-
-  if (!(strlen(accessid) == 17 && strlen(secretkey) == 43)) {
-    error = ERROR_INVALID_ARGUMENT;
-    goto QUIT;
-  }
-
+  ICasync *op = NULL;
+  int error = 0;
 
-  if (n <= 0) goto QUIT;
+  if (!done || !opP)
+    return ERROR_NULL_ARGUMENT;
+  *opP = NULL;
 
-  sprintf(command, "%s/%s", baseurl, endpoint);
-#ifdef VERBOSE
-  printf("command %s\n", command);
-#endif
+  if (!(strlen(accessid) == ACCESS_ID_LEN   &&
+        strlen(secretkey) == SECRET_KEY_LEN   ))
+    return ERROR_INVALID_ARGUMENT;
 
-  sprintf(request, "POST&id=%s", accessid);
+  CALLOC(op, 1);
+  op->done   = done;
+  op->arg    = arg;
+  op->fields = IC_FIELD_ALL;
 
-  sprintf(machineIdJSON, "%%5B"); /* [ -> %5B */
-  for (i = 0; i < n; i++) {
-    if (i > 0) {
-      sprintf(&machineIdJSON[strlen(machineIdJSON)], "%%2C"); /* , -> %2C */
-    }
-    /* " -> %22 */
-    sprintf(&machineIdJSON[strlen(machineIdJSON)], "%%22%s%%22",machine_ids[i]);
-  }
-  /* [ -> %5D */
-  sprintf(&machineIdJSON[strlen(machineIdJSON)], "%%5D");
-#ifdef VERBOSE
-  printf("machineJSON %s\n", machineIdJSON);
-#endif
+QUIT:
+  *opP = op;
+  return error;
+}
 
-  sprintf(&request[strlen(request)], "&machineIds=%s", machineIdJSON);
+int
+ICstartgetmachines(unsigned int      fields,
+                   ICasynccallback   done,
+                   void             *arg,
+                   ICasync         **opP)
+{
+  ICasync *op = NULL;
+  int error;
+  ICspan span = IC_SPAN_INIT;
 
-  post_end = &request[strlen(request)];
+  TRACE_BEGIN(span);
 
+  error = newasync(done, arg, &op);
+  if (error) goto QUIT;
 
-  getISO8601(timestr);
-  sprintf(&request[strlen(request)], "&%s", timestr);
+  op->fields = fields;
+  error = buildget("machines", &op->cmd);
+  if (error) goto QUIT;
 
-  sha1_init(&s);
-  sha1_initHmac(&s, (unsigned char *) secretkey, 43);
-  sha1_write(&s, request, strlen(request));
-  memcpy(digest, sha1_resultHmac(&s), 20);
-  digest[20] = 0;
-#ifdef VERBOSE
-  printf("digest ");
-  printHash((uint8_t *)digest);
-#endif
+  error = startasync(op, opP);
 
-  b64_encode(digest, 20, signature, SIG_LEN);
-  signature[SIG_LEN] = '\0';
+QUIT:
+  if (error)
+    ICfreeasync(&op);
+  TRACE_END(span, "ICstartgetmachines", NULL);
+  return error;
+}
 
-#ifdef VERBOSE
-  printf("request %s\n", request);
-  printf("timestr %s\n", timestr);
-  printf("signature %s\n", signature);
-#endif
+int
+ICstartgetlicenses(ICasynccallback   done,
+                   void             *arg,
+                   ICasync         **opP)
+{
+  ICasync *op = NULL;
+  int error;
+  ICspan span = IC_SPAN_INIT;
 
-  *post_end = '\0';
+  TRACE_BEGIN(span);
 
-  error = sendcommand(command, &request[5], timestr, signature, response);
+  error = newasync(done, arg, &op);
   if (error) goto QUIT;
 
-#ifdef VERBOSE
-  printf("response %s\n", response);
-#endif
-
-  error = getmachineinfo(response, machine_infoP);
+  error = buildget("licenses", &op->cmd);
   if (error) goto QUIT;
 
-QUIT:
+  error = startasync(op, opP);
 
+QUIT:
+  if (error)
+    ICfreeasync(&op);
+  TRACE_END(span, "ICstartgetlicenses", NULL);
   return error;
 }
 
 int
-ICcloudcreds(char *id,
-             char *key)
+ICstartlaunch(int               n,
+              char             *license_type,
+              int              *license_idP,
+              char             *user_password,
+              char             *region,
+              char             *machine_type,
+              int              *idleshutdownP,
+              char             *gurobi_version,
+              ICasynccallback   done,
+              void             *arg,
+              ICasync         **opP)
 {
-  if (!id || !key)
-    return ERROR_NULL_ARGUMENT;
+  ICasync *op = NULL;
+  int error;
+  ICspan span = IC_SPAN_INIT;
 
-  if (strlen(id)  != ACCESS_ID_LEN ||
-      strlen(key) != SECRET_KEY_LEN  )
+  if (n <= 0)
     return ERROR_INVALID_ARGUMENT;
 
-  memcpy(accessid, id, sizeof(char)*(ACCESS_ID_LEN+1));
-  accessid[ACCESS_ID_LEN] = 0;
+  TRACE_BEGIN(span);
 
-  memcpy(secretkey, key, sizeof(char)*(SECRET_KEY_LEN+1));
-  secretkey[SECRET_KEY_LEN] = 0;
+  error = newasync(done, arg, &op);
+  if (error) goto QUIT;
 
-  return 0;
+  error = buildlaunch(n, license_type, license_idP, user_password, region,
+                      machine_type, idleshutdownP, gurobi_version, &op->cmd);
+  if (error) goto QUIT;
+
+  error = startasync(op, opP);
+
+QUIT:
+  if (error)
+    ICfreeasync(&op);
+  TRACE_END(span, "ICstartlaunch", NULL);
+  return error;
 }
 
 int
-ICfreemachineinfo(ICmachineinfo **machine_infoP)
+ICstartkill(int               n,
+            char            **machine_ids,
+            ICasynccallback   done,
+            void             *arg,
+            ICasync         **opP)
 {
-  int i;
-  ICmachineinfo *info;
-  int num_machines;
-  int error = 0;
+  ICasync *op = NULL;
+  int error;
+  ICspan span = IC_SPAN_INIT;
 
-  if (*machine_infoP) {
-    info = *machine_infoP;
-    num_machines = info->num_machines;
+  if (n <= 0 || !machine_ids)
+    return ERROR_INVALID_ARGUMENT;
 
-    if (info->machine_ids) {
-      for (i = 0; i < num_machines; i++) {
-        FREE(info->machine_ids[i]);
-      }
-      FREE(info->machine_ids);
-    }
+  TRACE_BEGIN(span);
+
+  error = newasync(done, arg, &op);
+  if (error) goto QUIT;
+
+  error = buildkill(n, machine_ids, &op->cmd);
+  if (error) goto QUIT;
+
+  error = startasync(op, opP);
+
+QUIT:
+  if (error)
+    ICfreeasync(&op);
+  TRACE_END(span, "ICstartkill", NULL);
+  return error;
+}
 
-    if (info->machines) {
-      FREE(info->machines);
-    }
-    info->num_machines = 0;
+/* A timer of the pool thread, for polling without holding a thread.
+   It goes off early at the deadline or on cancellation, which
+   ICfinishdelay then returns. */
+int
+ICstartdelay(int               ms,
+             ICasynccallback   done,
+             void             *arg,
+             ICasync         **opP)
+{
+  ICasync  *op = NULL;
+  ICasync **link;
+  int error = 0;
 
-    FREE(info);
+  if (!done || !opP)
+    return ERROR_NULL_ARGUMENT;
+  *opP = NULL;
+
+  CALLOC(op, 1);
+  op->done        = done;
+  op->arg         = arg;
+  op->due_ms      = nowms() + (ms > 0 ? ms : 0);
+  op->deadline_ms = call_deadline_ms;
+  op->token       = call_token;
+  if (op->deadline_ms > 0 && op->deadline_ms < op->due_ms)
+    op->due_ms = op->deadline_ms;
+  *opP = op;
+
+  pthread_mutex_lock(&pool.lock);
+  error = startpool();
+  if (!error) {
+    for (link = &pool.timers; *link && (*link)->due_ms <= op->due_ms;
+         link = &(*link)->next_timer)
+      ;
+    op->next_timer = *link;
+    *link = op;
+    op->pooled = 1;
   }
+  pthread_mutex_unlock(&pool.lock);
+
+  if (error) goto QUIT;
+  curl_multi_wakeup(pool.multi);
 
+QUIT:
+  if (error) {
+    *opP = NULL;
+    FREE(op);
+  }
   return error;
 }
 
-struct MemoryStruct {
-  char *memory;
-  size_t size;
-};
-
-static size_t
-WriteMemoryCallback(void   *contents,
-                    size_t  size,
-                    size_t  nmemb,
-                    void   *userp)
+/* The outcome of a delay; releases the operation */
+int
+ICfinishdelay(ICasync **opP)
 {
-  size_t realsize = size * nmemb;
-  struct MemoryStruct *mem = (struct MemoryStruct *)userp;
+  int error;
 
-  if (mem->size + realsize > MAX_STRLEN)
-    return 0;
+  if (!opP || !*opP)
+    return ERROR_NULL_ARGUMENT;
 
-  memcpy(&(mem->memory[mem->size]), contents, realsize);
-  mem->size += realsize;
-  mem->memory[mem->size] = 0;
+  error = (*opP)->error;
+  ICfreeasync(opP);
 
-  return realsize;
+  return error;
 }
 
-
-static int
-sendcommand(const char *command,
-            char       *postfields,
-            char       *timestr,
-            char       *signature,
-            char       *response)
+/* The machines of a listing, launch or kill; releases the operation */
+int
+ICfinishmachines(ICasync        **opP,
+                 ICmachineinfo  **machine_infoP)
 {
-  int  error;
-  CURL *curl_handle;
-  CURLcode res;
-  struct MemoryStruct chunk;
-  struct curl_slist *list = NULL;
-  char dateheader[MAX_STRLEN+1];
-  char signheader[MAX_STRLEN+1];
-  long response_code;
-
-  chunk.memory = response;
-  chunk.size = 0;
+  ICasync *op;
+  int error = 0;
+  ICspan span = IC_SPAN_INIT;
 
-  curl_global_init(CURL_GLOBAL_ALL);
+  if (!opP || !*opP || !machine_infoP)
+    return ERROR_NULL_ARGUMENT;
+  op = *opP;
 
-  curl_handle = curl_easy_init();
+  TRACE_BEGIN(span);
 
-  curl_easy_setopt(curl_handle, CURLOPT_URL, command);
-  curl_easy_setopt(curl_handle, CURLOPT_USERAGENT, "libcurl-agent/1.0");
-  curl_easy_setopt(curl_handle, CURLOPT_FOLLOWLOCATION, 1);
+  error = ICfreemachineinfo(machine_infoP);
+  if (error) goto QUIT;
 
-  curl_easy_setopt(curl_handle, CURLOPT_WRITEFUNCTION, WriteMemoryCallback);
-  curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, (void *) &chunk);
+  error = op->error;
+  if (error) goto QUIT;
 
-#if 0
-  if (strlen(signature) != 28) {
-    printf("Bad signature %s\n", signature);
-  }
-  assert(strlen(signature) == 28);
+#ifdef VERBOSE
+  printf("response %s\n", op->cmd.response);
 #endif
 
-  sprintf(dateheader, "X-Gurobi-Date: %s", timestr);
-  sprintf(signheader, "X-Gurobi-Signature: %s", signature);
+  error = getmachineinfo(op->cmd.response, op->fields, machine_infoP);
+  if (error)
+    ICfreemachineinfo(machine_infoP);
+
+QUIT:
+  ICfreeasync(opP);
+  TRACE_END(span, "ICfinishmachines", NULL);
+  return error;
+}
+
+int
+ICfinishlicenses(ICasync         **opP,
+                 int              *num_licensesP,
+                 ICcloudlicense  **licensesP)
+{
+  ICcloudlicense *licenses = NULL;
+  ICasync *op;
+  int num_licenses = 0;
+  int error = 0;
+  ICspan span = IC_SPAN_INIT;
 
-  list = curl_slist_append(list, signheader);
-  list = curl_slist_append(list, dateheader);
+  if (!opP || !*opP || !num_licensesP || !licensesP)
+    return ERROR_NULL_ARGUMENT;
+  op = *opP;
 
-  curl_easy_setopt(curl_handle, CURLOPT_HTTPHEADER, list);
+  TRACE_BEGIN(span);
 
-  if (postfields) {
-    curl_easy_setopt(curl_handle, CURLOPT_POSTFIELDS, postfields);
-  }
+  error = op->error;
+  if (error) goto QUIT;
+
+  error = decodelicenses(op->cmd.response, &num_licenses, NULL);
+  if (error) goto QUIT;
 
-  res = curl_easy_perform(curl_handle);
+  CALLOC(licenses, num_licenses);
+  error = decodelicenses(op->cmd.response, NULL, licenses);
+  if (error) goto QUIT;
 
-  curl_easy_getinfo(curl_handle, CURLINFO_RESPONSE_CODE, &response_code);
+  *num_licensesP = num_licenses;
+  *licensesP     = licenses;
+  licenses       = NULL;
 
-  curl_slist_free_all(list);
+QUIT:
+  FREE(licenses);
+  ICfreeasync(opP);
+  TRACE_END(span, "ICfinishlicenses", NULL);
+  return error;
+}
 
-  curl_easy_cleanup(curl_handle);
+/* Releases a completed operation, or one whose outcome is not wanted.
+   One still in flight is cancelled and its done is not called: a
+   waiting timer is freed at once, anything else is left to the pool
+   thread to free once it lets go.  A done running on another thread is
+   waited for. */
+int
+ICfreeasync(ICasync **opP)
+{
+  ICasync  *op;
+  ICasync **link;
 
-  curl_global_cleanup();
+  if (!opP)
+    return ERROR_NULL_ARGUMENT;
 
-#ifdef VERBOSE
-  printf("response_code %ld\n", response_code);
-#endif
+  op   = *opP;
+  *opP = NULL;
+  if (!op)
+    return 0;
 
-  if (res == CURLE_OK && response_code == 200) {
-    error = 0;
-  } else {
-    printf("Server Error: %ld\n%s\n", response_code, response);
-    error = ERROR_NETWORK;
+  pthread_mutex_lock(&pool.lock);
+  if (op->pooled && !op->called) {
+    for (link = &pool.timers; *link && *link != op;
+         link = &(*link)->next_timer)
+      ;
+    if (*link == NULL) {
+      op->abandoned = 1;
+      if (op->transfer.async && !op->transfer.done && !op->transfer.cancel) {
+        op->transfer.cancel      = 1;
+        op->transfer.stop        = ERROR_CANCELLED;
+        op->transfer.next_cancel = pool.cancelled;
+        pool.cancelled           = &op->transfer;
+        curl_multi_wakeup(pool.multi);
+      }
+      pthread_mutex_unlock(&pool.lock);
+      return 0;
+    }
+    *link = op->next_timer;
   }
+  while (pool.calling == op && !pthread_equal(pthread_self(), pool.thread))
+    pthread_cond_wait(&pool.cond, &pool.lock);
+  pthread_mutex_unlock(&pool.lock);
 
-  return error;
-}
+  freeasync(op);
 
+  return 0;
+}
 
 /**
  * Allocates a fresh unused token from the token pull.
@@ -1427,8 +5152,9 @@ jsmn_parse(jsmn_parser *parser,
           parser->toksuper = token->parent;
           break;
         }
+        /* Error if unmatched closing bracket */
         if (token->parent == -1) {
-          break;
+          return JSMN_ERROR_INVAL;
         }
         token = &tokens[token->parent];
       }
@@ -1468,7 +5194,7 @@ jsmn_parse(jsmn_parser *parser,
       parser->toksuper = parser->toknext - 1;
       break;
     case ',':
-      if (tokens != NULL &&
+      if (tokens != NULL && parser->toksuper != -1 &&
           tokens[parser->toksuper].type != JSMN_ARRAY &&
           tokens[parser->toksuper].type != JSMN_OBJECT) {
 #ifdef JSMN_PARENT_LINKS
@@ -1537,3 +5263,557 @@ jsmn_init(jsmn_parser *parser) {
   parser->toknext = 0;
   parser->toksuper = -1;
 }
+
+
+/* Structural scanner.  Stage one classifies 64 bytes at a time into
+   bit masks of quotes, backslashes, structural characters and white
+   space with SSE2 or AVX2 compares.  Stage two resolves escapes and
+   string extents on the masks and walks the remaining set bits to
+   build the same tokens as jsmn_parse, which stays the fallback. */
+
+#ifdef HAVE_SSE2_SCAN
+struct ScanMasks {
+  uint64_t quote;
+  uint64_t backslash;
+  uint64_t structural;
+  uint64_t space;
+};
+
+static void
+classify_sse2(const char       *p,
+              struct ScanMasks *m)
+{
+  __m128i v;
+  __m128i lower;
+  __m128i st;
+  __m128i sp;
+  int k;
+
+  memset(m, 0, sizeof(*m));
+  for (k = 0; k < 4; k++) {
+    v     = _mm_loadu_si128((const __m128i *) (p + 16*k));
+    /* '[' and ']' differ from '{' and '}' only in bit 0x20 */
+    lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+    st = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(lower, _mm_set1_epi8('{')),
+                                   _mm_cmpeq_epi8(lower, _mm_set1_epi8('}'))),
+                      _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(':')),
+                                   _mm_cmpeq_epi8(v, _mm_set1_epi8(','))));
+    sp = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+                                   _mm_cmpeq_epi8(v, _mm_set1_epi8('\t'))),
+                      _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')),
+                                   _mm_cmpeq_epi8(v, _mm_set1_epi8('\r'))));
+    m->quote      |= (uint64_t) (unsigned) _mm_movemask_epi8(
+                       _mm_cmpeq_epi8(v, _mm_set1_epi8('"'))) << 16*k;
+    m->backslash  |= (uint64_t) (unsigned) _mm_movemask_epi8(
+                       _mm_cmpeq_epi8(v, _mm_set1_epi8('\\'))) << 16*k;
+    m->structural |= (uint64_t) (unsigned) _mm_movemask_epi8(st) << 16*k;
+    m->space      |= (uint64_t) (unsigned) _mm_movemask_epi8(sp) << 16*k;
+  }
+}
+#endif
+
+#ifdef HAVE_AVX2_SCAN
+__attribute__((target("avx2")))
+static void
+classify_avx2(const char       *p,
+              struct ScanMasks *m)
+{
+  __m256i v;
+  __m256i lower;
+  __m256i st;
+  __m256i sp;
+  int k;
+
+  memset(m, 0, sizeof(*m));
+  for (k = 0; k < 2; k++) {
+    v     = _mm256_loadu_si256((const __m256i *) (p + 32*k));
+    lower = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+    st = _mm256_or_si256(
+           _mm256_or_si256(_mm256_cmpeq_epi8(lower, _mm256_set1_epi8('{')),
+                           _mm256_cmpeq_epi8(lower, _mm256_set1_epi8('}'))),
+           _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(':')),
+                           _mm256_cmpeq_epi8(v, _mm256_set1_epi8(','))));
+    sp = _mm256_or_si256(
+           _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')),
+                           _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t'))),
+           _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')),
+                           _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r'))));
+    m->quote      |= (uint64_t) (unsigned) _mm256_movemask_epi8(
+                       _mm256_cmpeq_epi8(v, _mm256_set1_epi8('"'))) << 32*k;
+    m->backslash  |= (uint64_t) (unsigned) _mm256_movemask_epi8(
+                       _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\'))) << 32*k;
+    m->structural |= (uint64_t) (unsigned) _mm256_movemask_epi8(st) << 32*k;
+    m->space      |= (uint64_t) (unsigned) _mm256_movemask_epi8(sp) << 32*k;
+  }
+}
+#endif
+
+static int
+scanavailable(int kind)
+{
+  switch (kind) {
+  case IC_SCAN_AUTO:
+  case IC_SCAN_SCALAR:
+    return 1;
+#ifdef HAVE_SSE2_SCAN
+  case IC_SCAN_SSE2:
+    return 1;
+#endif
+#ifdef HAVE_AVX2_SCAN
+  case IC_SCAN_AVX2:
+    return __builtin_cpu_supports("avx2");
+#endif
+  }
+  return 0;
+}
+
+/* Unoptimized builds run the intrinsics slower than jsmn */
+static int
+bestscanner(void)
+{
+#ifndef __OPTIMIZE__
+  return IC_SCAN_SCALAR;
+#endif
+  if (scanavailable(IC_SCAN_AVX2))
+    return IC_SCAN_AVX2;
+  if (scanavailable(IC_SCAN_SSE2))
+    return IC_SCAN_SSE2;
+  return IC_SCAN_SCALAR;
+}
+
+int
+ICsetscanner(int kind)
+{
+  if (!scanavailable(kind))
+    return ERROR_INVALID_ARGUMENT;
+  scanner = kind;
+  return 0;
+}
+
+#ifdef HAVE_SSE2_SCAN
+/* Bit i of the result is the parity of the bits 0..i of x */
+static uint64_t
+prefixxor(uint64_t x)
+{
+  x ^= x << 1;
+  x ^= x << 2;
+  x ^= x << 4;
+  x ^= x << 8;
+  x ^= x << 16;
+  x ^= x << 32;
+  return x;
+}
+
+struct Scan {
+  jsmntok_t *tokens;
+  int        num_tokens;
+  int        max_tokens;
+  int       *stack;        /* open objects and arrays */
+  int        depth;
+  int        max_depth;
+  int        super;        /* token that receives the next child */
+};
+
+static int
+scantoken(struct Scan *sc,
+          jsmntype_t   type,
+          int          start,
+          int          end)
+{
+  jsmntok_t *more;
+  jsmntok_t *tok;
+
+  if (sc->num_tokens == sc->max_tokens) {
+    more = (jsmntok_t *) realloc(sc->tokens,
+                                 2*sc->max_tokens*sizeof(jsmntok_t));
+    if (more == NULL)
+      return ERROR_OUT_OF_MEMORY;
+    sc->tokens = more;
+    sc->max_tokens *= 2;
+  }
+  tok = &sc->tokens[sc->num_tokens++];
+  tok->type  = type;
+  tok->start = start;
+  tok->end   = end;
+  tok->size  = 0;
+#ifdef JSMN_PARENT_LINKS
+  tok->parent = sc->super;
+#endif
+  if (sc->super != -1)
+    sc->tokens[sc->super].size++;
+
+  return 0;
+}
+
+static int
+scanstructural(struct Scan *sc,
+               char         c,
+               int          at)
+{
+  jsmntype_t type;
+  int       *more;
+  int        top;
+  int        error = 0;
+
+  switch (c) {
+  case '{': case '[':
+    error = scantoken(sc, c == '{' ? JSMN_OBJECT : JSMN_ARRAY, at, -1);
+    if (error) break;
+    if (sc->depth == sc->max_depth) {
+      more = (int *) realloc(sc->stack, 2*sc->max_depth*sizeof(int));
+      if (more == NULL) {
+        error = ERROR_OUT_OF_MEMORY;
+        break;
+      }
+      sc->stack = more;
+      sc->max_depth *= 2;
+    }
+    sc->super = sc->stack[sc->depth++] = sc->num_tokens - 1;
+    break;
+  case '}': case ']':
+    type = (c == '}' ? JSMN_OBJECT : JSMN_ARRAY);
+    if (sc->depth == 0) {
+      error = ERROR_NETWORK;
+      break;
+    }
+    top = sc->stack[--sc->depth];
+    if (sc->tokens[top].type != type) {
+      error = ERROR_NETWORK;
+      break;
+    }
+    sc->tokens[top].end = at + 1;
+    sc->super = sc->depth ? sc->stack[sc->depth-1] : -1;
+    break;
+  case ':':
+    sc->super = sc->num_tokens - 1;
+    break;
+  case ',':
+    if (sc->super != -1 &&
+        sc->tokens[sc->super].type != JSMN_ARRAY &&
+        sc->tokens[sc->super].type != JSMN_OBJECT)
+      sc->super = sc->depth ? sc->stack[sc->depth-1] : -1;
+    break;
+  }
+
+  return error;
+}
+
+/* Masks of one 64 byte block, with the state carried between blocks */
+struct ScanBlock {
+  uint64_t carry_escaped;
+  uint64_t carry_string;
+  uint64_t carry_other;
+  uint64_t quote;        /* unescaped quotes */
+  uint64_t escapes;      /* backslashes starting an escape in a string */
+  uint64_t string;       /* inside a string, opening quote included */
+  uint64_t structural;   /* structural characters outside strings */
+  uint64_t starts;       /* first byte of a primitive */
+  uint64_t ends;         /* first byte after a primitive */
+};
+
+static void
+scanblock(const char       *js,
+          size_t            len,
+          size_t            pos,
+          int               kind,
+          struct ScanBlock *b)
+{
+  struct ScanMasks m;
+  char      tail[64];
+  const char *p;
+  uint64_t  escaped;
+  uint64_t  other;
+  uint64_t  bs;
+  int       i;
+
+  if (len - pos >= 64) {
+    p = js + pos;
+  } else {
+    memset(tail, ' ', sizeof(tail));
+    memcpy(tail, js + pos, len - pos);
+    p = tail;
+  }
+
+#ifdef HAVE_AVX2_SCAN
+  if (kind == IC_SCAN_AVX2)
+    classify_avx2(p, &m);
+  else
+#endif
+    classify_sse2(p, &m);
+
+  /* A backslash escapes the next byte unless it is escaped itself */
+  escaped = b->carry_escaped;
+  b->carry_escaped = 0;
+  for (bs = m.backslash; bs; bs &= bs - 1) {
+    i = __builtin_ctzll(bs);
+    if ((escaped >> i) & 1)
+      continue;
+    if (i == 63)
+      b->carry_escaped = 1;
+    else
+      escaped |= (uint64_t) 1 << (i + 1);
+  }
+
+  /* Strings run from an opening quote up to the closing quote */
+  b->quote  = m.quote & ~escaped;
+  b->string = prefixxor(b->quote) ^ b->carry_string;
+  b->carry_string = (uint64_t) ((int64_t) b->string >> 63);
+  b->escapes = m.backslash & ~escaped & b->string;
+
+  b->structural = m.structural & ~b->string;
+  other     = ~(m.structural | m.space | b->quote | b->string);
+  b->starts = other & ~((other << 1) | b->carry_other);
+  b->ends   = ~other & ((other << 1) | b->carry_other);
+  b->carry_other = other >> 63;
+}
+
+/* The escape at the backslash at, which jsmn_parse_string accepts only
+   as one of "/\bfnrt or u and four hex digits */
+static int
+scanescape(const char *js,
+           size_t      len,
+           size_t      at)
+{
+  size_t k;
+
+  if (at + 1 >= len)
+    return ERROR_NETWORK;
+
+  switch (js[at+1]) {
+  case '"': case '/': case '\\': case 'b':
+  case 'f': case 'r': case 'n':  case 't':
+    return 0;
+  case 'u':
+    for (k = at + 2; k < at + 6; k++) {
+      if (k >= len || !js[k] || !strchr("0123456789abcdefABCDEF", js[k]))
+        return ERROR_NETWORK;
+    }
+    return 0;
+  }
+
+  return ERROR_NETWORK;
+}
+
+static int
+scanjson(const char *js,
+         size_t      len,
+         int         kind,
+         jsmntok_t **tokensP,
+         int        *num_tokensP)
+{
+  struct Scan      sc;
+  struct ScanBlock b;
+  uint64_t  events;
+  uint64_t  bit;
+  size_t    pos;
+  int       string_start = -1;
+  int       prim = -1;
+  int       at;
+  int       i;
+  int       error = 0;
+
+  sc.tokens     = NULL;
+  sc.num_tokens = 0;
+  sc.max_tokens = len/8 + 16;
+  sc.stack      = NULL;
+  sc.depth      = 0;
+  sc.max_depth  = 16;
+  sc.super      = -1;
+  MALLOC(sc.tokens, sc.max_tokens);
+  MALLOC(sc.stack, sc.max_depth);
+
+  memset(&b, 0, sizeof(b));
+  for (pos = 0; pos < len; pos += 64) {
+    scanblock(js, len, pos, kind, &b);
+
+    events = b.structural | b.quote | b.starts | b.ends;
+    for (; events; events &= events - 1) {
+      i   = __builtin_ctzll(events);
+      bit = (uint64_t) 1 << i;
+      at  = pos + i;
+      if (b.ends & bit) {
+        sc.tokens[prim].end = at;
+        prim = -1;
+      }
+      if (b.starts & bit) {
+        error = scantoken(&sc, JSMN_PRIMITIVE, at, -1);
+        prim  = sc.num_tokens - 1;
+      } else if (b.quote & bit) {
+        if (b.string & bit)
+          string_start = at + 1;
+        else
+          error = scantoken(&sc, JSMN_STRING, string_start, at);
+      } else if (b.structural & bit) {
+        error = scanstructural(&sc, js[at], at);
+      }
+      if (error) goto QUIT;
+    }
+
+    for (events = b.escapes; events; events &= events - 1) {
+      error = scanescape(js, len, pos + __builtin_ctzll(events));
+      if (error) goto QUIT;
+    }
+  }
+
+  if (prim != -1)
+    sc.tokens[prim].end = len;
+
+  if (b.carry_string || sc.depth != 0) {
+    error = ERROR_NETWORK;
+    goto QUIT;
+  }
+
+  *tokensP     = sc.tokens;
+  *num_tokensP = sc.num_tokens;
+  sc.tokens = NULL;
+
+QUIT:
+  FREE(sc.tokens);
+  FREE(sc.stack);
+
+  return error;
+}
+#endif
+
+/* Offsets of the objects of a top level array, which bound the runs
+   that are decoded in parallel.  A response that is not an array is
+   ERROR_INVALID_ARGUMENT. */
+
+struct Split {
+  int  depth;
+  int *starts;
+  int *ends;
+  int  num_objects;
+  int  max_objects;
+};
+
+static int
+splitstructural(struct Split *sp,
+                char          c,
+                int           at)
+{
+  int *more;
+  int  error = 0;
+
+  switch (c) {
+  case '{': case '[':
+    if (sp->depth == 1 && c == '{') {
+      if (sp->num_objects == sp->max_objects) {
+        sp->max_objects *= 2;
+        more = (int *) realloc(sp->starts, sp->max_objects*sizeof(int));
+        if (more == NULL) {
+          error = ERROR_OUT_OF_MEMORY;
+          break;
+        }
+        sp->starts = more;
+        more = (int *) realloc(sp->ends, sp->max_objects*sizeof(int));
+        if (more == NULL) {
+          error = ERROR_OUT_OF_MEMORY;
+          break;
+        }
+        sp->ends = more;
+      }
+      sp->starts[sp->num_objects++] = at;
+    }
+    sp->depth++;
+    break;
+  case '}': case ']':
+    if (--sp->depth < 0) {
+      error = ERROR_NETWORK;
+      break;
+    }
+    if (sp->depth == 1 && c == '}')
+      sp->ends[sp->num_objects-1] = at + 1;
+    break;
+  }
+
+  return error;
+}
+
+static int
+splitobjects(const char *js,
+             size_t      len,
+             int       **startsP,
+             int       **endsP,
+             int        *num_objectsP)
+{
+  struct Split sp;
+  size_t pos = 0;
+  int    instring = 0;
+  int    escape   = 0;
+  int    kind     = scanner;
+  int    error = 0;
+#ifdef HAVE_SSE2_SCAN
+  struct ScanBlock b;
+  uint64_t events;
+  int      i;
+#endif
+
+  sp.depth       = 0;
+  sp.starts      = NULL;
+  sp.ends        = NULL;
+  sp.num_objects = 0;
+  sp.max_objects = 1024;
+
+  while (pos < len && strchr(" \t\r\n", js[pos]))
+    pos++;
+  if (pos == len || js[pos] != '[') {
+    error = ERROR_INVALID_ARGUMENT;
+    goto QUIT;
+  }
+
+  MALLOC(sp.starts, sp.max_objects);
+  MALLOC(sp.ends, sp.max_objects);
+
+  if (kind == IC_SCAN_AUTO)
+    kind = bestscanner();
+
+#ifdef HAVE_SSE2_SCAN
+  if (kind != IC_SCAN_SCALAR) {
+    memset(&b, 0, sizeof(b));
+    for (pos = 0; pos < len; pos += 64) {
+      scanblock(js, len, pos, kind, &b);
+      for (events = b.structural; events; events &= events - 1) {
+        i = __builtin_ctzll(events);
+        error = splitstructural(&sp, js[pos + i], pos + i);
+        if (error) goto QUIT;
+      }
+    }
+    instring = b.carry_string != 0;
+  } else
+#endif
+  {
+    for (pos = 0; pos < len; pos++) {
+      if (instring) {
+        if (escape)
+          escape = 0;
+        else if (js[pos] == '\\')
+          escape = 1;
+        else if (js[pos] == '"')
+          instring = 0;
+      } else if (js[pos] == '"') {
+        instring = 1;
+      } else {
+        error = splitstructural(&sp, js[pos], pos);
+        if (error) goto QUIT;
+      }
+    }
+  }
+
+  if (instring || sp.depth != 0) {
+    error = ERROR_NETWORK;
+    goto QUIT;
+  }
+
+  *startsP      = sp.starts;
+  *endsP        = sp.ends;
+  *num_objectsP = sp.num_objects;
+  sp.starts = NULL;
+  sp.ends   = NULL;
+
+QUIT:
+  FREE(sp.starts);
+  FREE(sp.ends);
+
+  return error;
+}
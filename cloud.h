@@ -1,4 +1,7 @@
 /* Instant Cloud Client */
+#ifndef _CLOUD_H
+#define _CLOUD_H
+
 #include <stdlib.h>
 
 #define NUM_CLOUD_LICENSE_TYPE 3
@@ -62,10 +65,27 @@ typedef struct _machine
   char user_password[MAX_ID_LEN+1];
 } ICmachine;
 
+/* Field masks selecting which ICmachine members are decoded */
+#define IC_FIELD_MACHINE_ID    (1 << 0)
+#define IC_FIELD_STATE         (1 << 1)
+#define IC_FIELD_DNS_NAME      (1 << 2)
+#define IC_FIELD_CREATE_TIME   (1 << 3)
+#define IC_FIELD_MACHINE_TYPE  (1 << 4)
+#define IC_FIELD_REGION        (1 << 5)
+#define IC_FIELD_LICENSE_TYPE  (1 << 6)
+#define IC_FIELD_IDLE_SHUTDOWN (1 << 7)
+#define IC_FIELD_LICENSE_ID    (1 << 8)
+#define IC_FIELD_USER_PASSWORD (1 << 9)
+#define IC_FIELD_ALL           ((1 << 10) - 1)
+
 typedef struct _machineinfo {
   ICmachine   *machines;
   char       **machine_ids;
   int          num_machines;
+  int          refcount;     /* holders of a shared result */
+  unsigned int fields;       /* decoded fields, the others are empty */
+  int         *index;        /* slots by machine_id, then by DNS name */
+  int          index_mask;   /* slots per table, less one */
 } ICmachineinfo;
 
 typedef struct _ICcloudlicense
@@ -76,16 +96,316 @@ typedef struct _ICcloudlicense
   char   rate_plan[MAX_RATE_LEN+1];
 } ICcloudlicense;
 
+/* One slice of a launch plan.  A negative license_id selects the
+   default license; status is set to the outcome of the slice. */
+typedef struct _launchslice
+{
+  char *region;
+  char *machine_type;
+  char *license_type;
+  int   license_id;
+  int   count;
+  int   status;
+} IClaunchslice;
+
+/* Columnar view of a machine list.  Enumerated columns hold the index
+   of the value in the corresponding list above (see ICcode), string
+   columns point into the ICmachineinfo the fleet was built from. */
+#define IC_COLUMN_STATE        0
+#define IC_COLUMN_REGION       1
+#define IC_COLUMN_MACHINE_TYPE 2
+#define IC_COLUMN_LICENSE_TYPE 3
+
+#define IC_UNKNOWN_CODE 31
+
+typedef struct _fleet
+{
+  int             num_machines;
+  unsigned char  *state;
+  unsigned char  *region;
+  unsigned char  *machine_type;
+  unsigned char  *license_type;
+  int            *license_id;
+  int            *idle_shutdown;
+  const char    **dns_name;
+  const char    **machine_id;
+  const char    **create_time;
+  const char    **user_password;
+} ICfleet;
+
+/* Machine records that point into the response they were decoded
+   from instead of copying it.  Each view holds the raw bytes of the
+   JSON value: strings are not unescaped or validated, numbers are
+   converted on access with ICviewint.  A field missing from the
+   response has a NULL ptr. */
+typedef struct _strview
+{
+  const char *ptr;
+  int         len;
+} ICstrview;
+
+typedef struct _machineview
+{
+  ICstrview machine_id;
+  ICstrview state;
+  ICstrview dns_name;
+  ICstrview create_time;
+  ICstrview machine_type;
+  ICstrview region;
+  ICstrview license_type;
+  ICstrview idle_shutdown;
+  ICstrview license_id;
+  ICstrview user_password;
+} ICmachineview;
+
+typedef struct _machineviews
+{
+  char          *response;    /* retained response, owned by the views */
+  ICmachineview *machines;
+  int            num_machines;
+} ICmachineviews;
+
+/* JSON scanners for ICsetscanner.  IC_SCAN_AUTO picks the widest one
+   the CPU supports in an optimized build and the scalar one otherwise,
+   IC_SCAN_SCALAR is the byte at a time parser. */
+#define IC_SCAN_AUTO   0
+#define IC_SCAN_SCALAR 1
+#define IC_SCAN_SSE2   2
+#define IC_SCAN_AVX2   3
+
+/* HTTP versions for ICsethttpversion.  IC_HTTP_2 negotiates HTTP/2 over
+   TLS and falls back to HTTP/1.1; prior knowledge also speaks HTTP/2 on
+   plain http:// URLs (h2c). */
+#define IC_HTTP_1_1                0
+#define IC_HTTP_2                  1
+#define IC_HTTP_2_PRIOR_KNOWLEDGE  2
+
+typedef struct _transferstats
+{
+  long   requests;      /* completed requests */
+  long   connects;      /* new connections opened for them */
+  long   wire_bytes;    /* response bodies as received */
+  long   body_bytes;    /* response bodies after content decoding */
+  long   header_bytes;  /* response headers */
+  double seconds;       /* total time of the requests */
+} ICtransferstats;
+
+#define IC_PRIORITY_KILL   0    /* request lanes, served in this order */
+#define IC_PRIORITY_LAUNCH 1
+#define IC_PRIORITY_LIST   2
+#define IC_NUM_PRIORITIES  3
+
+typedef struct _limiterstats
+{
+  long   admitted;       /* requests started */
+  long   queued;         /* requests that waited for a slot or a token */
+  double queue_ms;       /* total time they waited */
+  long   congested;      /* answers that signalled overload */
+  long   decreases;      /* cuts of the concurrency limit */
+  int    limit;          /* concurrency limit, 0 when not adaptive */
+  int    in_flight;
+  int    max_in_flight;
+  double latency_ms;     /* smoothed time to first byte */
+  double baseline_ms;    /* lowest recent time to first byte */
+  long   preempted;      /* listings aborted and sent again */
+  long   lane_admitted[IC_NUM_PRIORITIES];
+  double lane_queue_ms[IC_NUM_PRIORITIES];
+} IClimiterstats;
+
+typedef struct _hedgestats
+{
+  long requests;    /* hedgeable requests */
+  long hedges;      /* second requests sent */
+  long hedge_wins;  /* second requests that answered first */
+  long throttled;   /* second requests suppressed by the load cap */
+} IChedgestats;
+
+/* Transports carry one request at a time.  With none set, requests go
+   through the built-in pool of libcurl connections, with its
+   concurrency, priorities and hedging.  ICcurltransport is that pool,
+   for wrapping in a recorder: installed alone or inside recorders, the
+   requests keep the pool's concurrency and hedging and each answer is
+   passed to the recorders. */
+typedef struct _request
+{
+  const char *method;      /* "GET" or "POST" */
+  const char *url;
+  const char *endpoint;    /* last path component, e.g. "machines" */
+  const char *body;        /* POST body, NULL for a GET */
+  const char *date;        /* X-Gurobi-Date */
+  const char *signature;   /* X-Gurobi-Signature */
+} ICrequest;
+
+typedef struct _response
+{
+  long  status;            /* HTTP status, 0 when none was received */
+  char *body;              /* malloc'ed, owned by the caller */
+} ICresponse;
+
+typedef struct _transport ICtransport;
+struct _transport
+{
+  int  (*send)(ICtransport *transport, const ICrequest *request,
+               ICresponse *response);
+  void (*free)(ICtransport *transport);
+  void  *data;
+  /* Recorders only: requests go through inner, and each answered one
+     is passed to record */
+  ICtransport *inner;
+  void (*record)(ICtransport *transport, const ICrequest *request,
+                 const ICresponse *response);
+};
+
+/* Operations started with ICstart* call done once, from the pool's
+   thread, and are then completed with ICfinish* or ICfreeasync.
+   ICfreeasync may also release one still in flight: it is cancelled and
+   done is not called. */
+typedef struct _async ICasync;
+typedef void (*ICasynccallback)(ICasync *op, void *arg);
+
+/* Deadlines and cancellation.  The deadline, on the clock of ICnowms,
+   and the token set by a thread apply to the calls it makes after, and
+   to the operations it starts, from the connection to the last retry.
+   Such calls fail with ERROR_TIMEOUT once the deadline has passed and
+   with ERROR_CANCELLED once the token is cancelled, from any thread.
+   A token must outlive the calls and operations that use it. */
+typedef struct _canceltoken ICcanceltoken;
+
+/* Fleet snapshot in POSIX shared memory, written by one publisher and
+   copied by any number of local readers without locks */
+typedef struct _snapshot ICsnapshot;
+
+/* Fleet history: a file of the changes between successive listings,
+   appended by one recorder and streamed by any number of readers */
+typedef struct _history IChistory;
+
+#define IC_HISTORY_GONE 30   /* state of a machine no longer listed */
+
+/* A change of a machine in a history.  machine numbers the machines of
+   the history from 0 in order of appearance and is -1 for the mark of
+   a listing.  The other members are codes, see ICcode. */
+typedef struct _transition
+{
+  long long   time_ms;       /* since the epoch */
+  int         machine;
+  const char *machine_id;
+  int         state;
+  int         region;
+  int         machine_type;
+  int         license_type;
+} ICtransition;
+
+/* Return non-zero to stop reading */
+typedef int (*IChistorycallback)(const ICtransition *transition, void *arg);
+
+/* Trace file formats of ICstarttrace */
+#define IC_TRACE_CHROME 0    /* Chrome trace events, for Perfetto */
+#define IC_TRACE_OTLP   1    /* OpenTelemetry OTLP/JSON */
+
 int ICcloudcreds(char *accessid, char *secretkey);
 int IClaunchmachines(int n, char *license_type, int *license_idP,
                      char *machine_password, char *region,
                      char *machine_typeP, int *idleshutdownP,
                      char *gurobi_version,
                      ICmachineinfo **machine_infoP);
+int IClaunchplan(int num_slices, IClaunchslice *slices,
+                 char *machine_password, int *idleshutdownP,
+                 char *gurobi_version, int max_retries,
+                 ICmachineinfo **machine_infoP);
 int ICkillmachines(int n, char **machine_ids, ICmachineinfo **machine_infoP);
 int ICgetmachines(ICmachineinfo **machine_infoP);
+int ICgetmachinefields(unsigned int fields, ICmachineinfo **machine_infoP);
+int ICdecodemachines(const char *response, unsigned int fields,
+                     ICmachineinfo **machine_infoP);
 int ICgetlicenses(int *num_licensesP, ICcloudlicense *licenses);
+int ICgetlicenselist(int *num_licensesP, ICcloudlicense **licensesP);
+int ICfreelicenses(ICcloudlicense **licensesP);
 int ICfreemachineinfo(ICmachineinfo **machine_infoP);
+/* Indexing a shared single-flight result is safe: its holders may all
+   index it at once, and one index is kept */
+int ICindexmachines(ICmachineinfo *machine_info);
+int ICfindmachine(const ICmachineinfo *machine_info, const char *machine_id);
+int ICfinddns(const ICmachineinfo *machine_info, const char *dns_name);
+
+int ICsetscanner(int kind);
+int ICsetparsethreads(int num_threads);
+int ICsetsingleflight(int enable);
+int ICsetindexing(int enable);
+int ICsetcompression(int enable);
+int ICsethttpversion(int version);
+int ICsetsessioncache(const char *path);
+int ICgettransferstats(ICtransferstats *stats);
+int ICsetconcurrency(int enable, int initial_limit, int max_limit);
+int ICsetratelimit(double per_second, int burst);
+int ICsetpriorities(int reserved, int preempt);
+int ICgetlimiterstats(IClimiterstats *stats);
+int ICsethedging(int enable, double percentile, int min_delay_ms,
+                 double max_extra);
+int ICgethedgestats(IChedgestats *stats);
+int ICsettransport(ICtransport *transport);
+int ICcurltransport(ICtransport **transportP);
+int ICmemorytransport(ICtransport **transportP);
+int ICmemoryrespond(ICtransport *transport, const char *method,
+                    const char *endpoint, long status, const char *body);
+int ICrecordtransport(ICtransport *inner, const char *path,
+                      ICtransport **transportP);
+int ICreplaytransport(const char *path, ICtransport **transportP);
+int ICfreetransport(ICtransport **transportP);
+int ICstartgetmachines(unsigned int fields, ICasynccallback done, void *arg,
+                       ICasync **opP);
+int ICstartgetlicenses(ICasynccallback done, void *arg, ICasync **opP);
+int ICstartlaunch(int n, char *license_type, int *license_idP,
+                  char *machine_password, char *region, char *machine_type,
+                  int *idleshutdownP, char *gurobi_version,
+                  ICasynccallback done, void *arg, ICasync **opP);
+int ICstartkill(int n, char **machine_ids, ICasynccallback done, void *arg,
+                ICasync **opP);
+int ICstartdelay(int ms, ICasynccallback done, void *arg, ICasync **opP);
+int ICfinishdelay(ICasync **opP);
+int ICfinishmachines(ICasync **opP, ICmachineinfo **machine_infoP);
+int ICfinishlicenses(ICasync **opP, int *num_licensesP,
+                     ICcloudlicense **licensesP);
+int ICfreeasync(ICasync **opP);
+long long ICnowms(void);
+int ICsetdeadline(long long deadline_ms);
+long long ICgetdeadline(void);
+int ICcreatecanceltoken(ICcanceltoken **tokenP);
+int ICcancel(ICcanceltoken *token);
+int ICiscancelled(const ICcanceltoken *token);
+int ICfreecanceltoken(ICcanceltoken **tokenP);
+int ICsetcanceltoken(ICcanceltoken *token);
+ICcanceltoken *ICgetcanceltoken(void);
+int ICsleep(int ms);
+int ICcreatesnapshot(const char *name, ICsnapshot **snapP);
+int ICpublishsnapshot(ICsnapshot *snap, const ICmachineinfo *machine_info);
+int ICopensnapshot(const char *name, ICsnapshot **snapP);
+int ICreadsnapshot(ICsnapshot *snap, int max_machines, ICmachine *machines,
+                   int *num_machinesP, unsigned int *fieldsP,
+                   long long *published_msP);
+int ICsnapshotmachines(ICsnapshot *snap, ICmachineinfo **machine_infoP,
+                       long long *published_msP);
+int ICfreesnapshot(ICsnapshot **snapP);
+int ICopenhistory(const char *path, IChistory **historyP);
+int ICrecordhistory(IChistory *history, const ICmachineinfo *machine_info);
+int ICflushhistory(IChistory *history);
+int ICclosehistory(IChistory **historyP);
+int ICreadhistory(const char *path, IChistorycallback done, void *arg);
+int IChistorymachines(const char *path, long long at_ms,
+                      ICmachineinfo **machine_infoP, long long *listed_msP);
+int ICstarttrace(const char *path, int format);
+int ICstoptrace(void);
+
+int ICcode(int column, const char *value);
+int ICnumcodes(int column);
+const char *ICcodename(int column, int code);
+int ICbuildfleet(const ICmachineinfo *machine_info, ICfleet **fleetP);
+int ICfreefleet(ICfleet **fleetP);
+
+int ICgetmachineviews(ICmachineviews **viewsP);
+int ICfreemachineviews(ICmachineviews **viewsP);
+int ICviewint(ICstrview view);
+int ICviewcode(int column, ICstrview view);
+int ICviewequal(ICstrview view, const char *value);
 
 
 
@@ -93,6 +413,8 @@ int ICfreemachineinfo(ICmachineinfo **machine_infoP);
 #define ERROR_INVALID_ARGUMENT 2000
 #define ERROR_NETWORK          3000
 #define ERROR_OUT_OF_MEMORY    4000
+#define ERROR_TIMEOUT          5000
+#define ERROR_CANCELLED        6000
 
 
 #define MALLOC(ptr, count) do {                        \
@@ -126,3 +448,5 @@ int ICfreemachineinfo(ICmachineinfo **machine_infoP);
       ptr = NULL;                                       \
     }                                                   \
   } while(0)
+
+#endif
@@ -0,0 +1,543 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "format.h"
+
+static const char *format_names[] = { "text", "json", "jsonl", "csv", "tsv" };
+
+#define NUM_FORMATS (int) (sizeof(format_names)/sizeof(format_names[0]))
+
+static const char *field_names[NUM_FIELDS] =
+  { "machine_id", "state", "dns_name", "create_time", "machine_type",
+    "region", "license_type", "idle_shutdown", "license_id",
+    "user_password" };
+
+/* Short names accepted for some fields */
+static const struct {
+  const char *alias;
+  int         field;
+} field_aliases[] =
+  { { "id",      FIELD_MACHINE_ID },
+    { "dns",     FIELD_DNS_NAME },
+    { "type",    FIELD_MACHINE_TYPE },
+    { "license", FIELD_LICENSE_TYPE },
+    { "idle",    FIELD_IDLE_SHUTDOWN } };
+
+static const char machine_header[] =
+  "machine_id,state,dns_name,create_time,machine_type,region,"
+  "license_type,idle_shutdown,license_id,user_password";
+
+static const char license_header[] =
+  "license_id,credit,rate_plan,expiration";
+
+int
+fmt_parse(const char *name)
+{
+  int i;
+
+  for (i = 0; i < NUM_FORMATS; i++) {
+    if (strcmp(format_names[i], name) == 0)
+      return i;
+  }
+  return -1;
+}
+
+int
+fmt_field_parse(const char *name)
+{
+  int i;
+
+  for (i = 0; i < NUM_FIELDS; i++) {
+    if (strcmp(field_names[i], name) == 0)
+      return i;
+  }
+  for (i = 0; i < (int) (sizeof(field_aliases)/sizeof(field_aliases[0])); i++) {
+    if (strcmp(field_aliases[i].alias, name) == 0)
+      return field_aliases[i].field;
+  }
+  return -1;
+}
+
+const char *
+fmt_field_name(int field)
+{
+  return field >= 0 && field < NUM_FIELDS ? field_names[field] : "";
+}
+
+int
+fmt_init(ICformatter *f,
+         int          fd,
+         int          format)
+{
+  int error = 0;
+
+  memset(f, 0, sizeof(*f));
+  f->fd     = fd;
+  f->format = format;
+  f->cap    = FORMAT_BUFFER_LEN;
+  MALLOC(f->buf, f->cap);
+
+QUIT:
+  return error;
+}
+
+void
+fmt_free(ICformatter *f)
+{
+  fmt_flush(f);
+  FREE(f->buf);
+}
+
+/* A failed write, to a full disk or a closed pipe, is kept in f->error
+   as ERROR_INVALID_ARGUMENT, as the library reports failed writes to
+   its other files, and the buffer is dropped */
+int
+fmt_flush(ICformatter *f)
+{
+  size_t  done = 0;
+  ssize_t ret;
+
+  /* Anything already sitting in stdio must go out first */
+  fflush(stdout);
+
+  while (done < f->len) {
+    ret = write(f->fd, &f->buf[done], f->len - done);
+    if (ret < 0) {
+      if (errno == EINTR) continue;
+      f->error = ERROR_INVALID_ARGUMENT;
+      break;
+    }
+    done += ret;
+  }
+  f->len = 0;
+
+  return f->error;
+}
+
+/* Make room for len more bytes, flushing the buffer if needed */
+static char *
+fmt_reserve(ICformatter *f,
+            size_t       len)
+{
+  char *buf;
+
+  if (f->len + len > f->cap) {
+    fmt_flush(f);
+    if (len > f->cap) {
+      buf = realloc(f->buf, len);
+      if (buf == NULL) {
+        f->error = ERROR_OUT_OF_MEMORY;
+        return NULL;
+      }
+      f->buf = buf;
+      f->cap = len;
+    }
+  }
+  return &f->buf[f->len];
+}
+
+void
+fmt_puts(ICformatter *f,
+         const char  *s,
+         size_t       len)
+{
+  char *p = fmt_reserve(f, len);
+
+  if (p == NULL) return;
+  memcpy(p, s, len);
+  f->len += len;
+}
+
+#define fmt_lit(f, s) fmt_puts((f), (s), sizeof(s) - 1)
+
+static void
+fmt_char(ICformatter *f,
+         char         c)
+{
+  char *p = fmt_reserve(f, 1);
+
+  if (p == NULL) return;
+  *p = c;
+  f->len++;
+}
+
+void
+fmt_int(ICformatter *f,
+        long         value)
+{
+  char  digits[24];
+  char *p = &digits[sizeof(digits)];
+  unsigned long v = value < 0 ? -(unsigned long) value : (unsigned long) value;
+
+  do {
+    *--p = '0' + (v % 10);
+    v /= 10;
+  } while (v);
+  if (value < 0)
+    *--p = '-';
+
+  fmt_puts(f, p, &digits[sizeof(digits)] - p);
+}
+
+static void
+fmt_double(ICformatter *f,
+           double       value,
+           int          width)
+{
+  char *p = fmt_reserve(f, 64);
+  int   len;
+
+  if (p == NULL) return;
+  len = snprintf(p, 64, "%*.2f", width, value);
+  if (len > 0)
+    f->len += len < 64 ? len : 63;
+}
+
+static const char hex_digits[] = "0123456789abcdef";
+
+/* Write a string as a value of the current format.  JSON strings are
+   quoted and escaped, CSV fields are quoted when they need to be and
+   TSV fields have tabs and newlines replaced by spaces. */
+static void
+fmt_str(ICformatter *f,
+        const char  *s)
+{
+  size_t len = strlen(s);
+  size_t i;
+  char  *p;
+  char   c;
+
+  if (f->format == FORMAT_JSON || f->format == FORMAT_JSONL) {
+    p = fmt_reserve(f, 6*len + 2);
+    if (p == NULL) return;
+    *p++ = '"';
+    for (i = 0; i < len; i++) {
+      c = s[i];
+      if (c == '"' || c == '\\') {
+        *p++ = '\\';
+        *p++ = c;
+      } else if ((unsigned char) c < 0x20) {
+        *p++ = '\\';
+        *p++ = 'u';
+        *p++ = '0';
+        *p++ = '0';
+        *p++ = hex_digits[(c >> 4) & 0xf];
+        *p++ = hex_digits[c & 0xf];
+      } else {
+        *p++ = c;
+      }
+    }
+    *p++ = '"';
+    f->len = p - f->buf;
+  } else if (f->format == FORMAT_CSV &&
+             strpbrk(s, ",\"\r\n") != NULL) {
+    p = fmt_reserve(f, 2*len + 2);
+    if (p == NULL) return;
+    *p++ = '"';
+    for (i = 0; i < len; i++) {
+      if (s[i] == '"')
+        *p++ = '"';
+      *p++ = s[i];
+    }
+    *p++ = '"';
+    f->len = p - f->buf;
+  } else if (f->format == FORMAT_TSV) {
+    p = fmt_reserve(f, len);
+    if (p == NULL) return;
+    for (i = 0; i < len; i++) {
+      c = s[i];
+      *p++ = (c == '\t' || c == '\n' || c == '\r') ? ' ' : c;
+    }
+    f->len = p - f->buf;
+  } else {
+    fmt_puts(f, s, len);
+  }
+}
+
+/* Separator before the next record of a list */
+static void
+fmt_next(ICformatter *f)
+{
+  if (f->format == FORMAT_JSON && f->count > 0)
+    fmt_char(f, ',');
+  f->count++;
+}
+
+/* Separator between the fields of a CSV or TSV row */
+static void
+fmt_sep(ICformatter *f)
+{
+  fmt_char(f, f->format == FORMAT_TSV ? '\t' : ',');
+}
+
+static void
+fmt_header(ICformatter *f,
+           const char  *header,
+           size_t       len)
+{
+  char  *p;
+  size_t i;
+
+  if (f->format == FORMAT_JSON) {
+    fmt_char(f, '[');
+  } else if (f->format == FORMAT_CSV) {
+    fmt_puts(f, header, len);
+    fmt_char(f, '\n');
+  } else if (f->format == FORMAT_TSV) {
+    p = fmt_reserve(f, len + 1);
+    if (p == NULL) return;
+    for (i = 0; i < len; i++)
+      p[i] = header[i] == ',' ? '\t' : header[i];
+    p[len] = '\n';
+    f->len += len + 1;
+  }
+  f->count = 0;
+}
+
+static void
+fmt_footer(ICformatter *f)
+{
+  if (f->format == FORMAT_JSON)
+    fmt_lit(f, "]\n");
+  fmt_flush(f);
+}
+
+void
+fmt_begin_machines(ICformatter *f)
+{
+  TRACE_BEGIN(f->span);
+  fmt_header(f, machine_header, sizeof(machine_header) - 1);
+}
+
+void
+fmt_machine(ICformatter     *f,
+            const ICmachine *m)
+{
+  fmt_next(f);
+
+  switch (f->format) {
+  case FORMAT_TEXT:
+    fmt_lit(f, "Machine name: ");
+    fmt_str(f, m->dns_name);
+    fmt_lit(f, "\n\tlicense type: ");
+    fmt_str(f, m->license_type);
+    fmt_lit(f, "\n\tstate: ");
+    fmt_str(f, m->state);
+    fmt_lit(f, "\n\tmachine type: ");
+    fmt_str(f, m->machine_type);
+    fmt_lit(f, "\n\tregion: ");
+    fmt_str(f, m->region);
+    fmt_lit(f, "\n\tidle shutdown: ");
+    fmt_int(f, m->idle_shutdown);
+    fmt_lit(f, "\n\tuser password: ");
+    fmt_str(f, m->user_password);
+    fmt_lit(f, "\n\tcreate time: ");
+    fmt_str(f, m->create_time);
+    fmt_lit(f, "\n\tlicense id: ");
+    fmt_int(f, m->license_id);
+    fmt_lit(f, "\n\tmachine id: ");
+    fmt_str(f, m->machine_id);
+    fmt_char(f, '\n');
+    break;
+  case FORMAT_JSON:
+  case FORMAT_JSONL:
+    fmt_lit(f, "{\"machine_id\":");
+    fmt_str(f, m->machine_id);
+    fmt_lit(f, ",\"state\":");
+    fmt_str(f, m->state);
+    fmt_lit(f, ",\"dns_name\":");
+    fmt_str(f, m->dns_name);
+    fmt_lit(f, ",\"create_time\":");
+    fmt_str(f, m->create_time);
+    fmt_lit(f, ",\"machine_type\":");
+    fmt_str(f, m->machine_type);
+    fmt_lit(f, ",\"region\":");
+    fmt_str(f, m->region);
+    fmt_lit(f, ",\"license_type\":");
+    fmt_str(f, m->license_type);
+    fmt_lit(f, ",\"idle_shutdown\":");
+    fmt_int(f, m->idle_shutdown);
+    fmt_lit(f, ",\"license_id\":");
+    fmt_int(f, m->license_id);
+    fmt_lit(f, ",\"user_password\":");
+    fmt_str(f, m->user_password);
+    fmt_char(f, '}');
+    if (f->format == FORMAT_JSONL)
+      fmt_char(f, '\n');
+    break;
+  default:
+    fmt_str(f, m->machine_id);
+    fmt_sep(f);
+    fmt_str(f, m->state);
+    fmt_sep(f);
+    fmt_str(f, m->dns_name);
+    fmt_sep(f);
+    fmt_str(f, m->create_time);
+    fmt_sep(f);
+    fmt_str(f, m->machine_type);
+    fmt_sep(f);
+    fmt_str(f, m->region);
+    fmt_sep(f);
+    fmt_str(f, m->license_type);
+    fmt_sep(f);
+    fmt_int(f, m->idle_shutdown);
+    fmt_sep(f);
+    fmt_int(f, m->license_id);
+    fmt_sep(f);
+    fmt_str(f, m->user_password);
+    fmt_char(f, '\n');
+    break;
+  }
+}
+
+void
+fmt_end_machines(ICformatter *f)
+{
+  fmt_footer(f);
+  TRACE_END(f->span, "format", "machines");
+}
+
+void
+fmt_begin_licenses(ICformatter *f)
+{
+  TRACE_BEGIN(f->span);
+  if (f->format == FORMAT_TEXT) {
+    fmt_lit(f, "License Id   Credit  Rate      Expiration\n");
+    f->count = 0;
+  } else {
+    fmt_header(f, license_header, sizeof(license_header) - 1);
+  }
+}
+
+void
+fmt_license(ICformatter          *f,
+            const ICcloudlicense *l)
+{
+  fmt_next(f);
+
+  switch (f->format) {
+  case FORMAT_TEXT:
+    fmt_int(f, l->license_id);
+    fmt_lit(f, "      ");
+    fmt_double(f, l->credit, 8);
+    fmt_lit(f, "  ");
+    fmt_str(f, l->rate_plan);
+    fmt_lit(f, "  ");
+    fmt_str(f, l->expiration);
+    fmt_char(f, '\n');
+    break;
+  case FORMAT_JSON:
+  case FORMAT_JSONL:
+    fmt_lit(f, "{\"license_id\":");
+    fmt_int(f, l->license_id);
+    fmt_lit(f, ",\"credit\":");
+    fmt_double(f, l->credit, 0);
+    fmt_lit(f, ",\"rate_plan\":");
+    fmt_str(f, l->rate_plan);
+    fmt_lit(f, ",\"expiration\":");
+    fmt_str(f, l->expiration);
+    fmt_char(f, '}');
+    if (f->format == FORMAT_JSONL)
+      fmt_char(f, '\n');
+    break;
+  default:
+    fmt_int(f, l->license_id);
+    fmt_sep(f);
+    fmt_double(f, l->credit, 0);
+    fmt_sep(f);
+    fmt_str(f, l->rate_plan);
+    fmt_sep(f);
+    fmt_str(f, l->expiration);
+    fmt_char(f, '\n');
+    break;
+  }
+}
+
+void
+fmt_end_licenses(ICformatter *f)
+{
+  fmt_footer(f);
+  TRACE_END(f->span, "format", "licenses");
+}
+
+/* Generic tables: a header naming the columns, then one record per row.
+   In text format records are printed as tab separated values. */
+void
+fmt_begin_table(ICformatter *f,
+                const char **names,
+                int          num_names)
+{
+  int i;
+
+  TRACE_BEGIN(f->span);
+  if (f->format == FORMAT_CSV || f->format == FORMAT_TSV) {
+    for (i = 0; i < num_names; i++) {
+      if (i > 0)
+        fmt_sep(f);
+      fmt_str(f, names[i]);
+    }
+    fmt_char(f, '\n');
+  } else if (f->format == FORMAT_JSON) {
+    fmt_char(f, '[');
+  }
+  f->count = 0;
+}
+
+void
+fmt_begin_record(ICformatter *f)
+{
+  fmt_next(f);
+  if (f->format == FORMAT_JSON || f->format == FORMAT_JSONL)
+    fmt_char(f, '{');
+  f->column = 0;
+}
+
+static void
+fmt_key(ICformatter *f,
+        const char  *name)
+{
+  if (f->format == FORMAT_JSON || f->format == FORMAT_JSONL) {
+    if (f->column > 0)
+      fmt_char(f, ',');
+    fmt_str(f, name);
+    fmt_char(f, ':');
+  } else if (f->column > 0) {
+    fmt_char(f, f->format == FORMAT_CSV ? ',' : '\t');
+  }
+  f->column++;
+}
+
+void
+fmt_key_str(ICformatter *f,
+            const char  *name,
+            const char  *value)
+{
+  fmt_key(f, name);
+  fmt_str(f, value);
+}
+
+void
+fmt_key_int(ICformatter *f,
+            const char  *name,
+            long         value)
+{
+  fmt_key(f, name);
+  fmt_int(f, value);
+}
+
+void
+fmt_end_record(ICformatter *f)
+{
+  if (f->format == FORMAT_JSON || f->format == FORMAT_JSONL)
+    fmt_char(f, '}');
+  if (f->format != FORMAT_JSON)
+    fmt_char(f, '\n');
+}
+
+void
+fmt_end_table(ICformatter *f)
+{
+  fmt_footer(f);
+  TRACE_END(f->span, "format", "table");
+}
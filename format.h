@@ -0,0 +1,70 @@
+/* Buffered output formatter for the instantcloud command */
+#ifndef _FORMAT_H
+#define _FORMAT_H
+
+#include <stddef.h>
+#include "cloud.h"
+#include "trace.h"
+
+#define FORMAT_TEXT  0
+#define FORMAT_JSON  1
+#define FORMAT_JSONL 2
+#define FORMAT_CSV   3
+#define FORMAT_TSV   4
+
+#define FORMAT_BUFFER_LEN (1 << 16)
+
+/* Machine fields, in the order of the full listing; field f is
+   selected by the bit 1 << f of an IC_FIELD_ mask */
+#define FIELD_MACHINE_ID    0
+#define FIELD_STATE         1
+#define FIELD_DNS_NAME      2
+#define FIELD_CREATE_TIME   3
+#define FIELD_MACHINE_TYPE  4
+#define FIELD_REGION        5
+#define FIELD_LICENSE_TYPE  6
+#define FIELD_IDLE_SHUTDOWN 7
+#define FIELD_LICENSE_ID    8
+#define FIELD_USER_PASSWORD 9
+#define NUM_FIELDS          10
+
+typedef struct _formatter
+{
+  int    fd;
+  int    format;
+  int    count;
+  int    column;
+  int    error;
+  size_t len;
+  size_t cap;
+  char  *buf;
+  ICspan span;       /* from the begin to the end of a listing */
+} ICformatter;
+
+int  fmt_parse(const char *name);
+int  fmt_init(ICformatter *f, int fd, int format);
+void fmt_free(ICformatter *f);
+int  fmt_flush(ICformatter *f);
+
+void fmt_begin_machines(ICformatter *f);
+void fmt_machine(ICformatter *f, const ICmachine *machine);
+void fmt_end_machines(ICformatter *f);
+
+void fmt_begin_licenses(ICformatter *f);
+void fmt_license(ICformatter *f, const ICcloudlicense *license);
+void fmt_end_licenses(ICformatter *f);
+
+int  fmt_field_parse(const char *name);
+const char *fmt_field_name(int field);
+
+void fmt_begin_table(ICformatter *f, const char **names, int num_names);
+void fmt_begin_record(ICformatter *f);
+void fmt_key_str(ICformatter *f, const char *name, const char *value);
+void fmt_key_int(ICformatter *f, const char *name, long value);
+void fmt_end_record(ICformatter *f);
+void fmt_end_table(ICformatter *f);
+
+void fmt_puts(ICformatter *f, const char *s, size_t len);
+void fmt_int(ICformatter *f, long value);
+
+#endif
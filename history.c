@@ -0,0 +1,785 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include "cloud.h"
+
+/* Fleet history.  The recorder compares each listing with the previous
+   one and appends only the changes: a machine that appeared, changed
+   state or went away, and a mark for the listing itself.  A record is
+   the time since the previous record and a reference to the machine,
+   both as varints, then its state code.  A machine's id and its region,
+   machine type and license type codes are spelled out only the first
+   time a block refers to it, later records use its number in the block.
+
+   Records are buffered into blocks that are compressed with zlib and
+   checksummed.  Each block decodes on its own, so a block cut short by
+   a crash ends the history instead of corrupting what follows; the
+   recorder truncates it when it opens the file again. */
+
+#define HISTORY_MAGIC   0x48464349   /* "ICFH" */
+#define HISTORY_VERSION 1
+#define BLOCK_MAGIC     0x42484349   /* "ICHB" */
+#define FILE_HEADER     8
+#define BLOCK_HEADER    32           /* magic, raw and packed lengths, crc,
+                                        start time, records, unused */
+#define BLOCK_RAW       (1 << 16)    /* records buffered per block */
+#define BLOCK_MAX       (1 << 24)    /* largest block read back */
+#define RECORD_MAX      64           /* longest record */
+#define FLUSH_MS        60000        /* longest a record stays buffered */
+
+#define REF_NEW     0                /* a machine new to the block */
+#define REF_LISTING 1                /* a listing, no machine */
+#define REF_FIRST   2                /* the block's first machine */
+
+#define HISTORY_FIELDS (IC_FIELD_MACHINE_ID   | IC_FIELD_STATE  | \
+                        IC_FIELD_MACHINE_TYPE | IC_FIELD_REGION | \
+                        IC_FIELD_LICENSE_TYPE)
+
+typedef struct {
+  char          machine_id[MAX_ID_LEN+1];
+  unsigned char state;
+  unsigned char region;
+  unsigned char machine_type;
+  unsigned char license_type;
+  int           local;        /* number in the current block, or -1 */
+  int           seen;         /* the listing that last had it */
+} Entry;
+
+/* The machines of a history, found by id through open addressing */
+typedef struct {
+  Entry *entries;
+  int    num_entries;
+  int    max_entries;
+  int   *slots;               /* entry + 1, or 0 for a free slot */
+  int    mask;
+  int   *locals;              /* entry of each number in the block */
+  int    num_locals;
+  int    max_locals;
+} Table;
+
+struct _history {
+  int            fd;
+  off_t          end;         /* of the last block written */
+  Table          table;
+  unsigned char *raw;
+  size_t         raw_len;
+  int            num_records;
+  long long      start_ms;    /* of the block */
+  long long      last_ms;     /* of the last record */
+  int            listing;
+};
+
+static unsigned int
+hashid(const char *s)
+{
+  unsigned int h = 2166136261u;
+
+  for (; *s; s++)
+    h = (h ^ (unsigned char) *s)*16777619u;
+  return h;
+}
+
+static int
+findentry(const Table *t,
+          const char  *machine_id)
+{
+  unsigned int i;
+
+  if (t->slots == NULL)
+    return -1;
+  for (i = hashid(machine_id) & t->mask; t->slots[i];
+       i = (i + 1) & t->mask) {
+    if (strcmp(t->entries[t->slots[i] - 1].machine_id, machine_id) == 0)
+      return t->slots[i] - 1;
+  }
+  return -1;
+}
+
+/* A new entry for machine_id, in the state gone */
+static int
+addentry(Table      *t,
+         const char *machine_id)
+{
+  Entry *entries;
+  int   *slots;
+  int    size;
+  unsigned int j;
+  int    i;
+
+  if (t->num_entries == t->max_entries) {
+    size = t->max_entries ? 2*t->max_entries : 64;
+    entries = realloc(t->entries, sizeof(Entry)*size);
+    if (entries == NULL)
+      return -1;
+    t->entries = entries;
+    t->max_entries = size;
+  }
+
+  if (2*(t->num_entries + 1) > t->mask + 1) {
+    size = t->slots ? 2*(t->mask + 1) : 128;
+    slots = calloc(size, sizeof(int));
+    if (slots == NULL)
+      return -1;
+    for (i = 0; i < t->num_entries; i++) {
+      for (j = hashid(t->entries[i].machine_id) & (size - 1); slots[j];
+           j = (j + 1) & (size - 1))
+        ;
+      slots[j] = i + 1;
+    }
+    free(t->slots);
+    t->slots = slots;
+    t->mask  = size - 1;
+  }
+
+  i = t->num_entries++;
+  memset(&t->entries[i], 0, sizeof(Entry));
+  snprintf(t->entries[i].machine_id, MAX_ID_LEN+1, "%s", machine_id);
+  t->entries[i].state = IC_HISTORY_GONE;
+  t->entries[i].local = -1;
+
+  for (j = hashid(t->entries[i].machine_id) & t->mask; t->slots[j];
+       j = (j + 1) & t->mask)
+    ;
+  t->slots[j] = i + 1;
+  return i;
+}
+
+static int
+addlocal(Table *t,
+         int    e)
+{
+  int *locals;
+  int  size;
+
+  if (t->num_locals == t->max_locals) {
+    size = t->max_locals ? 2*t->max_locals : 256;
+    locals = realloc(t->locals, sizeof(int)*size);
+    if (locals == NULL)
+      return -1;
+    t->locals = locals;
+    t->max_locals = size;
+  }
+  t->entries[e].local = t->num_locals;
+  t->locals[t->num_locals++] = e;
+  return 0;
+}
+
+static void
+endblock(Table *t)
+{
+  int i;
+
+  for (i = 0; i < t->num_locals; i++)
+    t->entries[t->locals[i]].local = -1;
+  t->num_locals = 0;
+}
+
+static void
+freetable(Table *t)
+{
+  free(t->entries);
+  free(t->slots);
+  free(t->locals);
+  memset(t, 0, sizeof(Table));
+}
+
+static void
+put32(unsigned char *p,
+      uint32_t       v)
+{
+  p[0] = v;
+  p[1] = v >> 8;
+  p[2] = v >> 16;
+  p[3] = v >> 24;
+}
+
+static uint32_t
+get32(const unsigned char *p)
+{
+  return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+static void
+putvarint(unsigned char      *p,
+          size_t             *lenP,
+          unsigned long long  v)
+{
+  while (v >= 0x80) {
+    p[(*lenP)++] = (unsigned char) (v | 0x80);
+    v >>= 7;
+  }
+  p[(*lenP)++] = (unsigned char) v;
+}
+
+static int
+getvarint(const unsigned char *p,
+          size_t               len,
+          size_t              *posP,
+          unsigned long long  *vP)
+{
+  unsigned long long v = 0;
+  int shift;
+
+  for (shift = 0; *posP < len && shift < 64; shift += 7) {
+    v |= (unsigned long long) (p[*posP] & 0x7f) << shift;
+    if (!(p[(*posP)++] & 0x80)) {
+      *vP = v;
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static long long
+nowms(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (long long) ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+/* Decode the blocks of fp, updating the machines of t, and pass each
+   record up to until_ms (all of them if negative) to done.  Stops at
+   the first block that is cut short or damaged; endP is set past the
+   last good block, listedP to the time of the last listing. */
+static int
+scan(FILE              *fp,
+     Table             *t,
+     long long          until_ms,
+     IChistorycallback  done,
+     void              *arg,
+     off_t             *endP,
+     long long         *listedP)
+{
+  unsigned char       header[BLOCK_HEADER];
+  unsigned char      *packed = NULL;
+  unsigned char      *raw = NULL;
+  unsigned long long  v;
+  ICtransition        tr;
+  char    id[MAX_ID_LEN+1];
+  uLongf  raw_len;
+  size_t  packed_len;
+  size_t  pos;
+  size_t  len;
+  size_t  size = 0;
+  long long time_ms;
+  int  num_records;
+  int  e;
+  int  i;
+  int  error = 0;
+
+  for (;;) {
+    if (fread(header, 1, BLOCK_HEADER, fp) != BLOCK_HEADER)
+      break;
+    raw_len    = get32(&header[4]);
+    packed_len = get32(&header[8]);
+    if (get32(header) != BLOCK_MAGIC || raw_len > BLOCK_MAX ||
+        packed_len > BLOCK_MAX)
+      break;
+    time_ms = (long long) ((uint64_t) get32(&header[20]) << 32 |
+                           get32(&header[16]));
+    num_records = (int) get32(&header[24]);
+
+    if (packed_len + raw_len > size) {
+      size = packed_len + raw_len;
+      FREE(packed);
+      MALLOC(packed, size);
+    }
+    raw = packed + packed_len;
+    if (fread(packed, 1, packed_len, fp) != packed_len ||
+        crc32(0, packed, packed_len) != get32(&header[12]) ||
+        uncompress(raw, &raw_len, packed, packed_len) != Z_OK)
+      break;
+
+    pos = 0;
+    for (i = 0; i < num_records; i++) {
+      if (getvarint(raw, raw_len, &pos, &v))
+        goto DAMAGED;
+      time_ms += (long long) v;
+      if (until_ms >= 0 && time_ms > until_ms)
+        goto QUIT;
+      if (getvarint(raw, raw_len, &pos, &v))
+        goto DAMAGED;
+
+      memset(&tr, 0, sizeof(tr));
+      tr.time_ms = time_ms;
+      if (v == REF_LISTING) {
+        tr.machine = -1;
+        tr.state   = IC_HISTORY_GONE;
+        if (listedP)
+          *listedP = time_ms;
+      } else {
+        if (v == REF_NEW) {
+          if (pos >= raw_len || raw[pos] > MAX_ID_LEN ||
+              pos + 1 + raw[pos] + 4 > raw_len)
+            goto DAMAGED;
+          len = raw[pos];
+          memcpy(id, &raw[pos + 1], len);
+          id[len] = '\0';
+          pos += 1 + len;
+          e = findentry(t, id);
+          if (e < 0 && (e = addentry(t, id)) < 0) {
+            error = ERROR_OUT_OF_MEMORY;
+            goto QUIT;
+          }
+          if (addlocal(t, e)) {
+            error = ERROR_OUT_OF_MEMORY;
+            goto QUIT;
+          }
+          t->entries[e].region       = raw[pos + 1];
+          t->entries[e].machine_type = raw[pos + 2];
+          t->entries[e].license_type = raw[pos + 3];
+        } else {
+          if (v - REF_FIRST >= (unsigned long long) t->num_locals ||
+              pos >= raw_len)
+            goto DAMAGED;
+          e = t->locals[v - REF_FIRST];
+        }
+        t->entries[e].state = raw[pos];
+        pos += v == REF_NEW ? 4 : 1;
+
+        tr.machine      = e;
+        tr.machine_id   = t->entries[e].machine_id;
+        tr.state        = t->entries[e].state;
+        tr.region       = t->entries[e].region;
+        tr.machine_type = t->entries[e].machine_type;
+        tr.license_type = t->entries[e].license_type;
+      }
+      if (done && done(&tr, arg))
+        goto QUIT;
+    }
+    endblock(t);
+    if (endP)
+      *endP += BLOCK_HEADER + packed_len;
+  }
+  goto QUIT;
+
+DAMAGED:
+  /* The checksum held, so this was written wrong */
+  error = ERROR_INVALID_ARGUMENT;
+
+QUIT:
+  endblock(t);
+  FREE(packed);
+
+  return error;
+}
+
+static int
+readheader(FILE *fp)
+{
+  unsigned char header[FILE_HEADER];
+
+  if (fread(header, 1, FILE_HEADER, fp) != FILE_HEADER ||
+      get32(header) != HISTORY_MAGIC || get32(&header[4]) != HISTORY_VERSION)
+    return ERROR_INVALID_ARGUMENT;
+  return 0;
+}
+
+static int
+writeall(int                  fd,
+         const unsigned char *p,
+         size_t               len,
+         off_t                offset)
+{
+  ssize_t n;
+
+  while (len > 0) {
+    n = pwrite(fd, p, len, offset);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return ERROR_INVALID_ARGUMENT;
+    p += n;
+    len -= n;
+    offset += n;
+  }
+  return 0;
+}
+
+int
+ICopenhistory(const char  *path,
+              IChistory  **historyP)
+{
+  IChistory *h = NULL;
+  FILE      *fp = NULL;
+  unsigned char header[FILE_HEADER];
+  struct stat st;
+  int  fd;
+  int  error = 0;
+
+  if (!path || !historyP) {
+    error = ERROR_NULL_ARGUMENT;
+    goto QUIT;
+  }
+
+  CALLOC(h, 1);
+  h->fd = open(path, O_RDWR | O_CREAT, 0644);
+  if (h->fd < 0 || fstat(h->fd, &st)) {
+    error = ERROR_INVALID_ARGUMENT;
+    goto QUIT;
+  }
+
+  /* A single recorder per file */
+  if (flock(h->fd, LOCK_EX | LOCK_NB) && errno == EWOULDBLOCK) {
+    error = ERROR_INVALID_ARGUMENT;
+    goto QUIT;
+  }
+
+  MALLOC(h->raw, BLOCK_RAW + RECORD_MAX);
+
+  if (st.st_size == 0) {
+    put32(header, HISTORY_MAGIC);
+    put32(&header[4], HISTORY_VERSION);
+    error = writeall(h->fd, header, FILE_HEADER, 0);
+    if (error) goto QUIT;
+    h->end = FILE_HEADER;
+    goto QUIT;
+  }
+
+  /* Pick up the machines where the last recorder left them */
+  fd = dup(h->fd);
+  if (fd < 0 || (fp = fdopen(fd, "rb")) == NULL) {
+    if (fd >= 0)
+      close(fd);
+    error = ERROR_INVALID_ARGUMENT;
+    goto QUIT;
+  }
+  error = readheader(fp);
+  if (error) goto QUIT;
+
+  h->end = FILE_HEADER;
+  error = scan(fp, &h->table, -1, NULL, NULL, &h->end, &h->last_ms);
+  if (error) goto QUIT;
+
+  if (h->end < st.st_size && ftruncate(h->fd, h->end)) {
+    error = ERROR_INVALID_ARGUMENT;
+    goto QUIT;
+  }
+
+QUIT:
+  if (fp)
+    fclose(fp);
+  if (error)
+    ICclosehistory(&h);
+  if (historyP)
+    *historyP = h;
+
+  return error;
+}
+
+/* Append one record to the block */
+static int
+emit(IChistory *h,
+     long long  time_ms,
+     int        e)
+{
+  Entry *entry;
+  size_t len;
+
+  if (h->num_records == 0)
+    h->start_ms = h->last_ms = time_ms;
+  putvarint(h->raw, &h->raw_len, time_ms - h->last_ms);
+  h->last_ms = time_ms;
+  h->num_records++;
+
+  if (e < 0) {
+    putvarint(h->raw, &h->raw_len, REF_LISTING);
+    return 0;
+  }
+
+  entry = &h->table.entries[e];
+  if (entry->local >= 0) {
+    putvarint(h->raw, &h->raw_len, REF_FIRST + entry->local);
+    h->raw[h->raw_len++] = entry->state;
+    return 0;
+  }
+
+  if (addlocal(&h->table, e))
+    return ERROR_OUT_OF_MEMORY;
+  len = strlen(entry->machine_id);
+  putvarint(h->raw, &h->raw_len, REF_NEW);
+  h->raw[h->raw_len++] = (unsigned char) len;
+  memcpy(&h->raw[h->raw_len], entry->machine_id, len);
+  h->raw_len += len;
+  h->raw[h->raw_len++] = entry->state;
+  h->raw[h->raw_len++] = entry->region;
+  h->raw[h->raw_len++] = entry->machine_type;
+  h->raw[h->raw_len++] = entry->license_type;
+  return 0;
+}
+
+int
+ICflushhistory(IChistory *h)
+{
+  unsigned char *block = NULL;
+  uLongf packed_len;
+  int  error = 0;
+
+  if (!h) {
+    error = ERROR_NULL_ARGUMENT;
+    goto QUIT;
+  }
+  if (h->num_records == 0)
+    goto QUIT;
+
+  packed_len = compressBound(h->raw_len);
+  MALLOC(block, BLOCK_HEADER + packed_len);
+  if (compress2(block + BLOCK_HEADER, &packed_len, h->raw, h->raw_len,
+                Z_DEFAULT_COMPRESSION) != Z_OK) {
+    error = ERROR_OUT_OF_MEMORY;
+    goto QUIT;
+  }
+
+  put32(block, BLOCK_MAGIC);
+  put32(&block[4], (uint32_t) h->raw_len);
+  put32(&block[8], (uint32_t) packed_len);
+  put32(&block[12], (uint32_t) crc32(0, block + BLOCK_HEADER, packed_len));
+  put32(&block[16], (uint32_t) h->start_ms);
+  put32(&block[20], (uint32_t) ((uint64_t) h->start_ms >> 32));
+  put32(&block[24], (uint32_t) h->num_records);
+  put32(&block[28], 0);
+
+  /* Leave no partial block behind for the next one to follow */
+  error = writeall(h->fd, block, BLOCK_HEADER + packed_len, h->end);
+  if (error) {
+    if (ftruncate(h->fd, h->end))
+      error = ERROR_INVALID_ARGUMENT;
+    goto QUIT;
+  }
+  h->end += BLOCK_HEADER + packed_len;
+
+QUIT:
+  if (h && !error) {
+    endblock(&h->table);
+    h->raw_len     = 0;
+    h->num_records = 0;
+  }
+  FREE(block);
+
+  return error;
+}
+
+int
+ICrecordhistory(IChistory           *h,
+                const ICmachineinfo *machine_info)
+{
+  const ICmachine *m;
+  Entry    *entry;
+  long long now;
+  int  state;
+  int  e;
+  int  i;
+  int  error = 0;
+
+  if (!h || !machine_info) {
+    error = ERROR_NULL_ARGUMENT;
+    goto QUIT;
+  }
+  if ((machine_info->fields & HISTORY_FIELDS) != HISTORY_FIELDS) {
+    error = ERROR_INVALID_ARGUMENT;
+    goto QUIT;
+  }
+
+  /* A block whose flush failed is written before it grows further */
+  if (h->raw_len >= BLOCK_RAW) {
+    error = ICflushhistory(h);
+    if (error) goto QUIT;
+  }
+
+  /* Times only go forward, whatever the clock does */
+  now = nowms();
+  if (now < h->last_ms)
+    now = h->last_ms;
+  h->listing++;
+
+  for (i = 0; i < machine_info->num_machines; i++) {
+    m = &machine_info->machines[i];
+    e = findentry(&h->table, m->machine_id);
+    if (e < 0 && (e = addentry(&h->table, m->machine_id)) < 0) {
+      error = ERROR_OUT_OF_MEMORY;
+      goto QUIT;
+    }
+    entry = &h->table.entries[e];
+    if (entry->seen == h->listing)
+      continue;
+    entry->seen = h->listing;
+
+    state = ICcode(IC_COLUMN_STATE, m->state);
+    if (entry->state == state)
+      continue;
+    entry->state        = state;
+    entry->region       = ICcode(IC_COLUMN_REGION, m->region);
+    entry->machine_type = ICcode(IC_COLUMN_MACHINE_TYPE, m->machine_type);
+    entry->license_type = ICcode(IC_COLUMN_LICENSE_TYPE, m->license_type);
+    error = emit(h, now, e);
+    if (error) goto QUIT;
+    if (h->raw_len >= BLOCK_RAW) {
+      error = ICflushhistory(h);
+      if (error) goto QUIT;
+    }
+  }
+
+  for (e = 0; e < h->table.num_entries; e++) {
+    entry = &h->table.entries[e];
+    if (entry->state == IC_HISTORY_GONE || entry->seen == h->listing)
+      continue;
+    entry->state = IC_HISTORY_GONE;
+    error = emit(h, now, e);
+    if (error) goto QUIT;
+    if (h->raw_len >= BLOCK_RAW) {
+      error = ICflushhistory(h);
+      if (error) goto QUIT;
+    }
+  }
+
+  error = emit(h, now, -1);
+  if (error) goto QUIT;
+  if (h->raw_len >= BLOCK_RAW || now - h->start_ms >= FLUSH_MS)
+    error = ICflushhistory(h);
+
+QUIT:
+
+  return error;
+}
+
+int
+ICclosehistory(IChistory **historyP)
+{
+  IChistory *h;
+  int error = 0;
+
+  if (historyP && *historyP) {
+    h = *historyP;
+    if (h->fd >= 0) {
+      if (h->raw)
+        error = ICflushhistory(h);
+      close(h->fd);
+    }
+    freetable(&h->table);
+    FREE(h->raw);
+    FREE(h);
+    *historyP = NULL;
+  }
+
+  return error;
+}
+
+int
+ICreadhistory(const char        *path,
+              IChistorycallback  done,
+              void              *arg)
+{
+  Table table;
+  FILE *fp = NULL;
+  int   error = 0;
+
+  memset(&table, 0, sizeof(table));
+  if (!path || !done) {
+    error = ERROR_NULL_ARGUMENT;
+    goto QUIT;
+  }
+
+  fp = fopen(path, "rb");
+  if (fp == NULL) {
+    error = ERROR_INVALID_ARGUMENT;
+    goto QUIT;
+  }
+  error = readheader(fp);
+  if (error) goto QUIT;
+
+  error = scan(fp, &table, -1, done, arg, NULL, NULL);
+
+QUIT:
+  if (fp)
+    fclose(fp);
+  freetable(&table);
+
+  return error;
+}
+
+int
+IChistorymachines(const char     *path,
+                  long long       at_ms,
+                  ICmachineinfo **machine_infoP,
+                  long long      *listed_msP)
+{
+  ICmachineinfo *info = NULL;
+  ICmachine     *m;
+  Entry         *entry;
+  Table table;
+  FILE *fp = NULL;
+  long long listed = 0;
+  int   n = 0;
+  int   e;
+  int   error = 0;
+
+  memset(&table, 0, sizeof(table));
+  if (!path || !machine_infoP) {
+    error = ERROR_NULL_ARGUMENT;
+    goto QUIT;
+  }
+
+  error = ICfreemachineinfo(machine_infoP);
+  if (error) goto QUIT;
+
+  fp = fopen(path, "rb");
+  if (fp == NULL) {
+    error = ERROR_INVALID_ARGUMENT;
+    goto QUIT;
+  }
+  error = readheader(fp);
+  if (error) goto QUIT;
+
+  error = scan(fp, &table, at_ms, NULL, NULL, NULL, &listed);
+  if (error) goto QUIT;
+
+  CALLOC(info, 1);
+  info->refcount = 1;
+  info->fields   = HISTORY_FIELDS;
+  for (e = 0; e < table.num_entries; e++)
+    n += table.entries[e].state != IC_HISTORY_GONE;
+  CALLOC(info->machines, n);
+  CALLOC(info->machine_ids, n);
+
+  for (e = 0; e < table.num_entries; e++) {
+    entry = &table.entries[e];
+    if (entry->state == IC_HISTORY_GONE)
+      continue;
+    m = &info->machines[info->num_machines];
+    strcpy(m->machine_id, entry->machine_id);
+    snprintf(m->state, sizeof(m->state), "%s",
+             ICcodename(IC_COLUMN_STATE, entry->state));
+    snprintf(m->region, sizeof(m->region), "%s",
+             ICcodename(IC_COLUMN_REGION, entry->region));
+    snprintf(m->machine_type, sizeof(m->machine_type), "%s",
+             ICcodename(IC_COLUMN_MACHINE_TYPE, entry->machine_type));
+    snprintf(m->license_type, sizeof(m->license_type), "%s",
+             ICcodename(IC_COLUMN_LICENSE_TYPE, entry->license_type));
+    MALLOC(info->machine_ids[info->num_machines], MAX_ID_LEN+1);
+    strcpy(info->machine_ids[info->num_machines], m->machine_id);
+    info->num_machines++;
+  }
+
+QUIT:
+  if (fp)
+    fclose(fp);
+  freetable(&table);
+  if (error)
+    ICfreemachineinfo(&info);
+  if (machine_infoP)
+    *machine_infoP = info;
+  if (listed_msP)
+    *listed_msP = listed;
+
+  return error;
+}
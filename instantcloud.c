@@ -2,24 +2,58 @@
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/stat.h>
 #include "cloud.h"
+#include "format.h"
+#include "query.h"
+#include "autoscale.h"
+#include "apply.h"
 
 #define LAUNCH   "launch"
+#define PLAN     "plan"
 #define KILL     "kill"
 #define MACHINE  "machine"
 #define MACHINES "machines"
 #define LICENSE  "license"
 #define LICENSES "licenses"
+#define AUTOSCALE "autoscale"
+#define PUBLISH   "publish"
+#define APPLY     "apply"
+#define HISTORY   "history"
 
 #define HELP         "--help"
 #define ID           "--id"
 #define KEY          "--key"
+#define FORMAT       "--format"
+#define STATS        "--stats"
+#define NO_COMPRESS  "--no-compression"
+#define HTTP         "--http"
+#define SESSIONS     "--session-cache"
+#define CONCURRENCY  "--concurrency"
+#define RATE         "--rate"
+#define RECORD       "--record"
+#define REPLAY       "--replay"
+#define SNAPSHOT     "--snapshot"
+#define HISTORY_FILE "--history"
+#define TRACE        "--trace"
+#define TRACE_FORMAT "--trace-format"
+#define DEADLINE     "--deadline"
 
 #define SERVER       "--server"
 #define SERVERS      "--servers"
 #define WORKER       "--worker"
 #define WORKERS      "--workers"
 #define READY        "--ready"
+#define FILTER       "--filter"
+#define FIELDS       "--fields"
+#define COUNT_BY     "--count-by"
+#define AT           "--at"
+#define TIME_IN_STATE "--time-in-state"
+
+#define NO_CHECK     "--no-check"
 
 #define NUM_MACHINES   "--nummachines"
 #define LICENSE_TYPE   "--licensetype"
@@ -30,12 +64,36 @@
 #define IDLE_SHUTDOWN  "--idleshutdown"
 #define MACHINE_TYPE   "--machinetype"
 #define GUROBI_VERSION "--gurobiversion"
+#define SLICE          "--slice"
+#define RETRIES        "--retries"
+
+#define QUEUE           "--queue"
+#define SPARE_SERVERS   "--spare-servers"
+#define SPARE_WORKERS   "--spare-workers"
+#define WORKERS_PER_JOB "--workers-per-job"
+#define MAX_MACHINES    "--max-machines"
+#define COOLDOWN        "--cooldown"
+#define INTERVAL        "--interval"
+#define ONCE            "--once"
+
+#define DRY_RUN "--dry-run"
+#define WAIT    "--wait"
+#define TIMEOUT "--timeout"
+#define PRUNE   "--prune"
+#define FORCE   "--force"
 
 #define HELP_COMMAND     0
 #define LAUNCH_COMMAND   1
 #define KILL_COMMAND     2
 #define MACHINES_COMMAND 3
 #define LICENSES_COMMAND 4
+#define PLAN_COMMAND     5
+#define AUTOSCALE_COMMAND 6
+#define PUBLISH_COMMAND   7
+#define APPLY_COMMAND     8
+#define HISTORY_COMMAND   9
+
+#define DEFAULT_SNAPSHOT "/instantcloud-fleet"
 
 #define SERVERS_FLAG 1
 #define WORKERS_FLAG 2
@@ -75,14 +133,88 @@ usage() {
   printf("\n");
   printf("Here command is one of the following:\n");
   printf("\tlaunch\tLaunch a set of Gurobi machines\n");
+  printf("\tplan\tLaunch machines in several regions at once\n");
   printf("\tkill\tKill a set of Gurobi machines\n");
   printf("\tlicenses\tShow the licenses associated with your account\n");
   printf("\tmachines\tShow currently running machines\n");
+  printf("\tautoscale\tKeep a warm pool of machines for a job queue\n");
+  printf("\tpublish\tShare the machine list with processes on this host\n");
+  printf("\tapply\tLaunch and kill machines to match a desired state file\n");
+  printf("\thistory\tRecord the changes of the machines to a file\n");
   printf("\n");
   printf("General options:\n");
   printf("  --help (-h):  this message\n");
   printf("  --id (-I): access id\n");
   printf("  --key (-K): secret key\n");
+  printf("  --format (-f): output format, one of text, json, jsonl, csv, tsv\n");
+  printf("  --stats: print transfer statistics to stderr when done\n");
+  printf("  --no-compression: do not ask for compressed responses\n");
+  printf("  --http: HTTP version, one of 1.1, 2 (the default) or h2c\n");
+  printf("  --session-cache: reuse DNS results and TLS sessions across runs\n");
+  printf("  --concurrency: most requests in flight, adapted to the server's\n");
+  printf("                 answers (default 64, 0 for no limit)\n");
+  printf("  --rate: most requests per second, RATE[,BURST]\n");
+  printf("  --record: append each request's response to a file\n");
+  printf("  --replay: answer requests from a recording, without the network\n");
+  printf("  --trace: write a timeline of the calls and requests to a file\n");
+  printf("  --trace-format: chrome (the default, for Perfetto) or otlp\n");
+  printf("  --deadline: seconds the command may take, retries included, or\n");
+  printf("              each step of autoscale, publish and history\n");
+  printf("\n");
+  printf("Machines options:\n");
+  printf("  --servers (-s): DNS names of ready full compute servers\n");
+  printf("  --workers (-w): DNS names of ready machines\n");
+  printf("  --ready (-r): machines that are idle or running\n");
+  printf("  --filter: clauses FIELD=VALUE[|VALUE...], !=, <, <=, >, >=\n");
+  printf("            separated by commas, all of which must hold\n");
+  printf("  --fields: comma separated list of fields to print\n");
+  printf("  --count-by: count the machines per value of these fields\n");
+  printf("  --snapshot: read the machines shared by publish under this name,\n");
+  printf("              without credentials or a request\n");
+  printf("  --history: read the machines from a file written by history,\n");
+  printf("             without credentials or a request\n");
+  printf("  --at: with --history, the machines at this time, in seconds since\n");
+  printf("        the epoch or YYYY-MM-DDTHH:MM:SS UTC (the last listing)\n");
+  printf("  --time-in-state: with --history, seconds each machine spent in\n");
+  printf("                   each state, up to --at\n");
+  printf("\n");
+  printf("Kill options:\n");
+  printf("  --no-check: send the machine ids without checking them against\n");
+  printf("              the current machines, which also accept DNS names\n");
+  printf("\n");
+  printf("Autoscale options:\n");
+  printf("  --queue (-q): file or Unix socket holding the queue depth\n");
+  printf("  --spare-servers: idle compute servers beyond the queue (1)\n");
+  printf("  --spare-workers: idle distributed workers to keep (0)\n");
+  printf("  --workers-per-job: workers each queued job needs (0)\n");
+  printf("  --max-machines: most servers and workers at once (10)\n");
+  printf("  --cooldown: seconds of surplus before idle machines are killed (300)\n");
+  printf("  --interval: seconds between two checks (30)\n");
+  printf("  --once: check and adjust once, then exit\n");
+  printf("  and the launch options --region, --machinetype, --password,\n");
+  printf("  --licenseid, --idleshutdown and --gurobiversion\n");
+  printf("\n");
+  printf("Publish options:\n");
+  printf("  --snapshot: name of the shared memory segment (%s)\n",
+         DEFAULT_SNAPSHOT);
+  printf("  --interval: seconds between two listings (30)\n");
+  printf("  --once: publish once, then exit\n");
+  printf("\n");
+  printf("Apply options (instantcloud apply FILE):\n");
+  printf("  FILE: one REGION,MACHINETYPE,LICENSETYPE,COUNT[,LICENSEID] per line,\n");
+  printf("        - for standard input\n");
+  printf("  --dry-run: print the launches and kills without making them\n");
+  printf("  --prune: kill the machines of groups the file does not list\n");
+  printf("  --force: kill running machines too\n");
+  printf("  --wait: wait until every group is ready\n");
+  printf("  --interval: seconds between two checks while waiting (10)\n");
+  printf("  --timeout: seconds to wait at most (600)\n");
+  printf("  and the launch options --password, --idleshutdown,\n");
+  printf("  --gurobiversion and --retries\n");
+  printf("\n");
+  printf("History options (instantcloud history FILE):\n");
+  printf("  --interval: seconds between two listings (30)\n");
+  printf("  --once: record one listing, then exit\n");
 }
 
 int
@@ -114,23 +246,652 @@ get_secretkey(char **keyP)
   }
 }
 
+/* Parse REGION,MACHINETYPE,LICENSETYPE,COUNT[,LICENSEID] */
+int
+parse_slice(char          *arg,
+            IClaunchslice *slice,
+            int            min_count)
+{
+  char *field[5];
+  char *end;
+  int   num_fields = 0;
+  int   i;
+  int   flag;
+
+  field[num_fields++] = arg;
+  for (; *arg != '\0'; arg++) {
+    if (*arg == ',') {
+      if (num_fields == 5)
+        return 1;
+      *arg = '\0';
+      field[num_fields++] = arg + 1;
+    }
+  }
+  if (num_fields < 4)
+    return 1;
+
+  slice->region       = field[0];
+  slice->machine_type = field[1];
+  slice->license_type = field[2];
+  slice->count        = (int) strtol(field[3], &end, 10);
+  slice->license_id   = num_fields == 5 ? atoi(field[4]) : -1;
+  slice->status       = 0;
+
+  if (end == field[3] || *end != '\0' || slice->count < min_count)
+    return 1;
+
+  flag = 0;
+  for (i = 0; i < NUM_REGIONS; i++) {
+    if (strcmp(region_data[i], slice->region) == 0) {
+      flag = 1;
+      break;
+    }
+  }
+  if (!flag) return 1;
+
+  flag = 0;
+  for (i = 0; i < NUM_MACHINE_TYPE; i++) {
+    if (strcmp(machine_data[i], slice->machine_type) == 0) {
+      flag = 1;
+      break;
+    }
+  }
+  if (!flag) return 1;
+
+  flag = 0;
+  for (i = 0; i < NUM_CLOUD_LICENSE_TYPE; i++) {
+    if (strcmp(license_type_data[i], slice->license_type) == 0) {
+      flag = 1;
+      break;
+    }
+  }
+  if (!flag) return 1;
+
+  return 0;
+}
+
+/* Read the desired state of apply: a slice per line, where the count
+   may be 0, with blank lines and # comments.  The slices point into
+   the buffer returned in bufP. */
+int
+read_desired(const char     *path,
+             char          **bufP,
+             IClaunchslice **groupsP,
+             int            *num_groupsP)
+{
+  FILE          *fp;
+  IClaunchslice *groups = NULL;
+  char   *buf = NULL;
+  char   *line;
+  char   *next;
+  char   *end;
+  char   *p;
+  size_t  len = 0;
+  size_t  size = 0;
+  size_t  n;
+  int     num_lines = 1;
+  int     num_groups = 0;
+  int     lineno = 0;
+  int     failed = 0;
+  int     i;
+
+  fp = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+  if (fp == NULL) {
+    printf("Could not open %s\n", path);
+    return 1;
+  }
+  do {
+    if (len + 1 >= size) {
+      size = size ? 2*size : 4096;
+      p = realloc(buf, size);
+      if (p == NULL) {
+        failed = 1;
+        break;
+      }
+      buf = p;
+    }
+    n = fread(&buf[len], 1, size - 1 - len, fp);
+    len += n;
+  } while (n > 0);
+  if (ferror(fp))
+    failed = 1;
+  if (fp != stdin)
+    fclose(fp);
+  if (failed) {
+    printf("Could not read %s\n", path);
+    goto FAIL;
+  }
+  buf[len] = '\0';
+
+  for (p = buf; *p; p++)
+    num_lines += *p == '\n';
+  groups = malloc(sizeof(IClaunchslice)*num_lines);
+  if (groups == NULL)
+    goto FAIL;
+
+  for (line = buf; line; line = next) {
+    lineno++;
+    next = strchr(line, '\n');
+    if (next)
+      *next++ = '\0';
+    if ((p = strchr(line, '#')) != NULL)
+      *p = '\0';
+    while (*line == ' ' || *line == '\t')
+      line++;
+    end = line + strlen(line);
+    while (end > line && (end[-1] == ' ' || end[-1] == '\t' ||
+                          end[-1] == '\r'))
+      *--end = '\0';
+    if (*line == '\0')
+      continue;
+
+    if (parse_slice(line, &groups[num_groups], 0)) {
+      printf("Bad slice on line %d of %s\n", lineno, path);
+      goto FAIL;
+    }
+    for (i = 0; i < num_groups; i++) {
+      if (strcmp(groups[i].region, groups[num_groups].region) == 0 &&
+          strcmp(groups[i].machine_type,
+                 groups[num_groups].machine_type) == 0             &&
+          strcmp(groups[i].license_type,
+                 groups[num_groups].license_type) == 0               ) {
+        printf("Group on line %d of %s is listed twice\n", lineno, path);
+        goto FAIL;
+      }
+    }
+    num_groups++;
+  }
+
+  *bufP        = buf;
+  *groupsP     = groups;
+  *num_groupsP = num_groups;
+  return 0;
+
+FAIL:
+  free(groups);
+  free(buf);
+  return 1;
+}
+
+int
+get_format(char *name,
+           int  *formatP)
+{
+  int format;
+
+  if (name == NULL || (format = fmt_parse(name)) < 0) {
+    printf("Bad option %s for format\n", name ? name : "");
+    return 1;
+  }
+  *formatP = format;
+  return 0;
+}
+
+/* Print the DNS names of the selected machines, separated by commas */
+void
+print_hosts(ICformatter         *f,
+            const ICfleet       *fleet,
+            const unsigned char *selected)
+{
+  ICspan span = IC_SPAN_INIT;
+  int count = 0;
+  int i;
+
+  TRACE_BEGIN(span);
+  for (i = 0; i < fleet->num_machines; i++) {
+    if (!selected[i]) continue;
+    if (count > 0)
+      fmt_puts(f, ",", 1);
+    fmt_puts(f, fleet->dns_name[i], strlen(fleet->dns_name[i]));
+    count++;
+  }
+  TRACE_END(span, "format", "hosts");
+}
+
 void
-print_machines(int        num_machines,
-               ICmachine *machines)
+print_machines(ICformatter *f,
+               int          num_machines,
+               ICmachine   *machines)
 {
   int i;
-  for (i = 0; i < num_machines; i++) {
-    printf("Machine name: %s\n", machines[i].dns_name);
-    printf("\tlicense type: %s\n", machines[i].license_type);
-    printf("\tstate: %s\n", machines[i].state);
-    printf("\tmachine type: %s\n", machines[i].machine_type);
-    printf("\tregion: %s\n", machines[i].region);
-    printf("\tidle shutdown: %d\n", machines[i].idle_shutdown);
-    printf("\tuser password: %s\n", machines[i].user_password);
-    printf("\tcreate time: %s\n", machines[i].create_time);
-    printf("\tlicense id: %d\n", machines[i].license_id);
-    printf("\tmachine id: %s\n", machines[i].machine_id);
+
+  fmt_begin_machines(f);
+  for (i = 0; i < num_machines; i++)
+    fmt_machine(f, &machines[i]);
+  fmt_end_machines(f);
+}
+
+int
+get_http_version(const char *name)
+{
+  int version;
+
+  if (name && strcmp(name, "1.1") == 0) {
+    version = IC_HTTP_1_1;
+  } else if (name && strcmp(name, "2") == 0) {
+    version = IC_HTTP_2;
+  } else if (name && strcmp(name, "h2c") == 0) {
+    version = IC_HTTP_2_PRIOR_KNOWLEDGE;
+  } else {
+    printf("Bad option %s for http, use 1.1, 2 or h2c\n", name ? name : "");
+    return 1;
+  }
+
+  ICsethttpversion(version);
+  return 0;
+}
+
+int
+set_concurrency(const char *arg)
+{
+  int limit;
+
+  if (arg == NULL || (limit = atoi(arg)) < 0 ||
+      (limit == 0 && strcmp(arg, "0") != 0)) {
+    printf("Bad option %s for concurrency\n", arg ? arg : "");
+    return 1;
+  }
+
+  if (limit == 0)
+    return ICsetconcurrency(0, 0, 0);
+  return ICsetconcurrency(1, limit < 8 ? limit : 8, limit);
+}
+
+int
+set_rate(const char *arg)
+{
+  double rate;
+  int    burst = 1;
+  char  *end = NULL;
+
+  if (arg)
+    rate = strtod(arg, &end);
+  if (arg == NULL || end == arg || rate < 0 ||
+      (*end == ',' && (burst = atoi(end + 1)) < 1) ||
+      (*end != ',' && *end != '\0')) {
+    printf("Bad option %s for rate, use RATE[,BURST]\n", arg ? arg : "");
+    return 1;
+  }
+
+  return ICsetratelimit(rate, burst);
+}
+
+int
+get_trace_format(const char *arg,
+                 int        *formatP)
+{
+  if (arg && strcmp(arg, "chrome") == 0) {
+    *formatP = IC_TRACE_CHROME;
+  } else if (arg && strcmp(arg, "otlp") == 0) {
+    *formatP = IC_TRACE_OTLP;
+  } else {
+    printf("Bad option %s for trace-format, use chrome or otlp\n",
+           arg ? arg : "");
+    return 1;
+  }
+  return 0;
+}
+
+int
+get_deadline(const char *arg,
+             int        *secondsP)
+{
+  char *end = NULL;
+  long  seconds = 0;
+
+  if (arg)
+    seconds = strtol(arg, &end, 10);
+  if (arg == NULL || end == arg || *end != '\0' ||
+      seconds <= 0 || seconds > INT_MAX/1000) {
+    printf("Bad option %s for deadline, use a number of seconds\n",
+           arg ? arg : "");
+    return 1;
+  }
+
+  *secondsP = (int) seconds;
+  return 0;
+}
+
+/* The global options that take a value, so that a command reading its
+   own options after the command word can step over them */
+int
+global_value_option(const char *arg)
+{
+  return strcmp(arg, ID) == 0           || strcmp(arg, "-I") == 0     ||
+         strcmp(arg, KEY) == 0          || strcmp(arg, "-K") == 0     ||
+         strcmp(arg, FORMAT) == 0       || strcmp(arg, "-f") == 0     ||
+         strcmp(arg, HTTP) == 0         || strcmp(arg, CONCURRENCY) == 0 ||
+         strcmp(arg, RATE) == 0         || strcmp(arg, RECORD) == 0   ||
+         strcmp(arg, REPLAY) == 0       || strcmp(arg, SNAPSHOT) == 0 ||
+         strcmp(arg, HISTORY_FILE) == 0 || strcmp(arg, AT) == 0       ||
+         strcmp(arg, TRACE) == 0        || strcmp(arg, TRACE_FORMAT) == 0 ||
+         strcmp(arg, DEADLINE) == 0;
+}
+
+/* The session cache is opt-in.  --session-cache keeps it in the user's
+   cache directory, IC_SESSION_CACHE names any other file. */
+int
+set_session_cache(int enable)
+{
+  char  path[4096];
+  char *file = getenv("IC_SESSION_CACHE");
+  char *dir;
+
+  if (file == NULL && !enable)
+    return 0;
+
+  if (file == NULL) {
+    if ((dir = getenv("XDG_CACHE_HOME")) != NULL && *dir) {
+      snprintf(path, sizeof(path), "%s/instantcloud", dir);
+    } else if ((dir = getenv("HOME")) != NULL) {
+      snprintf(path, sizeof(path), "%s/.cache", dir);
+      mkdir(path, 0700);
+      snprintf(path, sizeof(path), "%s/.cache/instantcloud", dir);
+    } else {
+      printf("Could not find a cache directory, set IC_SESSION_CACHE\n");
+      return 1;
+    }
+    mkdir(path, 0700);
+    strncat(path, "/sessions", sizeof(path) - strlen(path) - 1);
+    file = path;
+  }
+
+  return ICsetsessioncache(file);
+}
+
+static volatile sig_atomic_t stopping = 0;
+static int deadline = 0;      /* seconds, 0 for none */
+
+/* The deadline of the calls that follow, from now */
+void
+start_deadline(void)
+{
+  if (deadline > 0)
+    ICsetdeadline(ICnowms() + 1000LL*deadline);
+}
+
+void
+stop_listing(int sig)
+{
+  stopping = 1;
+}
+
+/* List the machines every interval and publish them until interrupted.
+   A failed listing leaves the last snapshot in place, its age tells
+   the readers how current it is. */
+int
+publish_fleet(const char *name,
+              int         interval,
+              int         once)
+{
+  ICsnapshot    *snap = NULL;
+  ICmachineinfo *info = NULL;
+  struct timespec ts;
+  int error;
+
+  error = ICcreatesnapshot(name, &snap);
+  if (error) {
+    printf("Could not create the snapshot %s\n", name);
+    return error;
+  }
+
+  signal(SIGINT, stop_listing);
+  signal(SIGTERM, stop_listing);
+
+  for (;;) {
+    start_deadline();
+    error = ICgetmachines(&info);
+    if (!error)
+      error = ICpublishsnapshot(snap, info);
+    if (error)
+      printf("Could not publish the machines: error %d\n", error);
+    if (once || stopping)
+      break;
+
+    ts.tv_sec  = interval;
+    ts.tv_nsec = 0;
+    nanosleep(&ts, NULL);
+    if (stopping)
+      break;
+  }
+
+  ICfreemachineinfo(&info);
+  ICfreesnapshot(&snap);
+
+  return once ? error : 0;
+}
+
+/* List the machines every interval and append their changes to the
+   history until interrupted.  A failed listing is skipped, the next
+   one records what changed in between. */
+int
+record_history(const char *path,
+               int         interval,
+               int         once)
+{
+  IChistory     *history = NULL;
+  ICmachineinfo *info = NULL;
+  struct timespec ts;
+  int error;
+
+  error = ICopenhistory(path, &history);
+  if (error) {
+    printf("Could not open the history %s\n", path);
+    return error;
+  }
+
+  signal(SIGINT, stop_listing);
+  signal(SIGTERM, stop_listing);
+
+  for (;;) {
+    start_deadline();
+    error = ICgetmachinefields(IC_FIELD_MACHINE_ID   | IC_FIELD_STATE  |
+                               IC_FIELD_MACHINE_TYPE | IC_FIELD_REGION |
+                               IC_FIELD_LICENSE_TYPE, &info);
+    if (!error)
+      error = ICrecordhistory(history, info);
+    if (error)
+      printf("Could not record the machines: error %d\n", error);
+    if (once || stopping)
+      break;
+
+    ts.tv_sec  = interval;
+    ts.tv_nsec = 0;
+    nanosleep(&ts, NULL);
+    if (stopping)
+      break;
+  }
+
+  ICfreemachineinfo(&info);
+  if (ICclosehistory(&history)) {
+    printf("Could not write the history %s\n", path);
+    error = ERROR_INVALID_ARGUMENT;
+  }
+
+  return once ? error : 0;
+}
+
+/* TIME as seconds since the epoch or YYYY-MM-DDTHH:MM:SS[Z] in UTC */
+int
+get_time(const char *arg,
+         long long  *msP)
+{
+  struct tm tm;
+  char     *end;
+  long long seconds;
+  int       n = 0;
+
+  if (arg != NULL) {
+    seconds = strtoll(arg, &end, 10);
+    if (end != arg && *end == '\0') {
+      *msP = seconds*1000;
+      return 0;
+    }
+
+    memset(&tm, 0, sizeof(tm));
+    if (sscanf(arg, "%d-%d-%dT%d:%d:%d%n", &tm.tm_year, &tm.tm_mon,
+               &tm.tm_mday, &tm.tm_hour, &tm.tm_min, &tm.tm_sec, &n) == 6 &&
+        (arg[n] == '\0' || strcmp(&arg[n], "Z") == 0)) {
+      tm.tm_year -= 1900;
+      tm.tm_mon  -= 1;
+      *msP = (long long) timegm(&tm)*1000;
+      return 0;
+    }
+  }
+
+  printf("Bad option %s for at\n", arg ? arg : "");
+  return 1;
+}
+
+typedef struct {
+  int        num_machines;
+  int        max_machines;
+  int        num_states;
+  char     (*ids)[MAX_ID_LEN+1];
+  int       *state;
+  long long *since;
+  long long *ms;            /* per machine and state */
+  long long  until;
+  long long  end;
+  int        error;
+} StateTimes;
+
+int
+add_state_time(const ICtransition *t,
+               void               *arg)
+{
+  StateTimes *s = (StateTimes *) arg;
+  char     (*ids)[MAX_ID_LEN+1];
+  int       *state;
+  long long *since;
+  long long *ms;
+  int m = t->machine;
+  int size;
+
+  if (s->until >= 0 && t->time_ms > s->until)
+    return 1;
+  s->end = t->time_ms;
+  if (m < 0)
+    return 0;
+
+  if (m >= s->max_machines) {
+    size = s->max_machines ? 2*s->max_machines : 256;
+    if ((ids = realloc(s->ids, sizeof(*ids)*size)) != NULL)
+      s->ids = ids;
+    if ((state = realloc(s->state, sizeof(int)*size)) != NULL)
+      s->state = state;
+    if ((since = realloc(s->since, sizeof(long long)*size)) != NULL)
+      s->since = since;
+    if ((ms = realloc(s->ms, sizeof(long long)*size*s->num_states)) != NULL)
+      s->ms = ms;
+    if (!ids || !state || !since || !ms) {
+      s->error = ERROR_OUT_OF_MEMORY;
+      return 1;
+    }
+    memset(&s->ms[s->max_machines*s->num_states], 0,
+           sizeof(long long)*(size - s->max_machines)*s->num_states);
+    s->max_machines = size;
+  }
+  if (m >= s->num_machines) {
+    snprintf(s->ids[m], MAX_ID_LEN+1, "%s", t->machine_id);
+    s->state[m] = IC_HISTORY_GONE;
+    s->num_machines = m + 1;
+  }
+
+  if (s->state[m] < s->num_states)
+    s->ms[m*s->num_states + s->state[m]] += t->time_ms - s->since[m];
+  s->state[m] = t->state;
+  s->since[m] = t->time_ms;
+  return 0;
+}
+
+/* Seconds each machine of a history spent in each state, up to until
+   or the last listing */
+int
+print_time_in_state(ICformatter *f,
+                    const char  *path,
+                    long long    until)
+{
+  const char *names[3] = { "machine_id", "state", "seconds" };
+  StateTimes  s;
+  long long   end;
+  int  i;
+  int  j;
+  int  error;
+
+  memset(&s, 0, sizeof(s));
+  s.num_states = ICnumcodes(IC_COLUMN_STATE);
+  s.until      = until;
+
+  error = ICreadhistory(path, add_state_time, &s);
+  if (!error)
+    error = s.error;
+  if (error) goto QUIT;
+
+  end = until >= 0 ? until : s.end;
+  fmt_begin_table(f, names, 3);
+  for (i = 0; i < s.num_machines; i++) {
+    if (s.state[i] < s.num_states && end > s.since[i])
+      s.ms[i*s.num_states + s.state[i]] += end - s.since[i];
+    for (j = 0; j < s.num_states; j++) {
+      if (s.ms[i*s.num_states + j] == 0)
+        continue;
+      fmt_begin_record(f);
+      fmt_key_str(f, names[0], s.ids[i]);
+      fmt_key_str(f, names[1], ICcodename(IC_COLUMN_STATE, j));
+      fmt_key_int(f, names[2], (long) ((s.ms[i*s.num_states + j] + 500)/1000));
+      fmt_end_record(f);
+    }
   }
+  fmt_end_table(f);
+
+QUIT:
+  free(s.ids);
+  free(s.state);
+  free(s.since);
+  free(s.ms);
+
+  return error;
+}
+
+static struct timespec started;
+
+/* Bytes received against the time spent, for comparing encodings */
+void
+print_stats()
+{
+  struct timespec now;
+
+  ICtransferstats stats;
+  IClimiterstats  limiter;
+
+  ICgettransferstats(&stats);
+  ICgetlimiterstats(&limiter);
+  fprintf(stderr, "requests: %ld, new connections: %ld\n", stats.requests,
+          stats.connects);
+  fprintf(stderr, "received: %ld bytes, %ld bytes of headers\n",
+          stats.wire_bytes, stats.header_bytes);
+  fprintf(stderr, "decoded: %ld bytes", stats.body_bytes);
+  if (stats.wire_bytes > 0)
+    fprintf(stderr, " (%.1fx)", (double) stats.body_bytes/stats.wire_bytes);
+  fprintf(stderr, "\n");
+  fprintf(stderr, "transfer time: %.3f s\n", stats.seconds);
+  fprintf(stderr, "in flight: at most %d, limit %d, %ld cuts on %ld "
+          "overload signals\n", limiter.max_in_flight, limiter.limit,
+          limiter.decreases, limiter.congested);
+  fprintf(stderr, "queued: %ld of %ld requests, %.3f s in total\n",
+          limiter.queued, limiter.admitted, limiter.queue_ms/1000);
+  fprintf(stderr, "first byte: %.1f ms smoothed, %.1f ms best\n",
+          limiter.latency_ms, limiter.baseline_ms);
+  fprintf(stderr, "queue time by lane: kill %.3f s, launch %.3f s, "
+          "list %.3f s, %ld listings preempted\n",
+          limiter.lane_queue_ms[IC_PRIORITY_KILL]/1000,
+          limiter.lane_queue_ms[IC_PRIORITY_LAUNCH]/1000,
+          limiter.lane_queue_ms[IC_PRIORITY_LIST]/1000, limiter.preempted);
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  fprintf(stderr, "wall time: %.3f s\n", now.tv_sec - started.tv_sec +
+          (now.tv_nsec - started.tv_nsec)/1e9);
+  fprintf(stderr, "cpu time: %.3f s\n", (double) clock()/CLOCKS_PER_SEC);
 }
 
 int
@@ -153,13 +914,57 @@ main(int   argc,
   char **machine_ids          = NULL;
   int    num_licenses         = -1;
   ICcloudlicense *licenses    = NULL;
+  IClaunchslice  *slices      = NULL;
+  int    num_slices           = 0;
+  int    retries              = 2;
+  int    format               = FORMAT_TEXT;
+  int    stats                = 0;
+  ICformatter formatter;
+  ICfleet *fleet              = NULL;
+  ICquery  query;
+  ICquery  server_query;
+  unsigned char *selected     = NULL;
+  int    has_server           = 1;
+  int    print_dns            = 0;
+  unsigned int fields         = IC_FIELD_ALL;
+  char   servers_filter[]     = "state=idle|running,"
+                                "license_type=" LICENSE_FULL_COMPUTE_SERVER;
+  char   ready_filter[]       = "state=idle|running";
   int    command              = -1;
+  int    command_at           = 0;     /* argv index of the command */
   int    flag                 = 0;
   ICmachine *machines         = NULL;
   ICmachineinfo *machine_info = NULL;
+  ICmachineinfo *current      = NULL;
+  int    check                = 1;
+  ICautoscale autoscale;
+  ICapply     apply;
+  char  *desired              = NULL;
+  char  *desired_buf          = NULL;
   int    i;
+  int    j;
+  int    session_cache        = 0;
+  char  *record               = NULL;
+  char  *replay               = NULL;
+  char  *snapshot             = NULL;
+  char  *history              = NULL;
+  long long at_ms             = -1;
+  int    time_in_state        = 0;
+  ICsnapshot *snap            = NULL;
+  long long published_ms      = 0;
+  struct timespec now;
+  int    interval             = 30;
+  char  *trace                = NULL;
+  int    trace_format         = IC_TRACE_CHROME;
+  int    once                 = 0;
+  ICtransport *curl           = NULL;
+  ICtransport *transport      = NULL;
+  int    cleanup              = 0;
   int    error              = 0;
 
+  clock_gettime(CLOCK_MONOTONIC, &started);
+  formatter.buf = NULL;
+  query_init(&query);
 
   for (cursor = 1; cursor < argc; cursor++) {
     if (strlen(argv[cursor]) > 1 &&
@@ -175,21 +980,87 @@ main(int   argc,
                  strcmp(argv[cursor], "-K") == 0   ) {
         key = argv[cursor + 1];
         cursor++;
+      } else if (strcmp(argv[cursor], FORMAT) == 0 ||
+                 strcmp(argv[cursor], "-f") == 0     ) {
+        if (get_format(argv[++cursor], &format))
+          exit(1);
+      } else if (strcmp(argv[cursor], STATS) == 0) {
+        stats = 1;
+      } else if (strcmp(argv[cursor], NO_COMPRESS) == 0) {
+        ICsetcompression(0);
+      } else if (strcmp(argv[cursor], HTTP) == 0) {
+        if (get_http_version(argv[++cursor]))
+          exit(1);
+      } else if (strcmp(argv[cursor], SESSIONS) == 0) {
+        session_cache = 1;
+      } else if (strcmp(argv[cursor], CONCURRENCY) == 0) {
+        if (set_concurrency(argv[++cursor]))
+          exit(1);
+      } else if (strcmp(argv[cursor], RATE) == 0) {
+        if (set_rate(argv[++cursor]))
+          exit(1);
+      } else if (strcmp(argv[cursor], RECORD) == 0) {
+        record = argv[++cursor];
+      } else if (strcmp(argv[cursor], REPLAY) == 0) {
+        replay = argv[++cursor];
+      } else if (strcmp(argv[cursor], NO_CHECK) == 0) {
+        check = 0;
+      } else if (strcmp(argv[cursor], SNAPSHOT) == 0) {
+        snapshot = argv[++cursor];
+      } else if (strcmp(argv[cursor], HISTORY_FILE) == 0) {
+        history = argv[++cursor];
+      } else if (strcmp(argv[cursor], AT) == 0) {
+        if (get_time(argv[++cursor], &at_ms))
+          exit(1);
+      } else if (strcmp(argv[cursor], TIME_IN_STATE) == 0) {
+        time_in_state = 1;
+      } else if (strcmp(argv[cursor], TRACE) == 0) {
+        trace = argv[++cursor];
+      } else if (strcmp(argv[cursor], TRACE_FORMAT) == 0) {
+        if (get_trace_format(argv[++cursor], &trace_format))
+          exit(1);
+      } else if (strcmp(argv[cursor], DEADLINE) == 0) {
+        if (get_deadline(argv[++cursor], &deadline))
+          exit(1);
       }
     } else if (strlen(argv[cursor]) > 1          &&
                strcmp(argv[cursor], LAUNCH) == 0   ) {
       command = LAUNCH_COMMAND;
+      command_at = cursor;
+    } else if (strlen(argv[cursor]) > 1        &&
+               strcmp(argv[cursor], PLAN) == 0   ) {
+      command = PLAN_COMMAND;
+      command_at = cursor;
     } else if (strlen(argv[cursor]) > 1        &&
                strcmp(argv[cursor], KILL) == 0   ) {
       command = KILL_COMMAND;
+      command_at = cursor;
     } else if (strlen(argv[cursor]) > 1               &&
                (strcmp(argv[cursor], MACHINE) == 0 ||
                 strcmp(argv[cursor], MACHINES) == 0  )   ) {
       command = MACHINES_COMMAND;
+      command_at = cursor;
     } else if (strlen(argv[cursor]) > 1                &&
                (strcmp(argv[cursor], LICENSE) == 0 ||
                 strcmp(argv[cursor], LICENSES) == 0  )    ) {
       command = LICENSES_COMMAND;
+      command_at = cursor;
+    } else if (strlen(argv[cursor]) > 1             &&
+               strcmp(argv[cursor], AUTOSCALE) == 0   ) {
+      command = AUTOSCALE_COMMAND;
+      command_at = cursor;
+    } else if (strlen(argv[cursor]) > 1           &&
+               strcmp(argv[cursor], PUBLISH) == 0   ) {
+      command = PUBLISH_COMMAND;
+      command_at = cursor;
+    } else if (strlen(argv[cursor]) > 1         &&
+               strcmp(argv[cursor], APPLY) == 0   ) {
+      command = APPLY_COMMAND;
+      command_at = cursor;
+    } else if (strlen(argv[cursor]) > 1           &&
+               strcmp(argv[cursor], HISTORY) == 0   ) {
+      command = HISTORY_COMMAND;
+      command_at = cursor;
     } else {
       break;
     }
@@ -201,31 +1072,69 @@ main(int   argc,
     exit(1);
   }
 
-  error = get_id(&id);
-  if (error) {
-    printf("Could not find access id. Set the access id with --id\n");
-    printf("Or by setting the environmental variable IC_ACCESS_ID\n");
-    exit(1);
+  if (trace) {
+    trace_thread_name("main");
+    if (ICstarttrace(trace, trace_format)) {
+      printf("Could not open %s for tracing\n", trace);
+      exit(1);
+    }
   }
 
-  error = get_secretkey(&key);
-  if (error) {
-    printf("Could not find secret key. Set the secret key with --key\n");
-    printf("Or by setting the environmental variable IC_SECRET_KEY\n");
-    exit(1);
-  }
+  /* Readers of a published snapshot or of a history make no requests */
+  if (!(command == MACHINES_COMMAND && (snapshot || history))) {
+    error = get_id(&id);
+    if (error) {
+      printf("Could not find access id. Set the access id with --id\n");
+      printf("Or by setting the environmental variable IC_ACCESS_ID\n");
+      exit(1);
+    }
 
-  error = ICcloudcreds(id, key);
-  if (error) {
-    printf("Bad cloud credentials\n");
-    goto QUIT;
+    error = get_secretkey(&key);
+    if (error) {
+      printf("Could not find secret key. Set the secret key with --key\n");
+      printf("Or by setting the environmental variable IC_SECRET_KEY\n");
+      exit(1);
+    }
+
+    error = ICcloudcreds(id, key);
+    if (error) {
+      printf("Bad cloud credentials\n");
+      goto QUIT;
+    }
+
+    error = set_session_cache(session_cache);
+    if (error) goto QUIT;
+
+    if (replay) {
+      error = ICreplaytransport(replay, &transport);
+      if (error) {
+        printf("Could not read the recording %s\n", replay);
+        goto QUIT;
+      }
+    } else if (record) {
+      error = ICcurltransport(&curl);
+      if (error) goto QUIT;
+      error = ICrecordtransport(curl, record, &transport);
+      if (error) {
+        printf("Could not open %s for recording\n", record);
+        goto QUIT;
+      }
+    }
+    ICsettransport(transport);
   }
 
 
   if (command == HELP_COMMAND) {
     usage();
     exit(0);
-  } else if (command == LAUNCH_COMMAND) {
+  }
+
+  error = fmt_init(&formatter, 1, format);
+  if (error) goto QUIT;
+
+  start_deadline();
+
+  if (command == LAUNCH_COMMAND) {
     for (cursor = cursor - 1; cursor < argc; cursor++) {
       if (strlen(argv[cursor]) > 1 &&
           argv[cursor][0] == '-'     ) {
@@ -291,6 +1200,10 @@ main(int   argc,
         } else if (strcmp(argv[cursor], "-g") == 0          ||
                    strcmp(argv[cursor], GUROBI_VERSION) == 0  ) {
           gurobi_version = argv[++cursor];
+        } else if (strcmp(argv[cursor], "-f") == 0  ||
+                   strcmp(argv[cursor], FORMAT) == 0  ) {
+          if (get_format(argv[++cursor], &formatter.format))
+            goto QUIT;
         }
       }
     }
@@ -304,15 +1217,77 @@ main(int   argc,
     num_machines = machine_info->num_machines;
     machines     = machine_info->machines;
 
-    print_machines(num_machines, machines);
+    print_machines(&formatter, num_machines, machines);
+
+  } else if (command == PLAN_COMMAND) {
+    slices = malloc(sizeof(IClaunchslice)*argc);
+    if (slices == NULL) {
+      error = ERROR_OUT_OF_MEMORY;
+      goto QUIT;
+    }
+
+    for (cursor = cursor - 1; cursor < argc; cursor++) {
+      if (strlen(argv[cursor]) > 1 &&
+          argv[cursor][0] == '-'     ) {
+        if (strcmp(argv[cursor], "-e") == 0 ||
+            strcmp(argv[cursor], SLICE) == 0  ) {
+          if (parse_slice(argv[++cursor], &slices[num_slices], 1)) {
+            printf("Bad option %s for slice\n", argv[cursor]);
+            goto QUIT;
+          }
+          num_slices++;
+        } else if (strcmp(argv[cursor], "-p") == 0    ||
+                   strcmp(argv[cursor], PASSWORD) == 0  ) {
+          password = argv[++cursor];
+        } else if (strcmp(argv[cursor], "-s") == 0         ||
+                   strcmp(argv[cursor], IDLE_SHUTDOWN) == 0   ) {
+          idleshutdown = atoi(argv[++cursor]);
+        } else if (strcmp(argv[cursor], "-g") == 0          ||
+                   strcmp(argv[cursor], GUROBI_VERSION) == 0  ) {
+          gurobi_version = argv[++cursor];
+        } else if (strcmp(argv[cursor], "-f") == 0  ||
+                   strcmp(argv[cursor], FORMAT) == 0  ) {
+          if (get_format(argv[++cursor], &formatter.format))
+            goto QUIT;
+        } else if (strcmp(argv[cursor], RETRIES) == 0) {
+          retries = atoi(argv[++cursor]);
+        }
+      }
+    }
+
+    if (num_slices == 0) {
+      printf("No slices given. Add one with --slice\n");
+      goto QUIT;
+    }
+
+    error = IClaunchplan(num_slices, slices, password, &idleshutdown,
+                         gurobi_version, retries, &machine_info);
+    for (i = 0; i < num_slices; i++) {
+      if (slices[i].status) {
+        printf("Slice %s,%s,%s,%d failed: error %d\n", slices[i].region,
+               slices[i].machine_type, slices[i].license_type,
+               slices[i].count, slices[i].status);
+      }
+    }
+
+    if (machine_info) {
+      num_machines = machine_info->num_machines;
+      machines     = machine_info->machines;
+
+      print_machines(&formatter, num_machines, machines);
+    }
+    if (error) goto QUIT;
 
   } else if (command == KILL_COMMAND) {
     num_machines = 0;
     i = cursor;
     for (; cursor < argc; cursor++) {
-      if (strlen(argv[cursor]) != 17) {
-        printf("Invalid machine id: %s\n", argv[cursor]);
-        exit(1);
+      if (strcmp(argv[cursor], "-f") == 0  ||
+          strcmp(argv[cursor], FORMAT) == 0  ) {
+        if (get_format(argv[++cursor], &formatter.format))
+          goto QUIT;
+      } else if (strcmp(argv[cursor], NO_CHECK) == 0) {
+        check = 0;
       } else {
         num_machines++;
       }
@@ -327,21 +1302,54 @@ main(int   argc,
     cursor = i;
     i = 0;
     for (; cursor < argc; cursor++) {
+      if (strcmp(argv[cursor], "-f") == 0  ||
+          strcmp(argv[cursor], FORMAT) == 0  ) {
+        cursor++;
+        continue;
+      }
+      if (strcmp(argv[cursor], NO_CHECK) == 0)
+        continue;
       machine_ids[i] = argv[cursor];
       i++;
     }
 
+    /* Look the machines up in the current fleet, so that a mistyped id
+       is caught before anything is killed and DNS names can be given */
+    if (check) {
+      ICsetindexing(1);
+      error = ICgetmachinefields(IC_FIELD_MACHINE_ID | IC_FIELD_DNS_NAME,
+                                 &current);
+      if (error) goto QUIT;
+    }
+
+    for (i = 0; i < num_machines; i++) {
+      if (!check) {
+        if (strlen(machine_ids[i]) != 17) {
+          printf("Invalid machine id: %s\n", machine_ids[i]);
+          exit(1);
+        }
+      } else if (ICfindmachine(current, machine_ids[i]) < 0) {
+        j = ICfinddns(current, machine_ids[i]);
+        if (j < 0) {
+          printf("Unknown machine: %s\n", machine_ids[i]);
+          exit(1);
+        }
+        machine_ids[i] = current->machines[j].machine_id;
+      }
+    }
+
     error = ICkillmachines(num_machines, machine_ids, &machine_info);
     if (error) goto QUIT;
 
     num_machines = machine_info->num_machines;
     machines     = machine_info->machines;
 
-    print_machines(num_machines, machines);
+    print_machines(&formatter, num_machines, machines);
 
     free(machine_ids);
+    ICfreemachineinfo(&current);
   } else if (command == MACHINES_COMMAND) {
-    for (cursor = cursor - 1; cursor < argc; cursor++) {
+    for (cursor = command_at + 1; cursor < argc; cursor++) {
       if (strlen(argv[cursor]) > 1 &&
           argv[cursor][0] == '-'     ) {
         if (strcmp(argv[cursor], "-s") == 0   ||
@@ -355,6 +1363,32 @@ main(int   argc,
         } else if (strcmp(argv[cursor], "-r") == 0 ||
                    strcmp(argv[cursor], READY) == 0  ) {
           flag = READY_FLAG;
+        } else if (strcmp(argv[cursor], FILTER) == 0) {
+          if (query_parse_filter(&query, argv[++cursor])) {
+            printf("Bad option %s for filter\n", argv[cursor]);
+            goto QUIT;
+          }
+        } else if (strcmp(argv[cursor], FIELDS) == 0) {
+          if (query_parse_fields(query.fields, &query.num_fields,
+                                 argv[++cursor])) {
+            printf("Bad option %s for fields\n", argv[cursor]);
+            goto QUIT;
+          }
+        } else if (strcmp(argv[cursor], COUNT_BY) == 0) {
+          if (query_parse_fields(query.group, &query.num_group,
+                                 argv[++cursor])) {
+            printf("Bad option %s for count-by\n", argv[cursor]);
+            goto QUIT;
+          }
+        } else if (strcmp(argv[cursor], AT) == 0) {
+          if (get_time(argv[++cursor], &at_ms))
+            goto QUIT;
+        } else if (strcmp(argv[cursor], TIME_IN_STATE) == 0) {
+          time_in_state = 1;
+        } else if (strcmp(argv[cursor], "-f") == 0  ||
+                   strcmp(argv[cursor], FORMAT) == 0  ) {
+          if (get_format(argv[++cursor], &formatter.format))
+            goto QUIT;
         }
       }
     }
@@ -363,86 +1397,316 @@ main(int   argc,
     printf("machines flag %d\n", flag);
 #endif
 
-    error = ICgetmachines(&machine_info);
+    if (flag == SERVERS_FLAG) {
+      query_parse_filter(&query, servers_filter);
+    } else if (flag == WORKERS_FLAG) {
+      /* Workers are only of use once there is a server to join */
+      server_query = query;
+      query_parse_filter(&server_query, servers_filter);
+      query_parse_filter(&query, ready_filter);
+    } else if (flag == READY_FLAG) {
+      query_parse_filter(&query, ready_filter);
+    }
+
+    /* Only decode the fields that are filtered on or printed */
+    print_dns = (flag == SERVERS_FLAG || flag == WORKERS_FLAG) &&
+                formatter.format == FORMAT_TEXT && query.num_fields == 0;
+    fields = query_fieldmask(&query);
+    if (flag == WORKERS_FLAG)
+      fields |= query_fieldmask(&server_query);
+    if (print_dns)
+      fields |= IC_FIELD_DNS_NAME;
+    else if (query.num_group == 0 && query.num_fields == 0)
+      fields = IC_FIELD_ALL;
+
+    if ((at_ms >= 0 || time_in_state) && !history) {
+      printf("Name the history to read with --history\n");
+      goto QUIT;
+    }
+
+    if (time_in_state) {
+      error = print_time_in_state(&formatter, history, at_ms);
+      if (error)
+        printf("Could not read the history %s\n", history);
+      goto QUIT;
+    }
+
+    if (history) {
+      error = IChistorymachines(history, at_ms, &machine_info, &published_ms);
+      if (error) {
+        printf("Could not read the history %s\n", history);
+        goto QUIT;
+      }
+    } else if (snapshot) {
+      error = ICopensnapshot(snapshot, &snap);
+      if (!error)
+        error = ICsnapshotmachines(snap, &machine_info, &published_ms);
+      if (!error && published_ms == 0)
+        error = ERROR_INVALID_ARGUMENT;
+      if (error) {
+        printf("Could not read the snapshot %s\n", snapshot);
+        goto QUIT;
+      }
+      if (stats) {
+        clock_gettime(CLOCK_REALTIME, &now);
+        fprintf(stderr, "snapshot age: %.3f s\n",
+                now.tv_sec + now.tv_nsec/1e9 - published_ms/1000.0);
+      }
+    } else {
+      error = ICgetmachinefields(fields, &machine_info);
+      if (error) goto QUIT;
+    }
+
+    error = ICbuildfleet(machine_info, &fleet);
     if (error) goto QUIT;
 
     num_machines = machine_info->num_machines;
     machines     = machine_info->machines;
 
-    if (flag == SERVERS_FLAG) {
-      int server_count = 0;
+    selected = malloc(num_machines + 1);
+    if (selected == NULL) {
+      error = ERROR_OUT_OF_MEMORY;
+      goto QUIT;
+    }
+
+    if (flag == WORKERS_FLAG)
+      has_server = query_select(&server_query, fleet, selected) > 0;
+
+    query_select(&query, fleet, selected);
+    if (!has_server)
+      memset(selected, 0, num_machines);
 
+    if (query.num_group > 0) {
+      error = query_count(&formatter, &query, fleet, selected);
+    } else if (print_dns) {
+      print_hosts(&formatter, fleet, selected);
+      if (flag == SERVERS_FLAG)
+        fmt_puts(&formatter, "\n", 1);
+      fmt_flush(&formatter);
+    } else if (query.num_fields > 0) {
+      query_print(&formatter, &query, fleet, selected);
+    } else {
+      fmt_begin_machines(&formatter);
       for (i = 0; i < num_machines; i++) {
-        if ((strcmp(machines[i].state, STATE_IDLE) == 0   ||
-             strcmp(machines[i].state, STATE_RUNNING) == 0  ) &&
-            strcmp(machines[i].license_type,
-                   LICENSE_FULL_COMPUTE_SERVER) == 0             ) {
-          if (server_count > 0)
-            printf(",");
-          printf("%s", machines[i].dns_name);
-          server_count++;
+        if (selected[i])
+          fmt_machine(&formatter, &machines[i]);
+      }
+      fmt_end_machines(&formatter);
+    }
+  } else if (command == LICENSES_COMMAND) {
+    error = ICgetlicenselist(&num_licenses, &licenses);
+    if (error) goto QUIT;
+
+    fmt_begin_licenses(&formatter);
+    for (i = 0; i < num_licenses; i++)
+      fmt_license(&formatter, &licenses[i]);
+    fmt_end_licenses(&formatter);
+  } else if (command == AUTOSCALE_COMMAND) {
+    autoscale_init(&autoscale);
+    autoscale.idleshutdown = idleshutdown;
+    autoscale.deadline     = deadline;
+
+    for (cursor = command_at + 1; cursor < argc; cursor++) {
+      if (strlen(argv[cursor]) > 1 &&
+          argv[cursor][0] == '-'     ) {
+        if (strcmp(argv[cursor], "-q") == 0  ||
+            strcmp(argv[cursor], QUEUE) == 0   ) {
+          autoscale.queue = argv[++cursor];
+        } else if (strcmp(argv[cursor], SPARE_SERVERS) == 0) {
+          autoscale.spare[POOL_SERVERS] = atoi(argv[++cursor]);
+        } else if (strcmp(argv[cursor], SPARE_WORKERS) == 0) {
+          autoscale.spare[POOL_WORKERS] = atoi(argv[++cursor]);
+        } else if (strcmp(argv[cursor], WORKERS_PER_JOB) == 0) {
+          autoscale.per_job[POOL_WORKERS] = atoi(argv[++cursor]);
+        } else if (strcmp(argv[cursor], MAX_MACHINES) == 0) {
+          autoscale.max_machines = atoi(argv[++cursor]);
+        } else if (strcmp(argv[cursor], COOLDOWN) == 0) {
+          autoscale.cooldown = atoi(argv[++cursor]);
+        } else if (strcmp(argv[cursor], INTERVAL) == 0) {
+          autoscale.interval = atoi(argv[++cursor]);
+        } else if (strcmp(argv[cursor], ONCE) == 0) {
+          autoscale.once = 1;
+        } else if (strcmp(argv[cursor], "-r") == 0  ||
+                   strcmp(argv[cursor], REGION) == 0  ) {
+          autoscale.region = argv[++cursor];
+        } else if (strcmp(argv[cursor], "-m") == 0        ||
+                   strcmp(argv[cursor], MACHINE_TYPE) == 0  ) {
+          autoscale.machine_type = argv[++cursor];
+        } else if (strcmp(argv[cursor], "-p") == 0    ||
+                   strcmp(argv[cursor], PASSWORD) == 0  ) {
+          autoscale.password = argv[++cursor];
+        } else if (strcmp(argv[cursor], "-i") == 0     ||
+                   strcmp(argv[cursor], LICENSE_ID) == 0  ) {
+          licenseid = atoi(argv[++cursor]);
+          autoscale.license_idP = &licenseid;
+        } else if (strcmp(argv[cursor], "-s") == 0         ||
+                   strcmp(argv[cursor], IDLE_SHUTDOWN) == 0   ) {
+          autoscale.idleshutdown = atoi(argv[++cursor]);
+        } else if (strcmp(argv[cursor], "-g") == 0          ||
+                   strcmp(argv[cursor], GUROBI_VERSION) == 0  ) {
+          autoscale.gurobi_version = argv[++cursor];
         }
       }
-      printf("\n");
-    } else if (flag == WORKERS_FLAG) {
-      int has_server = 0;
-      int worker_count = 0;
+    }
 
-      for (i = 0; i < num_machines; i++) {
-        if ((strcmp(machines[i].state, STATE_IDLE) == 0   ||
-             strcmp(machines[i].state, STATE_RUNNING) == 0  )  &&
-            strcmp(machines[i].license_type,
-                   LICENSE_FULL_COMPUTE_SERVER) == 0             ) {
-           has_server = 1;
-           break;
-         }
+    if (autoscale.queue == NULL) {
+      printf("No queue given. Name the queue depth file with --queue\n");
+      goto QUIT;
+    }
+    if (autoscale.interval <= 0 || autoscale.max_machines < 0) {
+      printf("Bad option for interval or max-machines\n");
+      goto QUIT;
+    }
+    /* Spares outlive the autoscaler only up to the idle shutdown */
+    if (60*autoscale.idleshutdown < autoscale.cooldown)
+      printf("Note: idle shutdown of %d minutes is below the cooldown\n",
+             autoscale.idleshutdown);
+
+    error = autoscale_run(&autoscale);
+    if (error) goto QUIT;
+  } else if (command == PUBLISH_COMMAND) {
+    for (cursor = command_at + 1; cursor < argc; cursor++) {
+      if (strcmp(argv[cursor], INTERVAL) == 0) {
+        interval = atoi(argv[++cursor]);
+      } else if (strcmp(argv[cursor], ONCE) == 0) {
+        once = 1;
       }
+    }
 
-      if (has_server) {
-        for (i = 0; i < num_machines; i++) {
-          if (strcmp(machines[i].state, STATE_IDLE) == 0   ||
-              strcmp(machines[i].state, STATE_RUNNING) == 0  ) {
-            if (worker_count > 0)
-              printf(",");
-            printf("%s", machines[i].dns_name);
-            worker_count++;
-          }
+    if (interval <= 0) {
+      printf("Bad option for interval\n");
+      goto QUIT;
+    }
+
+    error = publish_fleet(snapshot ? snapshot : DEFAULT_SNAPSHOT, interval,
+                          once);
+    if (error) goto QUIT;
+  } else if (command == APPLY_COMMAND) {
+    apply_init(&apply);
+    apply.idleshutdown = idleshutdown;
+    apply.retries      = retries;
+
+    for (cursor = command_at + 1; cursor < argc; cursor++) {
+      if (strlen(argv[cursor]) > 1 &&
+          argv[cursor][0] == '-'     ) {
+        if (strcmp(argv[cursor], DRY_RUN) == 0) {
+          apply.dry_run = 1;
+        } else if (strcmp(argv[cursor], PRUNE) == 0) {
+          apply.prune = 1;
+        } else if (strcmp(argv[cursor], FORCE) == 0) {
+          apply.force = 1;
+        } else if (strcmp(argv[cursor], WAIT) == 0) {
+          apply.wait = 1;
+        } else if (strcmp(argv[cursor], INTERVAL) == 0) {
+          apply.interval = atoi(argv[++cursor]);
+        } else if (strcmp(argv[cursor], TIMEOUT) == 0) {
+          apply.timeout = atoi(argv[++cursor]);
+        } else if (strcmp(argv[cursor], "-p") == 0    ||
+                   strcmp(argv[cursor], PASSWORD) == 0  ) {
+          apply.password = argv[++cursor];
+        } else if (strcmp(argv[cursor], "-s") == 0         ||
+                   strcmp(argv[cursor], IDLE_SHUTDOWN) == 0   ) {
+          apply.idleshutdown = atoi(argv[++cursor]);
+        } else if (strcmp(argv[cursor], "-g") == 0          ||
+                   strcmp(argv[cursor], GUROBI_VERSION) == 0  ) {
+          apply.gurobi_version = argv[++cursor];
+        } else if (strcmp(argv[cursor], RETRIES) == 0) {
+          apply.retries = atoi(argv[++cursor]);
+        } else if (global_value_option(argv[cursor])) {
+          cursor++;
         }
+      } else {
+        desired = argv[cursor];
       }
-    } else {
-      print_machines(num_machines, machines);
     }
-  } else if (command == LICENSES_COMMAND) {
-    error = ICgetlicenses(&num_licenses, NULL);
-    if (error) goto QUIT;
 
-    licenses = malloc(sizeof(ICcloudlicense)*num_licenses);
-    if (licenses == NULL) {
-      error = ERROR_OUT_OF_MEMORY;
+    if (desired == NULL) {
+      printf("No desired state given. Name the file after apply\n");
+      goto QUIT;
+    }
+    if (apply.interval <= 0 || apply.timeout < 0) {
+      printf("Bad option for interval or timeout\n");
       goto QUIT;
     }
+    if (read_desired(desired, &desired_buf, &slices, &num_slices))
+      goto QUIT;
 
-    error = ICgetlicenses(&num_licenses, licenses);
+    apply.groups     = slices;
+    apply.num_groups = num_slices;
+    error = apply_run(&apply);
     if (error) goto QUIT;
+  } else if (command == HISTORY_COMMAND) {
+    for (cursor = command_at + 1; cursor < argc; cursor++) {
+      if (strcmp(argv[cursor], INTERVAL) == 0) {
+        interval = atoi(argv[++cursor]);
+      } else if (strcmp(argv[cursor], ONCE) == 0) {
+        once = 1;
+      } else if (global_value_option(argv[cursor])) {
+        cursor++;
+      } else if (argv[cursor][0] != '-') {
+        history = argv[cursor];
+      }
+    }
 
-    printf("License Id   Credit  Rate      Expiration\n");
-    for (i = 0; i < num_licenses; i++) {
-      printf("%d     ", licenses[i].license_id);
-      printf(" %8.2f ", licenses[i].credit);
-      printf(" %s ",    licenses[i].rate_plan);
-      printf(" %s\n",   licenses[i].expiration);
+    if (history == NULL) {
+      printf("No history given. Name the file after history\n");
+      goto QUIT;
+    }
+    if (interval <= 0) {
+      printf("Bad option for interval\n");
+      goto QUIT;
     }
+
+    error = record_history(history, interval, once);
+    if (error) goto QUIT;
   }
 
 QUIT:
-  if (licenses) {
-    free(licenses);
-    licenses = NULL;
+  /* apply --wait also times out on its own --timeout */
+  if (error == ERROR_TIMEOUT && deadline > 0 && ICnowms() >= ICgetdeadline())
+    printf("Gave up at the deadline of %d seconds\n", deadline);
+
+  if (slices) {
+    free(slices);
+    slices = NULL;
+  }
+
+  if (desired_buf) {
+    free(desired_buf);
+    desired_buf = NULL;
   }
 
-  error = ICfreemachineinfo(&machine_info);
-  if (error)
-    printf("error %d\n", error);
+  if (selected) {
+    free(selected);
+    selected = NULL;
+  }
+
+  ICfreelicenses(&licenses);
+  ICfreefleet(&fleet);
+  ICfreesnapshot(&snap);
+
+  if (formatter.buf) {
+    fmt_free(&formatter);
+    if (!error)
+      error = formatter.error;
+  }
+
+  if (stats)
+    print_stats();
+
+  if (ICstoptrace())
+    printf("Could not write the trace to %s\n", trace);
+
+  ICsettransport(NULL);
+  ICfreetransport(&transport);
+  ICfreetransport(&curl);
+
+  /* The command's error is the one returned */
+  cleanup = ICfreemachineinfo(&machine_info);
+  if (cleanup)
+    printf("error %d\n", cleanup);
+  if (!error)
+    error = cleanup;
 
   return error;
 }
@@ -0,0 +1,1076 @@
+/* Instant Cloud Client, C++17 wrapper.
+
+   Header only: link against cloud.o as a C program would.  Client,
+   Fleet, Licenses and Views are move-only and own the results of the C
+   layer, which are exposed as spans and string views into them without
+   copying.  Every call comes in two forms, one that reports failure
+   through a std::error_code and one that throws std::system_error.
+   A CallScope bounds the blocking calls of a thread by a deadline and a
+   CancelToken; the awaitables take theirs with until and cancel_with. */
+#ifndef _INSTANTCLOUD_HPP
+#define _INSTANTCLOUD_HPP
+
+#include <chrono>
+#include <cstddef>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+
+#if __cplusplus >= 202002L && defined(__has_include)
+#if __has_include(<span>)
+#include <span>
+#define IC_HAVE_STD_SPAN 1
+#endif
+#if __has_include(<coroutine>) && defined(__cpp_impl_coroutine)
+#include <condition_variable>
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
+#define IC_HAVE_COROUTINES 1
+#endif
+#endif
+
+extern "C" {
+#include "cloud.h"
+}
+
+namespace instantcloud {
+
+/* std::span where the standard library has it, otherwise the subset
+   of it the wrapper needs */
+#ifdef IC_HAVE_STD_SPAN
+template <class T> using span = std::span<T>;
+#else
+template <class T>
+class span
+{
+public:
+  using element_type = T;
+  using value_type   = std::remove_cv_t<T>;
+  using size_type    = std::size_t;
+  using pointer      = T *;
+  using reference    = T &;
+  using iterator     = T *;
+
+  constexpr span() noexcept = default;
+  constexpr span(T *data, size_type size) noexcept : data_(data), size_(size) {}
+  template <std::size_t N>
+  constexpr span(T (&array)[N]) noexcept : data_(array), size_(N) {}
+  template <class C, class = std::enable_if_t<std::is_convertible_v<
+                       decltype(std::declval<C &>().data()), T *>>>
+  constexpr span(C &c) noexcept : data_(c.data()), size_(c.size()) {}
+
+  constexpr T        *data() const noexcept { return data_; }
+  constexpr size_type size() const noexcept { return size_; }
+  constexpr bool      empty() const noexcept { return size_ == 0; }
+  constexpr iterator  begin() const noexcept { return data_; }
+  constexpr iterator  end() const noexcept { return data_ + size_; }
+  constexpr reference operator[](size_type i) const { return data_[i]; }
+  constexpr reference front() const { return data_[0]; }
+  constexpr reference back() const { return data_[size_ - 1]; }
+
+private:
+  T        *data_ = nullptr;
+  size_type size_ = 0;
+};
+#endif
+
+/* Error codes of the C layer */
+enum class errc
+{
+  null_argument    = ERROR_NULL_ARGUMENT,
+  invalid_argument = ERROR_INVALID_ARGUMENT,
+  network          = ERROR_NETWORK,
+  out_of_memory    = ERROR_OUT_OF_MEMORY,
+  timeout          = ERROR_TIMEOUT,
+  cancelled        = ERROR_CANCELLED,
+};
+
+class error_category_impl : public std::error_category
+{
+public:
+  const char *name() const noexcept override { return "instantcloud"; }
+
+  std::string message(int code) const override
+  {
+    switch (static_cast<errc>(code)) {
+    case errc::null_argument:    return "null argument";
+    case errc::invalid_argument: return "invalid argument";
+    case errc::network:          return "network or server error";
+    case errc::out_of_memory:    return "out of memory";
+    case errc::timeout:          return "deadline passed";
+    case errc::cancelled:        return "cancelled";
+    }
+    return "unknown error " + std::to_string(code);
+  }
+
+  std::error_condition default_error_condition(int code) const noexcept override
+  {
+    switch (static_cast<errc>(code)) {
+    case errc::invalid_argument:
+    case errc::null_argument:
+      return std::errc::invalid_argument;
+    case errc::out_of_memory:
+      return std::errc::not_enough_memory;
+    case errc::timeout:
+      return std::errc::timed_out;
+    case errc::cancelled:
+      return std::errc::operation_canceled;
+    default:
+      return std::error_condition(code, *this);
+    }
+  }
+};
+
+inline const std::error_category &
+error_category() noexcept
+{
+  static const error_category_impl category;
+  return category;
+}
+
+inline std::error_code
+make_error_code(errc e) noexcept
+{
+  return std::error_code(static_cast<int>(e), error_category());
+}
+
+namespace detail {
+
+inline std::error_code
+check(int error) noexcept
+{
+  return error ? std::error_code(error, error_category()) : std::error_code();
+}
+
+inline void
+throw_if(const std::error_code &ec, const char *what)
+{
+  if (ec)
+    throw std::system_error(ec, what);
+}
+
+/* A steady_clock time as a deadline of the C layer */
+inline long long
+deadline_ms(std::chrono::steady_clock::time_point deadline) noexcept
+{
+  auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+                deadline - std::chrono::steady_clock::now()).count();
+  return ICnowms() + (left > 0 ? left : 0);
+}
+
+/* The C structs hold NUL terminated strings in fixed arrays */
+template <std::size_t N>
+inline std::string_view
+field(const char (&s)[N]) noexcept
+{
+  return std::string_view(s, strnlen(s, N));
+}
+
+} // namespace detail
+
+/* Field accessors, for iterating a Fleet without copying */
+inline std::string_view machine_id(const ICmachine &m)    { return detail::field(m.machine_id); }
+inline std::string_view state(const ICmachine &m)         { return detail::field(m.state); }
+inline std::string_view dns_name(const ICmachine &m)      { return detail::field(m.dns_name); }
+inline std::string_view create_time(const ICmachine &m)   { return detail::field(m.create_time); }
+inline std::string_view machine_type(const ICmachine &m)  { return detail::field(m.machine_type); }
+inline std::string_view region(const ICmachine &m)        { return detail::field(m.region); }
+inline std::string_view license_type(const ICmachine &m)  { return detail::field(m.license_type); }
+inline std::string_view user_password(const ICmachine &m) { return detail::field(m.user_password); }
+
+inline std::string_view expiration(const ICcloudlicense &l) { return detail::field(l.expiration); }
+inline std::string_view rate_plan(const ICcloudlicense &l)  { return detail::field(l.rate_plan); }
+
+/* The raw JSON bytes of a view field, empty when it was missing */
+inline std::string_view
+value(const ICstrview &v) noexcept
+{
+  return v.ptr ? std::string_view(v.ptr, static_cast<std::size_t>(v.len))
+               : std::string_view();
+}
+
+/* Machines returned by a listing, a launch or a kill */
+class Fleet
+{
+public:
+  Fleet() noexcept = default;
+  explicit Fleet(ICmachineinfo *info) noexcept : info_(info) {}
+  Fleet(Fleet &&other) noexcept : info_(std::exchange(other.info_, nullptr)) {}
+  Fleet &operator=(Fleet &&other) noexcept
+  {
+    if (this != &other) {
+      reset();
+      info_ = std::exchange(other.info_, nullptr);
+    }
+    return *this;
+  }
+  Fleet(const Fleet &) = delete;
+  Fleet &operator=(const Fleet &) = delete;
+  ~Fleet() { reset(); }
+
+  span<const ICmachine> machines() const noexcept
+  {
+    if (info_ == nullptr || info_->machines == nullptr)
+      return {};
+    return { info_->machines, static_cast<std::size_t>(info_->num_machines) };
+  }
+
+  const ICmachine *begin() const noexcept { return machines().data(); }
+  const ICmachine *end() const noexcept { return begin() + size(); }
+  std::size_t size() const noexcept { return machines().size(); }
+  bool empty() const noexcept { return size() == 0; }
+  const ICmachine &operator[](std::size_t i) const { return info_->machines[i]; }
+
+  /* Fields decoded by the listing, IC_FIELD_* bits */
+  unsigned int fields() const noexcept { return info_ ? info_->fields : 0; }
+
+  /* The machine with this ID or DNS name, or nullptr */
+  const ICmachine *find(const char *machine_id) const noexcept
+  {
+    int i = ICfindmachine(info_, machine_id);
+    return i < 0 ? nullptr : &info_->machines[i];
+  }
+  const ICmachine *find_dns(const char *dns_name) const noexcept
+  {
+    int i = ICfinddns(info_, dns_name);
+    return i < 0 ? nullptr : &info_->machines[i];
+  }
+
+  const ICmachineinfo *get() const noexcept { return info_; }
+  ICmachineinfo *release() noexcept { return std::exchange(info_, nullptr); }
+
+  void reset() noexcept
+  {
+    if (info_)
+      ICfreemachineinfo(&info_);
+  }
+
+private:
+  ICmachineinfo *info_ = nullptr;
+};
+
+class Licenses
+{
+public:
+  Licenses() noexcept = default;
+  Licenses(ICcloudlicense *licenses, int num_licenses) noexcept
+    : licenses_(licenses), num_licenses_(num_licenses) {}
+  Licenses(Licenses &&other) noexcept
+    : licenses_(std::exchange(other.licenses_, nullptr)),
+      num_licenses_(std::exchange(other.num_licenses_, 0)) {}
+  Licenses &operator=(Licenses &&other) noexcept
+  {
+    if (this != &other) {
+      ICfreelicenses(&licenses_);
+      licenses_     = std::exchange(other.licenses_, nullptr);
+      num_licenses_ = std::exchange(other.num_licenses_, 0);
+    }
+    return *this;
+  }
+  Licenses(const Licenses &) = delete;
+  Licenses &operator=(const Licenses &) = delete;
+  ~Licenses() { ICfreelicenses(&licenses_); }
+
+  span<const ICcloudlicense> licenses() const noexcept
+  {
+    return { licenses_, static_cast<std::size_t>(num_licenses_) };
+  }
+
+  const ICcloudlicense *begin() const noexcept { return licenses_; }
+  const ICcloudlicense *end() const noexcept { return licenses_ + num_licenses_; }
+  std::size_t size() const noexcept { return static_cast<std::size_t>(num_licenses_); }
+  bool empty() const noexcept { return num_licenses_ == 0; }
+  const ICcloudlicense &operator[](std::size_t i) const { return licenses_[i]; }
+
+private:
+  ICcloudlicense *licenses_     = nullptr;
+  int             num_licenses_ = 0;
+};
+
+/* Machine records pointing into the retained response */
+class Views
+{
+public:
+  Views() noexcept = default;
+  explicit Views(ICmachineviews *views) noexcept : views_(views) {}
+  Views(Views &&other) noexcept : views_(std::exchange(other.views_, nullptr)) {}
+  Views &operator=(Views &&other) noexcept
+  {
+    if (this != &other) {
+      ICfreemachineviews(&views_);
+      views_ = std::exchange(other.views_, nullptr);
+    }
+    return *this;
+  }
+  Views(const Views &) = delete;
+  Views &operator=(const Views &) = delete;
+  ~Views() { ICfreemachineviews(&views_); }
+
+  span<const ICmachineview> machines() const noexcept
+  {
+    if (views_ == nullptr || views_->machines == nullptr)
+      return {};
+    return { views_->machines, static_cast<std::size_t>(views_->num_machines) };
+  }
+
+  const ICmachineview *begin() const noexcept { return machines().data(); }
+  const ICmachineview *end() const noexcept { return begin() + size(); }
+  std::size_t size() const noexcept { return machines().size(); }
+  bool empty() const noexcept { return size() == 0; }
+  const ICmachineview &operator[](std::size_t i) const { return views_->machines[i]; }
+
+private:
+  ICmachineviews *views_ = nullptr;
+};
+
+/* Launch options; a null pointer selects the server's default */
+struct LaunchOptions
+{
+  const char *license_type   = nullptr;
+  const int  *license_id     = nullptr;
+  const char *password       = nullptr;
+  const char *region         = nullptr;
+  const char *machine_type   = nullptr;
+  const int  *idle_shutdown  = nullptr;
+  const char *gurobi_version = nullptr;
+};
+
+/* Cancels the calls and operations it was given to, from any thread.
+   It must outlive them. */
+class CancelToken
+{
+public:
+  explicit CancelToken(std::error_code &ec) noexcept
+  {
+    ec = detail::check(ICcreatecanceltoken(&token_));
+  }
+  CancelToken()
+  {
+    detail::throw_if(detail::check(ICcreatecanceltoken(&token_)),
+                     "ICcreatecanceltoken");
+  }
+  CancelToken(CancelToken &&other) noexcept
+    : token_(std::exchange(other.token_, nullptr)) {}
+  CancelToken &operator=(CancelToken &&other) noexcept
+  {
+    if (this != &other) {
+      ICfreecanceltoken(&token_);
+      token_ = std::exchange(other.token_, nullptr);
+    }
+    return *this;
+  }
+  CancelToken(const CancelToken &) = delete;
+  CancelToken &operator=(const CancelToken &) = delete;
+  ~CancelToken() { ICfreecanceltoken(&token_); }
+
+  void cancel() noexcept { ICcancel(token_); }
+  bool cancelled() const noexcept { return ICiscancelled(token_); }
+
+  ICcanceltoken *get() const noexcept { return token_; }
+
+private:
+  ICcanceltoken *token_ = nullptr;
+};
+
+/* The deadline and token of the calling thread's blocking calls while
+   it lives; the previous ones are restored after.  Nested in another,
+   it keeps the earlier deadline and its token replaces the other's.  A
+   coroutine must not hold one across co_await, since it may resume on
+   another thread. */
+class CallScope
+{
+public:
+  explicit CallScope(std::chrono::steady_clock::time_point deadline,
+                     CancelToken *token = nullptr) noexcept
+  {
+    long long ms = detail::deadline_ms(deadline);
+    ICsetdeadline(deadline_ && deadline_ < ms ? deadline_ : ms);
+    if (token)
+      ICsetcanceltoken(token->get());
+  }
+  explicit CallScope(std::chrono::milliseconds timeout,
+                     CancelToken *token = nullptr) noexcept
+    : CallScope(std::chrono::steady_clock::now() + timeout, token) {}
+  explicit CallScope(CancelToken &token) noexcept
+  {
+    ICsetcanceltoken(token.get());
+  }
+  CallScope(const CallScope &) = delete;
+  CallScope &operator=(const CallScope &) = delete;
+  ~CallScope()
+  {
+    ICsetdeadline(deadline_);
+    ICsetcanceltoken(token_);
+  }
+
+private:
+  long long      deadline_ = ICgetdeadline();
+  ICcanceltoken *token_    = ICgetcanceltoken();
+};
+
+#ifdef IC_HAVE_COROUTINES
+
+/* Coroutines.  The awaitables start their operation on the pool of
+   the C layer, whose thread drives every transfer of the process, so a
+   suspended call holds no thread.  When the answer is in, the pool
+   thread hands the coroutine to a Scheduler, and the answer is decoded
+   where it resumes.  The default scheduler resumes on the pool thread
+   itself, which suits short continuations; an EventLoop runs them on a
+   thread of your choosing instead.  Nothing may call the blocking API
+   from the pool thread. */
+
+struct Scheduler
+{
+  void (*post)(void *context, std::coroutine_handle<> handle);
+  void  *context;
+};
+
+inline Scheduler
+inline_scheduler() noexcept
+{
+  return { [](void *, std::coroutine_handle<> handle) { handle.resume(); },
+           nullptr };
+}
+
+template <class T> class Task;
+
+namespace detail {
+
+template <class T>
+class TaskPromiseBase
+{
+public:
+  std::suspend_always initial_suspend() noexcept { return {}; }
+
+  struct FinalAwaiter
+  {
+    bool await_ready() noexcept { return false; }
+    template <class P>
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept
+    {
+      auto continuation = h.promise().continuation_;
+      return continuation ? continuation : std::noop_coroutine();
+    }
+    void await_resume() noexcept {}
+  };
+  FinalAwaiter final_suspend() noexcept { return {}; }
+
+  void unhandled_exception() noexcept { exception_ = std::current_exception(); }
+
+  std::coroutine_handle<> continuation_;
+  std::exception_ptr      exception_;
+};
+
+template <class T>
+class TaskPromise : public TaskPromiseBase<T>
+{
+public:
+  Task<T> get_return_object() noexcept;
+  template <class U> void return_value(U &&value) { value_.emplace(std::forward<U>(value)); }
+  T result()
+  {
+    if (this->exception_)
+      std::rethrow_exception(this->exception_);
+    return std::move(*value_);
+  }
+
+  std::optional<T> value_;
+};
+
+template <>
+class TaskPromise<void> : public TaskPromiseBase<void>
+{
+public:
+  Task<void> get_return_object() noexcept;
+  void return_void() noexcept {}
+  void result()
+  {
+    if (exception_)
+      std::rethrow_exception(exception_);
+  }
+};
+
+} // namespace detail
+
+/* A lazily started coroutine, run by co_await-ing it */
+template <class T = void>
+class [[nodiscard]] Task
+{
+public:
+  using promise_type = detail::TaskPromise<T>;
+
+  explicit Task(std::coroutine_handle<promise_type> h) noexcept : handle_(h) {}
+  Task(Task &&other) noexcept : handle_(std::exchange(other.handle_, nullptr)) {}
+  Task &operator=(Task &&other) noexcept
+  {
+    if (this != &other) {
+      if (handle_)
+        handle_.destroy();
+      handle_ = std::exchange(other.handle_, nullptr);
+    }
+    return *this;
+  }
+  Task(const Task &) = delete;
+  Task &operator=(const Task &) = delete;
+  ~Task()
+  {
+    if (handle_)
+      handle_.destroy();
+  }
+
+  bool await_ready() const noexcept { return false; }
+  std::coroutine_handle<> await_suspend(std::coroutine_handle<> continuation) noexcept
+  {
+    handle_.promise().continuation_ = continuation;
+    return handle_;
+  }
+  T await_resume() { return handle_.promise().result(); }
+
+private:
+  std::coroutine_handle<promise_type> handle_;
+};
+
+namespace detail {
+
+template <class T>
+inline Task<T>
+TaskPromise<T>::get_return_object() noexcept
+{
+  return Task<T>(std::coroutine_handle<TaskPromise<T>>::from_promise(*this));
+}
+
+inline Task<void>
+TaskPromise<void>::get_return_object() noexcept
+{
+  return Task<void>(std::coroutine_handle<TaskPromise<void>>::from_promise(*this));
+}
+
+/* A coroutine nobody awaits; it frees itself when it ends */
+struct Detached
+{
+  struct promise_type
+  {
+    Detached get_return_object() noexcept
+    {
+      return { std::coroutine_handle<promise_type>::from_promise(*this) };
+    }
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() noexcept {}
+    void unhandled_exception() noexcept { std::terminate(); }
+  };
+  std::coroutine_handle<promise_type> handle;
+};
+
+} // namespace detail
+
+/* Runs coroutines on the thread that calls run().  spawn() may be
+   called from any thread, including from coroutines of the loop. */
+class EventLoop
+{
+public:
+  EventLoop() = default;
+  EventLoop(const EventLoop &) = delete;
+  EventLoop &operator=(const EventLoop &) = delete;
+
+  Scheduler scheduler() noexcept
+  {
+    return { [](void *context, std::coroutine_handle<> handle) {
+               static_cast<EventLoop *>(context)->post(handle);
+             },
+             this };
+  }
+
+  void post(std::coroutine_handle<> handle)
+  {
+    std::lock_guard<std::mutex> guard(lock_);
+    ready_.push_back(handle);
+    cond_.notify_one();
+  }
+
+  template <class T>
+  void spawn(Task<T> task)
+  {
+    {
+      std::lock_guard<std::mutex> guard(lock_);
+      active_++;
+    }
+    post(run_task(std::move(task)).handle);
+  }
+
+  /* Until every spawned task has ended.  The first exception to escape
+     a task is thrown once they have. */
+  void run()
+  {
+    std::unique_lock<std::mutex> guard(lock_);
+    for (;;) {
+      cond_.wait(guard, [this] { return !ready_.empty() || active_ == 0; });
+      if (ready_.empty())
+        break;
+      std::coroutine_handle<> handle = ready_.front();
+      ready_.pop_front();
+      guard.unlock();
+      handle.resume();
+      guard.lock();
+    }
+    if (exception_)
+      std::rethrow_exception(std::exchange(exception_, nullptr));
+  }
+
+private:
+  template <class T>
+  detail::Detached run_task(Task<T> task)
+  {
+    try {
+      co_await task;
+    } catch (...) {
+      std::lock_guard<std::mutex> guard(lock_);
+      if (!exception_)
+        exception_ = std::current_exception();
+    }
+    std::lock_guard<std::mutex> guard(lock_);
+    if (--active_ == 0)
+      cond_.notify_all();
+  }
+
+  std::mutex                          lock_;
+  std::condition_variable             cond_;
+  std::deque<std::coroutine_handle<>> ready_;
+  std::size_t                         active_ = 0;
+  std::exception_ptr                  exception_;
+};
+
+namespace detail {
+
+/* Shared by the awaitables.  Once the operation has started, done may
+   run and resume the coroutine, which ends the awaitable's life, before
+   the starting call returns: await_suspend must not touch it after. */
+class AsyncCall
+{
+public:
+  bool await_ready() const noexcept { return false; }
+
+protected:
+  AsyncCall(Scheduler scheduler, std::error_code *ec) noexcept
+    : scheduler_(scheduler), ec_(ec) {}
+  /* Only before it is awaited, which no one can do after */
+  AsyncCall(AsyncCall &&other) noexcept
+    : scheduler_(other.scheduler_), ec_(other.ec_),
+      deadline_ms_(other.deadline_ms_), token_(other.token_) {}
+  AsyncCall(const AsyncCall &) = delete;
+  AsyncCall &operator=(const AsyncCall &) = delete;
+  /* An operation still in flight is cancelled, done is not called */
+  ~AsyncCall() { ICfreeasync(&op_); }
+
+  /* The operation takes the deadline and token of the thread that
+     starts it, unless the call was given its own */
+  template <class Start>
+  bool suspend(std::coroutine_handle<> handle, Start start) noexcept
+  {
+    long long      deadline = ICgetdeadline();
+    ICcanceltoken *token    = ICgetcanceltoken();
+
+    handle_ = handle;
+    if (deadline_ms_)
+      ICsetdeadline(deadline_ms_);
+    if (token_)
+      ICsetcanceltoken(token_);
+    int error = start(&AsyncCall::done, this, &op_);
+    ICsetdeadline(deadline);
+    ICsetcanceltoken(token);
+    if (error) {
+      error_ = error;
+      return false;
+    }
+    return true;
+  }
+
+  /* True, with the error reported, when the call failed */
+  bool failed(int error, const char *what)
+  {
+    std::error_code ec = check(error);
+    if (ec_)
+      *ec_ = ec;
+    else
+      throw_if(ec, what);
+    return bool(ec);
+  }
+
+  static void done(ICasync *, void *arg)
+  {
+    AsyncCall *self = static_cast<AsyncCall *>(arg);
+    self->scheduler_.post(self->scheduler_.context, self->handle_);
+  }
+
+  Scheduler               scheduler_;
+  std::error_code        *ec_;
+  std::coroutine_handle<> handle_;
+  ICasync                *op_    = nullptr;
+  int                     error_ = 0;
+  long long               deadline_ms_ = 0;
+  ICcanceltoken          *token_       = nullptr;
+};
+
+/* until and cancel_with, for co_await client.async_machines().until(t) */
+template <class Call>
+class BoundedCall : public AsyncCall
+{
+public:
+  Call until(std::chrono::steady_clock::time_point deadline) &&
+  {
+    deadline_ms_ = deadline_ms(deadline);
+    return std::move(static_cast<Call &>(*this));
+  }
+  Call cancel_with(CancelToken &token) &&
+  {
+    token_ = token.get();
+    return std::move(static_cast<Call &>(*this));
+  }
+
+protected:
+  using AsyncCall::AsyncCall;
+};
+
+} // namespace detail
+
+class MachinesCall : public detail::BoundedCall<MachinesCall>
+{
+public:
+  using Start = std::function<int(ICasynccallback, void *, ICasync **)>;
+
+  MachinesCall(Scheduler scheduler, std::error_code *ec, const char *what,
+               Start start)
+    : BoundedCall(scheduler, ec), what_(what), start_(std::move(start)) {}
+
+  bool await_suspend(std::coroutine_handle<> handle) noexcept
+  {
+    return suspend(handle, start_);
+  }
+
+  Fleet await_resume()
+  {
+    ICmachineinfo *info = nullptr;
+    int error = error_ ? error_ : ICfinishmachines(&op_, &info);
+    if (failed(error, what_))
+      return Fleet();
+    return Fleet(info);
+  }
+
+private:
+  const char *what_;
+  Start       start_;
+};
+
+class LicensesCall : public detail::BoundedCall<LicensesCall>
+{
+public:
+  LicensesCall(Scheduler scheduler, std::error_code *ec)
+    : BoundedCall(scheduler, ec) {}
+
+  bool await_suspend(std::coroutine_handle<> handle) noexcept
+  {
+    return suspend(handle, ICstartgetlicenses);
+  }
+
+  Licenses await_resume()
+  {
+    ICcloudlicense *licenses = nullptr;
+    int num_licenses = 0;
+    int error = error_ ? error_ : ICfinishlicenses(&op_, &num_licenses, &licenses);
+    if (failed(error, "ICstartgetlicenses"))
+      return Licenses();
+    return Licenses(licenses, num_licenses);
+  }
+};
+
+/* Ends early, with errc::timeout or errc::cancelled, at the deadline or
+   on cancellation */
+class DelayCall : public detail::BoundedCall<DelayCall>
+{
+public:
+  DelayCall(Scheduler scheduler, std::chrono::milliseconds delay)
+    : BoundedCall(scheduler, nullptr), ms_(static_cast<int>(delay.count())) {}
+
+  bool await_suspend(std::coroutine_handle<> handle) noexcept
+  {
+    int ms = ms_;
+    return suspend(handle, [ms](ICasynccallback done, void *arg, ICasync **opP) {
+      return ICstartdelay(ms, done, arg, opP);
+    });
+  }
+
+  void await_resume()
+  {
+    failed(error_ ? error_ : ICfinishdelay(&op_), "ICstartdelay");
+  }
+
+private:
+  int ms_;
+};
+
+#endif
+
+/* The C layer keeps one set of credentials per process: constructing a
+   Client sets them, and the last Client constructed is the one in use */
+class Client
+{
+public:
+  Client(const char *access_id, const char *secret_key, std::error_code &ec) noexcept
+  {
+    ec = detail::check(ICcloudcreds(const_cast<char *>(access_id),
+                                    const_cast<char *>(secret_key)));
+  }
+  Client(const char *access_id, const char *secret_key)
+  {
+    detail::throw_if(detail::check(ICcloudcreds(const_cast<char *>(access_id),
+                                                const_cast<char *>(secret_key))),
+                     "ICcloudcreds");
+  }
+  Client(Client &&) noexcept = default;
+  Client &operator=(Client &&) noexcept = default;
+  Client(const Client &) = delete;
+  Client &operator=(const Client &) = delete;
+
+  Fleet machines(std::error_code &ec, unsigned int fields = IC_FIELD_ALL) noexcept
+  {
+    ICmachineinfo *info = nullptr;
+    ec = detail::check(ICgetmachinefields(fields, &info));
+    return Fleet(ec ? nullptr : info);
+  }
+  Fleet machines(unsigned int fields = IC_FIELD_ALL)
+  {
+    std::error_code ec;
+    Fleet fleet = machines(ec, fields);
+    detail::throw_if(ec, "ICgetmachinefields");
+    return fleet;
+  }
+
+  Views views(std::error_code &ec) noexcept
+  {
+    ICmachineviews *views = nullptr;
+    ec = detail::check(ICgetmachineviews(&views));
+    return Views(ec ? nullptr : views);
+  }
+  Views views()
+  {
+    std::error_code ec;
+    Views v = views(ec);
+    detail::throw_if(ec, "ICgetmachineviews");
+    return v;
+  }
+
+  Licenses licenses(std::error_code &ec) noexcept
+  {
+    ICcloudlicense *licenses = nullptr;
+    int num_licenses = 0;
+    ec = detail::check(ICgetlicenselist(&num_licenses, &licenses));
+    if (ec)
+      return Licenses();
+    return Licenses(licenses, num_licenses);
+  }
+  Licenses licenses()
+  {
+    std::error_code ec;
+    Licenses l = licenses(ec);
+    detail::throw_if(ec, "ICgetlicenselist");
+    return l;
+  }
+
+  Fleet launch(int n, const LaunchOptions &options, std::error_code &ec) noexcept
+  {
+    ICmachineinfo *info = nullptr;
+    ec = detail::check(IClaunchmachines(n, const_cast<char *>(options.license_type),
+                                        const_cast<int *>(options.license_id),
+                                        const_cast<char *>(options.password),
+                                        const_cast<char *>(options.region),
+                                        const_cast<char *>(options.machine_type),
+                                        const_cast<int *>(options.idle_shutdown),
+                                        const_cast<char *>(options.gurobi_version),
+                                        &info));
+    return Fleet(ec ? nullptr : info);
+  }
+  Fleet launch(int n, const LaunchOptions &options = LaunchOptions())
+  {
+    std::error_code ec;
+    Fleet fleet = launch(n, options, ec);
+    detail::throw_if(ec, "IClaunchmachines");
+    return fleet;
+  }
+
+  /* The C layer only reads the ids */
+  Fleet kill(span<const char *const> machine_ids, std::error_code &ec) noexcept
+  {
+    ICmachineinfo *info = nullptr;
+    ec = detail::check(ICkillmachines(static_cast<int>(machine_ids.size()),
+                                      const_cast<char **>(machine_ids.data()),
+                                      &info));
+    return Fleet(ec ? nullptr : info);
+  }
+  Fleet kill(span<const char *const> machine_ids)
+  {
+    std::error_code ec;
+    Fleet fleet = kill(machine_ids, ec);
+    detail::throw_if(ec, "ICkillmachines");
+    return fleet;
+  }
+
+#ifdef IC_HAVE_COROUTINES
+  /* Where the coroutines awaiting this client's calls resume */
+  void set_scheduler(Scheduler scheduler) noexcept { scheduler_ = scheduler; }
+
+  /* The awaitables take the error_code, like the blocking calls, or
+     throw from co_await */
+  MachinesCall async_machines(unsigned int fields = IC_FIELD_ALL)
+  {
+    return async_machines(nullptr, fields);
+  }
+  MachinesCall async_machines(std::error_code &ec, unsigned int fields = IC_FIELD_ALL)
+  {
+    return async_machines(&ec, fields);
+  }
+
+  LicensesCall async_licenses() { return LicensesCall(scheduler_, nullptr); }
+  LicensesCall async_licenses(std::error_code &ec) { return LicensesCall(scheduler_, &ec); }
+
+  MachinesCall async_launch(int n, const LaunchOptions &options = LaunchOptions())
+  {
+    return async_launch(nullptr, n, options);
+  }
+  MachinesCall async_launch(int n, const LaunchOptions &options, std::error_code &ec)
+  {
+    return async_launch(&ec, n, options);
+  }
+
+  /* The ids are copied into the request when the call starts */
+  MachinesCall async_kill(span<const char *const> machine_ids)
+  {
+    return async_kill(nullptr, machine_ids);
+  }
+  MachinesCall async_kill(span<const char *const> machine_ids, std::error_code &ec)
+  {
+    return async_kill(&ec, machine_ids);
+  }
+
+  DelayCall sleep_for(std::chrono::milliseconds delay)
+  {
+    return DelayCall(scheduler_, delay);
+  }
+
+  /* Polls the listing every interval until all of machine_ids are idle
+     and returns that listing.  Past the timeout, which also bounds each
+     listing, the error is errc::timeout. */
+  Task<Fleet> wait_until_idle(std::vector<std::string> machine_ids,
+                              std::chrono::milliseconds interval,
+                              std::chrono::milliseconds timeout,
+                              std::error_code &ec)
+  {
+    return wait_until_idle(std::move(machine_ids), interval, timeout, &ec);
+  }
+  Task<Fleet> wait_until_idle(std::vector<std::string> machine_ids,
+                              std::chrono::milliseconds interval,
+                              std::chrono::milliseconds timeout)
+  {
+    return wait_until_idle(std::move(machine_ids), interval, timeout, nullptr);
+  }
+
+private:
+  MachinesCall async_machines(std::error_code *ec, unsigned int fields)
+  {
+    return MachinesCall(scheduler_, ec, "ICstartgetmachines",
+                        [fields](ICasynccallback done, void *arg, ICasync **opP) {
+                          return ICstartgetmachines(fields, done, arg, opP);
+                        });
+  }
+
+  MachinesCall async_launch(std::error_code *ec, int n, const LaunchOptions &o)
+  {
+    return MachinesCall(scheduler_, ec, "ICstartlaunch",
+                        [n, o](ICasynccallback done, void *arg, ICasync **opP) {
+                          return ICstartlaunch(n, const_cast<char *>(o.license_type),
+                                               const_cast<int *>(o.license_id),
+                                               const_cast<char *>(o.password),
+                                               const_cast<char *>(o.region),
+                                               const_cast<char *>(o.machine_type),
+                                               const_cast<int *>(o.idle_shutdown),
+                                               const_cast<char *>(o.gurobi_version),
+                                               done, arg, opP);
+                        });
+  }
+
+  MachinesCall async_kill(std::error_code *ec, span<const char *const> ids)
+  {
+    return MachinesCall(scheduler_, ec, "ICstartkill",
+                        [ids](ICasynccallback done, void *arg, ICasync **opP) {
+                          return ICstartkill(static_cast<int>(ids.size()),
+                                             const_cast<char **>(ids.data()),
+                                             done, arg, opP);
+                        });
+  }
+
+  Task<Fleet> wait_until_idle(std::vector<std::string> machine_ids,
+                              std::chrono::milliseconds interval,
+                              std::chrono::milliseconds timeout,
+                              std::error_code *ec)
+  {
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+    std::error_code listing;
+
+    for (;;) {
+      Fleet fleet = co_await async_machines(&listing,
+                                            IC_FIELD_MACHINE_ID | IC_FIELD_STATE)
+                                .until(deadline);
+      if (listing) {
+        if (ec)
+          *ec = listing;
+        else
+          detail::throw_if(listing, "ICstartgetmachines");
+        co_return Fleet();
+      }
+
+      std::size_t idle = 0;
+      for (const std::string &id : machine_ids) {
+        for (const ICmachine &m : fleet) {
+          if (instantcloud::machine_id(m) == id) {
+            idle += state(m) == STATE_IDLE;
+            break;
+          }
+        }
+      }
+      if (idle == machine_ids.size()) {
+        if (ec)
+          ec->clear();
+        co_return fleet;
+      }
+
+      if (std::chrono::steady_clock::now() + interval > deadline) {
+        std::error_code expired = make_error_code(errc::timeout);
+        if (ec)
+          *ec = expired;
+        else
+          detail::throw_if(expired, "wait_until_idle");
+        co_return Fleet();
+      }
+      co_await sleep_for(interval);
+    }
+  }
+
+  Scheduler scheduler_ = inline_scheduler();
+#endif
+};
+
+} // namespace instantcloud
+
+namespace std {
+template <> struct is_error_code_enum<instantcloud::errc> : true_type {};
+}
+
+#endif
@@ -0,0 +1,480 @@
+#include <stdio.h>
+#include <string.h>
+#include "query.h"
+
+/* Enumerated column behind a field, or -1 */
+static int
+fieldcolumn(int field)
+{
+  switch (field) {
+  case FIELD_STATE:        return IC_COLUMN_STATE;
+  case FIELD_REGION:       return IC_COLUMN_REGION;
+  case FIELD_MACHINE_TYPE: return IC_COLUMN_MACHINE_TYPE;
+  case FIELD_LICENSE_TYPE: return IC_COLUMN_LICENSE_TYPE;
+  }
+  return -1;
+}
+
+static const unsigned char *
+codecolumn(const ICfleet *fleet,
+           int            field)
+{
+  switch (field) {
+  case FIELD_STATE:        return fleet->state;
+  case FIELD_REGION:       return fleet->region;
+  case FIELD_MACHINE_TYPE: return fleet->machine_type;
+  case FIELD_LICENSE_TYPE: return fleet->license_type;
+  }
+  return NULL;
+}
+
+static const int *
+intcolumn(const ICfleet *fleet,
+          int            field)
+{
+  switch (field) {
+  case FIELD_IDLE_SHUTDOWN: return fleet->idle_shutdown;
+  case FIELD_LICENSE_ID:    return fleet->license_id;
+  }
+  return NULL;
+}
+
+static const char **
+strcolumn(const ICfleet *fleet,
+          int            field)
+{
+  switch (field) {
+  case FIELD_MACHINE_ID:    return fleet->machine_id;
+  case FIELD_DNS_NAME:      return fleet->dns_name;
+  case FIELD_CREATE_TIME:   return fleet->create_time;
+  case FIELD_USER_PASSWORD: return fleet->user_password;
+  }
+  return NULL;
+}
+
+static const char *
+fieldstr(const ICfleet *fleet,
+         int            field,
+         int            row)
+{
+  const unsigned char *codes = codecolumn(fleet, field);
+
+  if (codes)
+    return ICcodename(fieldcolumn(field), codes[row]);
+  return strcolumn(fleet, field)[row];
+}
+
+void
+query_init(ICquery *q)
+{
+  memset(q, 0, sizeof(*q));
+}
+
+/* Parse one clause FIELD OP VALUE, where VALUE may list alternatives
+   separated by '|' for the = and != operators */
+static int
+parseclause(ICclause *c,
+            char     *expr)
+{
+  char *op;
+  char *value;
+  char *next;
+  int   column;
+  int   code;
+
+  memset(c, 0, sizeof(*c));
+
+  op = strpbrk(expr, "!<>=");
+  if (op == NULL || op == expr)
+    return 1;
+
+  value = op + 1;
+  switch (*op) {
+  case '!':
+    if (*value != '=') return 1;
+    c->op = OP_NE;
+    value++;
+    break;
+  case '<':
+    c->op = (*value == '=') ? OP_LE : OP_LT;
+    if (*value == '=') value++;
+    break;
+  case '>':
+    c->op = (*value == '=') ? OP_GE : OP_GT;
+    if (*value == '=') value++;
+    break;
+  default:
+    c->op = OP_EQ;
+    break;
+  }
+  *op = '\0';
+
+  c->field = fmt_field_parse(expr);
+  if (c->field < 0)
+    return 1;
+
+  column = fieldcolumn(c->field);
+
+  if (c->field == FIELD_IDLE_SHUTDOWN || c->field == FIELD_LICENSE_ID) {
+    if (*value == '\0')
+      return 1;
+    c->value = strtol(value, &next, 10);
+    return *next != '\0';
+  }
+
+  if (c->op != OP_EQ && c->op != OP_NE)
+    return 1;
+
+  for (;;) {
+    next = strchr(value, '|');
+    if (next)
+      *next = '\0';
+    if (column >= 0) {
+      code = ICcode(column, value);
+      if (code == IC_UNKNOWN_CODE)
+        return 1;
+      c->mask |= 1u << code;
+    } else {
+      if (c->num_values == QUERY_MAX_VALUES)
+        return 1;
+      c->values[c->num_values++] = value;
+    }
+    if (!next)
+      break;
+    value = next + 1;
+  }
+
+  if (column >= 0 && c->op == OP_NE) {
+    c->mask = ~c->mask;
+    c->op = OP_EQ;
+  }
+
+  return 0;
+}
+
+/* Parse a comma separated list of clauses, all of which must hold */
+int
+query_parse_filter(ICquery *q,
+                   char    *expr)
+{
+  char *next;
+
+  while (expr && *expr) {
+    next = strchr(expr, ',');
+    if (next)
+      *next++ = '\0';
+    if (q->num_clauses == QUERY_MAX_CLAUSES)
+      return 1;
+    if (parseclause(&q->clauses[q->num_clauses], expr))
+      return 1;
+    q->num_clauses++;
+    expr = next;
+  }
+
+  return 0;
+}
+
+int
+query_parse_fields(int  *fields,
+                   int  *num_fieldsP,
+                   char *list)
+{
+  char *next;
+  int   field;
+
+  *num_fieldsP = 0;
+  while (list && *list) {
+    next = strchr(list, ',');
+    if (next)
+      *next++ = '\0';
+    field = fmt_field_parse(list);
+    if (field < 0 || *num_fieldsP == NUM_FIELDS)
+      return 1;
+    fields[(*num_fieldsP)++] = field;
+    list = next;
+  }
+
+  return *num_fieldsP == 0;
+}
+
+/* Fields a query reads, as an IC_FIELD_ mask */
+unsigned int
+query_fieldmask(const ICquery *q)
+{
+  unsigned int mask = 0;
+  int i;
+
+  for (i = 0; i < q->num_clauses; i++)
+    mask |= 1u << q->clauses[i].field;
+  for (i = 0; i < q->num_fields; i++)
+    mask |= 1u << q->fields[i];
+  for (i = 0; i < q->num_group; i++)
+    mask |= 1u << q->group[i];
+
+  return mask;
+}
+
+/* The per-clause loops below have no data dependent branches so that
+   the compiler can vectorize them over the columns */
+static void
+selectcodes(const unsigned char *codes,
+            int                  n,
+            unsigned int         mask,
+            unsigned char       *sel)
+{
+  int i;
+
+  for (i = 0; i < n; i++)
+    sel[i] &= (mask >> (codes[i] & 31)) & 1;
+}
+
+static void
+selectints(const int     *values,
+           int            n,
+           int            op,
+           int            value,
+           unsigned char *sel)
+{
+  int i;
+
+  switch (op) {
+  case OP_EQ:
+    for (i = 0; i < n; i++) sel[i] &= values[i] == value;
+    break;
+  case OP_NE:
+    for (i = 0; i < n; i++) sel[i] &= values[i] != value;
+    break;
+  case OP_LT:
+    for (i = 0; i < n; i++) sel[i] &= values[i] < value;
+    break;
+  case OP_LE:
+    for (i = 0; i < n; i++) sel[i] &= values[i] <= value;
+    break;
+  case OP_GT:
+    for (i = 0; i < n; i++) sel[i] &= values[i] > value;
+    break;
+  case OP_GE:
+    for (i = 0; i < n; i++) sel[i] &= values[i] >= value;
+    break;
+  }
+}
+
+static void
+selectstrs(const char   **values,
+           int            n,
+           const ICclause *c,
+           unsigned char  *sel)
+{
+  int i;
+  int j;
+  int match;
+
+  for (i = 0; i < n; i++) {
+    if (!sel[i]) continue;
+    match = 0;
+    for (j = 0; j < c->num_values; j++) {
+      if (strcmp(values[i], c->values[j]) == 0) {
+        match = 1;
+        break;
+      }
+    }
+    sel[i] = (c->op == OP_EQ) ? match : !match;
+  }
+}
+
+/* Mark the machines that satisfy every clause, return their number */
+int
+query_select(const ICquery *q,
+             const ICfleet *fleet,
+             unsigned char *sel)
+{
+  const ICclause *c;
+  int n = fleet->num_machines;
+  int count = 0;
+  int i;
+
+  memset(sel, 1, n);
+
+  for (i = 0; i < q->num_clauses; i++) {
+    c = &q->clauses[i];
+    if (codecolumn(fleet, c->field))
+      selectcodes(codecolumn(fleet, c->field), n, c->mask, sel);
+    else if (intcolumn(fleet, c->field))
+      selectints(intcolumn(fleet, c->field), n, c->op, c->value, sel);
+    else
+      selectstrs(strcolumn(fleet, c->field), n, c, sel);
+  }
+
+  for (i = 0; i < n; i++)
+    count += sel[i];
+
+  return count;
+}
+
+static void
+printfield(ICformatter   *f,
+           const ICfleet *fleet,
+           int            field,
+           int            row)
+{
+  const int *ints = intcolumn(fleet, field);
+
+  if (ints)
+    fmt_key_int(f, fmt_field_name(field), ints[row]);
+  else
+    fmt_key_str(f, fmt_field_name(field), fieldstr(fleet, field, row));
+}
+
+/* Print the selected machines restricted to the query fields */
+void
+query_print(ICformatter         *f,
+            const ICquery       *q,
+            const ICfleet       *fleet,
+            const unsigned char *sel)
+{
+  const char *names[NUM_FIELDS];
+  int i;
+  int j;
+
+  for (j = 0; j < q->num_fields; j++)
+    names[j] = fmt_field_name(q->fields[j]);
+
+  fmt_begin_table(f, names, q->num_fields);
+  for (i = 0; i < fleet->num_machines; i++) {
+    if (!sel[i]) continue;
+    fmt_begin_record(f);
+    for (j = 0; j < q->num_fields; j++)
+      printfield(f, fleet, q->fields[j], i);
+    fmt_end_record(f);
+  }
+  fmt_end_table(f);
+}
+
+static const ICquery *sort_query;
+static const ICfleet *sort_fleet;
+
+static int
+comparerows(const void *a,
+            const void *b)
+{
+  int ra = *(const int *) a;
+  int rb = *(const int *) b;
+  const int *ints;
+  int field;
+  int cmp;
+  int j;
+
+  for (j = 0; j < sort_query->num_group; j++) {
+    field = sort_query->group[j];
+    ints  = intcolumn(sort_fleet, field);
+    if (ints)
+      cmp = (ints[ra] > ints[rb]) - (ints[ra] < ints[rb]);
+    else
+      cmp = strcmp(fieldstr(sort_fleet, field, ra),
+                   fieldstr(sort_fleet, field, rb));
+    if (cmp) return cmp;
+  }
+  return 0;
+}
+
+static void
+printgroup(ICformatter   *f,
+           const ICquery *q,
+           const ICfleet *fleet,
+           int            row,
+           int            count)
+{
+  int j;
+
+  fmt_begin_record(f);
+  for (j = 0; j < q->num_group; j++)
+    printfield(f, fleet, q->group[j], row);
+  fmt_key_int(f, "count", count);
+  fmt_end_record(f);
+}
+
+/* Print the number of selected machines for each distinct value of the
+   group fields.  When every group field is enumerated the counts are
+   accumulated in a dense histogram indexed by the combined codes,
+   otherwise the selected rows are sorted and counted in runs. */
+int
+query_count(ICformatter         *f,
+            const ICquery       *q,
+            const ICfleet       *fleet,
+            const unsigned char *sel)
+{
+  const char *names[NUM_FIELDS+1];
+  const unsigned char *codes;
+  int  *counts = NULL;
+  int  *first  = NULL;
+  int  *key    = NULL;
+  int  *rows   = NULL;
+  int   n = fleet->num_machines;
+  int   num_keys = 1;
+  int   card;
+  int   dense = 1;
+  int   num_rows;
+  int   i;
+  int   j;
+  int   error = 0;
+
+  for (j = 0; j < q->num_group; j++) {
+    names[j] = fmt_field_name(q->group[j]);
+    if (fieldcolumn(q->group[j]) < 0)
+      dense = 0;
+    else
+      num_keys *= ICnumcodes(fieldcolumn(q->group[j])) + 1;
+  }
+  names[q->num_group] = "count";
+
+  fmt_begin_table(f, names, q->num_group + 1);
+
+  if (dense) {
+    CALLOC(counts, num_keys);
+    MALLOC(first, num_keys);
+    CALLOC(key, n);
+
+    for (j = 0; j < q->num_group; j++) {
+      codes = codecolumn(fleet, q->group[j]);
+      card  = ICnumcodes(fieldcolumn(q->group[j]));
+      for (i = 0; i < n; i++)
+        key[i] = key[i]*(card + 1) + (codes[i] < card ? codes[i] : card);
+    }
+    for (i = n - 1; i >= 0; i--) {
+      counts[key[i]] += sel[i];
+      if (sel[i])
+        first[key[i]] = i;
+    }
+    for (i = 0; i < num_keys; i++) {
+      if (counts[i])
+        printgroup(f, q, fleet, first[i], counts[i]);
+    }
+  } else {
+    MALLOC(rows, n);
+    num_rows = 0;
+    for (i = 0; i < n; i++) {
+      if (sel[i])
+        rows[num_rows++] = i;
+    }
+
+    sort_query = q;
+    sort_fleet = fleet;
+    qsort(rows, num_rows, sizeof(int), comparerows);
+
+    for (i = 0; i < num_rows; i = j) {
+      for (j = i + 1; j < num_rows && comparerows(&rows[i], &rows[j]) == 0;)
+        j++;
+      printgroup(f, q, fleet, rows[i], j - i);
+    }
+  }
+
+  fmt_end_table(f);
+
+QUIT:
+  FREE(counts);
+  FREE(first);
+  FREE(key);
+  FREE(rows);
+
+  return error;
+}
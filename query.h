@@ -0,0 +1,48 @@
+/* Filter, projection and aggregation over a columnar fleet */
+#ifndef _QUERY_H
+#define _QUERY_H
+
+#include "cloud.h"
+#include "format.h"
+
+#define OP_EQ 0
+#define OP_NE 1
+#define OP_LT 2
+#define OP_LE 3
+#define OP_GT 4
+#define OP_GE 5
+
+#define QUERY_MAX_CLAUSES 16
+#define QUERY_MAX_VALUES  8
+
+typedef struct _clause
+{
+  int          field;
+  int          op;
+  unsigned int mask;         /* allowed codes of an enumerated field */
+  long         value;        /* operand of an integer field */
+  int          num_values;   /* alternatives of a string field */
+  const char  *values[QUERY_MAX_VALUES];
+} ICclause;
+
+typedef struct _query
+{
+  int      num_clauses;
+  ICclause clauses[QUERY_MAX_CLAUSES];
+  int      num_fields;
+  int      fields[NUM_FIELDS];
+  int      num_group;
+  int      group[NUM_FIELDS];
+} ICquery;
+
+void query_init(ICquery *q);
+int  query_parse_filter(ICquery *q, char *expr);
+int  query_parse_fields(int *fields, int *num_fieldsP, char *list);
+unsigned int query_fieldmask(const ICquery *q);
+int  query_select(const ICquery *q, const ICfleet *fleet, unsigned char *sel);
+void query_print(ICformatter *f, const ICquery *q, const ICfleet *fleet,
+                 const unsigned char *sel);
+int  query_count(ICformatter *f, const ICquery *q, const ICfleet *fleet,
+                 const unsigned char *sel);
+
+#endif
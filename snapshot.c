@@ -0,0 +1,404 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "cloud.h"
+
+/* Shared-memory fleet snapshot.  One publisher writes the machine list
+   into a POSIX shared-memory segment: a 64 byte header followed by
+   ICmachine records.  The header's sequence number is odd while the
+   records are being written (a seqlock), so readers copy the records
+   and keep the copy only if the number was even and unchanged across
+   it.  Reading takes no lock and makes no system call, except to map
+   the segment again after the publisher has grown it. */
+
+#define SNAPSHOT_MAGIC   0x53464349   /* "ICFS" */
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_MIN     64           /* fewest records in a segment */
+#define SNAPSHOT_WAIT_MS 1000         /* longest wait for a publisher */
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t record_size;     /* sizeof(ICmachine) of the publisher */
+  uint32_t seq;
+  int32_t  capacity;        /* records the segment has room for */
+  int32_t  num_machines;
+  uint32_t fields;
+  uint32_t pad;
+  int64_t  published_ms;    /* wall clock of the last publish, 0 before */
+  char     reserved[24];
+} Header;
+
+struct _snapshot {
+  int      fd;
+  int      writer;
+  Header  *header;
+  size_t   size;
+  int      capacity;        /* records in the mapping */
+};
+
+static size_t
+segmentsize(int capacity)
+{
+  return sizeof(Header) + sizeof(ICmachine)*(size_t) capacity;
+}
+
+static int
+mapsegment(ICsnapshot *snap,
+           size_t      size)
+{
+  void *p;
+
+  if (snap->header)
+    munmap(snap->header, snap->size);
+  snap->header = NULL;
+
+  p = mmap(NULL, size, snap->writer ? PROT_READ | PROT_WRITE : PROT_READ,
+           MAP_SHARED, snap->fd, 0);
+  if (p == MAP_FAILED)
+    return ERROR_OUT_OF_MEMORY;
+
+  snap->header   = (Header *) p;
+  snap->size     = size;
+  snap->capacity = (int) ((size - sizeof(Header))/sizeof(ICmachine));
+  return 0;
+}
+
+static int
+validheader(const Header *h)
+{
+  return h->magic       == SNAPSHOT_MAGIC   &&
+         h->version     == SNAPSHOT_VERSION &&
+         h->record_size == sizeof(ICmachine);
+}
+
+int
+ICcreatesnapshot(const char  *name,
+                 ICsnapshot **snapP)
+{
+  ICsnapshot *snap = NULL;
+  struct stat st;
+  int  error = 0;
+
+  if (!name || !snapP) {
+    error = ERROR_NULL_ARGUMENT;
+    goto QUIT;
+  }
+
+  CALLOC(snap, 1);
+  snap->writer = 1;
+  snap->fd = shm_open(name, O_RDWR | O_CREAT, 0644);
+  if (snap->fd < 0) {
+    error = ERROR_INVALID_ARGUMENT;
+    goto QUIT;
+  }
+
+  /* A single publisher per segment */
+  if (flock(snap->fd, LOCK_EX | LOCK_NB) && errno == EWOULDBLOCK) {
+    error = ERROR_INVALID_ARGUMENT;
+    goto QUIT;
+  }
+
+  if (fstat(snap->fd, &st)) {
+    error = ERROR_INVALID_ARGUMENT;
+    goto QUIT;
+  }
+
+  /* Keep a segment left by an earlier publisher, so that its readers
+     stay mapped, unless it was written by a different build */
+  if ((size_t) st.st_size >= segmentsize(SNAPSHOT_MIN)) {
+    error = mapsegment(snap, st.st_size);
+    if (error) goto QUIT;
+    if (validheader(snap->header) &&
+        snap->header->capacity <= snap->capacity)
+      goto QUIT;
+  }
+
+  if (ftruncate(snap->fd, segmentsize(SNAPSHOT_MIN))) {
+    error = ERROR_OUT_OF_MEMORY;
+    goto QUIT;
+  }
+  error = mapsegment(snap, segmentsize(SNAPSHOT_MIN));
+  if (error) goto QUIT;
+
+  memset(snap->header, 0, sizeof(Header));
+  snap->header->version     = SNAPSHOT_VERSION;
+  snap->header->record_size = sizeof(ICmachine);
+  snap->header->capacity    = snap->capacity;
+  __atomic_store_n(&snap->header->magic, SNAPSHOT_MAGIC, __ATOMIC_RELEASE);
+
+QUIT:
+  if (error)
+    ICfreesnapshot(&snap);
+  if (snapP)
+    *snapP = snap;
+
+  return error;
+}
+
+int
+ICpublishsnapshot(ICsnapshot          *snap,
+                  const ICmachineinfo *machine_info)
+{
+  struct timespec ts;
+  Header  *h;
+  uint32_t seq;
+  int  n;
+  int  capacity;
+  int  error = 0;
+
+  if (!snap || !machine_info) {
+    error = ERROR_NULL_ARGUMENT;
+    goto QUIT;
+  }
+  if (!snap->writer) {
+    error = ERROR_INVALID_ARGUMENT;
+    goto QUIT;
+  }
+
+  n  = machine_info->num_machines;
+  h  = snap->header;
+
+  /* An odd number left by a publisher that died mid-write is skipped */
+  seq = (h->seq + 1) | 1;
+  __atomic_store_n(&h->seq, seq, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  /* Readers map the larger segment when they see the new capacity */
+  if (n > snap->capacity) {
+    for (capacity = snap->capacity; capacity < n; capacity *= 2)
+      ;
+    if (ftruncate(snap->fd, segmentsize(capacity)) ||
+        mapsegment(snap, segmentsize(capacity))) {
+      /* Leave the previous snapshot readable */
+      if (mapsegment(snap, snap->size) == 0)
+        __atomic_store_n(&snap->header->seq, seq + 1, __ATOMIC_RELEASE);
+      error = ERROR_OUT_OF_MEMORY;
+      goto QUIT;
+    }
+    h = snap->header;
+    h->capacity = snap->capacity;
+  }
+
+  memcpy((char *) h + sizeof(Header), machine_info->machines,
+         sizeof(ICmachine)*n);
+  h->num_machines = n;
+  h->fields       = machine_info->fields;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  h->published_ms = (int64_t) ts.tv_sec*1000 + ts.tv_nsec/1000000;
+
+  __atomic_store_n(&h->seq, seq + 1, __ATOMIC_RELEASE);
+
+QUIT:
+
+  return error;
+}
+
+int
+ICopensnapshot(const char  *name,
+               ICsnapshot **snapP)
+{
+  ICsnapshot *snap = NULL;
+  struct stat st;
+  int  error = 0;
+
+  if (!name || !snapP) {
+    error = ERROR_NULL_ARGUMENT;
+    goto QUIT;
+  }
+
+  CALLOC(snap, 1);
+  snap->fd = shm_open(name, O_RDONLY, 0);
+  if (snap->fd < 0 || fstat(snap->fd, &st) ||
+      (size_t) st.st_size < segmentsize(SNAPSHOT_MIN)) {
+    error = ERROR_INVALID_ARGUMENT;
+    goto QUIT;
+  }
+
+  error = mapsegment(snap, st.st_size);
+  if (error) goto QUIT;
+
+  if (__atomic_load_n(&snap->header->magic, __ATOMIC_ACQUIRE) !=
+      SNAPSHOT_MAGIC || !validheader(snap->header)) {
+    error = ERROR_INVALID_ARGUMENT;
+    goto QUIT;
+  }
+
+QUIT:
+  if (error)
+    ICfreesnapshot(&snap);
+  if (snapP)
+    *snapP = snap;
+
+  return error;
+}
+
+static long long
+monotonicms(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long) ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+int
+ICreadsnapshot(ICsnapshot   *snap,
+               int           max_machines,
+               ICmachine    *machines,
+               int          *num_machinesP,
+               unsigned int *fieldsP,
+               long long    *published_msP)
+{
+  const Header *h;
+  struct stat st;
+  uint32_t seq;
+  long long deadline = 0;
+  long long published;
+  unsigned int fields;
+  int  spins = 0;
+  int  n;
+  int  error = 0;
+
+  if (!snap || !num_machinesP) {
+    error = ERROR_NULL_ARGUMENT;
+    goto QUIT;
+  }
+  if (!machines)
+    max_machines = 0;
+
+  for (;;) {
+    h   = snap->header;
+    seq = __atomic_load_n(&h->seq, __ATOMIC_ACQUIRE);
+
+    if (!(seq & 1)) {
+      n         = __atomic_load_n(&h->num_machines, __ATOMIC_RELAXED);
+      fields    = __atomic_load_n(&h->fields, __ATOMIC_RELAXED);
+      published = __atomic_load_n(&h->published_ms, __ATOMIC_RELAXED);
+
+      if (n >= 0 && n <= snap->capacity) {
+        if (max_machines > 0)
+          memcpy(machines, (const char *) h + sizeof(Header),
+                 sizeof(ICmachine)*(n < max_machines ? n : max_machines));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&h->seq, __ATOMIC_RELAXED) == seq)
+          break;
+        continue;
+      }
+
+      /* The publisher has grown the segment */
+      if (__atomic_load_n(&h->seq, __ATOMIC_RELAXED) == seq) {
+        if (n < 0 || fstat(snap->fd, &st) ||
+            (size_t) st.st_size < segmentsize(n)) {
+          error = ERROR_INVALID_ARGUMENT;
+          goto QUIT;
+        }
+        error = mapsegment(snap, st.st_size);
+        if (error) goto QUIT;
+      }
+      continue;
+    }
+
+    /* Mid-write.  Spin briefly, then yield, and give up with
+       ERROR_TIMEOUT on a publisher that stopped with the sequence
+       number odd */
+    if (++spins < 1000)
+      continue;
+    if (deadline == 0)
+      deadline = monotonicms() + SNAPSHOT_WAIT_MS;
+    else if (monotonicms() > deadline) {
+      error = ERROR_TIMEOUT;
+      goto QUIT;
+    }
+    sched_yield();
+  }
+
+  *num_machinesP = n;
+  if (fieldsP)
+    *fieldsP = fields;
+  if (published_msP)
+    *published_msP = published;
+
+QUIT:
+
+  return error;
+}
+
+int
+ICsnapshotmachines(ICsnapshot     *snap,
+                   ICmachineinfo **machine_infoP,
+                   long long      *published_msP)
+{
+  ICmachineinfo *info = NULL;
+  unsigned int fields;
+  int  max_machines;
+  int  n;
+  int  i;
+  int  error = 0;
+
+  if (!snap || !machine_infoP) {
+    error = ERROR_NULL_ARGUMENT;
+    goto QUIT;
+  }
+
+  error = ICfreemachineinfo(machine_infoP);
+  if (error) goto QUIT;
+
+  CALLOC(info, 1);
+  info->refcount = 1;
+
+  /* Room for the current list and some growth, again if it outgrew it */
+  error = ICreadsnapshot(snap, 0, NULL, &n, NULL, NULL);
+  if (error) goto QUIT;
+  do {
+    max_machines = n + n/4 + 16;
+    FREE(info->machines);
+    CALLOC(info->machines, max_machines);
+    error = ICreadsnapshot(snap, max_machines, info->machines, &n, &fields,
+                           published_msP);
+    if (error) goto QUIT;
+  } while (n > max_machines);
+
+  info->num_machines = n;
+  info->fields       = fields;
+  CALLOC(info->machine_ids, n);
+  for (i = 0; i < n; i++) {
+    MALLOC(info->machine_ids[i], MAX_ID_LEN+1);
+    memcpy(info->machine_ids[i], info->machines[i].machine_id, MAX_ID_LEN+1);
+  }
+
+QUIT:
+  if (error)
+    ICfreemachineinfo(&info);
+  if (machine_infoP)
+    *machine_infoP = info;
+
+  return error;
+}
+
+int
+ICfreesnapshot(ICsnapshot **snapP)
+{
+  ICsnapshot *snap;
+
+  if (snapP && *snapP) {
+    snap = *snapP;
+    if (snap->header)
+      munmap(snap->header, snap->size);
+    if (snap->fd >= 0)
+      close(snap->fd);
+    FREE(snap);
+    *snapP = NULL;
+  }
+
+  return 0;
+}
@@ -0,0 +1,98 @@
+#!/bin/sh
+# Runs instantcloud against a replayed recording, so without the network.
+# Usage: sh tests/cli.sh [path to instantcloud]
+
+IC=${1:-./instantcloud}
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+failed=0
+
+IC_ACCESS_ID=aaaaaaaaaaaaaaaaa
+IC_SECRET_KEY=kkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkk
+export IC_ACCESS_ID IC_SECRET_KEY
+
+# One exchange of a recording: METHOD ENDPOINT STATUS BODY
+exchange() {
+  printf '%s %s %s %d 0\n%s\n\n' "$1" "$2" "$3" "${#4}" "$4"
+}
+
+fail() {
+  echo "FAIL: $1"
+  sed 's/^/  | /' "$DIR/out"
+  failed=1
+}
+
+# A light compute server still launching in us-east-1, and an idle
+# machine of a group the desired state does not list
+launching='{"_id": "m0000000000000001", "state": "launching", "DNSName": "", "machineType": "c4.large", "createTime": "2015-10-14T20:27:01.224Z", "region": "us-east-1", "licenseType": "light compute server", "idleShutdown": 60, "licenseId": "95900", "userPassword": "pw"}'
+idle='{"_id": "m0000000000000002", "state": "idle", "DNSName": "ec2-2.compute.amazonaws.com", "machineType": "c4.2xlarge", "createTime": "2015-10-14T20:27:01.224Z", "region": "eu-west-1", "licenseType": "full compute server", "idleShutdown": 60, "licenseId": "95900", "userPassword": "pw"}'
+exchange GET machines 200 "[$launching, $idle]" > "$DIR/fleet.rec"
+echo "us-east-1,c4.large,light compute server,1" > "$DIR/fleet.txt"
+
+# Every flag before FILE counts, --dry-run above all
+$IC --replay "$DIR/fleet.rec" apply --dry-run --prune --force "$DIR/fleet.txt" \
+  > "$DIR/out" 2>&1
+status=$?
+if [ $status -ne 0 ] || ! grep -q "other groups: 1, kill them" "$DIR/out" ||
+   grep -q "kill.*failed\|killed" "$DIR/out"; then
+  fail "apply --dry-run --prune --force FILE (exit $status)"
+fi
+
+# A flag before a filter is not lost either
+$IC --replay "$DIR/fleet.rec" machines --servers --filter region=eu-west-1 \
+  > "$DIR/out" 2>&1
+if [ "$(cat "$DIR/out")" != "ec2-2.compute.amazonaws.com" ]; then
+  fail "machines --servers --filter F"
+fi
+
+# Output that cannot be written fails with ERROR_INVALID_ARGUMENT
+if [ -w /dev/full ]; then
+  $IC --replay "$DIR/fleet.rec" machines -f csv > /dev/full 2> "$DIR/out"
+  status=$?
+  if [ $status -ne 208 ]; then
+    fail "machines > /dev/full (exit $status)"
+  fi
+fi
+
+# Nothing to change, but a machine still launching: --wait times out,
+# and the exit status is ERROR_TIMEOUT (5000) truncated to 8 bits
+$IC --replay "$DIR/fleet.rec" apply --wait --interval 1 --timeout 1 \
+  "$DIR/fleet.txt" > "$DIR/out" 2>&1
+status=$?
+if [ $status -ne 136 ] || ! grep -q "Not ready after" "$DIR/out"; then
+  fail "apply --wait --timeout on a launching machine (exit $status)"
+fi
+
+# --once before the other autoscale options still ends after one step
+echo 0 > "$DIR/queue"
+timeout 20 $IC --replay "$DIR/fleet.rec" autoscale --once --spare-servers 0 \
+  --queue "$DIR/queue" > "$DIR/out" 2>&1
+status=$?
+if [ $status -ne 0 ]; then
+  fail "autoscale --once --spare-servers 0 --queue Q (exit $status)"
+fi
+
+# The same for publish, whose snapshot is then read back
+snapshot=/instantcloud-test-$$
+timeout 20 $IC --replay "$DIR/fleet.rec" --snapshot $snapshot publish \
+  --once --interval 1 > "$DIR/out" 2>&1
+status=$?
+if [ $status -ne 0 ] ||
+   ! $IC --snapshot $snapshot machines -f csv > "$DIR/out" 2>&1 ||
+   ! grep -q m0000000000000002 "$DIR/out"; then
+  fail "publish --once --interval N (exit $status)"
+fi
+rm -f /dev/shm$snapshot
+
+# And for history, whose one listing is then read back
+timeout 20 $IC --replay "$DIR/fleet.rec" history --once --interval 1 \
+  "$DIR/history" > "$DIR/out" 2>&1
+status=$?
+if [ $status -ne 0 ] ||
+   ! $IC --history "$DIR/history" machines -f csv > "$DIR/out" 2>&1 ||
+   ! grep -q m0000000000000002 "$DIR/out"; then
+  fail "history --once --interval N FILE (exit $status)"
+fi
+
+[ $failed -eq 0 ] && echo "All CLI tests passed"
+exit $failed
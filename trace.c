@@ -0,0 +1,424 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sched.h>
+#include "cloud.h"
+#include "trace.h"
+
+/* Trace spans.  Each thread appends the spans it ends to a buffer of its
+   own, a list of chunks that no other thread writes to, so recording a
+   span takes no lock.  The buffer is pushed on a global list, with a
+   compare-and-swap, the first time the thread records, and ICstoptrace
+   writes every buffer to the file.  A thread counts itself in before
+   it looks at trace_enabled, so ICstoptrace, which turns it off first,
+   waits for the spans being recorded before it frees the buffers.
+   While tracing is off each span costs one test of trace_enabled.
+
+   Spans of a call nest on the calling thread.  The spans of a request
+   run by the connection pool hang under the span that submitted it and
+   are written as asynchronous events, since requests overlap. */
+
+#define TRACE_CHUNK      512
+#define TRACE_DETAIL_LEN 48
+
+typedef struct {
+  const char        *name;
+  char               detail[TRACE_DETAIL_LEN];
+  unsigned long long id;
+  unsigned long long parent;
+  unsigned long long root;
+  unsigned long long async;      /* request the span belongs to, or 0 */
+  long long          start_us;
+  long long          end_us;
+} TraceEvent;
+
+typedef struct _tracechunk {
+  int                  count;
+  struct _tracechunk  *next;
+  TraceEvent           events[TRACE_CHUNK];
+} TraceChunk;
+
+typedef struct _tracebuffer {
+  int                  tid;
+  char                 name[32];
+  unsigned long long   next_id;
+  TraceChunk          *first;
+  TraceChunk          *last;
+  struct _tracebuffer *next;
+} TraceBuffer;
+
+int trace_enabled = 0;
+
+static struct {
+  FILE        *fp;
+  int          format;
+  int          generation;
+  int          num_threads;
+  int          active;        /* threads recording a span */
+  long long    epoch_us;      /* wall clock less the monotonic clock */
+  TraceBuffer *buffers;
+} tracer;
+
+static __thread TraceBuffer *local = NULL;
+static __thread int          local_generation = 0;
+static __thread ICspan       current;     /* innermost open span */
+static __thread const char  *threadname = NULL;
+
+long long
+trace_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long) ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+void
+trace_thread_name(const char *name)
+{
+  threadname = name;
+}
+
+/* The calling thread's buffer for this trace */
+static TraceBuffer *
+getbuffer(void)
+{
+  TraceBuffer *b;
+  int generation = __atomic_load_n(&tracer.generation, __ATOMIC_ACQUIRE);
+
+  if (local && local_generation == generation)
+    return local;
+
+  b = calloc(1, sizeof(TraceBuffer));
+  if (b == NULL)
+    return NULL;
+  b->first = b->last = calloc(1, sizeof(TraceChunk));
+  if (b->first == NULL) {
+    free(b);
+    return NULL;
+  }
+  b->tid = __atomic_add_fetch(&tracer.num_threads, 1, __ATOMIC_RELAXED);
+  if (threadname)
+    snprintf(b->name, sizeof(b->name), "%s", threadname);
+  else
+    snprintf(b->name, sizeof(b->name), "thread %d", b->tid);
+
+  b->next = __atomic_load_n(&tracer.buffers, __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n(&tracer.buffers, &b->next, b, 1,
+                                      __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+    ;
+
+  local = b;
+  local_generation = generation;
+  return b;
+}
+
+static int
+enter(void)
+{
+  __atomic_add_fetch(&tracer.active, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&trace_enabled, __ATOMIC_SEQ_CST))
+    return 1;
+  __atomic_sub_fetch(&tracer.active, 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+static void
+leave(void)
+{
+  __atomic_sub_fetch(&tracer.active, 1, __ATOMIC_RELEASE);
+}
+
+static unsigned long long
+newid(void)
+{
+  TraceBuffer *b = getbuffer();
+
+  if (b == NULL)
+    return 0;
+  return ((unsigned long long) b->tid << 40) | ++b->next_id;
+}
+
+static void
+record(const char         *name,
+       const char         *detail,
+       unsigned long long  id,
+       unsigned long long  parent,
+       unsigned long long  root,
+       unsigned long long  async,
+       long long           start_us,
+       long long           end_us)
+{
+  TraceBuffer *b = getbuffer();
+  TraceChunk  *c;
+  TraceEvent  *e;
+
+  if (b == NULL)
+    return;
+
+  c = b->last;
+  if (c->count == TRACE_CHUNK) {
+    c = calloc(1, sizeof(TraceChunk));
+    if (c == NULL)
+      return;
+    b->last->next = c;
+    b->last = c;
+  }
+
+  e = &c->events[c->count];
+  e->name     = name;
+  e->id       = id;
+  e->parent   = parent;
+  e->root     = root;
+  e->async    = async;
+  e->start_us = start_us;
+  e->end_us   = end_us;
+  snprintf(e->detail, sizeof(e->detail), "%s", detail ? detail : "");
+  c->count++;
+}
+
+void
+trace_begin(ICspan *span)
+{
+  span->id = 0;
+  if (!enter())
+    return;
+  span->id = newid();
+  leave();
+  if (span->id == 0)
+    return;
+  span->parent   = current.id;
+  span->root     = current.id ? current.root : span->id;
+  span->start_us = trace_now();
+  current = *span;
+}
+
+void
+trace_end(ICspan     *span,
+          const char *name,
+          const char *detail)
+{
+  if (enter()) {
+    record(name, detail, span->id, span->parent, span->root, 0,
+           span->start_us, trace_now());
+    leave();
+  }
+
+  current.id   = span->parent;
+  current.root = span->parent ? span->root : 0;
+  span->id = 0;
+}
+
+/* The innermost open span, as the parent of work done elsewhere */
+void
+trace_current(ICspan *span)
+{
+  span->id     = TRACE_ENABLED ? current.id : 0;
+  span->parent = 0;
+  span->root   = span->id ? current.root : 0;
+}
+
+/* A span timed by someone else, under parent, in request async */
+unsigned long long
+trace_span(const char         *name,
+           const char         *detail,
+           const ICspan       *parent,
+           unsigned long long  async,
+           long long           start_us,
+           long long           end_us)
+{
+  unsigned long long id;
+
+  if (!enter())
+    return 0;
+
+  id = newid();
+  if (id)
+    record(name, detail, id, parent ? parent->id : 0,
+           parent && parent->id ? parent->root : id, async ? async : id,
+           start_us, end_us);
+  leave();
+  return id;
+}
+
+static void
+writestring(FILE       *fp,
+            const char *s)
+{
+  fputc('"', fp);
+  for (; *s; s++) {
+    if (*s == '"' || *s == '\\')
+      fprintf(fp, "\\%c", *s);
+    else if ((unsigned char) *s < 0x20)
+      fprintf(fp, "\\u%04x", *s);
+    else
+      fputc(*s, fp);
+  }
+  fputc('"', fp);
+}
+
+/* Chrome's trace event format, which Perfetto and chrome://tracing read */
+static void
+writechrome(FILE *fp)
+{
+  TraceBuffer *b;
+  TraceChunk  *c;
+  TraceEvent  *e;
+  int pid = (int) getpid();
+  int first = 1;
+  int i;
+
+  fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+  for (b = tracer.buffers; b; b = b->next) {
+    fprintf(fp, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,"
+            "\"tid\":%d,\"args\":{\"name\":", first ? "" : ",", pid, b->tid);
+    writestring(fp, b->name);
+    fprintf(fp, "}}");
+    first = 0;
+
+    for (c = b->first; c; c = c->next) {
+      for (i = 0; i < c->count; i++) {
+        e = &c->events[i];
+        if (e->async) {
+          fprintf(fp, ",\n{\"name\":\"%s\",\"cat\":\"request\",\"ph\":\"b\","
+                  "\"id\":\"0x%llx\",\"pid\":%d,\"tid\":%d,\"ts\":%lld,"
+                  "\"args\":{\"detail\":", e->name, e->async, pid, b->tid,
+                  e->start_us);
+          writestring(fp, e->detail);
+          fprintf(fp, "}},\n{\"name\":\"%s\",\"cat\":\"request\",\"ph\":\"e\","
+                  "\"id\":\"0x%llx\",\"pid\":%d,\"tid\":%d,\"ts\":%lld}",
+                  e->name, e->async, pid, b->tid, e->end_us);
+        } else {
+          fprintf(fp, ",\n{\"name\":\"%s\",\"cat\":\"call\",\"ph\":\"X\","
+                  "\"pid\":%d,\"tid\":%d,\"ts\":%lld,\"dur\":%lld,"
+                  "\"args\":{\"detail\":", e->name, pid, b->tid,
+                  e->start_us, e->end_us - e->start_us);
+          writestring(fp, e->detail);
+          fprintf(fp, "}}");
+        }
+      }
+    }
+  }
+  fprintf(fp, "\n]}\n");
+}
+
+/* OTLP/JSON, as accepted by OpenTelemetry collectors.  Each tree of
+   spans is a trace. */
+static void
+writeotlp(FILE *fp)
+{
+  TraceBuffer *b;
+  TraceChunk  *c;
+  TraceEvent  *e;
+  unsigned long long process;
+  int first = 1;
+  int i;
+
+  process = ((unsigned long long) (tracer.epoch_us/1000000) << 32) |
+            (unsigned int) getpid();
+
+  fprintf(fp, "{\"resourceSpans\":[{\"resource\":{\"attributes\":["
+          "{\"key\":\"service.name\",\"value\":{\"stringValue\":"
+          "\"instantcloud\"}},{\"key\":\"process.pid\",\"value\":"
+          "{\"intValue\":\"%d\"}}]},\"scopeSpans\":[{\"scope\":"
+          "{\"name\":\"instantcloud\"},\"spans\":[", (int) getpid());
+  for (b = tracer.buffers; b; b = b->next) {
+    for (c = b->first; c; c = c->next) {
+      for (i = 0; i < c->count; i++) {
+        e = &c->events[i];
+        fprintf(fp, "%s\n{\"traceId\":\"%016llx%016llx\","
+                "\"spanId\":\"%016llx\",", first ? "" : ",",
+                process, e->root, e->id);
+        if (e->parent)
+          fprintf(fp, "\"parentSpanId\":\"%016llx\",", e->parent);
+        fprintf(fp, "\"name\":\"%s\",\"kind\":%d,"
+                "\"startTimeUnixNano\":\"%lld000\","
+                "\"endTimeUnixNano\":\"%lld000\",\"attributes\":["
+                "{\"key\":\"thread.id\",\"value\":{\"intValue\":\"%d\"}},"
+                "{\"key\":\"thread.name\",\"value\":{\"stringValue\":",
+                e->name, e->async == e->id ? 3 : 1,
+                tracer.epoch_us + e->start_us, tracer.epoch_us + e->end_us,
+                b->tid);
+        writestring(fp, b->name);
+        fprintf(fp, "}},{\"key\":\"detail\",\"value\":{\"stringValue\":");
+        writestring(fp, e->detail);
+        fprintf(fp, "}}]}");
+        first = 0;
+      }
+    }
+  }
+  fprintf(fp, "\n]}]}]}\n");
+}
+
+int
+ICstarttrace(const char *path,
+             int         format)
+{
+  struct timespec ts;
+  int error = 0;
+
+  if (!path) {
+    error = ERROR_NULL_ARGUMENT;
+    goto QUIT;
+  }
+  if (tracer.fp || (format != IC_TRACE_CHROME && format != IC_TRACE_OTLP)) {
+    error = ERROR_INVALID_ARGUMENT;
+    goto QUIT;
+  }
+
+  tracer.fp = fopen(path, "w");
+  if (tracer.fp == NULL) {
+    error = ERROR_INVALID_ARGUMENT;
+    goto QUIT;
+  }
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  tracer.epoch_us = (long long) ts.tv_sec*1000000 + ts.tv_nsec/1000 -
+                    trace_now();
+  tracer.format = format;
+  __atomic_add_fetch(&tracer.generation, 1, __ATOMIC_RELEASE);
+  __atomic_store_n(&trace_enabled, 1, __ATOMIC_SEQ_CST);
+
+QUIT:
+
+  return error;
+}
+
+/* Write the spans out.  Spans that other threads, the pool's among
+   them, end from now on are dropped. */
+int
+ICstoptrace(void)
+{
+  TraceBuffer *b;
+  TraceChunk  *c;
+  int error = 0;
+
+  if (tracer.fp == NULL)
+    return 0;
+
+  __atomic_store_n(&trace_enabled, 0, __ATOMIC_SEQ_CST);
+  while (__atomic_load_n(&tracer.active, __ATOMIC_ACQUIRE))
+    sched_yield();
+
+  if (tracer.format == IC_TRACE_OTLP)
+    writeotlp(tracer.fp);
+  else
+    writechrome(tracer.fp);
+  if (fclose(tracer.fp))
+    error = ERROR_INVALID_ARGUMENT;
+  tracer.fp = NULL;
+
+  while ((b = tracer.buffers) != NULL) {
+    tracer.buffers = b->next;
+    while ((c = b->first) != NULL) {
+      b->first = c->next;
+      free(c);
+    }
+    free(b);
+  }
+  tracer.num_threads = 0;
+
+  return error;
+}
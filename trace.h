@@ -0,0 +1,37 @@
+/* Trace spans of the client's calls, recorded per thread */
+#ifndef _TRACE_H
+#define _TRACE_H
+
+/* A span being timed.  id is 0 when tracing was off at its start, and
+   root is the id of the outermost span of its tree. */
+typedef struct _span
+{
+  unsigned long long id;
+  unsigned long long parent;
+  unsigned long long root;
+  long long          start_us;
+} ICspan;
+
+#define IC_SPAN_INIT { 0, 0, 0, 0 }
+
+extern int trace_enabled;
+
+#define TRACE_ENABLED __atomic_load_n(&trace_enabled, __ATOMIC_RELAXED)
+
+/* Spans nest on each thread: a span begun becomes the parent of the
+   spans begun after it, until it ends */
+#define TRACE_BEGIN(span) \
+  do { if (TRACE_ENABLED) trace_begin(&(span)); } while (0)
+#define TRACE_END(span, name, detail) \
+  do { if ((span).id) trace_end(&(span), name, detail); } while (0)
+
+long long trace_now(void);
+void trace_begin(ICspan *span);
+void trace_end(ICspan *span, const char *name, const char *detail);
+void trace_current(ICspan *span);
+unsigned long long trace_span(const char *name, const char *detail,
+                              const ICspan *parent, unsigned long long async,
+                              long long start_us, long long end_us);
+void trace_thread_name(const char *name);
+
+#endif
@@ -0,0 +1,359 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "cloud.h"
+
+#define MAX_ENDPOINT 255
+
+/* In-memory transport.  Each method and endpoint has its own list of
+   canned answers, handed out in order and then again from the first,
+   so a replayed recording can be run any number of times. */
+
+typedef struct _answer {
+  char  *method;
+  char  *endpoint;
+  long   status;
+  char  *body;
+  size_t len;
+} Answer;
+
+typedef struct {
+  pthread_mutex_t lock;
+  Answer *answers;
+  int     num_answers;
+  int     max_answers;
+  int    *served;        /* requests answered for each answer's key */
+} Memory;
+
+typedef struct {
+  pthread_mutex_t lock;
+  FILE           *fp;
+} Recorder;
+
+static int
+addanswer(Memory     *m,
+          const char *method,
+          const char *endpoint,
+          long        status,
+          const char *body,
+          size_t      len)
+{
+  Answer *answers;
+  int    *served;
+  Answer *a;
+  int     max_answers;
+  int     error = 0;
+
+  if (m->num_answers == m->max_answers) {
+    max_answers = m->max_answers ? 2*m->max_answers : 16;
+    answers = realloc(m->answers, max_answers*sizeof(Answer));
+    if (answers == NULL)
+      return ERROR_OUT_OF_MEMORY;
+    m->answers = answers;
+    served = realloc(m->served, max_answers*sizeof(int));
+    if (served == NULL)
+      return ERROR_OUT_OF_MEMORY;
+    m->served = served;
+    m->max_answers = max_answers;
+  }
+
+  a = &m->answers[m->num_answers];
+  memset(a, 0, sizeof(*a));
+  a->status = status;
+  a->len    = len;
+  MALLOC(a->method, strlen(method) + 1);
+  MALLOC(a->endpoint, strlen(endpoint) + 1);
+  MALLOC(a->body, len + 1);
+  strcpy(a->method, method);
+  strcpy(a->endpoint, endpoint);
+  memcpy(a->body, body, len);
+  a->body[len] = '\0';
+  m->served[m->num_answers] = 0;
+  m->num_answers++;
+
+QUIT:
+  if (error) {
+    FREE(a->method);
+    FREE(a->endpoint);
+  }
+  return error;
+}
+
+static int
+memorysend(ICtransport     *t,
+           const ICrequest *request,
+           ICresponse      *response)
+{
+  Memory *m = t->data;
+  Answer *a = NULL;
+  int  first = -1;
+  int  count = 0;
+  int  i;
+  int  error = 0;
+
+  pthread_mutex_lock(&m->lock);
+  for (i = 0; i < m->num_answers; i++) {
+    if (strcmp(m->answers[i].method, request->method) == 0 &&
+        strcmp(m->answers[i].endpoint, request->endpoint) == 0) {
+      if (first < 0)
+        first = i;
+      count++;
+    }
+  }
+
+  /* The n-th request for a key gets its (n mod count)-th answer */
+  if (first >= 0) {
+    count = m->served[first]++ % count;
+    for (i = first; i < m->num_answers; i++) {
+      if (strcmp(m->answers[i].method, request->method) == 0 &&
+          strcmp(m->answers[i].endpoint, request->endpoint) == 0 &&
+          count-- == 0) {
+        a = &m->answers[i];
+        break;
+      }
+    }
+  }
+
+  if (a == NULL) {
+    response->status = 404;
+    MALLOC(response->body, 1);
+    response->body[0] = '\0';
+  } else {
+    response->status = a->status;
+    MALLOC(response->body, a->len + 1);
+    memcpy(response->body, a->body, a->len + 1);
+  }
+
+QUIT:
+  pthread_mutex_unlock(&m->lock);
+  return error;
+}
+
+static void
+memoryfree(ICtransport *t)
+{
+  Memory *m = t->data;
+  int i;
+
+  if (m == NULL)
+    return;
+
+  for (i = 0; i < m->num_answers; i++) {
+    FREE(m->answers[i].method);
+    FREE(m->answers[i].endpoint);
+    FREE(m->answers[i].body);
+  }
+  FREE(m->answers);
+  FREE(m->served);
+  pthread_mutex_destroy(&m->lock);
+  FREE(t->data);
+}
+
+int
+ICmemorytransport(ICtransport **transportP)
+{
+  ICtransport *t = NULL;
+  Memory      *m = NULL;
+  int error = 0;
+
+  if (!transportP)
+    return ERROR_NULL_ARGUMENT;
+  *transportP = NULL;
+
+  CALLOC(t, 1);
+  CALLOC(m, 1);
+  pthread_mutex_init(&m->lock, NULL);
+  t->send = memorysend;
+  t->free = memoryfree;
+  t->data = m;
+
+  *transportP = t;
+  t = NULL;
+
+QUIT:
+  if (t)
+    FREE(t);
+  return error;
+}
+
+int
+ICmemoryrespond(ICtransport *transport,
+                const char  *method,
+                const char  *endpoint,
+                long         status,
+                const char  *body)
+{
+  Memory *m;
+  int error;
+
+  if (!transport || !method || !endpoint || !body)
+    return ERROR_NULL_ARGUMENT;
+  if (transport->send != memorysend)
+    return ERROR_INVALID_ARGUMENT;
+
+  m = transport->data;
+  pthread_mutex_lock(&m->lock);
+  error = addanswer(m, method, endpoint, status, body, strlen(body));
+  pthread_mutex_unlock(&m->lock);
+
+  return error;
+}
+
+/* Recordings hold one exchange after another, each a line
+     METHOD ENDPOINT STATUS LENGTH BODY_LENGTH
+   followed by LENGTH bytes of response body and a newline, then
+   BODY_LENGTH bytes of request body and a newline.  Recordings made
+   before request bodies were kept lack BODY_LENGTH and the request
+   body.  Neither the secret key nor the signatures are written, but
+   request bodies hold the access id, and a launch body the machine
+   password if one was given. */
+
+static void
+recordwrite(ICtransport      *t,
+            const ICrequest  *request,
+            const ICresponse *response)
+{
+  Recorder *r = t->data;
+  size_t len      = strlen(response->body);
+  size_t body_len = request->body ? strlen(request->body) : 0;
+
+  pthread_mutex_lock(&r->lock);
+  fprintf(r->fp, "%s %s %ld %lu %lu\n", request->method, request->endpoint,
+          response->status, (unsigned long) len, (unsigned long) body_len);
+  fwrite(response->body, 1, len, r->fp);
+  fputc('\n', r->fp);
+  if (body_len)
+    fwrite(request->body, 1, body_len, r->fp);
+  fputc('\n', r->fp);
+  fflush(r->fp);
+  pthread_mutex_unlock(&r->lock);
+}
+
+static int
+recordsend(ICtransport     *t,
+           const ICrequest *request,
+           ICresponse      *response)
+{
+  int error;
+
+  error = t->inner->send(t->inner, request, response);
+  if (error || response->body == NULL)
+    return error;
+
+  t->record(t, request, response);
+
+  return 0;
+}
+
+static void
+recordfree(ICtransport *t)
+{
+  Recorder *r = t->data;
+
+  if (r == NULL)
+    return;
+
+  fclose(r->fp);
+  pthread_mutex_destroy(&r->lock);
+  FREE(t->data);
+}
+
+/* The recorder sends through inner, which the caller still owns.  Around
+   ICcurltransport it only watches the requests of the pool. */
+int
+ICrecordtransport(ICtransport  *inner,
+                  const char   *path,
+                  ICtransport **transportP)
+{
+  ICtransport *t = NULL;
+  Recorder    *r = NULL;
+  int error = 0;
+
+  if (!inner || !path || !transportP)
+    return ERROR_NULL_ARGUMENT;
+  *transportP = NULL;
+
+  CALLOC(t, 1);
+  CALLOC(r, 1);
+  r->fp = fopen(path, "a");
+  if (r->fp == NULL) {
+    error = ERROR_INVALID_ARGUMENT;
+    goto QUIT;
+  }
+  pthread_mutex_init(&r->lock, NULL);
+  t->send   = recordsend;
+  t->free   = recordfree;
+  t->data   = r;
+  t->inner  = inner;
+  t->record = recordwrite;
+
+  *transportP = t;
+  t = NULL;
+  r = NULL;
+
+QUIT:
+  FREE(r);
+  FREE(t);
+  return error;
+}
+
+int
+ICreplaytransport(const char   *path,
+                  ICtransport **transportP)
+{
+  ICtransport *t = NULL;
+  FILE  *fp = NULL;
+  char   line[MAX_ENDPOINT+64];
+  char   method[16];
+  char   endpoint[MAX_ENDPOINT+1];
+  char  *body = NULL;
+  long   status;
+  unsigned long len;
+  unsigned long body_len;
+  int    fields;
+  int    error = 0;
+
+  if (!path || !transportP)
+    return ERROR_NULL_ARGUMENT;
+  *transportP = NULL;
+
+  fp = fopen(path, "r");
+  if (fp == NULL)
+    return ERROR_INVALID_ARGUMENT;
+
+  error = ICmemorytransport(&t);
+  if (error) goto QUIT;
+
+  while (fgets(line, sizeof(line), fp)) {
+    fields = sscanf(line, "%15s %255s %ld %lu %lu", method, endpoint,
+                    &status, &len, &body_len);
+    if (fields < 4) {
+      error = ERROR_INVALID_ARGUMENT;
+      goto QUIT;
+    }
+    MALLOC(body, len + 1);
+    if (fread(body, 1, len, fp) != len || fgetc(fp) != '\n') {
+      error = ERROR_INVALID_ARGUMENT;
+      goto QUIT;
+    }
+    /* Answers are matched on the method and endpoint alone */
+    if (fields == 5 &&
+        (fseek(fp, body_len, SEEK_CUR) || fgetc(fp) != '\n')) {
+      error = ERROR_INVALID_ARGUMENT;
+      goto QUIT;
+    }
+    error = addanswer(t->data, method, endpoint, status, body, len);
+    if (error) goto QUIT;
+    FREE(body);
+  }
+
+  *transportP = t;
+  t = NULL;
+
+QUIT:
+  FREE(body);
+  ICfreetransport(&t);
+  fclose(fp);
+  return error;
+}